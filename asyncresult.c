@@ -31,20 +31,27 @@
  * AsyncResult will block until the call has completed on the HexChat main
  * thread and the data is available. The 'error' field will have an instance
  * of the exception that was raised - if one was. Its __traceback__ property
- * will be set.
+ * will be set. wait(), done() and add_done_callback() can be used to poll
+ * for, or be notified of, completion instead. AsyncResults are also
+ * awaitable from asyncio coroutines.
  */
 
 #include "minpython.h"
 
 /**
- * AsynchResult object data.
+ * AsynchResult object data. The result is delivered by the main thread with
+ * asyncresult_complete(). Threads waiting for it block on 'lock', which is
+ * only allocated once something actually has to wait; it is held until the
+ * result arrives, and each waiter releases it again after acquiring it so
+ * any other waiters get through as well.
  */
 typedef struct {
     PyObject_HEAD
-    PyObject *queue;
-    int      done;
-    PyObject *result;
-    PyObject *error;
+    PyThread_type_lock  lock;
+    int                 done;
+    PyObject            *result;
+    PyObject            *error;
+    PyObject            *callbacks;
 } AsyncResultObj;
 
 static int      AsyncResult_init           (AsyncResultObj *, PyObject *, 
@@ -53,11 +60,24 @@ static void     AsyncResult_dealloc        (AsyncResultObj *);
 
 static PyObject *AsyncResult_get_result    (AsyncResultObj *, void *);
 static PyObject *AsyncResult_get_error     (AsyncResultObj *, void *);
+static PyObject *AsyncResult_wait          (AsyncResultObj *, PyObject *, 
+                                                              PyObject *);
+static PyObject *AsyncResult_done          (AsyncResultObj *, PyObject *);
+static PyObject *AsyncResult_add_done_callback
+                                           (AsyncResultObj *, PyObject *);
+static PyObject *AsyncResult_await         (AsyncResultObj *);
+
+static PyObject *asyncresult_wakeup        (PyObject *, PyObject *);
+static PyObject *asyncresult_set_future    (PyObject *, PyObject *);
+static PyObject *asyncresult_transfer      (PyObject *, AsyncResultObj *);
 
+       PyObject *asyncresult_new           (void);
+       void     asyncresult_complete       (PyObject *, PyObject *, 
+                                                        PyObject *);
+       int      asyncresult_wait           (PyObject *, double);
+       PyObject *asyncresult_unwrap        (PyObject *);
        void     asyncresult_set_error      (PyObject *, PyObject *);
        void     asyncresult_set_result     (PyObject *, PyObject *);
-       
-       int      asyncresult_queue_get      (AsyncResultObj *);
 
 /**
  * Accessors for 'result' and 'error'.
@@ -79,6 +99,47 @@ static PyGetSetDef AsyncResult_accessors[] = {
     { NULL }
 };
 
+/**
+ * AsyncResult methods.
+ */
+static PyMethodDef AsyncResult_methods[] = {
+    {"wait",        (PyCFunction)AsyncResult_wait,  
+                                                METH_VARARGS | METH_KEYWORDS,
+     "wait(timeout=None) - Blocks until the call has completed, or `timeout` "
+     "seconds have passed. Returns True if the call completed."},
+
+    {"done",        (PyCFunction)AsyncResult_done,  METH_NOARGS,
+     "Returns True if the call has completed, without blocking."},
+
+    {"add_done_callback",
+                    (PyCFunction)AsyncResult_add_done_callback,
+                                                    METH_VARARGS,
+     "add_done_callback(fn) - Registers `fn` to be invoked with the "
+     "AsyncResult as its only argument when the call completes. Callbacks "
+     "run on the HexChat main thread. If the call has already completed, "
+     "`fn` is invoked immediately."},
+
+    { NULL }
+};
+
+/**
+ * Support for `await`.
+ */
+static PyAsyncMethods AsyncResult_async_methods = {
+    .am_await       = (unaryfunc)AsyncResult_await,
+};
+
+/**
+ * Functions used to transfer the outcome to an asyncio Future when the
+ * AsyncResult is awaited. See AsyncResult_await().
+ */
+static PyMethodDef asyncresult_wakeup_def = {
+    "_wakeup",      (PyCFunction)asyncresult_wakeup,        METH_O, NULL
+};
+static PyMethodDef asyncresult_set_future_def = {
+    "_set_future",  (PyCFunction)asyncresult_set_future,    METH_VARARGS, NULL
+};
+
 /**
  * AsyncResult type instance.
  */
@@ -93,38 +154,37 @@ static PyTypeObject AsyncResultType = {
     .tp_init        = (initproc)AsyncResult_init,
     .tp_dealloc     = (destructor)AsyncResult_dealloc,
     //.tp_members     = AsyncResult_members,
-    //.tp_methods     = AsyncResult_methods,
+    .tp_methods     = AsyncResult_methods,
     .tp_getset      = AsyncResult_accessors,
+    .tp_as_async    = &AsyncResult_async_methods,
 };
 
 /**
  * Convenient type pointer.
  */
-PyTypeObject *AsyncResultTypePtr = &AsyncResultType;
+PyTypeObject *AsyncResultTypeDef = &AsyncResultType;
 
 /**
  * Constructor.  Initializes 'error' and 'result' to None.
  * @param self      - Instance ponter.
- * @param args      - 'queue' is a queu.Queue instance passed in from Python.
- *                    This is used to send the result back from the main thread.
+ * @param args      - None.
  * @returns - 0 on success, -1 if there was an error invoking the constructor.
  */
 static int
 AsyncResult_init(AsyncResultObj *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject    *pyqueue;
-    static char *keywords[] = { "queue", NULL };
+    static char *keywords[] = { NULL };
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:init", keywords,
-                                     &pyqueue)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, ":init", keywords)) {
         return -1;
     }
-    self->queue     = pyqueue;
-    
-    self->error     = Py_None;
-    self->result    = Py_None;
-    
-    Py_INCREF(pyqueue);
+    self->lock      = NULL;
+    self->done      = 0;
+    self->callbacks = NULL;
+
+    Py_XSETREF(self->error, Py_None);
+    Py_XSETREF(self->result, Py_None);
+
     Py_INCREF(self->error);
     Py_INCREF(self->result);
     return 0;
@@ -136,10 +196,13 @@ AsyncResult_init(AsyncResultObj *self, PyObject *args, PyObject *kwargs)
 static void
 AsyncResult_dealloc(AsyncResultObj *self)
 {
+    if (self->lock) {
+        PyThread_free_lock(self->lock);
+    }
     Py_XDECREF(self->result);
-    Py_XDECREF(self->queue);
     Py_XDECREF(self->error);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    Py_XDECREF(self->callbacks);
+    interp_free_object((PyObject *)self);
 }
 
 /**
@@ -152,7 +215,7 @@ AsyncResult_dealloc(AsyncResultObj *self)
 PyObject *
 AsyncResult_get_result(AsyncResultObj *self, void *closure) 
 {
-    if (asyncresult_queue_get(self)) {
+    if (asyncresult_wait((PyObject *)self, -1) < 0) {
         return NULL;
     }
     Py_INCREF(self->result);
@@ -168,7 +231,7 @@ AsyncResult_get_result(AsyncResultObj *self, void *closure)
 PyObject *
 AsyncResult_get_error(AsyncResultObj *self, void *closure)
 {
-    if (asyncresult_queue_get(self)) {
+    if (asyncresult_wait((PyObject *)self, -1) < 0) {
         return NULL;
     }
     Py_INCREF(self->error);
@@ -176,80 +239,376 @@ AsyncResult_get_error(AsyncResultObj *self, void *closure)
 }
 
 /**
- * Retrieves the result of an asynchronous call from the instance's Queue.
- * Sets the 'result' or 'error' field. If the call was successful, and the
- * result is a Context object, it will be wrapped in an async DelegateProxy.
- * @param self  - An AsyncResult instance.
- * @returns - 0 on success, or -1 on failure with error state set.
+ * Implements AsyncResult.wait().
+ * @param args      - 'timeout', optional number of seconds to wait. None or
+ *                    omitted waits indefinitely.
+ * @returns - True if the call completed, False if the wait timed out.
  */
-int 
-asyncresult_queue_get(AsyncResultObj *self)
+PyObject *
+AsyncResult_wait(AsyncResultObj *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject *pyresult;
-    PyObject *pyproxy;
-    PyObject *pyresult_list;
-    PyObject *pystatus;
-    
+    PyObject    *pytimeout  = Py_None;
+    double      timeout     = -1;
+    int         ret;
+    static char *keywords[] = { "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:wait", keywords,
+                                     &pytimeout)) {
+        return NULL;
+    }
+    if (pytimeout != Py_None) {
+        timeout = PyFloat_AsDouble(pytimeout);
+        if (timeout == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (timeout < 0) {
+            PyErr_SetString(PyExc_ValueError, 
+                            "timeout must be a non-negative number.");
+            return NULL;
+        }
+    }
+    ret = asyncresult_wait((PyObject *)self, timeout);
+    if (ret < 0) {
+        return NULL;
+    }
+    return PyBool_FromLong(ret);
+}
+
+/**
+ * Implements AsyncResult.done().
+ */
+PyObject *
+AsyncResult_done(AsyncResultObj *self, PyObject *Py_UNUSED(args))
+{
+    return PyBool_FromLong(self->done);
+}
+
+/**
+ * Implements AsyncResult.add_done_callback().
+ * @param args  - 'fn', a callable that accepts the AsyncResult as its argument.
+ * @returns - None, or NULL with error state set.
+ */
+PyObject *
+AsyncResult_add_done_callback(AsyncResultObj *self, PyObject *args)
+{
+    PyObject *pycallable;
+    PyObject *pyret;
+
+    if (!PyArg_ParseTuple(args, "O:add_done_callback", &pycallable)) {
+        return NULL;
+    }
+    if (!PyCallable_Check(pycallable)) {
+        PyErr_SetString(PyExc_TypeError, "Argument must be callable.");
+        return NULL;
+    }
     if (self->done) {
-        return 0;
+        pyret = PyObject_CallFunctionObjArgs(pycallable, self, NULL);
+        if (!pyret) {
+            return NULL;
+        }
+        Py_DECREF(pyret);
+        Py_RETURN_NONE;
     }
-    
-    self->done = 1;
+    if (!self->callbacks) {
+        self->callbacks = PyList_New(0);
+        if (!self->callbacks) {
+            return NULL;
+        }
+    }
+    if (PyList_Append(self->callbacks, pycallable)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
 
-    // Blocking call.
-    pyresult_list = PyObject_CallMethod(self->queue, "get", NULL);
+/**
+ * Implements AsyncResult.__await__(). An asyncio Future is created on the
+ * current event loop and the AsyncResult's outcome is transferred to it. If
+ * the call has already completed, as it has for Delegates invoked on the
+ * HexChat main thread, the Future is resolved on the spot and the await
+ * doesn't suspend. Otherwise the transfer is scheduled on the Future's loop
+ * when the call completes.
+ * @returns - The Future's awaitable iterator, or NULL with error state set.
+ */
+PyObject *
+AsyncResult_await(AsyncResultObj *self)
+{
+    PyObject *pyasyncio;
+    PyObject *pyloop;
+    PyObject *pyfut;
+    PyObject *pyargs;
+    PyObject *pywakeup;
+    PyObject *pycbargs;
+    PyObject *pyret     = NULL;
 
-    if (!pyresult_list) {
-        return -1;
+    pyasyncio = PyImport_ImportModule("asyncio"); // NR.
+    if (!pyasyncio) {
+        return NULL;
+    }
+    pyloop = PyObject_CallMethod(pyasyncio, "get_event_loop", NULL);
+    Py_DECREF(pyasyncio);
+    if (!pyloop) {
+        return NULL;
+    }
+    pyfut = PyObject_CallMethod(pyloop, "create_future", NULL);
+    if (!pyfut) {
+        Py_DECREF(pyloop);
+        return NULL;
+    }
+    pyargs = PyTuple_Pack(2, pyloop, pyfut);
+    Py_DECREF(pyloop);
+    if (!pyargs) {
+        goto error;
+    }
+    if (self->done) {
+        pyret = asyncresult_transfer(pyfut, self);
+    }
+    else {
+        pywakeup = PyCFunction_New(&asyncresult_wakeup_def, pyargs);
+        pycbargs = pywakeup ? PyTuple_Pack(1, pywakeup) : NULL;
+        if (pycbargs) {
+            pyret = AsyncResult_add_done_callback(self, pycbargs);
+        }
+        Py_XDECREF(pycbargs);
+        Py_XDECREF(pywakeup);
     }
+    Py_DECREF(pyargs);
 
-    pystatus = PySequence_GetItem(pyresult_list, 0); // NR.
-    if (!pystatus) {
-        Py_DECREF(pyresult_list);
+    if (!pyret) {
+        goto error;
+    }
+    Py_DECREF(pyret);
+
+    pyret = PyObject_CallMethod(pyfut, "__await__", NULL);
+error:
+    Py_DECREF(pyfut);
+    return pyret;
+}
+
+/**
+ * Done callback added by AsyncResult_await(). Schedules the transfer of the
+ * outcome to the Future on the Future's loop, which may be running on a
+ * different thread.
+ * @param pyargs    - The (loop, future) tuple the function is bound to.
+ * @param pyresult  - The completed AsyncResult.
+ */
+PyObject *
+asyncresult_wakeup(PyObject *pyargs, PyObject *pyresult)
+{
+    PyObject *pysetter;
+    PyObject *pyret;
+
+    pysetter = PyCFunction_New(&asyncresult_set_future_def, NULL);
+    if (!pysetter) {
+        return NULL;
+    }
+    pyret = PyObject_CallMethod(PyTuple_GET_ITEM(pyargs, 0),
+                                "call_soon_threadsafe", "OOO", pysetter,
+                                PyTuple_GET_ITEM(pyargs, 1), pyresult);
+    Py_DECREF(pysetter);
+    return pyret;
+}
+
+/**
+ * Called on the Future's loop to transfer the outcome of the AsyncResult.
+ * @param pyargs    - (future, asyncresult).
+ */
+PyObject *
+asyncresult_set_future(PyObject *self, PyObject *pyargs)
+{
+    PyObject *pyfut;
+    PyObject *pyresult;
+
+    if (!PyArg_ParseTuple(pyargs, "OO!:_set_future", &pyfut, 
+                          AsyncResultTypePtr, &pyresult)) {
+        return NULL;
+    }
+    return asyncresult_transfer(pyfut, (AsyncResultObj *)pyresult);
+}
+
+/**
+ * Sets the result or exception of a Future from a completed AsyncResult,
+ * unless the Future was cancelled.
+ * @param pyfut     - The asyncio Future.
+ * @param self      - The completed AsyncResult.
+ * @returns - None, or NULL with error state set.
+ */
+PyObject *
+asyncresult_transfer(PyObject *pyfut, AsyncResultObj *self)
+{
+    PyObject *pycancelled;
+    PyObject *pyret      = NULL;
+
+    pycancelled = PyObject_CallMethod(pyfut, "cancelled", NULL);
+
+    if (pycancelled == Py_False) {
+        if (self->error != Py_None) {
+            pyret = PyObject_CallMethod(pyfut, "set_exception", "O", 
+                                        self->error);
+        }
+        else {
+            pyret = PyObject_CallMethod(pyfut, "set_result", "O",
+                                        self->result);
+        }
+    }
+    else if (pycancelled) {
+        pyret = Py_None;
+        Py_INCREF(pyret);
+    }
+    Py_XDECREF(pycancelled);
+    return pyret;
+}
+
+/**
+ * Creates an AsyncResult that is still waiting on its call to complete.
+ * @returns - A new reference, or NULL with error state set.
+ */
+PyObject *
+asyncresult_new()
+{
+    return PyObject_CallFunction((PyObject *)AsyncResultTypePtr, NULL);
+}
+
+/**
+ * Blocks until the AsyncResult has been completed. The GIL is released while
+ * waiting. Waiting for a pending result on the HexChat main thread is an error 
+ * since the main thread is what would complete it.
+ * @param asyncresult   - The AsyncResult.
+ * @param timeout       - Seconds to wait; negative to wait indefinitely.
+ * @returns - 1 if the result is available, 0 if the wait timed out, -1 on
+ *            failure with error state set.
+ */
+int
+asyncresult_wait(PyObject *asyncresult, double timeout)
+{
+    AsyncResultObj  *self = (AsyncResultObj *)asyncresult;
+    PY_TIMEOUT_T    microseconds;
+    PyLockStatus    status;
+
+    if (self->done) {
+        return 1;
+    }
+    if (PyThreadState_Get()->thread_id == py_g_main_threadstate->thread_id) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Can't wait for an AsyncResult on the HexChat main "
+                        "thread; the call can't complete until the main "
+                        "thread is free. Use add_done_callback() instead.");
         return -1;
     }
-    
-    if (PyLong_AsLong(pystatus) != 0) {
-        // Error occurred.
-        
-        Py_DECREF(self->error);
-        
-        self->error = PySequence_GetItem(pyresult_list, 1); // NR.
+    if (!self->lock) {
+        // The lock is held until asyncresult_complete() releases it.
+        self->lock = PyThread_allocate_lock();
+        if (!self->lock) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        PyThread_acquire_lock(self->lock, NOWAIT_LOCK);
+    }
+    if (timeout < 0) {
+        microseconds = -1;
+    }
+    else if (timeout * 1e6 >= (double)PY_TIMEOUT_MAX) {
+        microseconds = PY_TIMEOUT_MAX;
     }
     else {
-        // Success.
-        
-        Py_DECREF(self->result);
-        
-        pyresult = PySequence_GetItem(pyresult_list, 1); // NR.
-
-        if (Py_TYPE(pyresult) == ContextTypePtr) {
-            pyproxy = PyObject_CallFunction((PyObject *)
-                                            DelegateProxyTypePtr,
-                                            "Oi", pyresult, true);
-            Py_DECREF(pyresult);
-            pyresult = pyproxy;
+        microseconds = (PY_TIMEOUT_T)(timeout * 1e6);
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = PyThread_acquire_lock_timed(self->lock, microseconds, 0);
+    Py_END_ALLOW_THREADS
+
+    if (status != PY_LOCK_ACQUIRED) {
+        return 0;
+    }
+    // Pass it on to the next waiter, if any.
+    PyThread_release_lock(self->lock);
+
+    return 1;
+}
+
+/**
+ * Completes the AsyncResult, wakes any threads waiting on it, and invokes its
+ * done callbacks. Has no effect if it has already been completed. Must be 
+ * called with the interpreter the AsyncResult was created in current.
+ * **Steals the refs for 'result' and 'error'**
+ * @param asyncresult   - The AsyncResult.
+ * @param result        - The result, or NULL if the call raised.
+ * @param error         - The exception raised, or NULL.
+ */
+void
+asyncresult_complete(PyObject *asyncresult, PyObject *result, PyObject *error)
+{
+    AsyncResultObj  *self = (AsyncResultObj *)asyncresult;
+    PyObject        *pycallbacks;
+    PyObject        *pyret;
+    Py_ssize_t      i;
+
+    if (self->done) {
+        Py_XDECREF(result);
+        Py_XDECREF(error);
+        return;
+    }
+    if (result) {
+        Py_SETREF(self->result, result);
+    }
+    if (error) {
+        Py_SETREF(self->error, error);
+    }
+    self->done = 1;
+
+    if (self->lock) {
+        PyThread_release_lock(self->lock);
+    }
+
+    pycallbacks     = self->callbacks;
+    self->callbacks = NULL;
+
+    if (pycallbacks) {
+        for (i = 0; i < PyList_GET_SIZE(pycallbacks); i++) {
+            pyret = PyObject_CallFunctionObjArgs(
+                                        PyList_GET_ITEM(pycallbacks, i), 
+                                        asyncresult, NULL);
+            if (!pyret) {
+                PyErr_Print();
+            }
+            Py_XDECREF(pyret);
         }
+        Py_DECREF(pycallbacks);
+    }
+}
+
+/**
+ * Returns the result of a completed AsyncResult, or sets the error state to
+ * the exception it holds. Used by synchronous Delegates.
+ * @returns - A new reference to the result, or NULL with error state set.
+ */
+PyObject *
+asyncresult_unwrap(PyObject *asyncresult)
+{
+    AsyncResultObj *self = (AsyncResultObj *)asyncresult;
 
-        self->result = pyresult;
+    if (self->error != Py_None) {
+        Py_INCREF(self->error);
+        PyErr_Restore(PyObject_Type(self->error),  // Steals all refs.
+                      self->error, 
+                      PyException_GetTraceback(self->error));
+        return NULL;
     }
-    Py_DECREF(pystatus);
-    Py_DECREF(pyresult_list);
-    
-    return 0;
+    Py_INCREF(self->result);
+    return self->result;
 }
 
 /** 
- * This can be invoked from code that sets the result of an AsyncResult.
+ * This can be invoked from code that sets the result of an AsyncResult. If
+ * the result is a Context object, it will be wrapped in an async 
+ * DelegateProxy.
  * **Steals ref for 'result'**
  */
 void
 asyncresult_set_result(PyObject *asyncresult, PyObject *result)
 {
-    PyObject       *pyproxy;
-    AsyncResultObj *self = (AsyncResultObj *)asyncresult;
-
-    Py_DECREF(self->result);
+    PyObject *pyproxy;
 
     if (Py_TYPE(result) == ContextTypePtr) {
         pyproxy = PyObject_CallFunction((PyObject *)
@@ -258,9 +617,7 @@ asyncresult_set_result(PyObject *asyncresult, PyObject *result)
         Py_DECREF(result);
         result = pyproxy;
     }
-
-    self->result = result;
-    self->done   = 1;
+    asyncresult_complete(asyncresult, result, NULL);
 }
 
 /** 
@@ -269,12 +626,5 @@ asyncresult_set_result(PyObject *asyncresult, PyObject *result)
 void
 asyncresult_set_error(PyObject *asyncresult, PyObject *err)
 {
-    AsyncResultObj *self = (AsyncResultObj *)asyncresult;
-    
-    self->error     = err;
-    self->done      = 1;
+    asyncresult_complete(asyncresult, NULL, err);
 }
-
-
-
-
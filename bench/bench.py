@@ -0,0 +1,165 @@
+"""
+The plugin minpython-bench loads (see benchhost.c). It hooks the events the
+host replays, times the parts of the bridge that are driven from Python, and
+sends all the results back to the host as JSON.
+
+The host runs /BENCH_START <iterations> <calls> <users> <replay ops>
+<replay us> <command ops> <command us> once it has replayed the traffic and
+invoked /BENCH_CMD. The Delegate benchmarks run on a thread, as they need the
+host's timer loop to service them, and the thread sends the results with
+/BENCH_RESULT <json>.
+
+find_context() is checked against the host's two tabs before it's timed; a
+wrong result is reported as an error.
+"""
+
+__module_name__        = "bench"
+__module_version__     = "1.0"
+__module_description__ = "Times the MagPy bridge for minpython-bench."
+
+import json
+import sys
+import threading
+import time
+import traceback
+
+import hexchat
+
+
+SERVER_EVENTS = ["PRIVMSG", "JOIN", "PART", "NOTICE", "MODE", "PING"]
+PRINT_EVENTS  = ["Channel Message", "Channel Action", "Channel Notice",
+                 "Join", "Part with Reason"]
+
+seen = {"server": 0, "print": 0}
+
+
+def on_server(word, word_eol, userdata):
+    seen["server"] += 1
+    return hexchat.EAT_NONE
+
+
+def on_print(word, word_eol, userdata):
+    seen["print"] += 1
+    return hexchat.EAT_NONE
+
+
+def on_print_attrs(word, word_eol, attrs, userdata):
+    seen["print"] += 1
+    return hexchat.EAT_NONE
+
+
+def on_command(word, word_eol, userdata):
+    return hexchat.EAT_ALL
+
+
+def result(ops, ns, **extra):
+    res = {"n": ops, "total_ms": ns / 1e6,
+           "per_op_us": ns / 1e3 / ops if ops else 0.0}
+    res.update(extra)
+    return res
+
+
+def timed(ops, func, **extra):
+    start = time.perf_counter_ns()
+    for _ in range(ops):
+        func()
+    return result(ops, time.perf_counter_ns() - start, **extra)
+
+
+def get_list_users():
+    for user in hexchat.get_list("users"):
+        user.nick
+
+
+def listiter_users():
+    for user in hexchat.get_listiter("users"):
+        user.nick
+
+
+def check_find_context():
+    server = hexchat.get_info("server")
+    python = hexchat.find_context(server, "#python")
+    magpy  = hexchat.find_context(channel="#magpy")
+    for front in (python, magpy, python):
+        front.command("GUI FOCUS")
+        found = hexchat.find_context(server=server)
+        if found != front:
+            raise AssertionError("find_context(server=%r) gave %r with %r "
+                                 "in front" % (server, found, front))
+
+
+def delegate_async(calls):
+    start  = time.perf_counter_ns()
+    last   = None
+    for _ in range(calls):
+        last = hexchat.asynchronous.get_info("channel")
+    last.wait()
+    return result(calls, time.perf_counter_ns() - start)
+
+
+def report(results=None, error=None):
+    report = {"python": sys.version.split()[0]}
+    if error:
+        report["error"] = error
+    else:
+        report["results"] = results
+    hexchat.synchronous.command("BENCH_RESULT " + json.dumps(report))
+
+
+def run_delegates(results, calls):
+    try:
+        results["delegate_sync"] = timed(calls, lambda: hexchat.synchronous.
+                                                        get_info("channel"))
+        results["delegate_async"] = delegate_async(calls)
+    except Exception:
+        report(error=traceback.format_exc())
+    else:
+        report(results)
+
+
+def on_start(word, word_eol, userdata):
+    try:
+        start(word)
+    except Exception:
+        report(error=traceback.format_exc())
+    return hexchat.EAT_ALL
+
+
+def start(word):
+    (iterations, calls, users,
+     replay_ops, replay_us, cmd_ops, cmd_us) = [int(word[i])
+                                                for i in range(1, 8)]
+    results = {
+        "replay":  result(replay_ops, replay_us * 1000,
+                          server_callbacks=seen["server"],
+                          print_callbacks=seen["print"]),
+        "command": result(cmd_ops, cmd_us * 1000),
+    }
+    results["get_list"] = timed(iterations, get_list_users, rows=users)
+    results["listiter"] = timed(iterations, listiter_users, rows=users)
+
+    call = hexchat.InterpCall(lambda *args, **kwargs: args)
+    args = (1, "text", [1, 2, 3], {"key": "value"})
+
+    results["interpcall"] = timed(calls, lambda: call(*args, flag=True))
+
+    line = "x" * 60
+    results["outstream"] = timed(calls, lambda: print(line))
+
+    check_find_context()
+    results["find_context"] = timed(calls, lambda: hexchat.find_context(
+                                                       channel="#magpy"))
+
+    threading.Thread(target=run_delegates, args=(results, calls),
+                     daemon=True).start()
+
+
+for name in SERVER_EVENTS:
+    hexchat.hook_server(name, on_server)
+
+for name in PRINT_EVENTS:
+    hexchat.hook_print(name, on_print)
+
+hexchat.hook_print_attrs("Channel Message", on_print_attrs)
+hexchat.hook_command("BENCH_CMD", on_command)
+hexchat.hook_command("BENCH_START", on_start)
@@ -0,0 +1,1032 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+
+/**
+ * A mock HexChat that the bridge is linked into, for measuring its overhead
+ * without a GUI or a server. It implements the hexchat-plugin.h functions the
+ * bridge uses, loads bench.py as a plugin, and:
+ *
+ *  - Replays the IRC lines of a traffic file through the hooks bench.py has
+ *    on server and print events, the way HexChat would deliver them.
+ *  - Invokes a hooked command repeatedly.
+ *  - Has bench.py time get_list() and ListIter over a synthetic user list,
+ *    InterpCall marshalling, print() through OutStream, find_context(), and
+ *    Delegate calls from a thread, which the host's timer loop services.
+ *
+ * The server has two channel tabs, and /GUI FOCUS brings the current one to
+ * the front, so bench.py can check that find_context() follows focus.
+ *
+ * The results are written to stdout as one JSON object:
+ *
+ *      {"python": "3.12.1", "results": {"<name>": {"n": <ops>,
+ *       "total_ms": <ms>, "per_op_us": <us>, ...}, ...}}
+ *
+ * or {"python": ..., "error": "<traceback>"} if bench.py failed, with an exit
+ * status of 1. Delegate round trips include up to BENCH_IDLE us the timer
+ * loop sleeps between passes, where HexChat would wait in its main loop.
+ *
+ * Build it with `ninja minpython-bench` and run it from anywhere:
+ *
+ *      minpython-bench [--iterations N] [--calls N] [--users N]
+ *                      [--traffic FILE] [--script FILE] [--verbose]
+ *
+ * The plugin's config directory is a new temporary directory, so no installed
+ * plugins are loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "hexchat-plugin.h"
+
+#ifndef BENCH_DIR
+#define BENCH_DIR "bench"
+#endif
+
+#define BENCH_WORDS     32      // Size of HexChat's word arrays (PDIWORDS).
+#define BENCH_TIMEOUT   (120 * G_TIME_SPAN_SECOND)
+#define BENCH_IDLE      20      // us the timer loop sleeps when idle.
+#define BENCH_RESULT    "BENCH_RESULT "
+
+typedef enum {
+    HOOK_COMMAND,
+    HOOK_SERVER,
+    HOOK_SERVER_ATTRS,
+    HOOK_PRINT,
+    HOOK_PRINT_ATTRS,
+    HOOK_TIMER,
+    HOOK_FD
+} HookType;
+
+typedef int (*cmd_cb)       (char *[], char *[], void *);
+typedef int (*cmd_attrs_cb) (char *[], char *[], hexchat_event_attrs *,
+                             void *);
+typedef int (*prnt_cb)      (char *[], void *);
+typedef int (*prnt_attrs_cb)(char *[], hexchat_event_attrs *, void *);
+typedef int (*timer_cb)     (void *);
+
+/**
+ * Hooks are never freed while the host runs, as callbacks may unhook while
+ * they're being dispatched. Unhooked hooks are marked dead.
+ */
+struct _hexchat_hook {
+    hexchat_hook    *next;
+    HookType        type;
+    char            *name;
+    int             pri;
+    void            *callback;
+    void            *userdata;
+    int             timeout;
+    gint64          due;
+    int             dead;
+};
+
+struct _hexchat_plugin {
+    int             unused;
+};
+
+struct _hexchat_context {
+    const char      *channel;
+};
+
+struct _hexchat_list {
+    const char      *name;
+    int             pos;
+    int             count;
+    char            buf[64];
+};
+
+/**
+ * A line of the traffic file split the way HexChat splits server lines.
+ */
+typedef struct {
+    char            *line;
+    char            *buf;
+    char            *word[BENCH_WORDS];
+    char            *word_eol[BENCH_WORDS];
+} BenchLine;
+
+extern int hexchat_plugin_init  (hexchat_plugin *, char **, char **, char **,
+                                 char *);
+extern int hexchat_plugin_deinit(hexchat_plugin *);
+
+static hexchat_plugin   bench_plugin;
+/**
+ * The tabs of the one server. bench_current is the current context, and
+ * bench_front the tab in front, which /GUI FOCUS sets to the current one.
+ */
+static hexchat_context  bench_contexts[] = { { "#python" }, { "#magpy" } };
+static hexchat_context  *bench_current  = &bench_contexts[0];
+static hexchat_context  *bench_front    = &bench_contexts[0];
+
+static hexchat_hook     *bench_events   = NULL; // Main thread only.
+static hexchat_hook     *bench_timers   = NULL; // Prepended under the lock.
+static GMutex           bench_lock;
+
+static char             *bench_configdir    = NULL;
+static char             *bench_result       = NULL;
+
+static gint             opt_iterations      = 20;
+static gint             opt_calls           = 10000;
+static gint             opt_users           = 10000;
+static gchar            *opt_traffic        = NULL;
+static gchar            *opt_script         = NULL;
+static gboolean         opt_verbose         = FALSE;
+
+static hexchat_hook *bench_hook         (HookType, const char *, int, void *,
+                                         void *);
+static void         bench_split         (const char *, BenchLine *);
+static void         bench_free_line     (BenchLine *);
+static int          bench_dispatch      (HookType, const char *, char *[],
+                                         char *[]);
+static void         bench_command       (const char *);
+static void         bench_print_event   (const char *, const char *[]);
+static void         bench_replay_line   (BenchLine *);
+static int          bench_run_timers    (void);
+static int          bench_wait          (gint64);
+static GPtrArray    *bench_read_traffic (const char *);
+static void         bench_remove_tree   (const char *);
+static GHashTable   *bench_prefs        (void);
+
+
+/**
+ * Adds an event hook, kept in priority order. Main thread only.
+ */
+hexchat_hook *
+bench_hook(HookType type, const char *name, int pri, void *callback,
+           void *userdata)
+{
+    hexchat_hook *hook = g_new0(hexchat_hook, 1);
+    hexchat_hook **link;
+
+    hook->type      = type;
+    hook->name      = g_strdup(name);
+    hook->pri       = pri;
+    hook->callback  = callback;
+    hook->userdata  = userdata;
+
+    for (link = &bench_events; *link && (*link)->pri >= pri;
+         link = &(*link)->next);
+
+    hook->next = *link;
+    *link      = hook;
+
+    return hook;
+}
+
+/**
+ * Splits a line into HexChat's 1-based word and word_eol arrays. Unused
+ * entries are "".
+ */
+void
+bench_split(const char *text, BenchLine *line)
+{
+    char    *p;
+    int     i;
+
+    line->line = g_strdup(text);
+    line->buf  = g_strdup(text);
+
+    for (i = 0; i < BENCH_WORDS; i++) {
+        line->word[i]     = "";
+        line->word_eol[i] = "";
+    }
+    for (i = 1, p = line->buf; *p && i < BENCH_WORDS; i++) {
+        while (*p == ' ') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        line->word[i]     = p;
+        line->word_eol[i] = line->line + (p - line->buf);
+
+        while (*p && *p != ' ') {
+            p++;
+        }
+        if (*p) {
+            *p++ = '\0';
+        }
+    }
+}
+
+void
+bench_free_line(BenchLine *line)
+{
+    g_free(line->line);
+    g_free(line->buf);
+    g_free(line);
+}
+
+/**
+ * Calls the live hooks of a type and name, highest priority first, as HexChat
+ * does, until one eats the event.
+ * @returns - The number of hooks called.
+ */
+int
+bench_dispatch(HookType type, const char *name, char *word[],
+               char *word_eol[])
+{
+    static hexchat_event_attrs  attrs;
+    hexchat_hook                *hook;
+    int                         ret;
+    int                         count = 0;
+
+    for (hook = bench_events; hook; hook = hook->next) {
+        if (hook->dead || hook->type != type ||
+            g_ascii_strcasecmp(hook->name, name)) {
+            continue;
+        }
+        switch (type) {
+        case HOOK_COMMAND:
+        case HOOK_SERVER:
+            ret = ((cmd_cb)hook->callback)(word, word_eol, hook->userdata);
+            break;
+        case HOOK_SERVER_ATTRS:
+            ret = ((cmd_attrs_cb)hook->callback)(word, word_eol, &attrs,
+                                                 hook->userdata);
+            break;
+        case HOOK_PRINT:
+            ret = ((prnt_cb)hook->callback)(word, hook->userdata);
+            break;
+        case HOOK_PRINT_ATTRS:
+            ret = ((prnt_attrs_cb)hook->callback)(word, &attrs,
+                                                  hook->userdata);
+            break;
+        default:
+            ret = HEXCHAT_EAT_NONE;
+            break;
+        }
+        count++;
+
+        if (ret & HEXCHAT_EAT_PLUGIN) {
+            break;
+        }
+    }
+    return count;
+}
+
+/**
+ * Runs a command as if it were typed without the leading slash.
+ */
+void
+bench_command(const char *text)
+{
+    BenchLine *line = g_new0(BenchLine, 1);
+
+    bench_split(text, line);
+    bench_dispatch(HOOK_COMMAND, line->word[1], line->word, line->word_eol);
+    bench_free_line(line);
+}
+
+/**
+ * Delivers a print event with up to four arguments.
+ */
+void
+bench_print_event(const char *event, const char *args[])
+{
+    char    *word[BENCH_WORDS];
+    int     i;
+
+    word[0] = (char *)event;
+
+    for (i = 1; i < BENCH_WORDS; i++) {
+        word[i] = (i <= 4 && args[i - 1]) ? (char *)args[i - 1] : "";
+    }
+    bench_dispatch(HOOK_PRINT, event, word, NULL);
+    bench_dispatch(HOOK_PRINT_ATTRS, event, word, NULL);
+}
+
+/**
+ * Delivers a server line to the "RAW LINE" and command hooks, then emits the
+ * print event HexChat would show for it.
+ */
+void
+bench_replay_line(BenchLine *line)
+{
+    const char  *args[4]    = { NULL };
+    const char  *cmd        = line->word[1];
+    char        nick[64];
+    char        *text;
+    char        *bang;
+
+    if (*cmd == ':') {
+        cmd = line->word[2];
+    }
+    bench_dispatch(HOOK_SERVER, "RAW LINE", line->word, line->word_eol);
+    bench_dispatch(HOOK_SERVER, cmd, line->word, line->word_eol);
+    bench_dispatch(HOOK_SERVER_ATTRS, cmd, line->word, line->word_eol);
+
+    if (*line->word[1] != ':') {
+        return;
+    }
+    g_strlcpy(nick, line->word[1] + 1, sizeof(nick));
+    if ((bang = strchr(nick, '!'))) {
+        *bang = '\0';
+    }
+    text    = line->word_eol[4] + (*line->word_eol[4] == ':');
+    args[0] = nick;
+
+    if (!strcmp(cmd, "PRIVMSG")) {
+        if (!strncmp(text, "\001ACTION ", 8)) {
+            args[1] = text + 8;
+            bench_print_event("Channel Action", args);
+        }
+        else {
+            args[1] = text;
+            bench_print_event("Channel Message", args);
+        }
+    }
+    else if (!strcmp(cmd, "NOTICE")) {
+        args[1] = line->word[3];
+        args[2] = text;
+        bench_print_event("Channel Notice", args);
+    }
+    else if (!strcmp(cmd, "JOIN")) {
+        args[1] = line->word[3];
+        args[2] = line->word[1] + 1 + strlen(nick) + 1;
+        bench_print_event("Join", args);
+    }
+    else if (!strcmp(cmd, "PART")) {
+        args[1] = line->word[1] + 1 + strlen(nick) + 1;
+        args[2] = line->word[3];
+        args[3] = text;
+        bench_print_event("Part with Reason", args);
+    }
+}
+
+/**
+ * Runs the timers that are due, and any pending GLib sources.
+ * @returns - Nonzero if a timer ran.
+ */
+int
+bench_run_timers()
+{
+    hexchat_hook    *hook;
+    gint64          now = g_get_monotonic_time();
+    int             ran = 0;
+
+    g_mutex_lock(&bench_lock);
+    hook = bench_timers;
+    g_mutex_unlock(&bench_lock);
+
+    for (; hook; hook = hook->next) {
+        if (hook->dead || hook->due > now) {
+            continue;
+        }
+        ran = 1;
+
+        if (((timer_cb)hook->callback)(hook->userdata)) {
+            hook->due = now + hook->timeout * G_TIME_SPAN_MILLISECOND;
+        }
+        else {
+            hook->dead = 1;
+        }
+    }
+    while (g_main_context_iteration(NULL, FALSE));
+
+    return ran;
+}
+
+/**
+ * Runs the timer loop for a time, or until bench.py has sent its results.
+ * @param usec  - How long to run.
+ * @returns - Nonzero if the results came in.
+ */
+int
+bench_wait(gint64 usec)
+{
+    gint64 end = g_get_monotonic_time() + usec;
+
+    while (!bench_result && g_get_monotonic_time() < end) {
+        if (!bench_run_timers()) {
+            g_usleep(BENCH_IDLE);
+        }
+    }
+    return bench_result != NULL;
+}
+
+/**
+ * Reads the traffic file into split lines, skipping blank ones.
+ */
+GPtrArray *
+bench_read_traffic(const char *path)
+{
+    GPtrArray   *lines;
+    GError      *error = NULL;
+    BenchLine   *line;
+    char        *contents;
+    char        **texts;
+    char        *text;
+    int         i;
+
+    if (!g_file_get_contents(path, &contents, NULL, &error)) {
+        fprintf(stderr, "minpython-bench: %s\n", error->message);
+        g_error_free(error);
+        return NULL;
+    }
+    lines = g_ptr_array_new_with_free_func((GDestroyNotify)bench_free_line);
+    texts = g_strsplit(contents, "\n", -1);
+
+    for (i = 0; texts[i]; i++) {
+        text = g_strstrip(texts[i]);
+
+        if (*text == '@') {
+            // Skip IRCv3 message tags.
+            text = strchr(text, ' ') ? strchr(text, ' ') + 1 : "";
+        }
+        if (*text) {
+            line = g_new0(BenchLine, 1);
+            bench_split(text, line);
+            g_ptr_array_add(lines, line);
+        }
+    }
+    g_strfreev(texts);
+    g_free(contents);
+
+    return lines;
+}
+
+void
+bench_remove_tree(const char *path)
+{
+    GDir        *dir;
+    const char  *name;
+    char        *child;
+
+    if ((dir = g_dir_open(path, 0, NULL))) {
+        while ((name = g_dir_read_name(dir))) {
+            child = g_build_filename(path, name, NULL);
+            bench_remove_tree(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+    g_remove(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+    GOptionContext  *context;
+    GError          *error      = NULL;
+    GPtrArray       *traffic;
+    BenchLine       *cmdline;
+    hexchat_hook    *hook;
+    char            *name, *desc, *version;
+    char            *start;
+    char            *addons;
+    gint64          t0;
+    gint64          replay_us;
+    gint64          command_us;
+    int             i, j;
+
+    static GOptionEntry entries[] = {
+        { "iterations", 'i', 0, G_OPTION_ARG_INT, &opt_iterations,
+          "Times each list and the traffic are run through (20)", "N" },
+        { "calls", 'c', 0, G_OPTION_ARG_INT, &opt_calls,
+          "Calls made by the per-call benchmarks (10000)", "N" },
+        { "users", 'u', 0, G_OPTION_ARG_INT, &opt_users,
+          "Size of the synthetic user list (10000)", "N" },
+        { "traffic", 't', 0, G_OPTION_ARG_FILENAME, &opt_traffic,
+          "IRC lines to replay, one per line", "FILE" },
+        { "script", 's', 0, G_OPTION_ARG_FILENAME, &opt_script,
+          "The benchmark plugin", "FILE" },
+        { "verbose", 'v', 0, G_OPTION_ARG_NONE, &opt_verbose,
+          "Show the plugin's output on stderr", NULL },
+        { NULL }
+    };
+
+    context = g_option_context_new("- benchmark the MagPy bridge");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "minpython-bench: %s\n", error->message);
+        return 2;
+    }
+    g_option_context_free(context);
+
+    if (!opt_traffic) {
+        opt_traffic = g_build_filename(BENCH_DIR, "traffic.txt", NULL);
+    }
+    if (!opt_script) {
+        opt_script = g_build_filename(BENCH_DIR, "bench.py", NULL);
+    }
+    traffic = bench_read_traffic(opt_traffic);
+    if (!traffic) {
+        return 2;
+    }
+    bench_configdir = g_dir_make_tmp("minpython-bench-XXXXXX", &error);
+    if (!bench_configdir) {
+        fprintf(stderr, "minpython-bench: %s\n", error->message);
+        return 2;
+    }
+    addons = g_build_filename(bench_configdir, "addons", NULL);
+    g_mkdir_with_parents(addons, 0700);
+    g_free(addons);
+
+    hexchat_plugin_init(&bench_plugin, &name, &desc, &version, NULL);
+
+    start = g_strdup_printf("LOAD %s", opt_script);
+    bench_command(start);
+    g_free(start);
+
+    // Let the startup timers run.
+    bench_wait(100 * G_TIME_SPAN_MILLISECOND);
+
+    t0 = g_get_monotonic_time();
+
+    for (i = 0; i < opt_iterations; i++) {
+        for (j = 0; j < (int)traffic->len; j++) {
+            bench_replay_line(g_ptr_array_index(traffic, j));
+        }
+    }
+    replay_us = g_get_monotonic_time() - t0;
+
+    cmdline = g_new0(BenchLine, 1);
+    bench_split("BENCH_CMD alpha beta gamma", cmdline);
+
+    t0 = g_get_monotonic_time();
+
+    for (i = 0; i < opt_calls; i++) {
+        bench_dispatch(HOOK_COMMAND, cmdline->word[1], cmdline->word,
+                       cmdline->word_eol);
+    }
+    command_us = g_get_monotonic_time() - t0;
+    bench_free_line(cmdline);
+
+    start = g_strdup_printf("BENCH_START %d %d %d %d %" G_GINT64_FORMAT
+                            " %d %" G_GINT64_FORMAT, opt_iterations,
+                            opt_calls, opt_users,
+                            opt_iterations * (int)traffic->len, replay_us,
+                            opt_calls, command_us);
+    bench_command(start);
+    g_free(start);
+
+    if (bench_wait(BENCH_TIMEOUT)) {
+        printf("%s\n", bench_result);
+    }
+    else {
+        fprintf(stderr, "minpython-bench: %s didn't report its results.\n",
+                opt_script);
+    }
+    hexchat_plugin_deinit(&bench_plugin);
+
+    bench_remove_tree(bench_configdir);
+    g_ptr_array_free(traffic, TRUE);
+
+    for (hook = bench_events; hook; hook = bench_events) {
+        bench_events = hook->next;
+        g_free(hook->name);
+        g_free(hook);
+    }
+    for (hook = bench_timers; hook; hook = bench_timers) {
+        bench_timers = hook->next;
+        g_free(hook->name);
+        g_free(hook);
+    }
+    return (bench_result && !strstr(bench_result, "\"error\":")) ? 0 : 1;
+}
+
+
+/*
+ * The plugin API.
+ */
+
+hexchat_hook *
+hexchat_hook_command(hexchat_plugin *ph, const char *name, int pri,
+                     int (*callback)(char *[], char *[], void *),
+                     const char *help_text, void *userdata)
+{
+    return bench_hook(HOOK_COMMAND, name, pri, callback, userdata);
+}
+
+hexchat_hook *
+hexchat_hook_server(hexchat_plugin *ph, const char *name, int pri,
+                    int (*callback)(char *[], char *[], void *),
+                    void *userdata)
+{
+    return bench_hook(HOOK_SERVER, name, pri, callback, userdata);
+}
+
+hexchat_hook *
+hexchat_hook_server_attrs(hexchat_plugin *ph, const char *name, int pri,
+                          int (*callback)(char *[], char *[],
+                                          hexchat_event_attrs *, void *),
+                          void *userdata)
+{
+    return bench_hook(HOOK_SERVER_ATTRS, name, pri, callback, userdata);
+}
+
+hexchat_hook *
+hexchat_hook_print(hexchat_plugin *ph, const char *name, int pri,
+                   int (*callback)(char *[], void *), void *userdata)
+{
+    return bench_hook(HOOK_PRINT, name, pri, callback, userdata);
+}
+
+hexchat_hook *
+hexchat_hook_print_attrs(hexchat_plugin *ph, const char *name, int pri,
+                         int (*callback)(char *[], hexchat_event_attrs *,
+                                         void *),
+                         void *userdata)
+{
+    return bench_hook(HOOK_PRINT_ATTRS, name, pri, callback, userdata);
+}
+
+hexchat_hook *
+hexchat_hook_timer(hexchat_plugin *ph, int timeout, int (*callback)(void *),
+                   void *userdata)
+{
+    hexchat_hook *hook = g_new0(hexchat_hook, 1);
+
+    // Timers can be added from threads. They're prepended so the timer loop
+    // can walk the list while others are added.
+    hook->type      = HOOK_TIMER;
+    hook->timeout   = timeout;
+    hook->due       = g_get_monotonic_time() +
+                      timeout * G_TIME_SPAN_MILLISECOND;
+    hook->callback  = callback;
+    hook->userdata  = userdata;
+
+    g_mutex_lock(&bench_lock);
+    hook->next   = bench_timers;
+    bench_timers = hook;
+    g_mutex_unlock(&bench_lock);
+
+    return hook;
+}
+
+hexchat_hook *
+hexchat_hook_fd(hexchat_plugin *ph, int fd, int flags,
+                int (*callback)(int, int, void *), void *userdata)
+{
+    // Never fires; the bridge doesn't use fd hooks.
+    return bench_hook(HOOK_FD, NULL, 0, callback, userdata);
+}
+
+void *
+hexchat_unhook(hexchat_plugin *ph, hexchat_hook *hook)
+{
+    hook->dead = 1;
+    return hook->userdata;
+}
+
+void
+hexchat_print(hexchat_plugin *ph, const char *text)
+{
+    if (opt_verbose) {
+        fprintf(stderr, "%s\n", text);
+    }
+}
+
+void
+hexchat_printf(hexchat_plugin *ph, const char *format, ...)
+{
+    va_list args;
+    char    *text;
+
+    va_start(args, format);
+    text = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    hexchat_print(ph, text);
+    g_free(text);
+}
+
+void
+hexchat_command(hexchat_plugin *ph, const char *command)
+{
+    if (!strncmp(command, BENCH_RESULT, strlen(BENCH_RESULT))) {
+        g_free(bench_result);
+        bench_result = g_strdup(command + strlen(BENCH_RESULT));
+    }
+    else if (!g_ascii_strcasecmp(command, "GUI FOCUS")) {
+        bench_front = bench_current;
+    }
+    else if (opt_verbose) {
+        fprintf(stderr, "/%s\n", command);
+    }
+}
+
+void
+hexchat_commandf(hexchat_plugin *ph, const char *format, ...)
+{
+    va_list args;
+    char    *command;
+
+    va_start(args, format);
+    command = g_strdup_vprintf(format, args);
+    va_end(args);
+
+    hexchat_command(ph, command);
+    g_free(command);
+}
+
+int
+hexchat_nickcmp(hexchat_plugin *ph, const char *s1, const char *s2)
+{
+    return g_ascii_strcasecmp(s1, s2);
+}
+
+int
+hexchat_set_context(hexchat_plugin *ph, hexchat_context *ctx)
+{
+    bench_current = ctx;
+    return 1;
+}
+
+hexchat_context *
+hexchat_find_context(hexchat_plugin *ph, const char *servname,
+                     const char *channel)
+{
+    gsize i;
+
+    if (!channel) {
+        return bench_front;
+    }
+    for (i = 0; i < G_N_ELEMENTS(bench_contexts); i++) {
+        if (!g_ascii_strcasecmp(bench_contexts[i].channel, channel)) {
+            return &bench_contexts[i];
+        }
+    }
+    return NULL;
+}
+
+hexchat_context *
+hexchat_get_context(hexchat_plugin *ph)
+{
+    return bench_current;
+}
+
+const char *
+hexchat_get_info(hexchat_plugin *ph, const char *id)
+{
+    if (!strcmp(id, "xchatdir") || !strcmp(id, "configdir")) {
+        return bench_configdir;
+    }
+    if (!strcmp(id, "channel"))     return bench_current->channel;
+    if (!strcmp(id, "network"))     return "ExampleNet";
+    if (!strcmp(id, "server"))      return "irc.example.org";
+    if (!strcmp(id, "host"))        return "irc.example.org";
+    if (!strcmp(id, "nick"))        return "bench";
+    if (!strcmp(id, "version"))     return "2.16.1";
+    if (!strcmp(id, "inputbox"))    return "";
+
+    return NULL;
+}
+
+int
+hexchat_get_prefs(hexchat_plugin *ph, const char *name, const char **string,
+                  int *integer)
+{
+    return 0;
+}
+
+/**
+ * Lists are empty except "users", which has --users synthetic entries.
+ */
+hexchat_list *
+hexchat_list_get(hexchat_plugin *ph, const char *name)
+{
+    hexchat_list *list = g_new0(hexchat_list, 1);
+
+    list->name  = !strcmp(name, "users") ? "users" : "";
+    list->pos   = -1;
+    list->count = !strcmp(name, "users") ? opt_users : 0;
+
+    return list;
+}
+
+void
+hexchat_list_free(hexchat_plugin *ph, hexchat_list *xlist)
+{
+    g_free(xlist);
+}
+
+const char * const *
+hexchat_list_fields(hexchat_plugin *ph, const char *name)
+{
+    static const char * const users[]    = { "saccount", "iaway", "shost",
+                                             "tlasttalk", "snick", "sprefix",
+                                             "srealname", "iselected", NULL };
+    static const char * const channels[] = { "schannel", "ichantypes",
+                                             "pcontext", "iflags", "iid",
+                                             "ilag", "imaxmodes", "snetwork",
+                                             "snickprefixes", "snickmodes",
+                                             "iqueue", "sserver", "itype",
+                                             "iusers", NULL };
+    static const char * const none[]     = { NULL };
+
+    if (!strcmp(name, "users")) {
+        return users;
+    }
+    if (!strcmp(name, "channels")) {
+        return channels;
+    }
+    return none;
+}
+
+int
+hexchat_list_next(hexchat_plugin *ph, hexchat_list *xlist)
+{
+    return ++xlist->pos < xlist->count;
+}
+
+const char *
+hexchat_list_str(hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+    int pos = xlist->pos;
+
+    if (!strcmp(name, "nick")) {
+        g_snprintf(xlist->buf, sizeof(xlist->buf), "user%05d", pos);
+    }
+    else if (!strcmp(name, "host")) {
+        g_snprintf(xlist->buf, sizeof(xlist->buf),
+                   "~user%05d@%d.users.example.org", pos, pos % 97);
+    }
+    else if (!strcmp(name, "realname")) {
+        g_snprintf(xlist->buf, sizeof(xlist->buf), "User Number %d", pos);
+    }
+    else if (!strcmp(name, "prefix")) {
+        return (pos % 25 == 0) ? "@" : (pos % 7 == 0) ? "+" : "";
+    }
+    else {
+        return NULL;
+    }
+    return xlist->buf;
+}
+
+int
+hexchat_list_int(hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+    return (!strcmp(name, "away")) ? (xlist->pos % 5 == 0) : 0;
+}
+
+time_t
+hexchat_list_time(hexchat_plugin *ph, hexchat_list *xlist, const char *name)
+{
+    return 1500000000 + xlist->pos;
+}
+
+void *
+hexchat_plugingui_add(hexchat_plugin *ph, const char *filename,
+                      const char *name, const char *desc, const char *version,
+                      char *reserved)
+{
+    return g_strdup(name);
+}
+
+void
+hexchat_plugingui_remove(hexchat_plugin *ph, void *handle)
+{
+    g_free(handle);
+}
+
+int
+hexchat_emit_print(hexchat_plugin *ph, const char *event_name, ...)
+{
+    return 1;
+}
+
+int
+hexchat_emit_print_attrs(hexchat_plugin *ph, hexchat_event_attrs *attrs,
+                         const char *event_name, ...)
+{
+    return 1;
+}
+
+char *
+hexchat_gettext(hexchat_plugin *ph, const char *msgid)
+{
+    return (char *)msgid;
+}
+
+void
+hexchat_send_modes(hexchat_plugin *ph, const char **targets, int ntargets,
+                   int modes_per_line, char sign, char mode)
+{
+}
+
+char *
+hexchat_strip(hexchat_plugin *ph, const char *str, int len, int flags)
+{
+    return (len < 0) ? g_strdup(str) : g_strndup(str, len);
+}
+
+void
+hexchat_free(hexchat_plugin *ph, void *ptr)
+{
+    g_free(ptr);
+}
+
+hexchat_event_attrs *
+hexchat_event_attrs_create(hexchat_plugin *ph)
+{
+    return g_new0(hexchat_event_attrs, 1);
+}
+
+void
+hexchat_event_attrs_free(hexchat_plugin *ph, hexchat_event_attrs *attrs)
+{
+    g_free(attrs);
+}
+
+/*
+ * Pluginprefs are kept in memory for the run.
+ */
+
+GHashTable *
+bench_prefs()
+{
+    static GHashTable *prefs = NULL;
+
+    if (!prefs) {
+        prefs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    return prefs;
+}
+
+int
+hexchat_pluginpref_set_str(hexchat_plugin *ph, const char *var,
+                           const char *value)
+{
+    g_hash_table_replace(bench_prefs(), g_strdup(var), g_strdup(value));
+    return 1;
+}
+
+int
+hexchat_pluginpref_get_str(hexchat_plugin *ph, const char *var, char *dest)
+{
+    const char *value = g_hash_table_lookup(bench_prefs(), var);
+
+    if (!value) {
+        return 0;
+    }
+    g_strlcpy(dest, value, 512);
+    return 1;
+}
+
+int
+hexchat_pluginpref_set_int(hexchat_plugin *ph, const char *var, int value)
+{
+    char buf[16];
+
+    g_snprintf(buf, sizeof(buf), "%d", value);
+    return hexchat_pluginpref_set_str(ph, var, buf);
+}
+
+int
+hexchat_pluginpref_get_int(hexchat_plugin *ph, const char *var)
+{
+    char buf[512];
+
+    return hexchat_pluginpref_get_str(ph, var, buf) ? atoi(buf) : -1;
+}
+
+int
+hexchat_pluginpref_delete(hexchat_plugin *ph, const char *var)
+{
+    return g_hash_table_remove(bench_prefs(), var);
+}
+
+int
+hexchat_pluginpref_list(hexchat_plugin *ph, char *dest)
+{
+    GHashTableIter  iter;
+    gpointer        key;
+
+    *dest = '\0';
+    g_hash_table_iter_init(&iter, bench_prefs());
+
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_strlcat(dest, key, 4096);
+        g_strlcat(dest, ",", 4096);
+    }
+    return 1;
+}
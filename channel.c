@@ -0,0 +1,786 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * Channel objects pass messages between plugins without proxies. A channel is
+ * a named ring buffer in C; every hexchat.Channel(name) created with the same
+ * name, in any interp, refers to the same buffer. A message is copied into the
+ * buffer when it's sent and a new object is built from it when it's received,
+ * so nothing received refers to an object of the sending interp.
+ *
+ * bytes and str are copied as they are. Other values have to be ones that
+ * InterpCall would pass by value (None, the primitives, and plain tuples,
+ * lists, dicts, and frozensets of them); these are serialized with marshal.
+ *
+ * Any thread may send and receive. A call that has to wait releases the GIL
+ * while it does; waiting isn't allowed on the HexChat main thread, where the
+ * non-blocking forms should be used instead.
+ */
+
+#include <glib.h>
+#include "minpython.h"
+#include <marshal.h>
+
+/**
+ * The shared channel data.
+ */
+typedef struct _Channel Channel;
+
+struct _Channel {
+    Channel     *next;          // Registry link.
+    char        *name;
+    long        refs;           // Channel objects using it. Registry lock.
+    GMutex      lock;           // Guards the rest.
+    GCond       not_empty;
+    GCond       not_full;
+    char        *buf;
+    gsize       capacity;
+    gsize       head;           // Offset of the oldest message.
+    gsize       used;           // Bytes in use, headers included.
+    gsize       count;          // Number of messages.
+    int         closed;
+};
+
+/**
+ * Channel instance data.
+ */
+typedef struct {
+    PyObject_HEAD
+    Channel     *chan;
+} ChannelObj;
+
+/**
+ * Each message in the buffer is a header - the payload length followed by a
+ * type tag - and the payload.
+ */
+#define CHANNEL_HDR_SIZE            5
+#define CHANNEL_TAG_BYTES           'b'
+#define CHANNEL_TAG_STR             's'
+#define CHANNEL_TAG_VALUE           'm'
+
+#define CHANNEL_DEFAULT_CAPACITY    65536
+#define CHANNEL_MIN_CAPACITY        64
+
+/**
+ * Results of channel_put() and channel_take().
+ */
+#define CHANNEL_OK                  0
+#define CHANNEL_WOULD_BLOCK         1
+#define CHANNEL_IS_CLOSED           2
+
+/**
+ * All open channels. Registry lock is static, so doesn't need initializing.
+ */
+static Channel  *channels       = NULL;
+static GMutex   channels_lock;
+
+static Channel  *channel_open           (const char *, gsize);
+static void     channel_release         (Channel *);
+static void     channel_ring_write      (Channel *, const void *, gsize);
+static void     channel_ring_read       (Channel *, void *, gsize);
+static int      channel_put             (Channel *, char, const char *, gsize,
+                                         gint64);
+static int      channel_take            (Channel *, char *, char **, gsize *,
+                                         gint64);
+static int      channel_get_timeout     (PyObject *, int, gint64 *);
+static int      channel_may_wait        (void);
+static PyObject *channel_raise_queue_exc(const char *);
+
+static int      Channel_init            (ChannelObj *, PyObject *, PyObject *);
+static void     Channel_dealloc         (ChannelObj *);
+static PyObject *Channel_send           (ChannelObj *, PyObject *,
+                                         PyObject *);
+static PyObject *Channel_recv           (ChannelObj *, PyObject *,
+                                         PyObject *);
+static PyObject *Channel_send_nowait    (ChannelObj *, PyObject *);
+static PyObject *Channel_recv_nowait    (ChannelObj *, PyObject *);
+static PyObject *Channel_close          (ChannelObj *, PyObject *);
+static PyObject *Channel_get_name       (ChannelObj *, void *);
+static PyObject *Channel_get_closed     (ChannelObj *, void *);
+static PyObject *Channel_get_capacity   (ChannelObj *, void *);
+static Py_ssize_t Channel_length        (ChannelObj *);
+static PyObject *Channel_repr           (ChannelObj *, PyObject *);
+
+static PyObject *Channel_do_send        (ChannelObj *, PyObject *, int,
+                                         gint64);
+static PyObject *Channel_do_recv        (ChannelObj *, int, gint64);
+
+/**
+ * Channel methods.
+ */
+static PyMethodDef Channel_methods[] = {
+    {"send",        (PyCFunction)Channel_send,
+                    METH_VARARGS | METH_KEYWORDS,
+     "send(obj, block=True, timeout=None) - Puts a copy of obj in the "
+     "channel. If the channel is full and block is True, waits up to "
+     "timeout seconds (forever if None) for room; otherwise raises "
+     "queue.Full."},
+
+    {"recv",        (PyCFunction)Channel_recv,
+                    METH_VARARGS | METH_KEYWORDS,
+     "recv(block=True, timeout=None) - Removes and returns the oldest "
+     "message. If there is none and block is True, waits up to timeout "
+     "seconds (forever if None) for one; otherwise raises queue.Empty."},
+
+    {"send_nowait", (PyCFunction)Channel_send_nowait,   METH_O,
+     "Same as send(obj, False)."},
+
+    {"recv_nowait", (PyCFunction)Channel_recv_nowait,   METH_NOARGS,
+     "Same as recv(False)."},
+
+    {"close",       (PyCFunction)Channel_close,         METH_NOARGS,
+     "Closes the channel for every user of it. Further sends raise "
+     "ValueError; messages already sent can still be received."},
+
+    {NULL}
+};
+
+/**
+ * Channel accessors.
+ */
+static PyGetSetDef Channel_accessors[] = {
+    {"name",        (getter)Channel_get_name,       NULL,
+     "The name of the channel.", NULL},
+
+    {"closed",      (getter)Channel_get_closed,     NULL,
+     "True if the channel has been closed.", NULL},
+
+    {"capacity",    (getter)Channel_get_capacity,   NULL,
+     "The size of the channel's buffer in bytes.", NULL},
+
+    {NULL}
+};
+
+/**
+ * Channel sequence methods; len() gives the number of messages waiting.
+ */
+static PySequenceMethods Channel_seq_methods = {
+    .sq_length      = (lenfunc)Channel_length,
+};
+
+/**
+ * Channel type.
+ */
+static PyTypeObject ChannelType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name        = "hexchat.Channel",
+    .tp_doc         = "Channel(name, capacity=65536) - A message channel "
+                      "shared by every plugin that opens the same name. "
+                      "Carries bytes, str, and plain values by copy.",
+    .tp_basicsize   = sizeof(ChannelObj),
+    .tp_itemsize    = 0,
+    .tp_flags       = Py_TPFLAGS_DEFAULT,
+    .tp_new         = PyType_GenericNew,
+    .tp_init        = (initproc)Channel_init,
+    .tp_dealloc     = (destructor)Channel_dealloc,
+    .tp_methods     = Channel_methods,
+    .tp_getset      = Channel_accessors,
+    .tp_as_sequence = &Channel_seq_methods,
+    .tp_repr        = (reprfunc)Channel_repr,
+};
+
+/**
+ * Channel convenience ptr.
+ */
+PyTypeObject *ChannelTypeDef = &ChannelType;
+
+/**
+ * Constructor.
+ * @param args      - 'name', and optionally 'capacity', the size of the
+ *                    buffer in bytes. The capacity is set by the first
+ *                    Channel opened with the name; it's ignored otherwise.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+Channel_init(ChannelObj *self, PyObject *args, PyObject *kwargs)
+{
+    const char  *name;
+    Py_ssize_t  capacity    = CHANNEL_DEFAULT_CAPACITY;
+    static char *keywords[] = { "name", "capacity", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|n:__init__", keywords,
+                                     &name, &capacity)) {
+        return -1;
+    }
+    if (capacity < CHANNEL_MIN_CAPACITY) {
+        PyErr_Format(PyExc_ValueError,
+                     "capacity must be at least %d bytes.",
+                     CHANNEL_MIN_CAPACITY);
+        return -1;
+    }
+    if (self->chan) {
+        channel_release(self->chan);
+    }
+    if (!(self->chan = channel_open(name, (gsize)capacity))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+void
+Channel_dealloc(ChannelObj *self)
+{
+    if (self->chan) {
+        channel_release(self->chan);
+    }
+    interp_free_object((PyObject *)self);
+}
+
+PyObject *
+Channel_send(ChannelObj *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject    *pyobj;
+    PyObject    *pytimeout  = Py_None;
+    int         block       = 1;
+    gint64      timeout;
+    static char *keywords[] = { "obj", "block", "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|pO:send", keywords,
+                                     &pyobj, &block, &pytimeout)) {
+        return NULL;
+    }
+    if (channel_get_timeout(pytimeout, block, &timeout)) {
+        return NULL;
+    }
+    return Channel_do_send(self, pyobj, block, timeout);
+}
+
+PyObject *
+Channel_recv(ChannelObj *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject    *pytimeout  = Py_None;
+    int         block       = 1;
+    gint64      timeout;
+    static char *keywords[] = { "block", "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pO:recv", keywords,
+                                     &block, &pytimeout)) {
+        return NULL;
+    }
+    if (channel_get_timeout(pytimeout, block, &timeout)) {
+        return NULL;
+    }
+    return Channel_do_recv(self, block, timeout);
+}
+
+PyObject *
+Channel_send_nowait(ChannelObj *self, PyObject *pyobj)
+{
+    return Channel_do_send(self, pyobj, 0, 0);
+}
+
+PyObject *
+Channel_recv_nowait(ChannelObj *self, PyObject *Py_UNUSED(args))
+{
+    return Channel_do_recv(self, 0, 0);
+}
+
+PyObject *
+Channel_close(ChannelObj *self, PyObject *Py_UNUSED(args))
+{
+    Channel *chan = self->chan;
+
+    if (chan) {
+        g_mutex_lock(&chan->lock);
+        chan->closed = 1;
+        g_cond_broadcast(&chan->not_empty);
+        g_cond_broadcast(&chan->not_full);
+        g_mutex_unlock(&chan->lock);
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject *
+Channel_get_name(ChannelObj *self, void *closure)
+{
+    if (!self->chan) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(self->chan->name);
+}
+
+PyObject *
+Channel_get_closed(ChannelObj *self, void *closure)
+{
+    int closed = 1;
+
+    if (self->chan) {
+        g_mutex_lock(&self->chan->lock);
+        closed = self->chan->closed;
+        g_mutex_unlock(&self->chan->lock);
+    }
+    return PyBool_FromLong(closed);
+}
+
+PyObject *
+Channel_get_capacity(ChannelObj *self, void *closure)
+{
+    return PyLong_FromSize_t(self->chan ? self->chan->capacity : 0);
+}
+
+Py_ssize_t
+Channel_length(ChannelObj *self)
+{
+    gsize count = 0;
+
+    if (self->chan) {
+        g_mutex_lock(&self->chan->lock);
+        count = self->chan->count;
+        g_mutex_unlock(&self->chan->lock);
+    }
+    return (Py_ssize_t)count;
+}
+
+PyObject *
+Channel_repr(ChannelObj *self, PyObject *Py_UNUSED(args))
+{
+    return PyUnicode_FromFormat("Channel(%s)",
+                                self->chan ? self->chan->name : "");
+}
+
+/**
+ * Encodes and sends a message.
+ * @param self      - The Channel.
+ * @param pyobj     - The object to send.
+ * @param block     - Nonzero to wait for room if the channel is full.
+ * @param timeout   - Microseconds to wait, or -1 to wait indefinitely.
+ * @returns - None, or NULL with error state set.
+ */
+PyObject *
+Channel_do_send(ChannelObj *self, PyObject *pyobj, int block, gint64 timeout)
+{
+    Channel     *chan       = self->chan;
+    PyObject    *pyowner    = NULL;
+    const char  *data;
+    Py_ssize_t  len;
+    char        tag;
+    int         status;
+
+    if (!chan) {
+        PyErr_SetString(PyExc_RuntimeError, "The Channel isn't initialized.");
+        return NULL;
+    }
+
+    // Get the bytes of the message. str and bytes are copied directly; other
+    // values are marshalled.
+    if (PyBytes_CheckExact(pyobj)) {
+        tag     = CHANNEL_TAG_BYTES;
+        data    = PyBytes_AS_STRING(pyobj);
+        len     = PyBytes_GET_SIZE(pyobj);
+        pyowner = pyobj;
+        Py_INCREF(pyowner);
+    }
+    else if (PyUnicode_CheckExact(pyobj) &&
+             (data = PyUnicode_AsUTF8AndSize(pyobj, &len))) {
+        tag     = CHANNEL_TAG_STR;
+        pyowner = pyobj;
+        Py_INCREF(pyowner);
+    }
+    else {
+        // A str with lone surrogates can't be UTF-8 encoded; marshal
+        // handles those.
+        PyErr_Clear();
+        if (!interp_is_value(pyobj)) {
+            PyErr_Format(PyExc_TypeError,
+                         "Channels can't carry '%s' objects; send bytes, "
+                         "str, or plain values.",
+                         Py_TYPE(pyobj)->tp_name);
+            return NULL;
+        }
+        if (!(pyowner = PyMarshal_WriteObjectToString(pyobj,
+                                                      Py_MARSHAL_VERSION))) {
+            return NULL;
+        }
+        tag  = CHANNEL_TAG_VALUE;
+        data = PyBytes_AS_STRING(pyowner);
+        len  = PyBytes_GET_SIZE(pyowner);
+    }
+    if ((gsize)len + CHANNEL_HDR_SIZE > chan->capacity || len > G_MAXUINT32) {
+        Py_DECREF(pyowner);
+        PyErr_Format(PyExc_ValueError,
+                     "Message of %zd bytes is too large for the channel.",
+                     len);
+        return NULL;
+    }
+
+    // Try without waiting first so the GIL is only released when needed.
+    status = channel_put(chan, tag, data, (gsize)len, 0);
+
+    if (status == CHANNEL_WOULD_BLOCK && block) {
+        if (!channel_may_wait()) {
+            Py_DECREF(pyowner);
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        status = channel_put(chan, tag, data, (gsize)len, timeout);
+        Py_END_ALLOW_THREADS
+    }
+    Py_DECREF(pyowner);
+
+    switch (status) {
+        case CHANNEL_OK:
+            Py_RETURN_NONE;
+        case CHANNEL_IS_CLOSED:
+            PyErr_SetString(PyExc_ValueError, "The channel is closed.");
+            return NULL;
+        default:
+            return channel_raise_queue_exc("Full");
+    }
+}
+
+/**
+ * Receives and decodes a message.
+ * @param self      - The Channel.
+ * @param block     - Nonzero to wait for a message if there is none.
+ * @param timeout   - Microseconds to wait, or -1 to wait indefinitely.
+ * @returns - The message, or NULL with error state set.
+ */
+PyObject *
+Channel_do_recv(ChannelObj *self, int block, gint64 timeout)
+{
+    Channel     *chan       = self->chan;
+    PyObject    *pyobj;
+    char        *data       = NULL;
+    gsize       len         = 0;
+    char        tag         = 0;
+    int         status;
+
+    if (!chan) {
+        PyErr_SetString(PyExc_RuntimeError, "The Channel isn't initialized.");
+        return NULL;
+    }
+    status = channel_take(chan, &tag, &data, &len, 0);
+
+    if (status == CHANNEL_WOULD_BLOCK && block) {
+        if (!channel_may_wait()) {
+            return NULL;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        status = channel_take(chan, &tag, &data, &len, timeout);
+        Py_END_ALLOW_THREADS
+    }
+    if (status != CHANNEL_OK) {
+        // A closed channel that's been drained is just empty.
+        return channel_raise_queue_exc("Empty");
+    }
+    switch (tag) {
+        case CHANNEL_TAG_BYTES:
+            pyobj = PyBytes_FromStringAndSize(data, (Py_ssize_t)len);
+            break;
+        case CHANNEL_TAG_STR:
+            pyobj = PyUnicode_DecodeUTF8(data, (Py_ssize_t)len, NULL);
+            break;
+        default:
+            pyobj = PyMarshal_ReadObjectFromString(data, (Py_ssize_t)len);
+            break;
+    }
+    g_free(data);
+
+    return pyobj;
+}
+
+/**
+ * Converts the timeout argument of send() and recv().
+ * @param pytimeout - None, or the number of seconds.
+ * @param block     - The block argument; the timeout is ignored if it's 0.
+ * @param timeout   - Receives the microseconds to wait, or -1 for no limit.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+channel_get_timeout(PyObject *pytimeout, int block, gint64 *timeout)
+{
+    double seconds;
+
+    *timeout = -1;
+
+    if (!block || pytimeout == Py_None) {
+        return 0;
+    }
+    seconds = PyFloat_AsDouble(pytimeout);
+    if (seconds == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+    if (seconds < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "timeout must be a non-negative number.");
+        return -1;
+    }
+    if (seconds * G_TIME_SPAN_SECOND < (double)G_MAXINT64) {
+        *timeout = (gint64)(seconds * G_TIME_SPAN_SECOND);
+    }
+    return 0;
+}
+
+/**
+ * Checks whether the calling thread may wait on a channel.
+ * @returns - 1 if so; 0 on the HexChat main thread, with error state set.
+ */
+int
+channel_may_wait()
+{
+    if (PyThreadState_Get()->thread_id == py_g_main_threadstate->thread_id) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Can't wait on a Channel on the HexChat main thread. "
+                        "Use block=False, or the _nowait methods.");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Raises queue.Empty or queue.Full in the current interp.
+ * @returns - NULL.
+ */
+PyObject *
+channel_raise_queue_exc(const char *name)
+{
+    PyObject *pymodule;
+    PyObject *pyexc;
+
+    if (!(pymodule = PyImport_ImportModule("queue"))) {
+        return NULL;
+    }
+    pyexc = PyObject_GetAttrString(pymodule, name);
+    Py_DECREF(pymodule);
+
+    if (pyexc) {
+        PyErr_SetNone(pyexc);
+        Py_DECREF(pyexc);
+    }
+    return NULL;
+}
+
+/**
+ * Returns the channel with the given name, creating it if it doesn't exist.
+ * The caller gets a reference to it that it has to release with
+ * channel_release().
+ * @returns - The channel, or NULL if it couldn't be allocated.
+ */
+Channel *
+channel_open(const char *name, gsize capacity)
+{
+    Channel *chan;
+
+    g_mutex_lock(&channels_lock);
+
+    for (chan = channels; chan; chan = chan->next) {
+        if (!strcmp(chan->name, name)) {
+            break;
+        }
+    }
+    if (!chan && (chan = g_try_malloc0(sizeof(Channel)))) {
+        chan->name     = g_strdup(name);
+        chan->capacity = capacity;
+        if (!(chan->buf = g_try_malloc(capacity))) {
+            g_free(chan->name);
+            g_free(chan);
+            chan = NULL;
+        }
+        else {
+            g_mutex_init(&chan->lock);
+            g_cond_init(&chan->not_empty);
+            g_cond_init(&chan->not_full);
+            chan->next = channels;
+            channels   = chan;
+        }
+    }
+    if (chan) {
+        chan->refs++;
+    }
+    g_mutex_unlock(&channels_lock);
+
+    return chan;
+}
+
+/**
+ * Releases a reference to a channel. The last one frees it along with any
+ * messages that haven't been received.
+ */
+void
+channel_release(Channel *chan)
+{
+    Channel **link;
+
+    g_mutex_lock(&channels_lock);
+
+    if (--chan->refs > 0) {
+        g_mutex_unlock(&channels_lock);
+        return;
+    }
+    for (link = &channels; *link; link = &(*link)->next) {
+        if (*link == chan) {
+            *link = chan->next;
+            break;
+        }
+    }
+    g_mutex_unlock(&channels_lock);
+
+    g_cond_clear(&chan->not_full);
+    g_cond_clear(&chan->not_empty);
+    g_mutex_clear(&chan->lock);
+    g_free(chan->buf);
+    g_free(chan->name);
+    g_free(chan);
+}
+
+/**
+ * Copies data into the free part of the ring buffer, after the last message.
+ * The channel lock must be held, and there must be room.
+ */
+void
+channel_ring_write(Channel *chan, const void *src, gsize len)
+{
+    gsize tail  = (chan->head + chan->used) % chan->capacity;
+    gsize first = MIN(len, chan->capacity - tail);
+
+    memcpy(chan->buf + tail, src, first);
+    memcpy(chan->buf, (const char *)src + first, len - first);
+    chan->used += len;
+}
+
+/**
+ * Copies data out of the ring buffer from the head, and frees that space.
+ * The channel lock must be held.
+ */
+void
+channel_ring_read(Channel *chan, void *dst, gsize len)
+{
+    gsize first = MIN(len, chan->capacity - chan->head);
+
+    memcpy(dst, chan->buf + chan->head, first);
+    memcpy((char *)dst + first, chan->buf, len - first);
+    chan->head  = (chan->head + len) % chan->capacity;
+    chan->used -= len;
+}
+
+/**
+ * Adds a message to a channel. Doesn't use Python, so it can be called with
+ * the GIL released.
+ * @param chan      - The channel.
+ * @param tag       - The message type tag.
+ * @param data      - The payload.
+ * @param len       - Length of the payload, which has to fit the channel.
+ * @param timeout   - Microseconds to wait for room: 0 not to wait, -1 to wait
+ *                    indefinitely.
+ * @returns - CHANNEL_OK, CHANNEL_WOULD_BLOCK if there wasn't room in time, or
+ *            CHANNEL_IS_CLOSED.
+ */
+int
+channel_put(Channel *chan, char tag, const char *data, gsize len,
+            gint64 timeout)
+{
+    gint64  end_time    = 0;
+    guint32 len32       = (guint32)len;
+    char    hdr[CHANNEL_HDR_SIZE];
+
+    if (timeout > 0) {
+        end_time = g_get_monotonic_time() + timeout;
+    }
+    g_mutex_lock(&chan->lock);
+
+    while (!chan->closed &&
+           chan->capacity - chan->used < len + CHANNEL_HDR_SIZE) {
+        if (timeout == 0 ||
+            (timeout > 0 && !g_cond_wait_until(&chan->not_full, &chan->lock,
+                                               end_time))) {
+            g_mutex_unlock(&chan->lock);
+            return CHANNEL_WOULD_BLOCK;
+        }
+        if (timeout < 0) {
+            g_cond_wait(&chan->not_full, &chan->lock);
+        }
+    }
+    if (chan->closed) {
+        g_mutex_unlock(&chan->lock);
+        return CHANNEL_IS_CLOSED;
+    }
+    memcpy(hdr, &len32, sizeof(len32));
+    hdr[4] = tag;
+
+    channel_ring_write(chan, hdr, CHANNEL_HDR_SIZE);
+    channel_ring_write(chan, data, len);
+    chan->count++;
+
+    g_cond_signal(&chan->not_empty);
+    g_mutex_unlock(&chan->lock);
+
+    return CHANNEL_OK;
+}
+
+/**
+ * Removes the oldest message from a channel. Doesn't use Python, so it can be
+ * called with the GIL released.
+ * @param chan      - The channel.
+ * @param tag       - Receives the message type tag.
+ * @param data      - Receives the payload; free it with g_free().
+ * @param len       - Receives the length of the payload.
+ * @param timeout   - As for channel_put().
+ * @returns - CHANNEL_OK, CHANNEL_WOULD_BLOCK if there was no message in time,
+ *            or CHANNEL_IS_CLOSED if the channel is closed and empty.
+ */
+int
+channel_take(Channel *chan, char *tag, char **data, gsize *len,
+             gint64 timeout)
+{
+    gint64  end_time    = 0;
+    guint32 len32;
+    char    hdr[CHANNEL_HDR_SIZE];
+
+    if (timeout > 0) {
+        end_time = g_get_monotonic_time() + timeout;
+    }
+    g_mutex_lock(&chan->lock);
+
+    while (!chan->count) {
+        if (chan->closed) {
+            g_mutex_unlock(&chan->lock);
+            return CHANNEL_IS_CLOSED;
+        }
+        if (timeout == 0 ||
+            (timeout > 0 && !g_cond_wait_until(&chan->not_empty, &chan->lock,
+                                               end_time))) {
+            g_mutex_unlock(&chan->lock);
+            return CHANNEL_WOULD_BLOCK;
+        }
+        if (timeout < 0) {
+            g_cond_wait(&chan->not_empty, &chan->lock);
+        }
+    }
+    channel_ring_read(chan, hdr, CHANNEL_HDR_SIZE);
+    memcpy(&len32, hdr, sizeof(len32));
+
+    *tag  = hdr[4];
+    *len  = len32;
+    *data = g_malloc(len32 ? len32 : 1);
+
+    channel_ring_read(chan, *data, len32);
+    chan->count--;
+
+    // Messages vary in size, so any of the waiting senders might fit now.
+    g_cond_broadcast(&chan->not_full);
+    g_mutex_unlock(&chan->lock);
+
+    return CHANNEL_OK;
+}
@@ -0,0 +1,227 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+
+/**
+ * A cache of the compiled code of plugin scripts, so loading or reloading a
+ * plugin doesn't parse and compile its source each time. Scripts are run by
+ * plugin.c rather than imported, so they don't get __pycache__ files; these
+ * are kept under <config dir>/mpycache instead.
+ *
+ * Each cache file has a header with the Python magic number and the script's
+ * path, modification time and size, followed by the marshalled code object.
+ * The entry is only used if all of these match the script. Problems with the
+ * cache aren't reported; the script is just compiled.
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "minpython.h"
+#include <marshal.h>
+
+#define CODECACHE_DIR   "mpycache"
+
+/**
+ * The header of a cache file. The script's path, path_len bytes, follows.
+ */
+typedef struct {
+    guint32     magic;
+    guint32     path_len;
+    gint64      mtime;
+    gint64      size;
+} CodeCacheHeader;
+
+PyObject        *codecache_get_code     (FILE *, const char *);
+
+static char     *codecache_file_path    (const char *);
+static PyObject *codecache_read         (const char *, const char *,
+                                         CodeCacheHeader *);
+static void     codecache_write         (const char *, const char *,
+                                         CodeCacheHeader *, PyObject *);
+static PyObject *codecache_compile      (FILE *, const char *);
+
+/**
+ * Gets the code object of a plugin script from the cache, or compiles it and
+ * adds it to the cache. Must be called in the interp that will run it. The
+ * path keys the cache entry, so it must be the full path load_plugin()
+ * resolved; a relative path is compiled but not cached.
+ * @param fp    - The open script file.
+ * @param path  - The script's full path.
+ * @returns - A new reference to the code object, or NULL with error state set
+ *            if the script couldn't be compiled.
+ */
+PyObject *
+codecache_get_code(FILE *fp, const char *path)
+{
+    CodeCacheHeader hdr;
+    GStatBuf        st;
+    PyObject        *pycode;
+    char            *cpath;
+
+    if (!g_path_is_absolute(path) || g_stat(path, &st)) {
+        return codecache_compile(fp, path);
+    }
+    hdr.magic    = (guint32)PyImport_GetMagicNumber();
+    hdr.path_len = (guint32)strlen(path);
+    hdr.mtime    = (gint64)st.st_mtime;
+    hdr.size     = (gint64)st.st_size;
+
+    cpath  = codecache_file_path(path);
+    pycode = codecache_read(cpath, path, &hdr);
+
+    if (!pycode) {
+        pycode = codecache_compile(fp, path);
+        if (pycode) {
+            codecache_write(cpath, path, &hdr, pycode);
+        }
+    }
+    g_free(cpath);
+    return pycode;
+}
+
+/**
+ * Gets the path of the cache file for a script. The name is the script's
+ * file name and a hash of its full path.
+ * @param path  - The script's path.
+ * @returns - The path, to be freed with g_free().
+ */
+char *
+codecache_file_path(const char *path)
+{
+    char    *base;
+    char    *fname;
+    char    *cpath;
+
+    base  = g_path_get_basename(path);
+    fname = g_strdup_printf("%s.%08x.mpyc", base, g_str_hash(path));
+    cpath = g_build_filename(hexchat_get_info(ph, "xchatdir"), CODECACHE_DIR,
+                             fname, NULL);
+    g_free(fname);
+    g_free(base);
+    return cpath;
+}
+
+/**
+ * Reads a code object from a cache file if it's current.
+ * @param cpath - The cache file's path.
+ * @param path  - The script's path.
+ * @param hdr   - The header the cache file must have.
+ * @returns - A new reference to the code object, or NULL with no error set.
+ */
+PyObject *
+codecache_read(const char *cpath, const char *path, CodeCacheHeader *hdr)
+{
+    PyObject    *pycode = NULL;
+    char        *data;
+    gsize       len;
+    gsize       offset = sizeof(CodeCacheHeader) + hdr->path_len;
+
+    if (!g_file_get_contents(cpath, &data, &len, NULL)) {
+        return NULL;
+    }
+    if (len > offset && !memcmp(data, hdr, sizeof(CodeCacheHeader)) &&
+        !memcmp(data + sizeof(CodeCacheHeader), path, hdr->path_len)) {
+
+        pycode = PyMarshal_ReadObjectFromString(data + offset, 
+                                                (Py_ssize_t)(len - offset));
+        if (pycode && !PyCode_Check(pycode)) {
+            Py_CLEAR(pycode);
+        }
+        PyErr_Clear();
+    }
+    g_free(data);
+    return pycode;
+}
+
+/**
+ * Writes a code object to a cache file. g_file_set_contents() replaces the
+ * file atomically, so a plugin loading at the same time never reads part of
+ * one.
+ * @param cpath - The cache file's path.
+ * @param path  - The script's path.
+ * @param hdr   - The header to write.
+ * @param pycode - The script's code object.
+ */
+void
+codecache_write(const char *cpath, const char *path, CodeCacheHeader *hdr,
+                PyObject *pycode)
+{
+    PyObject    *pydata;
+    char        *dir;
+    char        *buf;
+    gsize       offset = sizeof(CodeCacheHeader) + hdr->path_len;
+    gsize       len;
+
+    pydata = PyMarshal_WriteObjectToString(pycode, Py_MARSHAL_VERSION);
+    if (!pydata) {
+        PyErr_Clear();
+        return;
+    }
+    len = offset + (gsize)PyBytes_GET_SIZE(pydata);
+    buf = g_malloc(len);
+
+    memcpy(buf, hdr, sizeof(CodeCacheHeader));
+    memcpy(buf + sizeof(CodeCacheHeader), path, hdr->path_len);
+    memcpy(buf + offset, PyBytes_AS_STRING(pydata), len - offset);
+
+    dir = g_path_get_dirname(cpath);
+    g_mkdir_with_parents(dir, 0700);
+    g_file_set_contents(cpath, buf, (gssize)len, NULL);
+
+    g_free(dir);
+    g_free(buf);
+    Py_DECREF(pydata);
+}
+
+/**
+ * Compiles a script's source.
+ * @param fp    - The open script file.
+ * @param path  - The script's path, used as the code's file name.
+ * @returns - A new reference to the code object, or NULL with error state set.
+ */
+PyObject *
+codecache_compile(FILE *fp, const char *path)
+{
+    PyObject    *pycode;
+    char        *src  = NULL;
+    size_t      len   = 0;
+    size_t      cap   = 0;
+    size_t      n;
+
+    do {
+        if (cap - len < 4096) {
+            cap = cap ? cap * 2 : 16384;
+            src = g_realloc(src, cap);
+        }
+        n    = fread(src + len, 1, cap - len - 1, fp);
+        len += n;
+    } while (n > 0);
+
+    src[len] = '\0';
+
+    pycode = Py_CompileStringExFlags(src, path, Py_file_input, NULL, -1);
+
+    g_free(src);
+    return pycode;
+}
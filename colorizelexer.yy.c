@@ -316,6 +316,8 @@ void yyfree ( void * , yyscan_t yyscanner );
 #define YY_AT_BOL() (YY_CURRENT_BUFFER_LVALUE->yy_at_bol)
 
 /* Begin user sect3 */
+#define yywrap(yyscanner) (/*CONSTCOND*/1)
+#define YY_SKIP_YYWRAP
 typedef flex_uint8_t YY_CHAR;
 
 typedef int yy_state_type;
@@ -826,43 +828,81 @@ static const flex_int16_t yy_chk[1290] =
  *
  * This file defines a simple lexer grammaer for Python with action code that
  * adds IRC color codes to tokens.
+ *
+ * Each colorizing OutStream keeps its own scanner (see flex_colorizer_init()),
+ * and the action code appends straight to the stream's native output buffer.
+ * Text is lexed a line at a time. Lines that start and end outside of any 
+ * string are kept in a small LRU cache, so the lines of tracebacks and console
+ * echoes that repeat are colorized once. The start condition is carried from 
+ * line to line, and in streaming mode from one write to the next, so an open
+ * triple-quoted string keeps its color.
  */
 
 #pragma warning(disable:4005)
 
+#include <glib.h>
 #include "minpython.h"
 
 #pragma warning(default:4005)
 
+#define COLORIZE_CACHE_SIZE     256     // Max lines in the LRU cache.
+#define COLORIZE_CACHE_LINE     256     // Longer lines aren't cached.
 
 // Custom parameters for yylex().
 #define YY_DECL int yylex(yyscan_t yyscanner, \
-                          PyObject *pylist, \
                           ColorizerParams *params)
 
 // For explicit control over the yylex() switch statement breaks.
 #define YY_BREAK
 
+// Text no rule matches is passed through rather than written to stdout. The
+// default rule has no break of its own and would fall into the EOF case.
+#define ECHO colorize_append(params, yytext, yyleng); break
+
 // #define YY_FATAL_ERROR(msg) \
 
-PyObject *flex_colorize(PyObject *, ColorizerParams *);
+/**
+ * An entry in the LRU cache of colorized lines. The line and its colorized
+ * text are allocated with the entry.
+ */
+typedef struct _ColorCacheEntry {
+    struct _ColorCacheEntry *prev;
+    struct _ColorCacheEntry *next;
+    char                    *line;
+    char                    *text;
+    Py_ssize_t              size;
+} ColorCacheEntry;
+
+int             flex_colorizer_init     (ColorizerParams *);
+void            flex_colorizer_free     (ColorizerParams *);
+const char      *flex_colorize          (ColorizerParams *, const char *,
+                                         Py_ssize_t, int, Py_ssize_t *);
+
+static void     colorize_append         (ColorizerParams *, const char *,
+                                         Py_ssize_t);
+static void     colorize_lex_line       (ColorizerParams *, const char *,
+                                         Py_ssize_t);
+static const 
+ColorCacheEntry *colorize_cache_get     (ColorizerParams *, const char *);
+static void     colorize_cache_put      (ColorizerParams *, const char *,
+                                         Py_ssize_t, const char *, 
+                                         Py_ssize_t);
 
 #define lappend1(s) \
-    pystr = PyUnicode_FromString(s); \
-    PyList_Append(pylist, pystr); \
-    Py_DECREF(pystr)
+    colorize_append(params, s, yyleng)
 
 #define lappend2(c, s) \
-    if (c != pylast_color) { \
-        PyList_Append(pylist, c); \
+    if (c != last_color) { \
+        colorize_append(params, c, strlen(c)); \
     } \
-    pystr = PyUnicode_FromString(s); \
-    PyList_Append(pylist, pystr); \
-    Py_DECREF(pystr); \
-    pylast_color = c
+    colorize_append(params, s, yyleng); \
+    last_color = c
+
+#define lappendc(c) \
+    colorize_append(params, c, strlen(c))
 
-#line 864 "colorizelexer.yy.c"
-#line 69 "colorizelexer.flex"
+#line 905 "colorizelexer.yy.c"
+#line 106 "colorizelexer.flex"
     // Code generation options.
 #define YY_NO_INPUT 1
 #define YY_NO_UNISTD_H 1
@@ -898,7 +938,7 @@ PyObject *flex_colorize(PyObject *, ColorizerParams *);
     xid_continue        {xid_start}|{xid_cont_1}|{xid_cont_2}|{xid_cont_3}
     identifier          (_|{xid_start}){xid_continue}*
     */
-#line 926 "colorizelexer.yy.c"
+#line 942 "colorizelexer.yy.c"
 
 #define INITIAL 0
 #define longquotestring 1
@@ -1163,16 +1203,15 @@ YY_DECL
 		}
 
 	{
-#line 135 "colorizelexer.flex"
+#line 173 "colorizelexer.flex"
 
     // Declarations within yylex() scope.
-    PyObject *pycolor       = NULL;
-    PyObject *pylast_color  = NULL;
-    PyObject *pystr         = NULL;
+    const char *color       = NULL;
+    const char *last_color  = NULL;
 
     // Lexer rules with blocks of action code inserted into yylex() follow...
 
-#line 1200 "colorizelexer.yy.c"
+#line 1215 "colorizelexer.yy.c"
 
 	while ( /*CONSTCOND*/1 )		/* loops until end-of-file is reached */
 		{
@@ -1231,7 +1270,7 @@ do_action:	/* This label is used only to access EOF actions. */
 
 case 1:
 YY_RULE_SETUP
-#line 143 "colorizelexer.flex"
+#line 180 "colorizelexer.flex"
 {
         // Command prompt.
         lappend2(params->origattr_color, yytext);
@@ -1240,7 +1279,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 2:
 YY_RULE_SETUP
-#line 149 "colorizelexer.flex"
+#line 186 "colorizelexer.flex"
 {
         // Number.
         lappend2(params->number_color, yytext);
@@ -1249,7 +1288,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 3:
 YY_RULE_SETUP
-#line 155 "colorizelexer.flex"
+#line 192 "colorizelexer.flex"
 {
         // def or class declaration.
         BEGIN(defclassdecl);
@@ -1259,7 +1298,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 4:
 YY_RULE_SETUP
-#line 162 "colorizelexer.flex"
+#line 199 "colorizelexer.flex"
 {
         // Make class and function names same color as buitins in their 
         // declaration.
@@ -1270,57 +1309,57 @@ YY_RULE_SETUP
 	YY_BREAK
 case 5:
 YY_RULE_SETUP
-#line 170 "colorizelexer.flex"
+#line 207 "colorizelexer.flex"
 
 	YY_BREAK
 case 6:
 YY_RULE_SETUP
-#line 171 "colorizelexer.flex"
+#line 208 "colorizelexer.flex"
 
 	YY_BREAK
 case 7:
 YY_RULE_SETUP
-#line 172 "colorizelexer.flex"
+#line 209 "colorizelexer.flex"
 
 	YY_BREAK
 case 8:
 YY_RULE_SETUP
-#line 173 "colorizelexer.flex"
+#line 210 "colorizelexer.flex"
 
 	YY_BREAK
 case 9:
 YY_RULE_SETUP
-#line 174 "colorizelexer.flex"
+#line 211 "colorizelexer.flex"
 
 	YY_BREAK
 case 10:
 YY_RULE_SETUP
-#line 175 "colorizelexer.flex"
+#line 212 "colorizelexer.flex"
 
 	YY_BREAK
 case 11:
 YY_RULE_SETUP
-#line 176 "colorizelexer.flex"
+#line 213 "colorizelexer.flex"
 
 	YY_BREAK
 case 12:
 YY_RULE_SETUP
-#line 177 "colorizelexer.flex"
+#line 214 "colorizelexer.flex"
 
 	YY_BREAK
 case 13:
 YY_RULE_SETUP
-#line 178 "colorizelexer.flex"
+#line 215 "colorizelexer.flex"
 
 	YY_BREAK
 case 14:
 YY_RULE_SETUP
-#line 179 "colorizelexer.flex"
+#line 216 "colorizelexer.flex"
 
 	YY_BREAK
 case 15:
 YY_RULE_SETUP
-#line 180 "colorizelexer.flex"
+#line 217 "colorizelexer.flex"
 {
         // Keywords.
         lappend2(params->keyword_color, yytext);
@@ -1329,42 +1368,42 @@ YY_RULE_SETUP
 	YY_BREAK
 case 16:
 YY_RULE_SETUP
-#line 186 "colorizelexer.flex"
+#line 223 "colorizelexer.flex"
 
 	YY_BREAK
 case 17:
 YY_RULE_SETUP
-#line 187 "colorizelexer.flex"
+#line 224 "colorizelexer.flex"
 
 	YY_BREAK
 case 18:
 YY_RULE_SETUP
-#line 188 "colorizelexer.flex"
+#line 225 "colorizelexer.flex"
 
 	YY_BREAK
 case 19:
 YY_RULE_SETUP
-#line 189 "colorizelexer.flex"
+#line 226 "colorizelexer.flex"
 
 	YY_BREAK
 case 20:
 YY_RULE_SETUP
-#line 190 "colorizelexer.flex"
+#line 227 "colorizelexer.flex"
 
 	YY_BREAK
 case 21:
 YY_RULE_SETUP
-#line 191 "colorizelexer.flex"
+#line 228 "colorizelexer.flex"
 
 	YY_BREAK
 case 22:
 YY_RULE_SETUP
-#line 192 "colorizelexer.flex"
+#line 229 "colorizelexer.flex"
 
 	YY_BREAK
 case 23:
 YY_RULE_SETUP
-#line 193 "colorizelexer.flex"
+#line 230 "colorizelexer.flex"
 {
         // Operators and delimiters.
         lappend2(params->operator_color, yytext);
@@ -1373,23 +1412,17 @@ YY_RULE_SETUP
 	YY_BREAK
 case 24:
 YY_RULE_SETUP
-#line 199 "colorizelexer.flex"
+#line 236 "colorizelexer.flex"
 {
         // Identifier.
-        pystr = PyUnicode_FromString(yytext);
-        if (PySequence_Contains(params->builtins_list, pystr)) {
+        if (g_hash_table_contains(params->builtins, yytext)) {
             // Different color for identifiers in the list of builtins.
-            pycolor = params->builtins_color;
+            color = params->builtins_color;
         }
         else {
-            pycolor = params->origattr_color;
-        }
-        if (pycolor != pylast_color) {
-            PyList_Append(pylist, pycolor);
+            color = params->origattr_color;
         }
-        PyList_Append(pylist, pystr);
-        Py_DECREF(pystr);
-        pylast_color = pycolor;
+        lappend2(color, yytext);
         break;
     }
 	YY_BREAK
@@ -1398,7 +1431,7 @@ case 25:
 yyg->yy_c_buf_p = yy_cp -= 1;
 YY_DO_BEFORE_ACTION; /* set up yytext again */
 YY_RULE_SETUP
-#line 218 "colorizelexer.flex"
+#line 249 "colorizelexer.flex"
 {
         // Comment.
         lappend2(params->comment_color, yytext);
@@ -1408,17 +1441,17 @@ YY_RULE_SETUP
 case 26:
 /* rule 26 can match eol */
 YY_RULE_SETUP
-#line 225 "colorizelexer.flex"
+#line 256 "colorizelexer.flex"
 {
         // Line continuation.
         lappend1(yytext);
-        pylast_color = NULL;
+        last_color = NULL;
         break;
     }
 	YY_BREAK
 case 27:
 YY_RULE_SETUP
-#line 232 "colorizelexer.flex"
+#line 263 "colorizelexer.flex"
 {
         // Whitespace.
         lappend1(yytext);
@@ -1428,17 +1461,17 @@ YY_RULE_SETUP
 case 28:
 /* rule 28 can match eol */
 YY_RULE_SETUP
-#line 238 "colorizelexer.flex"
+#line 269 "colorizelexer.flex"
 {
         // Newline.
         lappend1(yytext);
-        pylast_color = NULL;
+        last_color = NULL;
         break;
     }
 	YY_BREAK
 case 29:
 YY_RULE_SETUP
-#line 245 "colorizelexer.flex"
+#line 276 "colorizelexer.flex"
 {
         // <longquotestring> BEGIN.
         BEGIN(longquotestring);
@@ -1448,7 +1481,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 30:
 YY_RULE_SETUP
-#line 252 "colorizelexer.flex"
+#line 283 "colorizelexer.flex"
 {
         // <longquotestring> Allowable characters.
         lappend1(yytext);
@@ -1458,17 +1491,17 @@ YY_RULE_SETUP
 case 31:
 /* rule 31 can match eol */
 YY_RULE_SETUP
-#line 258 "colorizelexer.flex"
+#line 289 "colorizelexer.flex"
 {
         // Add color code to new line.
         lappend1(yytext);
-        PyList_Append(pylist, params->string_color);
+        lappendc(params->string_color);
         break;
     }
 	YY_BREAK
 case 32:
 YY_RULE_SETUP
-#line 265 "colorizelexer.flex"
+#line 296 "colorizelexer.flex"
 {
         // <longquotestring> END.
         BEGIN(INITIAL);
@@ -1478,7 +1511,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 33:
 YY_RULE_SETUP
-#line 272 "colorizelexer.flex"
+#line 303 "colorizelexer.flex"
 {
         // <longtickstring> BEGIN.
         BEGIN(longtickstring);
@@ -1488,7 +1521,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 34:
 YY_RULE_SETUP
-#line 279 "colorizelexer.flex"
+#line 310 "colorizelexer.flex"
 {
         lappend1(yytext);
         break;
@@ -1496,7 +1529,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 35:
 YY_RULE_SETUP
-#line 284 "colorizelexer.flex"
+#line 315 "colorizelexer.flex"
 {
         // <longtickstring> END.
         BEGIN(INITIAL);
@@ -1506,7 +1539,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 36:
 YY_RULE_SETUP
-#line 291 "colorizelexer.flex"
+#line 322 "colorizelexer.flex"
 {
         // <shortquotestring> BEGIN.
         BEGIN(shortquotestring);
@@ -1516,7 +1549,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 37:
 YY_RULE_SETUP
-#line 298 "colorizelexer.flex"
+#line 329 "colorizelexer.flex"
 {
         // <shortquotestring> Allow any character except unescaped newlines.
         lappend1(yytext);
@@ -1526,17 +1559,17 @@ YY_RULE_SETUP
 case 38:
 /* rule 38 can match eol */
 YY_RULE_SETUP
-#line 304 "colorizelexer.flex"
+#line 335 "colorizelexer.flex"
 {
         // Line continuation (escaped newline). Add color code to new line.
         lappend1(yytext);
-        PyList_Append(pylist, params->string_color);
+        lappendc(params->string_color);
         break;
     }
 	YY_BREAK
 case 39:
 YY_RULE_SETUP
-#line 311 "colorizelexer.flex"
+#line 342 "colorizelexer.flex"
 {
         // <shortquotestring> END.
         BEGIN(INITIAL);
@@ -1546,7 +1579,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 40:
 YY_RULE_SETUP
-#line 318 "colorizelexer.flex"
+#line 349 "colorizelexer.flex"
 {
         // <shorttickstring> BEGIN.
         BEGIN(shorttickstring);
@@ -1556,7 +1589,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 41:
 YY_RULE_SETUP
-#line 325 "colorizelexer.flex"
+#line 356 "colorizelexer.flex"
 {
         lappend1(yytext);
         break;
@@ -1564,7 +1597,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 42:
 YY_RULE_SETUP
-#line 330 "colorizelexer.flex"
+#line 361 "colorizelexer.flex"
 {
         // <shorttickstring> END.
         BEGIN(INITIAL);
@@ -1574,10 +1607,10 @@ YY_RULE_SETUP
 	YY_BREAK
 case 43:
 YY_RULE_SETUP
-#line 337 "colorizelexer.flex"
+#line 368 "colorizelexer.flex"
 ECHO;
 	YY_BREAK
-#line 1605 "colorizelexer.yy.c"
+#line 1614 "colorizelexer.yy.c"
 case YY_STATE_EOF(INITIAL):
 case YY_STATE_EOF(longquotestring):
 case YY_STATE_EOF(longtickstring):
@@ -2751,49 +2784,282 @@ void yyfree (void * ptr , yyscan_t yyscanner)
 
 #define YYTABLES_NAME "yytables"
 
-#line 337 "colorizelexer.flex"
+#line 368 "colorizelexer.flex"
 
 
 /**
- * Colorizes the given string of Python code using IRC color codes. 
- * Returns the colorized string.
- * @param pystring  - the string of Python code to colorize.
+ * Creates the scanner and line cache for a colorizer. The colors and builtins
+ * of the params are set by the caller.
  * @param params    - parameters with color assignments.
- * @returns the color coded string for printing in the HexChat Python console.
+ * @returns - 0 on success, -1 on fail.
  */
-PyObject *
-flex_colorize(PyObject *pystring, ColorizerParams *params)
+int
+flex_colorizer_init(ColorizerParams *params)
 {
-    Py_ssize_t  size;
-    const char  *base;
-    PyObject    *pystr;
-    PyObject    *pylist     = PyList_New(0);
-    PyObject    *pyemptystr = PyUnicode_FromString("");
-    yyscan_t    scanner;
+    yyscan_t scanner;
+
+    if (yylex_init(&scanner)) {
+        return -1;
+    }
+    params->scanner = scanner;
+    params->state   = INITIAL;
+    params->cache   = g_hash_table_new(g_str_hash, g_str_equal);
+
+    return 0;
+}
+
+/**
+ * Frees the scanner, cache, output buffer, and builtins of a colorizer.
+ * @param params    - parameters with color assignments.
+ */
+void
+flex_colorizer_free(ColorizerParams *params)
+{
+    ColorCacheEntry *entry;
+    ColorCacheEntry *next;
+
+    if (params->scanner) {
+        yylex_destroy(params->scanner);
+        params->scanner = NULL;
+    }
+    for (entry = params->lru_head; entry; entry = next) {
+        next = entry->next;
+        PyMem_RawFree(entry);
+    }
+    params->lru_head = NULL;
+    params->lru_tail = NULL;
+
+    if (params->cache) {
+        g_hash_table_destroy(params->cache);
+        params->cache = NULL;
+    }
+    if (params->builtins) {
+        g_hash_table_destroy(params->builtins);
+        params->builtins = NULL;
+    }
+    PyMem_RawFree(params->out);
+    params->out      = NULL;
+    params->out_len  = 0;
+    params->out_size = 0;
+}
+
+/**
+ * Colorizes the given UTF-8 Python code using IRC color codes. The result is
+ * in the colorizer's output buffer and is valid until its next call.
+ * @param params    - parameters with color assignments.
+ * @param text      - the UTF-8 Python code to colorize.
+ * @param size      - the length of text in bytes.
+ * @param stream    - if non-zero, lexing starts in the state the last streamed
+ *                    call ended in, and this call's end state is kept.
+ * @param out_size  - receives the length of the colorized text.
+ * @returns the NUL terminated colorized text, or NULL if out of memory.
+ */
+const char *
+flex_colorize(ColorizerParams *params, const char *text, Py_ssize_t size,
+              int stream, Py_ssize_t *out_size)
+{
+    struct yyguts_t         *yyg = (struct yyguts_t *)params->scanner;
+    const ColorCacheEntry   *entry;
+    const char              *end = text + size;
+    const char              *nl;
+    Py_ssize_t              len;
+    Py_ssize_t              mark;
+    int                     start;
+    int                     cacheable;
+
+    params->out_len   = 0;
+    params->out_error = 0;
+
+    // Make sure there's a buffer even when there's no text.
+    colorize_append(params, "", 0);
+
+    BEGIN(stream ? params->state : INITIAL);
+
+    if (YY_START != INITIAL && YY_START != defclassdecl) {
+        // A string is continued from the last write. Color it again.
+        lappendc(params->string_color);
+    }
+    for ( ; text < end; text += len) {
+        nl        = memchr(text, '\n', end - text);
+        len       = nl ? nl - text + 1 : end - text;
+        start     = YY_START;
+
+        // Only whole lines lexed from the initial state can be reused. Lines
+        // with NUL characters can't be keys.
+        cacheable = nl && start == INITIAL && len <= COLORIZE_CACHE_LINE &&
+                    !memchr(text, '\0', len);
+
+        if (cacheable && (entry = colorize_cache_get(params, text))) {
+            colorize_append(params, entry->text, entry->size);
+            continue;
+        }
+        mark = params->out_len;
+
+        colorize_lex_line(params, text, len);
+
+        if (cacheable && YY_START == INITIAL && !params->out_error) {
+            colorize_cache_put(params, text, len, params->out + mark, 
+                               params->out_len - mark);
+        }
+    }
+    if (stream) {
+        params->state = YY_START;
+    }
+    if (params->out_error) {
+        return NULL;
+    }
+    *out_size = params->out_len;
+    return params->out;
+}
 
+/**
+ * Runs the lexer over one line. Only long strings continue on the next line;
+ * short strings and def/class names end with the line unless it ends in a
+ * backslash.
+ * @param params    - parameters with color assignments.
+ * @param line      - the text of the line.
+ * @param len       - the length of the line in bytes, including its newline.
+ */
+void
+colorize_lex_line(ColorizerParams *params, const char *line, Py_ssize_t len)
+{
+    struct yyguts_t *yyg = (struct yyguts_t *)params->scanner;
     YY_BUFFER_STATE buf;
 
-    base = PyUnicode_AsUTF8AndSize(pystring, &size);
+    buf = yy_scan_bytes(line, (int)len, params->scanner);
 
-    yylex_init(&scanner);
+    yylex(params->scanner, params);
 
-    buf = yy_scan_bytes(base, (int)size, scanner);
+    yy_delete_buffer(buf, params->scanner);
 
-    yylex(scanner, pylist, params);
+    if ((YY_START == shortquotestring || YY_START == shorttickstring ||
+         YY_START == defclassdecl) && line[len - 1] == '\n' &&
+        !(len >= 2 && line[len - 2] == '\\') &&
+        !(len >= 3 && line[len - 2] == '\r' && line[len - 3] == '\\')) {
+        BEGIN(INITIAL);
+    }
+}
 
-    yy_delete_buffer(buf, scanner);
-    yylex_destroy(scanner);
+/**
+ * Appends text to the colorizer's output buffer, which is kept NUL terminated.
+ * On allocation failure the error flag is set and the text is dropped.
+ * @param params    - parameters with color assignments.
+ * @param text      - the text to append.
+ * @param len       - the length of text in bytes.
+ */
+void
+colorize_append(ColorizerParams *params, const char *text, Py_ssize_t len)
+{
+    Py_ssize_t  need = params->out_len + len + 1;
+    Py_ssize_t  new_size;
+    char        *out;
 
-    pystr = PyUnicode_Join(pyemptystr, pylist);
+    if (need > params->out_size) {
+        new_size = params->out_size ? params->out_size : 256;
 
-    Py_DECREF(pyemptystr);
-    Py_DECREF(pylist);
+        while (new_size < need) {
+            new_size *= 2;
+        }
+        out = PyMem_RawRealloc(params->out, new_size);
 
-    return pystr;
+        if (!out) {
+            params->out_error = 1;
+            return;
+        }
+        params->out      = out;
+        params->out_size = new_size;
+    }
+    memcpy(params->out + params->out_len, text, len);
+    params->out_len += len;
+    params->out[params->out_len] = '\0';
 }
 
+/**
+ * Looks up a line in the cache and makes it the most recently used.
+ * @param params    - parameters with color assignments.
+ * @param line      - the line, terminated by its newline.
+ * @returns - The cache entry, or NULL if the line isn't cached.
+ */
+const ColorCacheEntry *
+colorize_cache_get(ColorizerParams *params, const char *line)
+{
+    char            key[COLORIZE_CACHE_LINE + 1];
+    ColorCacheEntry *entry;
+    Py_ssize_t      len = strchr(line, '\n') - line + 1;
 
+    memcpy(key, line, len);
+    key[len] = '\0';
 
+    entry = g_hash_table_lookup(params->cache, key);
 
+    if (entry && entry != params->lru_head) {
+        // Unlink and move to the front.
+        entry->prev->next = entry->next;
 
+        if (entry->next) {
+            entry->next->prev = entry->prev;
+        }
+        else {
+            params->lru_tail = entry->prev;
+        }
+        entry->prev             = NULL;
+        entry->next             = params->lru_head;
+        params->lru_head->prev  = entry;
+        params->lru_head        = entry;
+    }
+    return entry;
+}
+
+/**
+ * Adds a colorized line to the cache, evicting the least recently used line
+ * if the cache is full.
+ * @param params    - parameters with color assignments.
+ * @param line      - the line.
+ * @param len       - the length of the line in bytes.
+ * @param text      - the colorized line.
+ * @param size      - the length of the colorized line in bytes.
+ */
+void
+colorize_cache_put(ColorizerParams *params, const char *line, Py_ssize_t len,
+                   const char *text, Py_ssize_t size)
+{
+    ColorCacheEntry *entry;
+
+    if (g_hash_table_size(params->cache) >= COLORIZE_CACHE_SIZE) {
+        entry = params->lru_tail;
+
+        g_hash_table_remove(params->cache, entry->line);
+
+        params->lru_tail = entry->prev;
+        params->lru_tail->next = NULL;
+
+        PyMem_RawFree(entry);
+    }
+    entry = PyMem_RawMalloc(sizeof(ColorCacheEntry) + len + size + 2);
+
+    if (!entry) {
+        return;
+    }
+    entry->line = (char *)(entry + 1);
+    entry->text = entry->line + len + 1;
+    entry->size = size;
+
+    memcpy(entry->line, line, len);
+    entry->line[len] = '\0';
+    memcpy(entry->text, text, size);
+    entry->text[size] = '\0';
+
+    entry->prev = NULL;
+    entry->next = params->lru_head;
+
+    if (params->lru_head) {
+        params->lru_head->prev = entry;
+    }
+    else {
+        params->lru_tail = entry;
+    }
+    params->lru_head = entry;
+
+    g_hash_table_insert(params->cache, entry->line, entry);
+}
 
@@ -31,13 +31,26 @@
  *
  * See notes at the top of outstream.c for how to customize the colorizer
  * colors. The Console supports multi-line code blocks.
+ *
+ * Statements are compiled incrementally with codeop's CommandCompiler, which
+ * says when a statement is incomplete and yields the code object to run once
+ * it isn't, so the source is compiled only once.
+ *
+ * With /MPY EXEC --bg, or after /MPY CONSOLE --bg, statements run one at a 
+ * time on a worker thread so a slow one doesn't freeze HexChat. In the 
+ * background, the hexchat module and functions from it are looked up as their
+ * hexchat.synchronous Delegates, so API calls are made on the main thread. 
+ * Functions defined by a statement keep the real module in their globals and
+ * should use hexchat.synchronous themselves if called on the worker.
  */
 
+#include <glib.h>
 #include "minpython.h"
-#include <node.h>
 
 typedef enum {INITIAL=0, MULTILINE, FINISH} ContinueMode;
 
+#define CONSOLE_BG_STOP_TIMEOUT 5000    // ms to wait for the worker to stop.
+
 
 /**
  * Data for the console and single global instance of the console interpreter.
@@ -53,14 +66,45 @@ typedef struct {
     PyObject        *locals;
     PyObject        *scriptbuf;
     ContinueMode    contmode;
+    PyObject        *compiler;      // codeop.CommandCompiler instance.
+    PyObject        *bg_locals;     // ConsoleBgNamespace over globals.
+    GThreadPool     *bg_pool;       // One worker; runs statements in order.
+    unsigned long   bg_thread_id;   // Worker running a statement, or 0.
+    gint            bg_pending;     // Statements queued or running.
+    gint            bg_stopping;
+    int             background;     // Console window statements run in bg.
 } ConsoleData;
 
 /**
  * The Console instance.
  */
-static ConsoleData console_interp_data = { NULL, NULL, NULL, NULL, 
-                                           NULL, NULL, NULL, NULL, NULL, 
-                                           INITIAL };
+static ConsoleData console_interp_data = { .contmode = INITIAL };
+
+/**
+ * Python source for the locals mapping of background statements. Reads and
+ * writes go to the Console's globals; the hexchat module and its functions
+ * are swapped for their synchronous Delegates.
+ */
+static const char *console_bg_namespace_src =
+    "import collections.abc, hexchat\n"
+    "class ConsoleBgNamespace(collections.abc.MutableMapping):\n"
+    "    def __init__(self, names):\n"
+    "        self.names = names\n"
+    "    def __getitem__(self, name):\n"
+    "        value = self.names[name]\n"
+    "        if value is hexchat:\n"
+    "            return hexchat.synchronous\n"
+    "        if getattr(value, '__self__', None) is hexchat:\n"
+    "            return getattr(hexchat.synchronous, value.__name__)\n"
+    "        return value\n"
+    "    def __setitem__(self, name, value):\n"
+    "        self.names[name] = value\n"
+    "    def __delitem__(self, name):\n"
+    "        del self.names[name]\n"
+    "    def __iter__(self):\n"
+    "        return iter(self.names)\n"
+    "    def __len__(self):\n"
+    "        return len(self.names)\n";
 
 static int python_command_callback  (char *[], void *);
 static int keypress_callback        (char *[], void *);
@@ -68,9 +112,14 @@ static int server_text_callback     (char *[], void *);
 static int close_context_callback   (char *[], void *);
 int        create_console_interp    (void);
 int        delete_console_interp    (void);
-int        exec_console_command     (const char *);
+int        exec_console_command     (const char *, int);
 int        create_console           (void);
 int        close_console            (void);
+int        console_set_background   (int);
+
+static int  console_bg_push         (ConsoleData *, PyObject *);
+static void console_bg_run          (gpointer, gpointer);
+static int  console_bg_stop         (ConsoleData *);
 
 //static int is_complete              (const char *);
 
@@ -88,6 +137,9 @@ create_callback(PyThreadState *ts, void *userdata)
     PyObject    *pyglobals;
     PyObject    *pystdout;
     PyObject    *pymodname;
+    PyObject    *pycodeop;
+    PyObject    *pyns;
+    PyObject    *pyret;
     ConsoleData *data = &console_interp_data;
     
     pymodule  = PyImport_AddModule("__main__");  // Borrowd ref.
@@ -103,12 +155,40 @@ create_callback(PyThreadState *ts, void *userdata)
     
     pymodname = PyUnicode_FromString("Console");
     PyDict_SetItemString(pyglobals, "__module_name__", pymodname);
+    interp_set_plugin_name(pymodname);
     Py_DECREF(pymodname);
 
-    // Turn on code colorization.
+    // Turn on code colorization. Streaming keeps multiline strings entered a
+    // line at a time colored.
     pystdout = PySys_GetObject("stdout"); // Borrowed ref.
     PyObject_SetAttrString(pystdout, "colorize_on", Py_True);
+    PyObject_SetAttrString(pystdout, "colorize_stream", Py_True);
+
+    // The compiler remembers __future__ imports across statements.
+    pycodeop       = PyImport_ImportModule("codeop");
+    data->compiler = pycodeop ? 
+                     PyObject_CallMethod(pycodeop, "CommandCompiler", NULL) :
+                     NULL;
+    Py_XDECREF(pycodeop);
+
+    // Create the locals mapping for background statements.
+    pyns  = PyDict_New();
+    pyret = PyRun_String(console_bg_namespace_src, Py_file_input, pyns, pyns);
+
+    if (pyret) {
+        data->bg_locals = PyObject_CallMethod(pyns, "__getitem__", "s",
+                                              "ConsoleBgNamespace");
+        if (data->bg_locals) {
+            Py_SETREF(data->bg_locals, 
+                      PyObject_CallFunction(data->bg_locals, "O", pyglobals));
+        }
+        Py_DECREF(pyret);
+    }
+    Py_DECREF(pyns);
 
+    if (!data->compiler || !data->bg_locals) {
+        PyErr_Print();
+    }
     return 0;
 }
 
@@ -122,7 +202,7 @@ create_console_interp()
     ConsoleData *data = &console_interp_data;
 
     if (!data->threadstate) {
-        create_interp(create_callback, NULL);
+        create_interp(create_callback, NULL, 0);
     }
     return 0;
 }
@@ -138,6 +218,8 @@ delete_callback(PyThreadState *ts, void *userdata)
     
     Py_DECREF(data->globals);
     Py_DECREF(data->scriptbuf);
+    Py_CLEAR(data->compiler);
+    Py_CLEAR(data->bg_locals);
 
     data->globals       = NULL;
     data->locals        = NULL;
@@ -148,13 +230,18 @@ delete_callback(PyThreadState *ts, void *userdata)
 
 /**
  * Deletes the console interpreter. Called when the plugin is unloaded, or 
- * during shutdown.
+ * during shutdown. The interp is left if the worker won't stop.
+ * @returns - 0 on success, -1 if the interp was left.
  */
 int
 delete_console_interp()
 {
     ConsoleData *data = &console_interp_data;
 
+    // A worker that's still in the interp would crash deleting it.
+    if (console_bg_stop(data)) {
+        return -1;
+    }
     delete_interp(data->threadstate, delete_callback, data);
 
     return 0;
@@ -162,127 +249,100 @@ delete_console_interp()
 
 /**
  * Executes the provided script string. This is called in the console and with
- * the /MPY EXEC command.
- * @param script    - The code to execute in the Console interp.
- * @returns         - 0 on success, -1 on fail.
+ * the /MPY EXEC command. Lines are buffered until they form a complete
+ * statement, which is compiled once with the codeop CommandCompiler and then
+ * run, either here or on the Console's worker thread.
+ * @param script        - The code to execute in the Console interp.
+ * @param background    - Nonzero to run the statement on the worker thread.
+ * @returns             - 0 on success, -1 on fail.
  */
 int
-exec_console_command(const char *script)
+exec_console_command(const char *script, int background)
 {
     ConsoleData     *data;
     SwitchTSInfo    tsinfo;
     PyObject        *pyresult;
     PyObject        *pystr;
     PyObject        *pyscript;
-    PyObject        *pyempstr;
+    PyObject        *pysep;
+    PyObject        *pycode;
     PyObject        *pyerrtype;
     PyObject        *pyerrval;
     PyObject        *pytraceback;
-    PyObject        *pyerrmsg;
     int             retval = 0;
-    struct _node    *retnode;
 
     data = &console_interp_data;
 
     // Switch threadstate.
     tsinfo = switch_threadstate(data->threadstate);
 
-    pystr = PyUnicode_FromFormat("%s\n", script);
-
     if (data->contmode == INITIAL) {
         // Print first line of statement.
-        PySys_FormatStdout(">>> %U", pystr);
-        pyscript = pystr;
-        
-        Py_INCREF(pystr);
+        PySys_FormatStdout(">>> %s\n", script);
+    }
+    else if (data->contmode == MULTILINE) {
+        // Print continuing line of script.
+        PySys_FormatStdout("... %s\n", script);
     }
-    else {
-        if (data->contmode == MULTILINE) {
-            // Print continuing line of script.
-            PySys_FormatStdout("... %U", pystr);
-        }
 
-        // If there are partials in scriptbuf, join them in.
-        PyList_Append(data->scriptbuf, pystr);
+    // An empty line ends a block, same as the interactive interpreter.
+    pystr = PyUnicode_FromString(data->contmode == FINISH ? "" : script);
 
-        pyempstr = PyUnicode_FromString("");
-        pyscript = PyUnicode_Join(pyempstr, data->scriptbuf);
+    // Join any partials in scriptbuf with the new line.
+    PyList_Append(data->scriptbuf, pystr);
 
-        Py_DECREF(pyempstr);
-    }
+    pysep    = PyUnicode_FromString("\n");
+    pyscript = PyUnicode_Join(pysep, data->scriptbuf);
+
+    Py_DECREF(pysep);
+    Py_DECREF(pystr);
+
+    // Returns None if the statement is incomplete, raises SyntaxError if it's
+    // invalid, or returns the compiled code.
+    pycode = PyObject_CallFunction(data->compiler, "Oss", 
+                                   pyscript, "<console>", "single");
+    Py_DECREF(pyscript);
 
-    // Parse script to see if it's complete or partial.
-    retnode = PyParser_SimpleParseString(PyUnicode_AsUTF8(pyscript),
-                                         Py_file_input);
-                                         
-    if (!retnode) {
-        // Determine if script is incomplete. If so, append it to
-        // self->scriptbuf and change mode to MULTILINE. If not print error.
-
-        if (PyErr_ExceptionMatches(PyExc_SyntaxError)) {
-
-            PyErr_Fetch(&pyerrtype, &pyerrval, &pytraceback);
-            PyErr_NormalizeException(&pyerrtype, &pyerrval, &pytraceback);
-
-            pyerrmsg = PyObject_GetAttrString(pyerrval, "msg");
-
-            if (!PyUnicode_CompareWithASCIIString(
-                    pyerrmsg, "unexpected EOF while parsing")) {
-                        
-                // pystr is a partial statement. Add it to the list of
-                // partials if it hasn't already been.
-                if (data->contmode == INITIAL) {
-                    PyList_Append(data->scriptbuf, pystr);
-                    data->contmode = MULTILINE;
-                }
-
-                Py_DECREF(pyerrtype);
-                Py_DECREF(pyerrval);
+    if (pycode == Py_None) {
+        data->contmode = MULTILINE;
+    }
+    else {
+        Py_CLEAR(data->scriptbuf);
+        data->scriptbuf = PyList_New(0);
+        data->contmode  = INITIAL;
+
+        if (!pycode) {
+            // Drop the traceback into codeop itself, like the interactive
+            // interpreter does for syntax errors.
+            if (PyErr_ExceptionMatches(PyExc_SyntaxError)) {
+                PyErr_Fetch(&pyerrtype, &pyerrval, &pytraceback);
+                PyErr_NormalizeException(&pyerrtype, &pyerrval, &pytraceback);
+                PyException_SetTraceback(pyerrval, Py_None);
                 Py_XDECREF(pytraceback);
-                retval = 0;
-            }
-            else {
-                PyErr_Restore(pyerrtype, pyerrval, pytraceback);
-                retval = -1;
+                PyErr_Restore(pyerrtype, pyerrval, NULL);
             }
-            Py_XDECREF(pyerrmsg);
-        }
-        else {
             retval = -1;
         }
-    }
-    else {
-        PyNode_Free(retnode);
-    }
-    if (data->contmode != MULTILINE) {
-        if (data->contmode == FINISH) {
-            Py_DECREF(data->scriptbuf);
-            data->scriptbuf = PyList_New(0);
-            data->contmode = INITIAL;            
-        }
-
-        // We have a completed code block - execute it.
-        pyresult = PyRun_String(PyUnicode_AsUTF8(pyscript),
-                                Py_single_input,
-                                data->globals,
-                                data->locals);
-        if (!pyresult) {
-            retval = -1;
+        else if (background) {
+            // Runs on the worker; it prints its own errors.
+            retval = console_bg_push(data, pycode);
         }
         else {
-            Py_DECREF(pyresult);
-            retval = 0;
+            // We have a completed code block - execute it.
+            pyresult = PyEval_EvalCode(pycode, data->globals, data->locals);
+
+            if (!pyresult) {
+                retval = -1;
+            }
+            else {
+                Py_DECREF(pyresult);
+            }
         }
     }
     if (retval != 0) {
         PyErr_Print();
-        Py_DECREF(data->scriptbuf);
-        data->scriptbuf = PyList_New(0);
-        data->contmode = INITIAL;
     }
-
-    Py_DECREF(pyscript);
-    Py_DECREF(pystr);
+    Py_XDECREF(pycode);
     
     // Switch back.
     switch_threadstate_back(tsinfo);
@@ -290,6 +350,169 @@ exec_console_command(const char *script)
     return retval;
 }
 
+/**
+ * Sets whether statements typed in the Console window run on the worker
+ * thread. Implements /MPY CONSOLE --bg and --fg.
+ * @param background    - Nonzero for the worker thread, 0 for the main thread.
+ * @returns HEXCHAT_EAT_ALL.
+ */
+int
+console_set_background(int background)
+{
+    console_interp_data.background = background;
+
+    hexchat_printf(ph, "Console statements will run in the %s.", 
+                   background ? "background" : "foreground");
+
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Queues a compiled statement for the Console's worker thread, creating the
+ * worker if needed. Called holding the GIL of the Console interp.
+ * @param data      - The ConsoleData of the Console.
+ * @param pycode    - The code object to run.
+ * @returns 0 on success, -1 with a Python error set on failure.
+ */
+int
+console_bg_push(ConsoleData *data, PyObject *pycode)
+{
+    GError *error = NULL;
+
+    if (!data->bg_locals) {
+        PyErr_SetString(PyExc_RuntimeError, 
+                        "Console background namespace wasn't created.");
+        return -1;
+    }
+    if (!data->bg_pool) {
+        // A single exclusive thread keeps statements in order.
+        data->bg_pool = g_thread_pool_new(console_bg_run, data, 1, TRUE, 
+                                          &error);
+        if (!data->bg_pool) {
+            PyErr_Format(PyExc_RuntimeError, 
+                         "Unable to start Console worker: %s", 
+                         error ? error->message : "unknown error");
+            if (error) {
+                g_error_free(error);
+            }
+            return -1;
+        }
+    }
+    Py_INCREF(pycode);
+    g_atomic_int_inc(&data->bg_pending);
+
+    if (!g_thread_pool_push(data->bg_pool, pycode, &error)) {
+        g_atomic_int_dec_and_test(&data->bg_pending);
+        Py_DECREF(pycode);
+        PyErr_Format(PyExc_RuntimeError, 
+                     "Unable to queue Console statement: %s", 
+                     error ? error->message : "unknown error");
+        if (error) {
+            g_error_free(error);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs a statement on the Console's worker thread. The worker gets its own
+ * threadstate in the Console interp for each statement.
+ * @param item      - The code object queued by console_bg_push().
+ * @param userdata  - The ConsoleData of the Console.
+ */
+void
+console_bg_run(gpointer item, gpointer userdata)
+{
+    ConsoleData     *data   = (ConsoleData *)userdata;
+    PyObject        *pycode = (PyObject *)item;
+    PyObject        *pyresult;
+    PyThreadState   *ts;
+
+    ts = PyThreadState_New(data->threadstate->interp);
+    PyEval_RestoreThread(ts);
+
+    data->bg_thread_id = ts->thread_id;
+
+    if (!g_atomic_int_get(&data->bg_stopping)) {
+        pyresult = PyEval_EvalCode(pycode, data->globals, data->bg_locals);
+
+        if (!pyresult) {
+            PyErr_Print();
+        }
+        Py_XDECREF(pyresult);
+    }
+    data->bg_thread_id = 0;
+
+    Py_DECREF(pycode);
+    g_atomic_int_dec_and_test(&data->bg_pending);
+
+    PyThreadState_Clear(ts);
+    PyThreadState_DeleteCurrent();
+}
+
+/**
+ * Stops the Console's worker before its interp is deleted. Statements still
+ * queued are skipped, and the running one gets a KeyboardInterrupt once, so
+ * its except and finally blocks can run. Delegate calls are pumped while
+ * waiting since the worker may be blocked on one. A statement can keep
+ * running regardless, such as one blocked in C code, so the wait gives up
+ * after CONSOLE_BG_STOP_TIMEOUT ms. Called on the main thread.
+ * @param data  - The ConsoleData of the Console.
+ * @returns - 0 once the worker has stopped, -1 if it's stuck in a statement.
+ */
+int
+console_bg_stop(ConsoleData *data)
+{
+    SwitchTSInfo    tsinfo;
+    gint64          deadline;
+    int             sent = 0;
+
+    if (!data->bg_pool) {
+        return 0;
+    }
+    g_atomic_int_set(&data->bg_stopping, 1);
+
+    deadline = g_get_monotonic_time() + CONSOLE_BG_STOP_TIMEOUT * 1000;
+
+    while (g_atomic_int_get(&data->bg_pending) > 0) {
+        if (g_get_monotonic_time() >= deadline) {
+            hexchat_printf(ph, "\00304The Console worker didn't stop within "
+                               "%d ms. Its statement is left running, and "
+                               "the Console interpreter isn't deleted.",
+                           CONSOLE_BG_STOP_TIMEOUT);
+
+            // The pool is freed once the worker returns.
+            g_thread_pool_free(data->bg_pool, TRUE, FALSE);
+            data->bg_pool = NULL;
+            return -1;
+        }
+        // Once per statement; sent is reset when the worker finishes one.
+        if (!sent) {
+            tsinfo = switch_threadstate(data->threadstate);
+
+            if (data->bg_thread_id) {
+                PyThreadState_SetAsyncExc(data->bg_thread_id, 
+                                          PyExc_KeyboardInterrupt);
+                sent = 1;
+            }
+            switch_threadstate_back(tsinfo);
+        }
+        else if (!data->bg_thread_id) {
+            sent = 0;
+        }
+
+        delegate_run_pending();
+        g_usleep(1000);
+    }
+    g_thread_pool_free(data->bg_pool, FALSE, TRUE);
+
+    data->bg_pool     = NULL;
+    data->bg_stopping = 0;
+
+    return 0;
+}
+
 
 /**
  * Opens the console widow.
@@ -386,7 +609,7 @@ python_command_callback(char *word[], void *userdata)
         return HEXCHAT_EAT_NONE;
     }
 
-    exec_console_command(word[2]);
+    exec_console_command(word[2], data->background);
 
     return HEXCHAT_EAT_ALL;
 }
@@ -419,7 +642,7 @@ keypress_callback(char *word[], void *userdata)
         if (strlen(inbox) == 0) {
             // This is the end of the script being built.
             data->contmode = FINISH;
-            exec_console_command("\n");
+            exec_console_command("", data->background);
             hexchat_print(ph, "\n");
         }
     }
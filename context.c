@@ -29,10 +29,22 @@
  * support use of Context objects as dict keys.  The context also provides
  * a small subset of the HexChat API that will execute within the associated
  * context when invoked.
+ *
+ * Each Context method switches HexChat to its context and back. Within
+ * `with ctx.batch():` HexChat stays in the context for the whole block, so
+ * the methods called on it in between don't switch at all.
+ *
+ * hexchat.get_context(), find_context() and the channels list hand out one
+ * Context object per context pointer, interned per interp. find_context()
+ * also remembers what HexChat found for each channel, and checks that the
+ * context still has that channel and server before reusing it.
  */
 
+#include <glib.h>
 #include "minpython.h"
 
+#define CONTEXT_CACHE_MAX   256     // Entries kept before a cache is cleared.
+
 /**
  * Context instance data.
  */
@@ -42,8 +54,17 @@ typedef struct {
     PyObject *ctxptrval;
     void     *ctxptr;
     int      fields_set;
+    int      batch_depth;
+    void     *batch_prior;  // Context to go back to when the batch ends.
 } ContextObj;
 
+/**
+ * What find_context() found, keyed by its arguments (see context_find_ptr()).
+ * Cleared when any context is closed, since its pointer could be reused.
+ */
+static GHashTable   *context_find_cache = NULL;
+static hexchat_hook *context_close_hook = NULL;
+
 static int      Context_init            (ContextObj *, PyObject *, PyObject *);
 static void     Context_dealloc         (ContextObj *);
 static PyObject *Context_set            (ContextObj *, PyObject *);
@@ -51,9 +72,13 @@ static PyObject *Context_prnt           (ContextObj *, PyObject *);
 static PyObject *Context_emit_print     (ContextObj *, PyObject *, PyObject *);
 static PyObject *Context_command        (ContextObj *, PyObject *);
 static PyObject *Context_get_info       (ContextObj *, PyObject *);
-static PyObject *Context_get_list       (ContextObj *, PyObject *);
+static PyObject *Context_get_list       (ContextObj *, PyObject *,
+                                         PyObject *);
 static PyObject *Context_get_listiter   (ContextObj *, PyObject *);
 static PyObject *Context_repr           (ContextObj *, PyObject *);
+static PyObject *Context_batch          (ContextObj *, PyObject *);
+static PyObject *Context_enter          (ContextObj *, PyObject *);
+static PyObject *Context_exit           (ContextObj *, PyObject *);
 
 static Py_hash_t Context_hash           (ContextObj *);
 static PyObject *Context_cmp            (ContextObj *, PyObject *, int);
@@ -61,7 +86,22 @@ static PyObject *Context_cmp            (ContextObj *, PyObject *, int);
 static PyObject *Context_get_network    (ContextObj *, void *);
 static PyObject *Context_get_channel    (ContextObj *, void *);
 
-static inline int set_ctx               (ContextObj *, hexchat_context **);
+static inline int  set_ctx              (ContextObj *, hexchat_context **);
+static inline void restore_ctx          (ContextObj *, hexchat_context *);
+static int         context_closed_callback
+                                        (char *[], void *);
+static int         context_find_check   (hexchat_context *, hexchat_context *,
+                                         const char *, const char *);
+
+       hexchat_context *context_get_ptr (PyObject *);
+       PyObject        *context_intern  (hexchat_context *);
+       PyObject        *context_find    (PyObject *, PyObject *);
+       hexchat_context *context_find_ptr
+                                        (const char *, const char *);
+       void            context_cache_start
+                                        (void);
+       void            context_cache_stop
+                                        (void);
 
 /**
  * Methods provided by Context objects.
@@ -89,9 +129,21 @@ static PyMethodDef Context_methods[] = {
                                                   METH_VARARGS,
     "Retrieves an iterator for lists of information from this Context."},
 
-    {"get_list",   (PyCFunction)Context_get_list, METH_VARARGS,
+    {"get_list",   (PyCFunction)Context_get_list, 
+                                                  METH_VARARGS | METH_KEYWORDS,
      "Retrieves lists of information from this Context."},
 
+    {"batch",      (PyCFunction)Context_batch,    METH_NOARGS,
+     "Returns this Context as a context manager. HexChat stays in this "
+     "context for the duration of the with block, so calls made in it don't "
+     "switch contexts."},
+
+    {"__enter__",  (PyCFunction)Context_enter,    METH_NOARGS,
+     "Switches to this Context until __exit__()."},
+
+    {"__exit__",   (PyCFunction)Context_exit,     METH_VARARGS,
+     "Switches back to the context that was current before __enter__()."},
+
     {NULL}
 };
 
@@ -130,7 +182,7 @@ static PyTypeObject ContextType = {
 /**
  * Convenience pointer to Context type.
  */
-PyTypeObject *ContextTypePtr = &ContextType;
+PyTypeObject *ContextTypeDef = &ContextType;
 
 /**
  * Constructor for Context objects. If no parameters are provided, the context
@@ -220,7 +272,7 @@ Context_dealloc(ContextObj *self)
 {
     Py_XDECREF(self->ctx_capsule);
     Py_XDECREF(self->ctxptrval);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 /**
@@ -238,6 +290,10 @@ set_ctx(ContextObj *self, hexchat_context **prior_ctx)
     
     *prior_ctx = hexchat_get_context(ph);
 
+    if (*prior_ctx == self->ctxptr) {
+        // Already there, as in a batch.
+        return 0;
+    }
     result = hexchat_set_context(ph, self->ctxptr);
 
     if (!result) {
@@ -248,6 +304,19 @@ set_ctx(ContextObj *self, hexchat_context **prior_ctx)
     return retval;
 }
 
+/**
+ * Switches back to the context that was current before set_ctx().
+ * @param self      - The Context instance passed to set_ctx().
+ * @param prior_ctx - The prior context set_ctx() returned.
+ */
+void
+restore_ctx(ContextObj *self, hexchat_context *prior_ctx)
+{
+    if (prior_ctx != self->ctxptr) {
+        hexchat_set_context(ph, prior_ctx);
+    }
+}
+
 /**
  * Implements Context.set(). Sets the HexChat active context to self->ctxptr.
  * @returns - None on success, NULL on failure with error state set.
@@ -293,7 +362,7 @@ Context_prnt(ContextObj *self, PyObject *args)
     }
     hexchat_print(ph, PyUnicode_AsUTF8(pytext));
     
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
     
     Py_RETURN_NONE;
 }
@@ -323,7 +392,7 @@ Context_emit_print(ContextObj *self, PyObject *args, PyObject *kwargs)
     
     pyret = py_emit_print((PyObject *)self, args, kwargs);
     
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
     
     return pyret;
 }
@@ -353,7 +422,7 @@ Context_command(ContextObj *self, PyObject *args)
 
     hexchat_command(ph, PyUnicode_AsUTF8(pytext));
 
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
 
     Py_RETURN_NONE;
 }
@@ -387,7 +456,7 @@ Context_get_info(ContextObj *self, PyObject *args)
 
     pyret = py_get_info((PyObject *)self, args);
 
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
 
     return pyret;
 }
@@ -396,30 +465,34 @@ Context_get_info(ContextObj *self, PyObject *args)
  * Implements Context.get_list(). Sets the context and forwards call to
  * py_get_list().
  * @param self  - Context instance.
- * @param args  - 'text'. The name of the list to retrieve.
- * @returns - A Python list object, or NULL on failure with error state set.
+ * @param args  - 'name'. The name of the list to retrieve.
+ * @param kwargs- 'columns', as for hexchat.get_list().
+ * @returns - A Python list or dict, or NULL on failure with error state set.
  */
 PyObject *
-Context_get_list(ContextObj *self, PyObject *args)
+Context_get_list(ContextObj *self, PyObject *args, PyObject *kwargs)
 {
     PyObject        *pytext;
     hexchat_context *prior_ctx;
     PyObject        *pyret;
+    int             columns     = 0;
+    static char     *keywords[] = { "name", "columns", NULL };
 
     if (main_thread_check()) {
         return NULL;
     }
     
-    if (!PyArg_ParseTuple(args, "U:Context.get_list", &pytext)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|p:Context.get_list",
+                                     keywords, &pytext, &columns)) {
         return NULL;
     }    
     if (set_ctx(self, &prior_ctx)) {
         return NULL;
     }
 
-    pyret = py_get_list((PyObject *)self, args);
+    pyret = py_get_list((PyObject *)self, args, kwargs);
     
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
 
     return pyret;
 }
@@ -452,11 +525,68 @@ Context_get_listiter(ContextObj *self, PyObject *args)
 
     pyret = py_get_listiter((PyObject *)self, args);
     
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
 
     return pyret;
 }
 
+/**
+ * Implements Context.batch(). The Context is its own context manager, so this
+ * returns self, and `with ctx.batch():` is the same as `with ctx:`.
+ * @param self  - Context instance.
+ * @returns - self.
+ */
+PyObject *
+Context_batch(ContextObj *self, PyObject *Py_UNUSED(ignored))
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/**
+ * Implements Context.__enter__(). Switches HexChat to this context. Batches
+ * of the same Context can be nested; only the outermost one switches.
+ * @param self  - Context instance.
+ * @returns - self, or NULL on failure with error state set.
+ */
+PyObject *
+Context_enter(ContextObj *self, PyObject *Py_UNUSED(ignored))
+{
+    hexchat_context *prior_ctx;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (self->batch_depth == 0) {
+        if (set_ctx(self, &prior_ctx)) {
+            return NULL;
+        }
+        self->batch_prior = prior_ctx;
+    }
+    self->batch_depth++;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/**
+ * Implements Context.__exit__(). Switches back to the context that was current
+ * before the outermost __enter__(). Exceptions raised in the block aren't
+ * suppressed.
+ * @param self  - Context instance.
+ * @param args  - The exception type, value, and traceback. Ignored.
+ * @returns - False.
+ */
+PyObject *
+Context_exit(ContextObj *self, PyObject *args)
+{
+    if (self->batch_depth > 0 && --self->batch_depth == 0) {
+        restore_ctx(self, self->batch_prior);
+        self->batch_prior = NULL;
+    }
+    Py_RETURN_FALSE;
+}
+
 /**
  * Implements the Context.__repr__() method to intuitive represent the object
  * to the user.
@@ -479,7 +609,7 @@ Context_repr(ContextObj *self, PyObject *Py_UNUSED(args))
     network = hexchat_get_info(ph, "network");
     channel = hexchat_get_info(ph, "channel");
     
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
 
     if (!channel) {
         pyrepr = PyUnicode_FromFormat("Context(network='%s', channel='')",
@@ -510,7 +640,7 @@ Context_get_network(ContextObj *self, void *closure)
         return NULL;
     }
     network = hexchat_get_info(ph, "network");
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
     
     return PyUnicode_FromString(network);
 }
@@ -523,7 +653,7 @@ Context_get_network(ContextObj *self, void *closure)
  */
 PyObject *
 Context_get_channel(ContextObj *self, void *closure)
-{
+{
     hexchat_context *prior_ctx;
     const char *channel;
     
@@ -531,7 +661,7 @@ Context_get_channel(ContextObj *self, void *closure)
         return NULL;
     }
     channel = hexchat_get_info(ph, "channel");
-    hexchat_set_context(ph, prior_ctx);
+    restore_ctx(self, prior_ctx);
     
     return PyUnicode_FromString(channel);
 }
@@ -563,3 +693,228 @@ Context_cmp(ContextObj *a, PyObject *b, int op)
 
 
     
+
+/**
+ * Returns the HexChat context of a Context object, for other modules.
+ * @param pyctx - The Context object.
+ * @returns - The context pointer, or NULL with error state set if pyctx isn't
+ *            a Context.
+ */
+hexchat_context *
+context_get_ptr(PyObject *pyctx)
+{
+    if (Py_TYPE(pyctx) != ContextTypePtr) {
+        PyErr_SetString(PyExc_TypeError, "A Context object was expected.");
+        return NULL;
+    }
+    return ((ContextObj *)pyctx)->ctxptr;
+}
+
+/**
+ * Returns the Context object for a context pointer. Each interp gets the same
+ * object for the same pointer each time. The main interp gets a new one.
+ * @param ctx   - The context pointer.
+ * @returns - A new reference to the Context, or NULL with error state set.
+ */
+PyObject *
+context_intern(hexchat_context *ctx)
+{
+    PyObject *pycache;
+    PyObject *pyptr;
+    PyObject *pycap;
+    PyObject *pyret;
+
+    pycache = interp_get_context_cache(); // BR.
+    pyptr   = PyLong_FromVoidPtr(ctx);
+
+    if (pycache) {
+        pyret = PyDict_GetItemWithError(pycache, pyptr); // BR.
+
+        if (pyret) {
+            Py_DECREF(pyptr);
+            Py_INCREF(pyret);
+            return pyret;
+        }
+    }
+    pycap = PyCapsule_New(ctx, "context", NULL);
+    pyret = (pycap) ? PyObject_CallFunction((PyObject *)ContextTypePtr,
+                                            "OOO", Py_None, Py_None, pycap)
+                    : NULL;
+    Py_XDECREF(pycap);
+
+    if (pyret && pycache) {
+        // Entries of closed contexts aren't removed, so start over now and
+        // then. The objects still compare equal to new ones.
+        if (PyDict_GET_SIZE(pycache) >= CONTEXT_CACHE_MAX) {
+            PyDict_Clear(pycache);
+        }
+        PyDict_SetItem(pycache, pyptr, pyret);
+    }
+    Py_DECREF(pyptr);
+    return pyret;
+}
+
+/**
+ * Implements the lookup for hexchat.find_context(). Lookups without a channel
+ * aren't cached, as HexChat gives the server's front tab, which changes with
+ * focus. For a channel, what HexChat found is cached, but only if it's on the
+ * server that was asked for; when the server isn't given that's the current
+ * context's server, which HexChat looks on first, so the current context is
+ * part of the key. A context found on another server is a fallback that
+ * joining the channel on the current one would change. Tabs can be renamed
+ * and servers reconnect under other names, so a cached context is checked
+ * before it's returned.
+ * @param server    - The server name, or NULL.
+ * @param channel   - The channel name, or NULL.
+ * @returns - The context, or NULL if there's no such context.
+ */
+hexchat_context *
+context_find_ptr(const char *server, const char *channel)
+{
+    hexchat_context *ctx;
+    hexchat_context *cur;
+    char            *key;
+    char            *curserver;
+    const char      *want;
+
+    if (!channel || !context_find_cache) {
+        return (server || channel) ? hexchat_find_context(ph, server, channel)
+                                   : hexchat_get_context(ph);
+    }
+    cur = hexchat_get_context(ph);
+    key = server ? g_strdup_printf("s%s\001%s", server, channel)
+                 : g_strdup_printf("c%p\001%s", (void *)cur, channel);
+
+    curserver = server ? NULL : g_strdup(hexchat_get_info(ph, "server"));
+    want      = server ? server : curserver;
+    ctx       = g_hash_table_lookup(context_find_cache, key);
+
+    if (ctx && context_find_check(ctx, cur, want, channel)) {
+        g_free(curserver);
+        g_free(key);
+        return ctx;
+    }
+    if (ctx) {
+        g_hash_table_remove(context_find_cache, key);
+    }
+    ctx = hexchat_find_context(ph, server, channel);
+
+    // Misses aren't cached; the context may be opened later.
+    if (!ctx || !context_find_check(ctx, cur, want, channel)) {
+        g_free(curserver);
+        g_free(key);
+        return ctx;
+    }
+    if (g_hash_table_size(context_find_cache) >= CONTEXT_CACHE_MAX) {
+        g_hash_table_remove_all(context_find_cache);
+    }
+    g_hash_table_replace(context_find_cache, key, ctx); // Takes key.
+    g_free(curserver);
+
+    return ctx;
+}
+
+/**
+ * Checks that a context is the tab for a channel on a server, as HexChat
+ * would find it: the server can be its server name or its network.
+ * @param ctx       - The context to check.
+ * @param cur       - The current context, restored before returning.
+ * @param server    - The server name, or NULL if there's none to match.
+ * @param channel   - The channel name.
+ * @returns - 1 if the context matches, 0 if not.
+ */
+int
+context_find_check(hexchat_context *ctx, hexchat_context *cur,
+                   const char *server, const char *channel)
+{
+    const char  *info;
+    int         match;
+
+    if (!server || !hexchat_set_context(ph, ctx)) {
+        return 0;
+    }
+    info  = hexchat_get_info(ph, "channel");
+    match = info && !hexchat_nickcmp(ph, info, channel);
+
+    if (match) {
+        info  = hexchat_get_info(ph, "server");
+        match = info && !hexchat_nickcmp(ph, info, server);
+
+        if (!match) {
+            info  = hexchat_get_info(ph, "network");
+            match = info && !hexchat_nickcmp(ph, info, server);
+        }
+    }
+    hexchat_set_context(ph, cur);
+
+    return match;
+}
+
+/**
+ * Returns the Context for hexchat.find_context(). See context_find_ptr().
+ * @param pyserver  - The server name, or None.
+ * @param pychannel - The channel name, or None.
+ * @returns - A new reference to the Context, None if there's no such
+ *            context, or NULL with error state set.
+ */
+PyObject *
+context_find(PyObject *pyserver, PyObject *pychannel)
+{
+    hexchat_context *ctx;
+
+    ctx = context_find_ptr(
+            (pyserver  != Py_None) ? PyUnicode_AsUTF8(pyserver)  : NULL,
+            (pychannel != Py_None) ? PyUnicode_AsUTF8(pychannel) : NULL);
+    if (!ctx) {
+        Py_RETURN_NONE;
+    }
+    return context_intern(ctx);
+}
+
+/**
+ * Starts caching find_context() results. The cache is cleared whenever a
+ * context is closed, since its pointer could be reused.
+ */
+void
+context_cache_start()
+{
+    if (context_find_cache) {
+        return;
+    }
+    context_find_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, NULL);
+    context_close_hook = hexchat_hook_print(ph, "Close Context", 
+                                            HEXCHAT_PRI_HIGHEST,
+                                            context_closed_callback, NULL);
+}
+
+/**
+ * Stops caching find_context() results.
+ */
+void
+context_cache_stop()
+{
+    if (context_close_hook) {
+        hexchat_unhook(ph, context_close_hook);
+        context_close_hook = NULL;
+    }
+    if (context_find_cache) {
+        g_hash_table_destroy(context_find_cache);
+        context_find_cache = NULL;
+    }
+}
+
+/**
+ * Clears the find_context() cache when a context is closed.
+ * @param word      - Not used.
+ * @param userdata  - Not used.
+ * @returns - HEXCHAT_EAT_NONE.
+ */
+int
+context_closed_callback(char *word[], void *userdata)
+{
+    if (context_find_cache) {
+        g_hash_table_remove_all(context_find_cache);
+    }
+    return HEXCHAT_EAT_NONE;
+}
@@ -28,6 +28,12 @@
  * back to the caller (synchronous), or an AsyncResult object (asynchronous)
  * that can be used by the caller to retrieve the result or error - or it can
  * be ignored.
+ *
+ * Calls made from threads other than the main thread are pushed onto a
+ * lock-free queue owned by the Delegate's interpreter. A single HexChat timer
+ * (the "pump") is armed when the first call of a burst arrives; it drains the
+ * queues of all interpreters, up to a per-interp budget of calls per tick, and
+ * keeps itself scheduled only while there is still work pending.
  */
 
 #include "minpython.h"
@@ -38,22 +44,50 @@
 typedef struct {
     PyObject_HEAD
     PyObject        *callable;
-    PyObject        *queue_constr;
     int             is_async;
 } DelegateObj;
 
 /**
- * Data passed to timer callbacks used to invoke the internal callable on the
- * main thread.
+ * A pending Delegate call. These are the nodes of a DelegateQueue and hold the
+ * data used to invoke the internal callable on the main thread.
  */
-typedef struct {
+typedef struct _DelegateData DelegateData;
+
+struct _DelegateData {
+    DelegateData  *next;
     PyObject      *callable;
     PyObject      *args;
     PyObject      *kwargs;
-    PyObject      *queue;
+    PyObject      *asyncresult;
     int           is_async;
+};
+
+/**
+ * Intrusive multi-producer/single-consumer queue of pending calls for one
+ * interpreter. Any thread may push to it; only the pump on the HexChat main
+ * thread pops from it. See delegate_queue_push() and delegate_queue_pop().
+ */
+struct _DelegateQueue {
+    DelegateQueue *next;        // Registry link. Main thread only.
+    DelegateData  *head;        // Most recently pushed node. Producers.
+    DelegateData  *tail;        // Next node to pop. Consumer only.
+    DelegateData  stub;
     PyThreadState *threadstate;
-} DelegateData;
+    HookStats     *stats;       // Main thread only. Set when first timed.
+    PluginQuota   *quota;
+    long          budget;
+    int           dead;
+};
+
+#define DELEGATE_DEFAULT_BUDGET 64
+
+/**
+ * The queues of all live interpreters, the flag indicating the pump timer is
+ * scheduled, and the flag indicating the pump is currently executing.
+ */
+static DelegateQueue    *delegate_queues    = NULL;
+static long             pump_armed          = 0;
+static int              pump_running        = 0;
 
 static int      Delegate_init           (DelegateObj *, PyObject *, PyObject *);
 static void     Delegate_dealloc        (DelegateObj *);
@@ -61,8 +95,21 @@ static PyObject *Delegate_call          (DelegateObj *, PyObject *, PyObject *);
 static PyObject *Delegate_get_is_async  (DelegateObj *, void *);
 static PyObject *Delegate_repr          (DelegateObj *, PyObject *);
 
-static PyObject *delegate_get_queue_constr  (DelegateObj *);
-static int      delegate_timer_callback     (void *);
+static int      delegate_pump_callback      (void *);
+static void     delegate_invoke             (DelegateData *);
+static void     delegate_send_result        (DelegateData *, long, PyObject *);
+static void     delegate_data_free          (DelegateData *);
+
+static void         delegate_queue_push     (DelegateQueue *, DelegateData *);
+static DelegateData *delegate_queue_pop     (DelegateQueue *);
+static int          delegate_queue_pending  (DelegateQueue *);
+static void         delegate_queue_unlink   (DelegateQueue *);
+static void         delegate_pump_arm       (void);
+
+DelegateQueue   *delegate_queue_create      (PyThreadState *);
+void            delegate_queue_destroy      (DelegateQueue *);
+int             delegate_queue_set_budget   (DelegateQueue *, int);
+void            delegate_run_pending        (void);
 
 /**
  * Delegate accessor functions to be registered with the type.
@@ -103,7 +150,7 @@ static PyTypeObject DelegateType = {
 /**
  * Convenient Delegate type pointer.
  */
-PyTypeObject *DelegateTypePtr = &DelegateType;
+PyTypeObject *DelegateTypeDef = &DelegateType;
 
 /**
  * Delegate constructor.
@@ -135,12 +182,6 @@ Delegate_init(DelegateObj *self, PyObject *args, PyObject *kwargs)
     self->is_async = is_async;
 
     Py_INCREF(pycallable);
-    
-    // Get the queueQueue constructor for creating thread-safe queues.
-    self->queue_constr = delegate_get_queue_constr(self);
-    if (!self->queue_constr) {
-        return -1;
-    }
 
     return 0;
 }
@@ -152,15 +193,14 @@ void
 Delegate_dealloc(DelegateObj *self)
 {
     Py_XDECREF(self->callable);
-    Py_XDECREF(self->queue_constr);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 /**
  * Implements Delegate.__call__() which makes Delegate objects invokable as a
- * function. When invoked, the wrapped callable is put in the HexChat timer
- * queue for execution on the main thread. The result of this call will be
- * sent back to this function via a Queue object and returned, or an
+ * function. When invoked, the wrapped callable is put on the interpreter's
+ * Delegate queue for execution on the main thread. The result of this call
+ * will be sent back to this function via an AsyncResult and returned, or the
  * AsyncResult will be immediately returned if the Delegate was created with
  * 'is_async' True.
  * @param self      - Delegate instance.
@@ -177,15 +217,12 @@ Delegate_call(DelegateObj *self, PyObject *args, PyObject *kwargs)
 {
     PyObject      *pyret        = NULL;
     PyObject      *pyasync_result;
-    PyObject      *pyqueue;
     PyObject      *pytemp;
     PyObject      *pyexc        = NULL;
     PyObject      *pyexc_type   = NULL;
     PyObject      *pytraceback  = NULL;
-    PyObject      *pystatus;
-    PyObject      *pyresult;
-    long          status;
     DelegateData  *data;
+    DelegateQueue *dqueue;
     PyThreadState *pycur_threadstate;
 
     pycur_threadstate = PyThreadState_Get();
@@ -210,9 +247,12 @@ Delegate_call(DelegateObj *self, PyObject *args, PyObject *kwargs)
                 Py_DECREF(pytraceback);
             }
             
-            pyasync_result = PyObject_CallFunction((PyObject *)
-                                                    AsyncResultTypePtr, "O",
-                                                    Py_None);
+            pyasync_result = asyncresult_new();
+            if (!pyasync_result) {
+                Py_XDECREF(pyret);
+                Py_XDECREF(pyexc);
+                return NULL;
+            }
             if (pyret) {
                 asyncresult_set_result(pyasync_result, pyret); // Steals ref.
             }
@@ -223,66 +263,54 @@ Delegate_call(DelegateObj *self, PyObject *args, PyObject *kwargs)
         }
     }
     else {
-        // This is not the main thread; set up a timer callback to invoke the
-        // callable.
+        // This is not the main thread; queue the call for the pump to invoke
+        // on the main thread.
+        dqueue = interp_get_delegate_queue();
+        if (!dqueue) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "Delegate called while its interpreter is "
+                            "shutting down.");
+            return NULL;
+        }
+        pyasync_result = asyncresult_new();
+        if (!pyasync_result) {
+            return NULL;
+        }
         data = PyMem_RawMalloc(sizeof(DelegateData));
-
+        if (!data) {
+            Py_DECREF(pyasync_result);
+            return PyErr_NoMemory();
+        }
         data->callable    = self->callable;
         data->args        = args;
         data->kwargs      = kwargs;
         data->is_async    = self->is_async;
-        data->threadstate = interp_get_main_threadstate(); 
-
-        pyqueue = PyObject_CallFunction(self->queue_constr, "i", 1);
-        if (!pyqueue) {
-            return NULL;
-        }
-        data->queue = pyqueue;
+        data->asyncresult = pyasync_result;
 
         Py_INCREF(data->callable);
-        Py_INCREF(data->queue);
+        Py_INCREF(data->asyncresult);
         Py_XINCREF(args);
         Py_XINCREF(kwargs);
 
-        // Put the invokation information on the timer queue.
-        hexchat_hook_timer(ph, 0, delegate_timer_callback, (void *)data);
+        delegate_queue_push(dqueue, data);
 
-        if (!self->is_async) {
-            // Synchronous call. Do a blocking read on the queue and wait for
-            // the result.
-            pyret = PyObject_CallMethod(pyqueue, "get", NULL);
-            
-            // Get the result list, check result, handle result or error. 
-            // If error.. set the interp error state.
-            
-            pystatus = PySequence_GetItem(pyret, 0); // NR.
-            pyresult = PySequence_GetItem(pyret, 1);
+        // Only the first call of a burst schedules the pump.
+        delegate_pump_arm();
 
-            status = PyLong_AsLong(pystatus);
-            
-            Py_DECREF(pystatus);
-            Py_DECREF(pyret);
-            Py_DECREF(pyqueue);
-                
-            if (status == 0) {
-                pyret = pyresult;
+        if (!self->is_async) {
+            // Synchronous call. Block until the main thread completes the
+            // result. If the call raised, the exception is restored so the
+            // caller gets it.
+            if (asyncresult_wait(pyasync_result, -1) < 0) {
+                pyret = NULL;
             }
             else {
-                // For synchronous calls that have an exception, restore the
-                // exception so the caller gets it.
-                pyret = NULL;
-                PyErr_Restore(PyObject_Type(pyresult),  // Steals all refs.
-                              pyresult, 
-                              PyObject_GetAttrString(pyresult, 
-                                                     "__traceback__"));
+                pyret = asyncresult_unwrap(pyasync_result);
             }
+            Py_DECREF(pyasync_result);
         }
         else {
-            // Async call. Create an AsyncResult object and return it.
-            pyasync_result = PyObject_CallFunction((PyObject *)
-                                                   AsyncResultTypePtr, "O", 
-                                                   pyqueue);
-            Py_DECREF(pyqueue);
+            // Async call. Return the AsyncResult object.
             pyret = pyasync_result;
         }
     }
@@ -297,32 +325,146 @@ Delegate_call(DelegateObj *self, PyObject *args, PyObject *kwargs)
 }
 
 /**
- * The callback passed to hexchat_hook_timer() that invokes the Delegate's
- * wrapped callable on the main thread of HexChat.
- * @param userdata  - The userdata passed to hexchat_hook_timer().
- * @returns - 0 so the timer won't be rescheduled.
+ * Schedules the pump timer if it isn't already scheduled. Can be called from
+ * any thread.
+ */
+void
+delegate_pump_arm()
+{
+    if (atom_cas_long(&pump_armed, 0, 1)) {
+        hexchat_hook_timer(ph, 0, delegate_pump_callback, NULL);
+    }
+}
+
+/**
+ * The callback passed to hexchat_hook_timer() that drains the Delegate queues
+ * of all interpreters on the main thread of HexChat. At most `budget` calls
+ * are made for each interpreter per tick so a flood of calls from one plugin
+ * can't stall the client's event loop.
+ * @param userdata  - Not used.
+ * @returns - 1 to keep the timer scheduled if calls are still pending, 0
+ *            otherwise.
  */
 int 
-delegate_timer_callback(void *userdata)
+delegate_pump_callback(void *userdata)
 {
+    DelegateQueue   *dqueue;
+    DelegateQueue   *dnext;
     DelegateData    *data;
+    SwitchTSInfo    tsinfo;
+    long            budget;
+    long            i;
+    long long       t0;
+    long long       gil_ns;
+    long long       used;
+    int             profile = stats_enabled;
+    int             pending = 0;
+
+    pump_running = 1;
+
+    for (dqueue = delegate_queues; dqueue; dqueue = dqueue->next) {
+        if (dqueue->dead || !delegate_queue_pending(dqueue)) {
+            continue;
+        }
+        budget = atom_load_long(&dqueue->budget);
+
+        if (profile && !dqueue->stats) {
+            dqueue->stats = stats_get(dqueue->threadstate, "delegate",
+                                      "calls from threads");
+        }
+        // Switch to the queue's sub-interpreter, grabbing the GIL.
+        t0     = profile ? stats_now() : 0;
+        tsinfo = switch_threadstate(dqueue->threadstate);
+        gil_ns = profile ? stats_now() - t0 : 0;
+        used   = 0;
+
+        for (i = 0; i < budget && !dqueue->dead; i++) {
+            data = delegate_queue_pop(dqueue);
+            if (!data) {
+                break;
+            }
+            t0 = stats_now();
+            delegate_invoke(data);
+            t0 = stats_now() - t0;
+
+            used += t0;
+
+            if (profile) {
+                // The switch is counted against the first call.
+                stats_record(dqueue->stats, gil_ns, 0, t0);
+                gil_ns = 0;
+            }
+        }
+        if (!dqueue->dead && delegate_queue_pending(dqueue)) {
+            pending = 1;
+        }
+        switch_threadstate_back(tsinfo);
+
+        // Charged, but never blocked; the plugin's threads are waiting.
+        quota_charge(dqueue->quota, used);
+    }
+
+    pump_running = 0;
+
+    // Free any queues whose interpreters were deleted by the calls above.
+    for (dqueue = delegate_queues; dqueue; dqueue = dnext) {
+        dnext = dqueue->next;
+        if (dqueue->dead) {
+            delegate_queue_unlink(dqueue);
+            PyMem_RawFree(dqueue);
+        }
+    }
+
+    if (pending) {
+        return 1;
+    }
+
+    // Disarm, then look again in case a producer pushed after its queue was
+    // checked but saw the pump still armed.
+    atom_store_long(&pump_armed, 0);
+
+    for (dqueue = delegate_queues; dqueue; dqueue = dqueue->next) {
+        if (delegate_queue_pending(dqueue)) {
+            return atom_cas_long(&pump_armed, 0, 1) ? 1 : 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Runs pending Delegate calls now instead of waiting for the pump timer. Used
+ * on the main thread when it has to wait on a thread that may be blocked on
+ * a synchronous call. Does nothing if called from within the pump.
+ */
+void
+delegate_run_pending()
+{
+    if (!pump_running) {
+        delegate_pump_callback(NULL);
+    }
+}
+
+/**
+ * Invokes the wrapped callable of a pending call and sends the result back to
+ * the caller. Must be called with the target interp's threadstate current.
+ * The call data is freed.
+ * @param data  - The call to make.
+ */
+void
+delegate_invoke(DelegateData *data)
+{
     PyObject        *pyret;
-    PyObject        *pylist;
-    PyObject        *pytemp;
     PyObject        *pyexc          = NULL;
     PyObject        *pyexc_type     = NULL;
     PyObject        *pytraceback    = NULL;
-    SwitchTSInfo    tsinfo;
-    
-    data = (DelegateData *)userdata;
-
-    // Switch to the userdata sub-interpreter's threadstate, grabbing the GIL.
-    tsinfo = switch_threadstate(data->threadstate);
 
     // Invoke the function/method.
     pyret = PyObject_Call(data->callable, data->args, data->kwargs);
 
-    if (!pyret) {
+    if (pyret) {
+        delegate_send_result(data, 0, pyret);   // Steals ref.
+    }
+    else {
         // Error occurred. Get the exception with __traceback__ set.
         PyErr_Fetch(&pyexc_type, &pyexc, &pytraceback);
         PyErr_NormalizeException(&pyexc_type, &pyexc, &pytraceback);
@@ -330,55 +472,208 @@ delegate_timer_callback(void *userdata)
             PyException_SetTraceback(pyexc, pytraceback);
         }
         Py_DECREF(pyexc_type);
-        Py_DECREF(pytraceback);
+        Py_XDECREF(pytraceback);
+
+        delegate_send_result(data, -1, pyexc);
     }
-    
-    // Create result list and populate with either error or result.
-    pylist = PyList_New(2);
-    
-    if (pyret) {
-        // Success.
-        PyList_SetItem(pylist, 0, PyLong_FromLong(0)); // Steals ref.
-        PyList_SetItem(pylist, 1, pyret);
+    delegate_data_free(data);
+}
+
+/**
+ * Completes the call's AsyncResult, waking the caller if it's waiting on it.
+ * Async results that are Context objects get wrapped in an async 
+ * DelegateProxy; synchronous Delegate_call() does its own wrapping.
+ * @param data      - The call data.
+ * @param status    - 0 for success, -1 if value is an exception.
+ * @param pyvalue   - The result or exception. The reference is stolen.
+ */
+void
+delegate_send_result(DelegateData *data, long status, PyObject *pyvalue)
+{
+    if (status != 0) {
+        asyncresult_set_error(data->asyncresult, pyvalue);
+    }
+    else if (data->is_async) {
+        asyncresult_set_result(data->asyncresult, pyvalue);
     }
     else {
-        // Error.
-        PyList_SetItem(pylist, 0, PyLong_FromLong(-1));
-        PyList_SetItem(pylist, 1, pyexc);
+        asyncresult_complete(data->asyncresult, pyvalue, NULL);
     }
-    
-    // Send the result data back to the caller.
-    pytemp = PyObject_CallMethod(data->queue, "put", "O", pylist);
-    
-    Py_DECREF(pylist);
-    Py_DECREF(pytemp);
+}
+
+/**
+ * Releases the references held by the call data and frees it.
+ */
+void
+delegate_data_free(DelegateData *data)
+{
     Py_DECREF(data->callable);
-    Py_DECREF(data->queue);
+    Py_DECREF(data->asyncresult);
     Py_XDECREF(data->args);
     Py_XDECREF(data->kwargs);
 
     PyMem_RawFree(data);
+}
+
+/**
+ * Creates the Delegate queue for an interpreter and adds it to the registry
+ * the pump drains. Called on the main thread when the interp's private data
+ * is set up.
+ * @param ts    - The main threadstate of the interpreter.
+ * @returns - The new queue, or NULL if out of memory.
+ */
+DelegateQueue *
+delegate_queue_create(PyThreadState *ts)
+{
+    DelegateQueue *dqueue;
 
-    // Switch back to the prior threadstate and release the GIL.
-    switch_threadstate_back(tsinfo);
+    dqueue = PyMem_RawMalloc(sizeof(DelegateQueue));
+    if (!dqueue) {
+        return NULL;
+    }
+    dqueue->stub.next   = NULL;
+    dqueue->head        = &dqueue->stub;
+    dqueue->tail        = &dqueue->stub;
+    dqueue->threadstate = ts;
+    dqueue->stats       = NULL;
+    dqueue->quota       = quota_get(ts);
+    dqueue->budget      = DELEGATE_DEFAULT_BUDGET;
+    dqueue->dead        = 0;
+
+    if (!delegate_queues) {
+        // No interps are live, so any pump left scheduled has nothing to do.
+        // Make sure a stale armed flag can't keep the pump from scheduling.
+        atom_store_long(&pump_armed, 0);
+    }
+    dqueue->next        = delegate_queues;
+    delegate_queues     = dqueue;
 
-    // Return 0 so this callback isn't put back on the timer queue.
-    return 0;
+    return dqueue;
 }
 
 /**
- * Used to retrieve queue.Queue so queue objects can be created to pass
- * results from the timer callback to a Delegate object invoked from another
- * thread to the caller.
+ * Destroys an interpreter's Delegate queue. Calls still pending are not made;
+ * their callers get a RuntimeError instead. Must be called on the main thread
+ * with the queue's interp current. If the pump is running (one of its calls
+ * is unloading a plugin), the queue is only marked dead and the pump frees it.
+ * @param dqueue    - The queue to destroy.
  */
-PyObject *
-delegate_get_queue_constr(DelegateObj *self)
+void
+delegate_queue_destroy(DelegateQueue *dqueue)
+{
+    DelegateData *data;
+    PyObject     *pyexc;
+
+    if (!dqueue) {
+        return;
+    }
+    dqueue->dead = 1;
+
+    while ((data = delegate_queue_pop(dqueue)) != NULL) {
+        pyexc = PyObject_CallFunction(PyExc_RuntimeError, "s",
+                                      "The interpreter was shut down before "
+                                      "the Delegate call was made.");
+        delegate_send_result(data, -1, pyexc);
+        delegate_data_free(data);
+    }
+    if (!pump_running) {
+        delegate_queue_unlink(dqueue);
+        PyMem_RawFree(dqueue);
+    }
+}
+
+/**
+ * Sets the maximum number of calls made for the queue's interp per pump tick.
+ * Can be called from any thread.
+ * @param dqueue    - The queue.
+ * @param budget    - The new budget. Must be greater than 0.
+ * @returns - The previous budget.
+ */
+int
+delegate_queue_set_budget(DelegateQueue *dqueue, int budget)
+{
+    long prior;
+
+    prior = atom_load_long(&dqueue->budget);
+    atom_store_long(&dqueue->budget, (long)budget);
+
+    return (int)prior;
+}
+
+/**
+ * Pushes a call onto the queue. Safe to call from any number of threads.
+ */
+void
+delegate_queue_push(DelegateQueue *dqueue, DelegateData *data)
+{
+    DelegateData *prev;
+
+    data->next = NULL;
+    prev = atom_xchg_ptr(&dqueue->head, data);
+    atom_store_ptr(&prev->next, data);
+}
+
+/**
+ * Pops the oldest call off the queue. Only the main thread may call this.
+ * @returns - The call, or NULL if the queue is empty, or a producer is in the
+ *            middle of a push (delegate_queue_pending() will still report it).
+ */
+DelegateData *
+delegate_queue_pop(DelegateQueue *dqueue)
+{
+    DelegateData *tail = dqueue->tail;
+    DelegateData *next = atom_load_ptr(&tail->next);
+
+    if (tail == &dqueue->stub) {
+        if (!next) {
+            return NULL;
+        }
+        dqueue->tail = next;
+        tail         = next;
+        next         = atom_load_ptr(&next->next);
+    }
+    if (next) {
+        dqueue->tail = next;
+        return tail;
+    }
+    if (tail != atom_load_ptr(&dqueue->head)) {
+        return NULL;
+    }
+    // Tail is the last node; put the stub behind it so it can be handed out.
+    delegate_queue_push(dqueue, &dqueue->stub);
+
+    next = atom_load_ptr(&tail->next);
+    if (next) {
+        dqueue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/**
+ * Returns non-zero if the queue has calls, including any partially pushed.
+ */
+int
+delegate_queue_pending(DelegateQueue *dqueue)
 {
-    PyObject *pyqconstr;
+    return dqueue->tail != &dqueue->stub ||
+           atom_load_ptr(&dqueue->head) != &dqueue->stub;
+}
 
-    pyqconstr = interp_get_queue_constr();
-    Py_INCREF(pyqconstr);
-    return pyqconstr;
+/**
+ * Removes a queue from the registry.
+ */
+void
+delegate_queue_unlink(DelegateQueue *dqueue)
+{
+    DelegateQueue **link;
+
+    for (link = &delegate_queues; *link; link = &(*link)->next) {
+        if (*link == dqueue) {
+            *link = dqueue->next;
+            break;
+        }
+    }
 }
 
 /**
@@ -114,7 +114,7 @@ static PyTypeObject DelegateProxyType = {
 /**
  * Convenience pointer to the type.
  */
-PyTypeObject *DelegateProxyTypePtr = &DelegateProxyType;
+PyTypeObject *DelegateProxyTypeDef = &DelegateProxyType;
 
 /**
  * Constructor.
@@ -153,7 +153,7 @@ DelegateProxy_dealloc(DelegateProxyObj *self)
 {
     Py_XDECREF(self->cache);
     Py_XDECREF(self->obj);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 /**
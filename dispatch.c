@@ -0,0 +1,526 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * Print and server event hooks from all plugins are multiplexed through
+ * dispatchers. There's one HexChat hook, and one Dispatcher, per event type,
+ * event name and priority. The dispatcher holds the Python callbacks (its
+ * subscribers) grouped by interpreter, in the order they were hooked within
+ * each group. When the event fires, the dispatcher switches to each group's
+ * interpreter once, builds word/word_eol/attrs once for the group, and invokes
+ * the group's callbacks in turn.
+ *
+ * EAT_* return values work as they do between separate HexChat hooks:
+ * EAT_HEXCHAT from any callback keeps HexChat from processing the event but
+ * the remaining callbacks still run; EAT_PLUGIN stops the fan-out.
+ *
+ * A subscriber hooked with a `filter` (see hookfilter.c) is skipped without
+ * switching interpreters when the filter doesn't match, so an event no filter
+ * accepts never acquires the GIL.
+ */
+
+#include "minpython.h"
+
+/**
+ * The subscribers of one (event type, name, priority). While an event is being
+ * dispatched ('depth' > 0), removed subscribers leave a NULL slot and new ones
+ * are appended; the array is compacted and regrouped afterward.
+ */
+struct _Dispatcher {
+    Dispatcher      *next;
+    CB_VER          ver;
+    char            *name;
+    int             priority;
+    hexchat_hook    *hook;
+    CallbackData    **subs;
+    int             nsubs;
+    int             capacity;
+    int             nlive;
+    int             depth;
+    int             dirty;
+};
+
+/**
+ * All dispatchers. Only accessed on the main thread.
+ */
+static Dispatcher *dispatchers = NULL;
+
+       hexchat_hook *dispatch_hook              (CB_VER, const char *, int,
+                                                 CallbackData *);
+       void         dispatch_unhook             (CallbackData *);
+static Dispatcher   *dispatch_find              (CB_VER, const char *, int);
+static Dispatcher   *dispatch_new               (CB_VER, const char *, int);
+static int          dispatch_register           (Dispatcher *);
+static int          dispatch_insert             (Dispatcher *,
+                                                 CallbackData *);
+static void         dispatch_compact            (Dispatcher *);
+static void         dispatch_free               (Dispatcher *);
+static int          dispatch_event              (Dispatcher *, char *[],
+                                                 char *[],
+                                                 hexchat_event_attrs *);
+
+static int          dispatch_print_cb           (char *[], void *);
+static int          dispatch_print_attrs_cb     (char *[],
+                                                 hexchat_event_attrs *,
+                                                 void *);
+static int          dispatch_server_cb          (char *[], char *[], void *);
+static int          dispatch_server_attrs_cb    (char *[], char *[],
+                                                 hexchat_event_attrs *,
+                                                 void *);
+
+/**
+ * Subscribes a callback to an event. The event's dispatcher, and its HexChat
+ * hook, are created if this is the first subscriber.
+ * @param ver       - One of CBV_PRNT, CBV_PRNT_ATTR, CBV_SRV, CBV_SRV_ATTR.
+ * @param name      - The event name.
+ * @param priority  - The HexChat priority.
+ * @param data      - The callback data of the subscriber.
+ * @returns - The dispatcher's HexChat hook, or NULL on failure.
+ */
+hexchat_hook *
+dispatch_hook(CB_VER ver, const char *name, int priority, CallbackData *data)
+{
+    Dispatcher *disp;
+
+    disp = dispatch_find(ver, name, priority);
+    if (!disp) {
+        disp = dispatch_new(ver, name, priority);
+        if (!disp) {
+            return NULL;
+        }
+    }
+    if (!disp->hook && dispatch_register(disp)) {
+        if (disp->nlive == 0 && disp->depth == 0) {
+            dispatch_free(disp);
+        }
+        return NULL;
+    }
+    if (dispatch_insert(disp, data)) {
+        if (disp->nlive == 0) {
+            hexchat_unhook(ph, disp->hook);
+            disp->hook = NULL;
+            if (disp->depth == 0) {
+                dispatch_free(disp);
+            }
+        }
+        return NULL;
+    }
+    data->dispatcher = disp;
+
+    return disp->hook;
+}
+
+/**
+ * Removes a subscriber from its dispatcher. When the last subscriber is
+ * removed, the HexChat hook is removed too.
+ * @param data  - The callback data of the subscriber.
+ */
+void
+dispatch_unhook(CallbackData *data)
+{
+    Dispatcher  *disp = data->dispatcher;
+    int         i;
+
+    for (i = 0; i < disp->nsubs && disp->subs[i] != data; i++);
+
+    if (i == disp->nsubs) {
+        return;
+    }
+    if (disp->depth > 0) {
+        disp->subs[i] = NULL;
+        disp->dirty   = 1;
+    }
+    else {
+        memmove(&disp->subs[i], &disp->subs[i + 1],
+                (disp->nsubs - i - 1) * sizeof(CallbackData *));
+        disp->nsubs--;
+    }
+    data->dispatcher = NULL;
+
+    if (--disp->nlive == 0) {
+        hexchat_unhook(ph, disp->hook);
+        disp->hook = NULL;
+
+        if (disp->depth == 0) {
+            dispatch_free(disp);
+        }
+    }
+}
+
+/**
+ * Looks up the dispatcher for an event.
+ */
+Dispatcher *
+dispatch_find(CB_VER ver, const char *name, int priority)
+{
+    Dispatcher *disp;
+
+    for (disp = dispatchers; disp; disp = disp->next) {
+        if (disp->ver == ver && disp->priority == priority &&
+            !strcmp(disp->name, name)) {
+            return disp;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Creates a dispatcher with no subscribers and adds it to the list.
+ */
+Dispatcher *
+dispatch_new(CB_VER ver, const char *name, int priority)
+{
+    Dispatcher  *disp;
+    size_t      len = strlen(name);
+
+    disp = PyMem_RawMalloc(sizeof(Dispatcher));
+    if (!disp) {
+        return NULL;
+    }
+    disp->name = PyMem_RawMalloc(len + 1);
+    if (!disp->name) {
+        PyMem_RawFree(disp);
+        return NULL;
+    }
+    memcpy(disp->name, name, len + 1);
+
+    disp->ver       = ver;
+    disp->priority  = priority;
+    disp->hook      = NULL;
+    disp->subs      = NULL;
+    disp->nsubs     = 0;
+    disp->capacity  = 0;
+    disp->nlive     = 0;
+    disp->depth     = 0;
+    disp->dirty     = 0;
+
+    disp->next      = dispatchers;
+    dispatchers     = disp;
+
+    return disp;
+}
+
+/**
+ * Hooks the dispatcher's event with HexChat.
+ * @returns - 0 on success, -1 on failure.
+ */
+int
+dispatch_register(Dispatcher *disp)
+{
+    switch (disp->ver) {
+    case CBV_PRNT:
+        disp->hook = hexchat_hook_print(ph, disp->name, disp->priority,
+                                        dispatch_print_cb, disp);
+        break;
+    case CBV_PRNT_ATTR:
+        disp->hook = hexchat_hook_print_attrs(ph, disp->name, disp->priority,
+                                              dispatch_print_attrs_cb, disp);
+        break;
+    case CBV_SRV:
+        disp->hook = hexchat_hook_server(ph, disp->name, disp->priority,
+                                         dispatch_server_cb, disp);
+        break;
+    case CBV_SRV_ATTR:
+        disp->hook = hexchat_hook_server_attrs(ph, disp->name, disp->priority,
+                                               dispatch_server_attrs_cb, disp);
+        break;
+    default:
+        // Can't get here.
+        assert("Bad value for ver!" == 0);
+        break;
+    }
+    return disp->hook ? 0 : -1;
+}
+
+/**
+ * Adds a subscriber after the last subscriber from the same interpreter, or
+ * at the end if there's none. During a dispatch, it's appended and the array
+ * is regrouped afterward.
+ * @returns - 0 on success, -1 if out of memory.
+ */
+int
+dispatch_insert(Dispatcher *disp, CallbackData *data)
+{
+    CallbackData    **subs;
+    int             capacity;
+    int             i;
+    int             pos;
+
+    if (disp->nsubs == disp->capacity) {
+        capacity = disp->capacity ? disp->capacity * 2 : 4;
+        subs     = PyMem_RawRealloc(disp->subs,
+                                    capacity * sizeof(CallbackData *));
+        if (!subs) {
+            return -1;
+        }
+        disp->subs      = subs;
+        disp->capacity  = capacity;
+    }
+    pos = disp->nsubs;
+
+    if (disp->depth > 0) {
+        disp->dirty = 1;
+    }
+    else {
+        for (i = disp->nsubs - 1; i >= 0; i--) {
+            if (disp->subs[i]->threadstate == data->threadstate) {
+                pos = i + 1;
+                break;
+            }
+        }
+        memmove(&disp->subs[pos + 1], &disp->subs[pos],
+                (disp->nsubs - pos) * sizeof(CallbackData *));
+    }
+    disp->subs[pos] = data;
+    disp->nsubs++;
+    disp->nlive++;
+
+    return 0;
+}
+
+/**
+ * Removes the slots left by subscribers that unhooked during a dispatch, and
+ * regroups subscribers added during one with the others from their interp.
+ * Frees the dispatcher if it has no subscribers left.
+ */
+void
+dispatch_compact(Dispatcher *disp)
+{
+    CallbackData    **subs  = disp->subs;
+    CallbackData    *data;
+    int             n       = 0;
+    int             i;
+    int             j;
+
+    if (disp->nlive == 0) {
+        dispatch_free(disp);
+        return;
+    }
+    if (!disp->dirty) {
+        return;
+    }
+    for (i = 0; i < disp->nsubs; i++) {
+        if (subs[i]) {
+            subs[n++] = subs[i];
+        }
+    }
+    // Stable regroup by interp: move each subscriber back to just after the
+    // last earlier subscriber from the same interp.
+    for (i = 1; i < n; i++) {
+        data = subs[i];
+        for (j = i - 1; j >= 0 && subs[j]->threadstate != data->threadstate;
+             j--);
+
+        if (j >= 0 && j != i - 1) {
+            memmove(&subs[j + 2], &subs[j + 1],
+                    (i - j - 1) * sizeof(CallbackData *));
+            subs[j + 1] = data;
+        }
+    }
+    disp->nsubs = n;
+    disp->dirty = 0;
+}
+
+/**
+ * Unlinks and frees a dispatcher. Its HexChat hook must already be removed.
+ */
+void
+dispatch_free(Dispatcher *disp)
+{
+    Dispatcher **link;
+
+    for (link = &dispatchers; *link; link = &(*link)->next) {
+        if (*link == disp) {
+            *link = disp->next;
+            break;
+        }
+    }
+    PyMem_RawFree(disp->subs);
+    PyMem_RawFree(disp->name);
+    PyMem_RawFree(disp);
+}
+
+/**
+ * Delivers an event to the dispatcher's subscribers.
+ * @param disp      - The dispatcher.
+ * @param word      - HexChat's word[] array.
+ * @param word_eol  - HexChat's word_eol[] array, or NULL for print events.
+ * @param attrs     - The event attrs for the _attrs event types, or NULL.
+ * @returns - The combined EAT_* value for HexChat.
+ */
+int
+dispatch_event(Dispatcher *disp, char *word[], char *word_eol[],
+               hexchat_event_attrs *attrs)
+{
+    CallbackData    *data;
+    PyThreadState   *group_ts       = NULL;
+    PyObject        *pyword         = NULL;
+    PyObject        *pyword_eol     = NULL;
+    PyObject        *pyeol_list     = NULL;
+    PyObject        *pyattrs        = NULL;
+    PyObject        *pyeol;
+    PyObject        *pycallback;
+    PyObject        *pyuserdata;
+    PyObject        *pyret;
+    HookStats       *stats;
+    PluginQuota     *quota;
+    SwitchTSInfo    tsinfo;
+    long long       t0;
+    long long       t1;
+    long long       gil_ns          = 0;
+    long long       conv_ns         = 0;
+    int             profile         = stats_enabled;
+    int             group_ok        = 0;
+    int             retval          = HEXCHAT_EAT_NONE;
+    int             ret;
+    int             end;
+    int             i;
+
+    disp->depth++;
+
+    // Subscribers added by the callbacks don't get this event.
+    end = disp->nsubs;
+
+    for (i = 0; i < end && !(retval & HEXCHAT_EAT_PLUGIN); i++) {
+        data = disp->subs[i];
+        if (!data || !data->hook) {
+            continue;
+        }
+        // Filters are checked before switching to the callback's interp.
+        if (data->filter && !hookfilter_match(data->filter, word, word_eol)) {
+            continue;
+        }
+        if (quota_blocked(data->quota, 0)) {
+            continue;
+        }
+        if (data->threadstate != group_ts) {
+            // Start of the next interp's group. Finish the prior one.
+            if (group_ts) {
+                Py_CLEAR(pyeol_list);
+                Py_CLEAR(pyattrs);
+                hc_release_words(pyword, pyword_eol);
+                switch_threadstate_back(tsinfo);
+            }
+            // The group's switch and conversion are counted against its
+            // first callback.
+            t0       = stats_now();
+            group_ts = data->threadstate;
+            tsinfo   = switch_threadstate(group_ts);
+            t1       = stats_now();
+            gil_ns   = t1 - t0;
+            group_ok = !hc_build_words(disp->ver, word, word_eol,
+                                       &pyword, &pyword_eol);
+            if (group_ok && attrs) {
+                pyattrs  = PyObject_CallFunction((PyObject *)
+                                                 EventAttrsTypePtr, "L",
+                                             (long long)attrs->server_time_utc);
+                group_ok = (pyattrs != NULL);
+            }
+            if (!group_ok) {
+                PyErr_Print();
+            }
+            conv_ns = stats_now() - t1;
+        }
+        if (!group_ok) {
+            continue;
+        }
+        t0    = stats_now();
+        pyeol = hc_eol_arg(data, pyword_eol, &pyeol_list);
+        if (!pyeol) {
+            PyErr_Print();
+            continue;
+        }
+        // The callback could unhook itself, which frees its data.
+        pycallback = data->callback;
+        pyuserdata = data->userdata;
+        stats      = data->stats;
+        quota      = data->quota;
+        Py_INCREF(pycallback);
+        Py_INCREF(pyuserdata);
+
+        t1       = stats_now();
+        conv_ns += t1 - t0;
+
+        if (pyattrs) {
+            pyret = PyObject_CallFunctionObjArgs(pycallback, pyword, pyeol,
+                                                 pyattrs, pyuserdata, NULL);
+        }
+        else {
+            pyret = PyObject_CallFunctionObjArgs(pycallback, pyword, pyeol,
+                                                 pyuserdata, NULL);
+        }
+        Py_DECREF(pycallback);
+        Py_DECREF(pyuserdata);
+
+        t0      = stats_now();
+        ret     = hc_callback_retval(disp->ver, pyret);
+        retval |= ret;
+        conv_ns += stats_now() - t0;
+
+        // Time waiting on the GIL isn't charged to the plugin.
+        quota_charge(quota, conv_ns + (t0 - t1));
+
+        if (profile) {
+            stats_record(stats, gil_ns, conv_ns, t0 - t1);
+        }
+        gil_ns  = 0;
+        conv_ns = 0;
+    }
+    if (group_ts) {
+        Py_XDECREF(pyeol_list);
+        Py_XDECREF(pyattrs);
+        hc_release_words(pyword, pyword_eol);
+        switch_threadstate_back(tsinfo);
+    }
+    if (--disp->depth == 0) {
+        dispatch_compact(disp);
+    }
+    return retval;
+}
+
+int
+dispatch_print_cb(char *word[], void *userdata)
+{
+    return dispatch_event((Dispatcher *)userdata, word, NULL, NULL);
+}
+
+int
+dispatch_print_attrs_cb(char *word[], hexchat_event_attrs *attrs,
+                        void *userdata)
+{
+    return dispatch_event((Dispatcher *)userdata, word, NULL, attrs);
+}
+
+int
+dispatch_server_cb(char *word[], char *word_eol[], void *userdata)
+{
+    return dispatch_event((Dispatcher *)userdata, word, word_eol, NULL);
+}
+
+int
+dispatch_server_attrs_cb(char *word[], char *word_eol[],
+                         hexchat_event_attrs *attrs, void *userdata)
+{
+    return dispatch_event((Dispatcher *)userdata, word, word_eol, attrs);
+}
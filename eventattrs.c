@@ -75,7 +75,7 @@ static PyTypeObject EventAttrsType = {
 /**
  * Conenient type pointer.
  */
-PyTypeObject *EventAttrsTypePtr = &EventAttrsType;
+PyTypeObject *EventAttrsTypeDef = &EventAttrsType;
 
 /**
  * Constructor.
@@ -131,7 +131,7 @@ void
 EventAttrs_dealloc(EventAttrsObj *self)
 {
     Py_XDECREF(self->server_time_utc);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 /**
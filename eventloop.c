@@ -0,0 +1,521 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * Provides each plugin an asyncio event loop that runs on the HexChat main
+ * thread. The loop is created the first time hexchat.get_event_loop() is
+ * called and is installed as the main thread's event loop for the plugin's
+ * interpreter, so asyncio.get_event_loop() returns it as well. A HexChat
+ * timer runs one iteration of the loop at a time, which lets plugin
+ * coroutines run between HexChat's own events and call the API directly.
+ * The timer is armed for the loop's next ready or scheduled callback, and is
+ * stopped while the loop has nothing to do; scheduling a callback arms it
+ * again.
+ */
+
+#include "minpython.h"
+
+#define EVENTLOOP_DEFAULT_INTERVAL  10
+#define EVENTLOOP_MAX_DELAY         60000   // ms, so the clock is rechecked.
+
+/**
+ * Per-interpreter event loop data.
+ */
+struct _EventLoop {
+    PyObject        *loop;
+    hexchat_hook    *hook;
+    int             interval;
+    int             delay;          // ms the timer in 'hook' was set for.
+    long long       due;            // stats_now() time the timer fires.
+    int             in_tick;        // Nonzero while the loop is run by C.
+    PyThreadState   *threadstate;
+    PluginQuota     *quota;
+};
+
+       EventLoop    *eventloop_create        (PyThreadState *);
+       void         eventloop_destroy        (EventLoop *);
+       PyObject     *py_get_event_loop       (PyObject *, PyObject *,
+                                                          PyObject *);
+static PyObject     *eventloop_new_loop      (EventLoop *);
+static PyObject     *eventloop_wake          (PyObject *, PyObject *);
+static void         eventloop_arm           (EventLoop *);
+static int          eventloop_next_delay     (EventLoop *);
+static int          eventloop_timer_callback (void *);
+static int          eventloop_run_once       (PyObject *);
+static void         eventloop_cancel_tasks   (PyObject *);
+
+/**
+ * Python source for the loop class. Each way of adding work to the loop calls
+ * _mpy_wake() afterwards, so the timer can be armed for it. Other threads
+ * wake the loop through an async Delegate. _mpy_timeout() gives the seconds
+ * until the loop has work, or None if it has none; the self-pipe is always
+ * registered, so any other reader or writer means I/O has to be polled.
+ */
+static const char *eventloop_class_src =
+    "import asyncio\n"
+    "class HexChatEventLoop(asyncio.SelectorEventLoop):\n"
+    "    def __init__(self, wake, wake_threadsafe):\n"
+    "        self._mpy_wake = wake\n"
+    "        self._mpy_wake_threadsafe = wake_threadsafe\n"
+    "        super().__init__()\n"
+    "    def call_soon(self, *args, **kwargs):\n"
+    "        handle = super().call_soon(*args, **kwargs)\n"
+    "        self._mpy_wake()\n"
+    "        return handle\n"
+    "    def call_at(self, *args, **kwargs):\n"
+    "        handle = super().call_at(*args, **kwargs)\n"
+    "        self._mpy_wake()\n"
+    "        return handle\n"
+    "    def call_soon_threadsafe(self, *args, **kwargs):\n"
+    "        handle = super().call_soon_threadsafe(*args, **kwargs)\n"
+    "        self._mpy_wake_threadsafe()\n"
+    "        return handle\n"
+    "    def _add_reader(self, *args, **kwargs):\n"
+    "        handle = super()._add_reader(*args, **kwargs)\n"
+    "        self._mpy_wake()\n"
+    "        return handle\n"
+    "    def _add_writer(self, *args, **kwargs):\n"
+    "        handle = super()._add_writer(*args, **kwargs)\n"
+    "        self._mpy_wake()\n"
+    "        return handle\n"
+    "    def _mpy_timeout(self):\n"
+    "        if self._ready:\n"
+    "            return 0.0\n"
+    "        if self._selector is not None and \\\n"
+    "                len(self._selector.get_map()) > 1:\n"
+    "            return 0.0\n"
+    "        if self._scheduled:\n"
+    "            return max(0.0, self._scheduled[0].when() - self.time())\n"
+    "        return None\n";
+
+/**
+ * The C function behind the loop's _mpy_wake(). Its self is a capsule of the
+ * EventLoop.
+ */
+static PyMethodDef eventloop_wake_def = {
+    "_mpy_wake",    (PyCFunction)eventloop_wake,    METH_NOARGS, NULL
+};
+
+/**
+ * Creates the (empty) event loop data for an interpreter. Nothing is imported
+ * or scheduled until a plugin asks for its loop.
+ * @param ts    - The main threadstate of the interpreter.
+ * @returns - The event loop data, or NULL if out of memory.
+ */
+EventLoop *
+eventloop_create(PyThreadState *ts)
+{
+    EventLoop *evloop;
+
+    evloop = PyMem_RawMalloc(sizeof(EventLoop));
+    if (!evloop) {
+        return NULL;
+    }
+    evloop->loop        = NULL;
+    evloop->hook        = NULL;
+    evloop->interval    = EVENTLOOP_DEFAULT_INTERVAL;
+    evloop->delay       = 0;
+    evloop->due         = 0;
+    evloop->in_tick     = 0;
+    evloop->threadstate = ts;
+    evloop->quota       = quota_get(ts);
+
+    return evloop;
+}
+
+/**
+ * Stops the loop's timer, cancels its remaining tasks, and closes it. Must be
+ * called on the main thread with the loop's interp current.
+ * @param evloop    - The event loop data to free.
+ */
+void
+eventloop_destroy(EventLoop *evloop)
+{
+    PyObject *pyret;
+
+    if (!evloop) {
+        return;
+    }
+    if (evloop->hook) {
+        hexchat_unhook(ph, evloop->hook);
+        evloop->hook = NULL;
+    }
+    // Nothing scheduled from here on may arm the timer again.
+    evloop->in_tick = 1;
+
+    if (evloop->loop) {
+        pyret = PyObject_CallMethod(evloop->loop, "is_running", NULL);
+
+        if (pyret == Py_False) {
+            // Give cancelled tasks one iteration to clean up before closing.
+            eventloop_cancel_tasks(evloop->loop);
+            eventloop_run_once(evloop->loop);
+
+            Py_XDECREF(PyObject_CallMethod(evloop->loop, "close", NULL));
+        }
+        Py_XDECREF(pyret);
+
+        if (PyErr_Occurred()) {
+            PyErr_Print();
+        }
+        Py_DECREF(evloop->loop);
+    }
+    PyMem_RawFree(evloop);
+}
+
+/**
+ * Implements hexchat.get_event_loop(). Returns the plugin's event loop,
+ * creating it on the first call.
+ * @param args  - 'interval', optional number of milliseconds between loop
+ *                iterations.
+ * @returns - The asyncio event loop, or NULL with error state set.
+ */
+PyObject *
+py_get_event_loop(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    EventLoop   *evloop;
+    PyObject    *pyasyncio;
+    PyObject    *pyloop;
+    PyObject    *pyret;
+    int         interval    = 0;
+    static char *keywords[] = { "interval", NULL };
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:get_event_loop",
+                                     keywords, &interval)) {
+        return NULL;
+    }
+    if (interval < 0) {
+        PyErr_SetString(PyExc_ValueError, 
+                        "interval must be a positive number of milliseconds.");
+        return NULL;
+    }
+    evloop = interp_get_event_loop();
+    if (!evloop) {
+        return NULL;
+    }
+    if (!evloop->loop) {
+        pyasyncio = PyImport_ImportModule("asyncio"); // NR.
+        if (!pyasyncio) {
+            return NULL;
+        }
+        // The selector loop is used on all platforms. The Proactor loop's
+        // signal handling setup doesn't work in subinterpreters.
+        pyloop = eventloop_new_loop(evloop);
+        if (!pyloop) {
+            Py_DECREF(pyasyncio);
+            return NULL;
+        }
+        pyret = PyObject_CallMethod(pyasyncio, "set_event_loop", "O", pyloop);
+
+        Py_DECREF(pyasyncio);
+
+        if (!pyret) {
+            Py_DECREF(pyloop);
+            return NULL;
+        }
+        Py_DECREF(pyret);
+
+        evloop->loop = pyloop;
+    }
+    if (interval && interval != evloop->interval && evloop->hook) {
+        hexchat_unhook(ph, evloop->hook);
+        evloop->hook = NULL;
+    }
+    if (interval) {
+        evloop->interval = interval;
+    }
+    // Arm the timer for anything scheduled before the loop was created.
+    eventloop_arm(evloop);
+
+    Py_INCREF(evloop->loop);
+    return evloop->loop;
+}
+
+/**
+ * Creates the HexChatEventLoop of an interp. Must be called with the interp
+ * current.
+ * @param evloop    - The interp's event loop data.
+ * @returns - A new reference to the loop, or NULL with error state set.
+ */
+PyObject *
+eventloop_new_loop(EventLoop *evloop)
+{
+    PyObject    *pyns;
+    PyObject    *pyret;
+    PyObject    *pycap;
+    PyObject    *pywake;
+    PyObject    *pywake_ts  = NULL;
+    PyObject    *pyloop     = NULL;
+
+    pycap  = PyCapsule_New(evloop, "eventloop", NULL);
+    pywake = pycap ? PyCFunction_New(&eventloop_wake_def, pycap) : NULL;
+    Py_XDECREF(pycap);
+
+    if (!pywake) {
+        return NULL;
+    }
+    pywake_ts = PyObject_CallFunction((PyObject *)DelegateTypePtr, "Oi",
+                                      pywake, 1);
+    pyns      = pywake_ts ? PyDict_New() : NULL;
+    pyret     = pyns ? PyRun_String(eventloop_class_src, Py_file_input,
+                                    pyns, pyns) : NULL;
+    if (pyret) {
+        pyloop = PyObject_CallMethod(pyns, "__getitem__", "s",
+                                     "HexChatEventLoop");
+        if (pyloop) {
+            Py_SETREF(pyloop, PyObject_CallFunction(pyloop, "OO",
+                                                    pywake, pywake_ts));
+        }
+        Py_DECREF(pyret);
+    }
+    Py_XDECREF(pyns);
+    Py_XDECREF(pywake_ts);
+    Py_DECREF(pywake);
+
+    return pyloop;
+}
+
+/**
+ * Implements the loop's _mpy_wake(). Always called on the main thread.
+ * @param self  - A capsule of the EventLoop.
+ * @returns - None, or NULL with error state set.
+ */
+PyObject *
+eventloop_wake(PyObject *self, PyObject *unused)
+{
+    EventLoop *evloop;
+
+    evloop = PyCapsule_GetPointer(self, "eventloop");
+    if (!evloop) {
+        return NULL;
+    }
+    eventloop_arm(evloop);
+    Py_RETURN_NONE;
+}
+
+/**
+ * Arms the timer if the loop has work due sooner than the timer fires. Does
+ * nothing while the loop is run by eventloop_timer_callback(), which sets the
+ * timer itself once the iteration is done. Must be called with the loop's
+ * interp current.
+ * @param evloop    - The event loop data.
+ */
+void
+eventloop_arm(EventLoop *evloop)
+{
+    long long   due;
+    int         delay;
+
+    // The loop isn't set until it's constructed; the constructor registers
+    // the self-pipe.
+    if (evloop->in_tick || !evloop->loop) {
+        return;
+    }
+    delay = eventloop_next_delay(evloop);
+    due   = stats_now() + delay * 1000000LL;
+
+    if (delay < 0 || (evloop->hook && evloop->due <= due)) {
+        return;
+    }
+    if (evloop->hook) {
+        hexchat_unhook(ph, evloop->hook);
+    }
+    evloop->hook  = hexchat_hook_timer(ph, delay, eventloop_timer_callback,
+                                       evloop);
+    evloop->delay = delay;
+    evloop->due   = due;
+}
+
+/**
+ * Gets how long the timer should wait before running the loop again: the
+ * loop's interval if it has callbacks ready or I/O to poll, or the time until
+ * its next scheduled callback, whichever is longer. Must be called with the
+ * loop's interp current.
+ * @param evloop    - The event loop data.
+ * @returns - The delay in ms, or -1 if the loop is idle.
+ */
+int
+eventloop_next_delay(EventLoop *evloop)
+{
+    PyObject    *pyret;
+    double      ms;
+
+    pyret = PyObject_CallMethod(evloop->loop, "_mpy_timeout", NULL);
+    if (!pyret) {
+        // Keep the loop running rather than lose its callbacks.
+        PyErr_Print();
+        return evloop->interval;
+    }
+    if (pyret == Py_None) {
+        Py_DECREF(pyret);
+        return -1;
+    }
+    ms = PyFloat_AsDouble(pyret) * 1000.0;
+    Py_DECREF(pyret);
+
+    if (ms >= EVENTLOOP_MAX_DELAY) {
+        return EVENTLOOP_MAX_DELAY;
+    }
+    if (ms <= evloop->interval) {
+        return evloop->interval;
+    }
+    // Round up, so the callback is due when the timer fires.
+    return (int)ms + ((double)(int)ms < ms);
+}
+
+/**
+ * HexChat timer callback that runs one iteration of an interp's event loop,
+ * then sets the timer for the loop's next work.
+ * @param userdata  - The EventLoop data.
+ * @returns - 1 to keep the timer if its delay is still right, or 0 once it's
+ *            been replaced or the loop is idle.
+ */
+int
+eventloop_timer_callback(void *userdata)
+{
+    EventLoop       *evloop = (EventLoop *)userdata;
+    SwitchTSInfo    tsinfo;
+    long long       t0;
+    int             delay;
+
+    // Loop ticks are paused like timers while the plugin is over its quota.
+    if (quota_blocked(evloop->quota, 1)) {
+        return 1;
+    }
+    tsinfo = switch_threadstate(evloop->threadstate);
+    t0     = stats_now();
+
+    evloop->in_tick = 1;
+
+    if (eventloop_run_once(evloop->loop)) {
+        PyErr_Print();
+    }
+    evloop->in_tick = 0;
+
+    delay = eventloop_next_delay(evloop);
+    t0    = stats_now() - t0;
+
+    switch_threadstate_back(tsinfo);
+    quota_charge(evloop->quota, t0);
+
+    evloop->due = stats_now() + delay * 1000000LL;
+
+    // The timer is gone if the loop's interval was changed while it ran.
+    if (evloop->hook && delay == evloop->delay) {
+        return 1;
+    }
+    // HexChat removes this timer when 0 is returned.
+    evloop->hook  = (delay < 0) ? NULL :
+                    hexchat_hook_timer(ph, delay, eventloop_timer_callback,
+                                       evloop);
+    evloop->delay = delay;
+
+    return 0;
+}
+
+/**
+ * Runs a single iteration of the loop: everything that's ready is run, and
+ * I/O is polled without blocking. This is the documented
+ * `loop.call_soon(loop.stop); loop.run_forever()` idiom. Does nothing if the
+ * loop is already running further up the stack.
+ * @param pyloop    - The asyncio loop.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+eventloop_run_once(PyObject *pyloop)
+{
+    PyObject *pyret;
+    PyObject *pystop;
+    int      running;
+
+    pyret = PyObject_CallMethod(pyloop, "is_running", NULL);
+    if (!pyret) {
+        return -1;
+    }
+    running = PyObject_IsTrue(pyret);
+    Py_DECREF(pyret);
+
+    if (running) {
+        return 0;
+    }
+    pystop = PyObject_GetAttrString(pyloop, "stop");
+    if (!pystop) {
+        return -1;
+    }
+    pyret = PyObject_CallMethod(pyloop, "call_soon", "O", pystop);
+    Py_DECREF(pystop);
+    if (!pyret) {
+        return -1;
+    }
+    Py_DECREF(pyret);
+
+    pyret = PyObject_CallMethod(pyloop, "run_forever", NULL);
+    if (!pyret) {
+        return -1;
+    }
+    Py_DECREF(pyret);
+    return 0;
+}
+
+/**
+ * Cancels all tasks of the loop that haven't finished.
+ * @param pyloop    - The asyncio loop.
+ */
+void
+eventloop_cancel_tasks(PyObject *pyloop)
+{
+    PyObject    *pyasyncio;
+    PyObject    *pytasks;
+    PyObject    *pyiter;
+    PyObject    *pytask;
+
+    pyasyncio = PyImport_ImportModule("asyncio");
+    if (!pyasyncio) {
+        PyErr_Print();
+        return;
+    }
+    pytasks = PyObject_CallMethod(pyasyncio, "all_tasks", "O", pyloop);
+    Py_DECREF(pyasyncio);
+
+    if (!pytasks) {
+        // asyncio.all_tasks() was added in 3.7.
+        PyErr_Clear();
+        return;
+    }
+    pyiter = PyObject_GetIter(pytasks);
+    Py_DECREF(pytasks);
+
+    while (pyiter && (pytask = PyIter_Next(pyiter)) != NULL) {
+        Py_XDECREF(PyObject_CallMethod(pytask, "cancel", NULL));
+        Py_DECREF(pytask);
+    }
+    Py_XDECREF(pyiter);
+
+    if (PyErr_Occurred()) {
+        PyErr_Print();
+    }
+}
@@ -0,0 +1,432 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * Hook filters are declarative predicates passed to hook_print() and
+ * hook_server() as `filter=`. They're converted to C when the hook is created
+ * and evaluated by the dispatcher against HexChat's raw word arrays, so the
+ * interpreter isn't entered at all for events its callback would ignore.
+ *
+ * A filter is either a compiled regular expression, which is searched for in
+ * the raw line (server hooks only), or a dict whose items must all match:
+ *
+ *  'word[N]'       - str, re pattern, or a collection of str. Strings are
+ *                    compared with hexchat.nickcmp() (the server's casemapping),
+ *                    a collection matches if any of its strings does.
+ *  'word_eol[N]'   - Same as 'word[N]', applied to word_eol (server hooks).
+ *  'prefix'        - str, tuple of str, or re pattern; matches the start of
+ *                    word[1] with any leading ':' removed (ASCII case is
+ *                    ignored). For PRIVMSG this is 'nick!user@host'.
+ *
+ * Patterns are compiled with GLib's GRegex (PCRE), so Python-only regex syntax
+ * isn't supported; the IGNORECASE, MULTILINE, DOTALL and VERBOSE flags are.
+ * Patterns are searched for anywhere in the string, as with re.search().
+ */
+
+#include <glib.h>
+#include "minpython.h"
+
+/**
+ * word[] arrays from HexChat have this many entries, with unused ones set
+ * to "".
+ */
+#define FILTER_MAX_WORDS    32
+
+#define RE_IGNORECASE       2
+#define RE_MULTILINE        8
+#define RE_DOTALL           16
+#define RE_VERBOSE          64
+
+typedef enum { FLT_WORD, FLT_WORD_EOL, FLT_PREFIX } FLT_KIND;
+
+/**
+ * One item of a filter. Either 'strs' or 'regex' is set.
+ */
+typedef struct {
+    FLT_KIND    kind;
+    int         index;
+    char        **strs;
+    int         nstrs;
+    GRegex      *regex;
+} FilterClause;
+
+struct _HookFilter {
+    int             nclauses;
+    FilterClause    clauses[1];
+};
+
+       HookFilter   *hookfilter_new         (CB_VER, PyObject *);
+       void         hookfilter_free         (HookFilter *);
+       int          hookfilter_match        (HookFilter *, char *[], char *[]);
+static int          hookfilter_parse_key    (CB_VER, PyObject *, FilterClause *);
+static int          hookfilter_parse_value  (PyObject *, FilterClause *);
+static int          hookfilter_is_pattern   (PyObject *);
+static GRegex       *hookfilter_compile     (PyObject *);
+static int          hookfilter_clause_match (FilterClause *, char *[],
+                                             char *[]);
+
+/**
+ * Converts a Python filter spec to its C form.
+ * @param ver       - The type of hook the filter is for.
+ * @param pyfilter  - The `filter` argument of the hook function.
+ * @returns - A new filter, or NULL with error state set.
+ */
+HookFilter *
+hookfilter_new(CB_VER ver, PyObject *pyfilter)
+{
+    HookFilter  *filter;
+    PyObject    *pykey;
+    PyObject    *pyvalue;
+    Py_ssize_t  pos = 0;
+    Py_ssize_t  size;
+
+    if (hookfilter_is_pattern(pyfilter)) {
+        size = 1;
+    }
+    else if (PyDict_Check(pyfilter)) {
+        size = PyDict_Size(pyfilter);
+        if (size == 0) {
+            PyErr_SetString(PyExc_ValueError, "filter can't be empty.");
+            return NULL;
+        }
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError,
+                        "filter must be a dict or a compiled regex.");
+        return NULL;
+    }
+    filter = PyMem_RawCalloc(1, sizeof(HookFilter) +
+                                (size - 1) * sizeof(FilterClause));
+    if (!filter) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (!PyDict_Check(pyfilter)) {
+        // A bare pattern is searched for in the whole line.
+        if (!(ver & (CBV_SRV | CBV_SRV_ATTR))) {
+            PyErr_SetString(PyExc_ValueError,
+                            "A regex filter for print events must be given "
+                            "for a word, as in {'word[2]': pattern}.");
+            PyMem_RawFree(filter);
+            return NULL;
+        }
+        filter->nclauses          = 1;
+        filter->clauses[0].kind   = FLT_WORD_EOL;
+        filter->clauses[0].index  = 1;
+
+        if (hookfilter_parse_value(pyfilter, &filter->clauses[0])) {
+            hookfilter_free(filter);
+            return NULL;
+        }
+        return filter;
+    }
+    while (PyDict_Next(pyfilter, &pos, &pykey, &pyvalue)) {
+        // nclauses counts the clauses that need freeing.
+        if (hookfilter_parse_key(ver, pykey,
+                                 &filter->clauses[filter->nclauses]) ||
+            hookfilter_parse_value(pyvalue,
+                                   &filter->clauses[filter->nclauses++])) {
+            hookfilter_free(filter);
+            return NULL;
+        }
+    }
+    return filter;
+}
+
+/**
+ * Frees a filter. NULL is ignored.
+ */
+void
+hookfilter_free(HookFilter *filter)
+{
+    FilterClause    *clause;
+    int             i;
+    int             j;
+
+    if (!filter) {
+        return;
+    }
+    for (i = 0; i < filter->nclauses; i++) {
+        clause = &filter->clauses[i];
+
+        for (j = 0; j < clause->nstrs; j++) {
+            PyMem_RawFree(clause->strs[j]);
+        }
+        PyMem_RawFree(clause->strs);
+
+        if (clause->regex) {
+            g_regex_unref(clause->regex);
+        }
+    }
+    PyMem_RawFree(filter);
+}
+
+/**
+ * Evaluates a filter against an event's words. Doesn't need the GIL. Must be
+ * called on the main thread from within the event's callback, as the word
+ * comparisons use the current context's server.
+ * @param filter    - The filter.
+ * @param word      - HexChat's word[] array.
+ * @param word_eol  - HexChat's word_eol[] array, or NULL for print events.
+ * @returns - 1 if all of the filter's items match, 0 otherwise.
+ */
+int
+hookfilter_match(HookFilter *filter, char *word[], char *word_eol[])
+{
+    int i;
+
+    for (i = 0; i < filter->nclauses; i++) {
+        if (!hookfilter_clause_match(&filter->clauses[i], word, word_eol)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Parses a filter dict key: 'word[N]', 'word_eol[N]', or 'prefix'.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+hookfilter_parse_key(CB_VER ver, PyObject *pykey, FilterClause *clause)
+{
+    const char  *key;
+    char        close;
+    int         index;
+
+    key = PyUnicode_Check(pykey) ? PyUnicode_AsUTF8(pykey) : NULL;
+    if (!key) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_TypeError, "filter keys must be strings.");
+        return -1;
+    }
+    if (!strcmp(key, "prefix")) {
+        clause->kind  = FLT_PREFIX;
+        clause->index = 1;
+        return 0;
+    }
+    if (sscanf(key, "word[%d%c", &index, &close) == 2 && close == ']') {
+        clause->kind = FLT_WORD;
+    }
+    else if (sscanf(key, "word_eol[%d%c", &index, &close) == 2 &&
+             close == ']') {
+        if (!(ver & (CBV_SRV | CBV_SRV_ATTR))) {
+            PyErr_SetString(PyExc_ValueError,
+                            "Print events have no word_eol to filter on.");
+            return -1;
+        }
+        clause->kind = FLT_WORD_EOL;
+    }
+    else {
+        PyErr_Format(PyExc_ValueError,
+                     "Unknown filter key '%s'. Keys can be 'word[N]', "
+                     "'word_eol[N]', or 'prefix'.", key);
+        return -1;
+    }
+    if (index < 1 || index >= FILTER_MAX_WORDS) {
+        PyErr_Format(PyExc_ValueError,
+                     "Filter key '%s' must have an index from 1 to %d.",
+                     key, FILTER_MAX_WORDS - 1);
+        return -1;
+    }
+    clause->index = index;
+    return 0;
+}
+
+/**
+ * Parses a filter dict value (or a bare pattern): a str, a compiled regex, or
+ * a collection of str.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+hookfilter_parse_value(PyObject *pyvalue, FilterClause *clause)
+{
+    PyObject    *pyseq;
+    PyObject    *pyitem;
+    const char  *str;
+    Py_ssize_t  size;
+    Py_ssize_t  len;
+    Py_ssize_t  i;
+
+    if (hookfilter_is_pattern(pyvalue)) {
+        clause->regex = hookfilter_compile(pyvalue);
+        return clause->regex ? 0 : -1;
+    }
+    if (PyUnicode_Check(pyvalue)) {
+        pyseq = PyTuple_Pack(1, pyvalue);
+    }
+    else if (clause->kind == FLT_PREFIX && !PyTuple_Check(pyvalue)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "The 'prefix' filter must be a str, a tuple of str, "
+                        "or a compiled regex.");
+        return -1;
+    }
+    else {
+        pyseq = PySequence_Fast(pyvalue,
+                                "filter values must be a str, a collection of "
+                                "str, or a compiled regex.");
+    }
+    if (!pyseq) {
+        return -1;
+    }
+    size = PySequence_Fast_GET_SIZE(pyseq);
+
+    clause->strs = PyMem_RawCalloc(size ? size : 1, sizeof(char *));
+    if (!clause->strs) {
+        Py_DECREF(pyseq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        pyitem = PySequence_Fast_GET_ITEM(pyseq, i); // BR.
+
+        str = PyUnicode_Check(pyitem)
+            ? PyUnicode_AsUTF8AndSize(pyitem, &len) : NULL;
+
+        if (!str) {
+            Py_DECREF(pyseq);
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError,
+                                "filter collections must contain only str.");
+            }
+            return -1;
+        }
+        clause->strs[i] = PyMem_RawMalloc(len + 1);
+        if (!clause->strs[i]) {
+            Py_DECREF(pyseq);
+            PyErr_NoMemory();
+            return -1;
+        }
+        memcpy(clause->strs[i], str, len + 1);
+        clause->nstrs++;
+    }
+    Py_DECREF(pyseq);
+    return 0;
+}
+
+/**
+ * Returns 1 if the object is a compiled regular expression (str-typed).
+ */
+int
+hookfilter_is_pattern(PyObject *pyobj)
+{
+    PyObject    *pypattern;
+    int         result;
+
+    if (PyUnicode_Check(pyobj) || PyDict_Check(pyobj)) {
+        return 0;
+    }
+    pypattern = PyObject_GetAttrString(pyobj, "pattern");
+    if (!pypattern) {
+        PyErr_Clear();
+        return 0;
+    }
+    result = PyUnicode_Check(pypattern) &&
+             PyObject_HasAttrString(pyobj, "flags") &&
+             PyObject_HasAttrString(pyobj, "search");
+
+    Py_DECREF(pypattern);
+    return result;
+}
+
+/**
+ * Compiles a Python regex's pattern string with GRegex.
+ * @returns - The compiled GRegex, or NULL with error state set.
+ */
+GRegex *
+hookfilter_compile(PyObject *pypattern)
+{
+    PyObject            *pystr;
+    PyObject            *pyflags;
+    long                flags;
+    GRegexCompileFlags  gflags  = G_REGEX_OPTIMIZE;
+    GRegex              *regex;
+    GError              *error  = NULL;
+
+    pystr   = PyObject_GetAttrString(pypattern, "pattern");  // NR.
+    pyflags = PyObject_GetAttrString(pypattern, "flags");    // NR.
+
+    if (!pystr || !pyflags) {
+        Py_XDECREF(pystr);
+        Py_XDECREF(pyflags);
+        return NULL;
+    }
+    flags = PyLong_AsLong(pyflags);
+    Py_DECREF(pyflags);
+
+    if (flags == -1 && PyErr_Occurred()) {
+        Py_DECREF(pystr);
+        return NULL;
+    }
+    if (flags & RE_IGNORECASE) gflags |= G_REGEX_CASELESS;
+    if (flags & RE_MULTILINE)  gflags |= G_REGEX_MULTILINE;
+    if (flags & RE_DOTALL)     gflags |= G_REGEX_DOTALL;
+    if (flags & RE_VERBOSE)    gflags |= G_REGEX_EXTENDED;
+
+    regex = g_regex_new(PyUnicode_AsUTF8(pystr), gflags, 0, &error);
+
+    if (!regex) {
+        PyErr_Format(PyExc_ValueError, "Can't compile filter pattern %R: %s",
+                     pystr, error->message);
+        g_error_free(error);
+    }
+    Py_DECREF(pystr);
+    return regex;
+}
+
+/**
+ * Evaluates one filter item.
+ * @returns - 1 on a match, 0 otherwise.
+ */
+int
+hookfilter_clause_match(FilterClause *clause, char *word[], char *word_eol[])
+{
+    const char  *str;
+    size_t      len;
+    int         i;
+
+    str = (clause->kind == FLT_WORD_EOL) ? word_eol[clause->index]
+                                         : word[clause->index];
+    if (!str) {
+        return 0;
+    }
+    if (clause->kind == FLT_PREFIX && *str == ':') {
+        str++;
+    }
+    if (clause->regex) {
+        return g_regex_match(clause->regex, str, 0, NULL) ? 1 : 0;
+    }
+    for (i = 0; i < clause->nstrs; i++) {
+        if (clause->kind == FLT_PREFIX) {
+            len = strlen(clause->strs[i]);
+            if (!g_ascii_strncasecmp(str, clause->strs[i], len)) {
+                return 1;
+            }
+        }
+        else if (!hexchat_nickcmp(ph, str, clause->strs[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -25,6 +25,14 @@
 /**
  * InterpCall objects execute callables in a specific (sub)interprer's
  * environment.
+ *
+ * This file also holds the marshalling used whenever a value crosses from one
+ * interp to another through an InterpCall or InterpObjProxy. None, the
+ * primitives, and plain containers of them are passed by value; anything else
+ * is passed as a proxy that executes in the interp that owns the object. The
+ * owning interp caches the proxies it hands out, so its most recently proxied
+ * objects stay alive until they're pushed out of the cache or the interp is
+ * deleted.
  */
 
 #include "minpython.h"
@@ -45,6 +53,27 @@ static void     InterpCall_dealloc   (InterpCallObj *);
 static PyObject *InterpCall_call     (InterpCallObj *, PyObject *, PyObject *);
 static PyObject *InterpCall_repr     (InterpCallObj *, PyObject *);
 
+       PyObject *interp_marshal      (PyObject *, int);
+       int      interp_marshal_args  (PyObject *, PyObject *,
+                                      int, PyObject **, PyObject **);
+       int      interp_is_value      (PyObject *);
+
+static int      marshal_is_value     (PyObject *, int);
+static PyObject *marshal_copy        (PyObject *);
+static PyObject *marshal_proxy       (PyObject *, int);
+
+/**
+ * Containers nested deeper than this are passed by proxy.
+ */
+#define MARSHAL_MAX_DEPTH   8
+
+/**
+ * Number of proxies each interp keeps for reuse. Each cached proxy keeps its
+ * object alive, so the cache is bounded; the least recently used entry is
+ * dropped when it's full.
+ */
+#define MARSHAL_CACHE_SIZE  256
+
 
 /**
  * Type declaration/instance.
@@ -66,7 +95,7 @@ static PyTypeObject InterpCallType = {
 /**
  * Convenient type pointer.
  */
-PyTypeObject *InterpCallTypePtr = &InterpCallType;
+PyTypeObject *InterpCallTypeDef = &InterpCallType;
 
 
 int
@@ -114,69 +143,30 @@ InterpCall_dealloc(InterpCallObj *self)
 {
     Py_XDECREF(self->callable);
     Py_XDECREF(self->tscap);
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    interp_free_object((PyObject *)self);
 }
 
 
 PyObject *
 InterpCall_call(InterpCallObj *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject     *pyret;
-    PyObject     *pytmp;
-    PyObject     *pyexc_type    = NULL;
-    PyObject     *pyexc         = NULL;
-    PyObject     *pytraceback   = NULL;
-    PyObject     *pytup;
-    PyObject     *pydict        = NULL;
-    PyObject     *pykey;
-    PyObject     *pyobj;
-    Py_ssize_t   i, j, len;
-    SwitchTSInfo tsinfo;
-
-    // Wrap callables and non basic types in a proxy that executes in the
-    // caller's context.
-    len    = PyObject_Length(args);
-    pytup  = PyTuple_New(len);
-
-    for (i = 0; i < len; i++) {
-        pyobj = PyTuple_GetItem(args, i); // BR.
-        if (PyObject_IsInstance(pyobj, (PyObject *)InterpCallTypePtr)     ||
-            PyObject_IsInstance(pyobj, (PyObject *)InterpObjProxyTypePtr) ||
-            interp_is_primitive(pyobj)) {
-            Py_INCREF(pyobj);
-        }
-        else if (PyCallable_Check(pyobj)) {
-            pyobj = PyObject_CallFunction((PyObject *)InterpCallTypePtr,
-                                          "O", pyobj);
-        }
-        else {
-            pyobj = PyObject_CallFunction((PyObject *)InterpObjProxyTypePtr,
-                                          "O", pyobj);
-        }
-        PyTuple_SetItem(pytup, i, pyobj);
+    PyObject      *pyret;
+    PyObject      *pytmp;
+    PyObject      *pyexc_type    = NULL;
+    PyObject      *pyexc         = NULL;
+    PyObject      *pytraceback   = NULL;
+    PyObject      *pytup;
+    PyObject      *pydict;
+    SwitchTSInfo  tsinfo;
+
+    if (interp_check_shared_gil(self->threadstate)) {
+        return NULL;
     }
-    if (kwargs) {
-        len    = PyDict_Size(kwargs);
-        pydict = PyDict_New();
-        for (i = 0; i < len; i++) {
-            PyDict_Next(kwargs, &j, &pykey, &pyobj);
 
-            if (PyObject_IsInstance(pyobj, (PyObject *)InterpCallTypePtr)     ||
-                PyObject_IsInstance(pyobj, (PyObject *)InterpObjProxyTypePtr) ||
-                interp_is_primitive(pyobj)) {
-                Py_INCREF(pyobj);
-            }
-            else if (PyCallable_Check(pyobj)) {
-                pyobj = PyObject_CallFunction((PyObject *)InterpCallTypePtr,
-                                              "O", pyobj);
-            }
-            else {
-                pyobj = PyObject_CallFunction((PyObject *)InterpObjProxyTypePtr,
-                                              "O", pyobj);
-            }
-            PyDict_SetItem(pydict, pykey, pyobj);
-            Py_DECREF(pyobj);
-        }
+    // Pass the arguments by value where possible, otherwise as proxies that
+    // execute in the caller's context.
+    if (interp_marshal_args(args, kwargs, 1, &pytup, &pydict)) {
+        return NULL;
     }
 
     // Switch to target interpreter.
@@ -185,6 +175,13 @@ InterpCall_call(InterpCallObj *self, PyObject *args, PyObject *kwargs)
     // Invoke call.
     pyret = PyObject_Call(self->callable, pytup, pydict);
 
+    if (pyret) {
+        // Marshal the return value while its interp is current so its proxy
+        // comes from the target's cache.
+        pytmp = interp_marshal(pyret, 1);
+        Py_DECREF(pyret);
+        pyret = pytmp;
+    }
     if (!pyret) {
         // If error, capture exception data, clearing it in the target interp.
         PyErr_Fetch(&pyexc_type, &pyexc, &pytraceback);
@@ -202,23 +199,6 @@ InterpCall_call(InterpCallObj *self, PyObject *args, PyObject *kwargs)
         // If error, restore the exception in the calling interp.
         PyErr_Restore(pyexc_type, pyexc, pytraceback);
     }
-    else if (pyret == Py_None) {
-        // Do Nothing.
-    }
-    else if (PyCallable_Check(pyret)) {
-        pytmp = PyObject_CallFunction((PyObject *)InterpCallTypePtr,
-                                      "OO", pyret, self->tscap);
-        Py_DECREF(pyret);
-        pyret = pytmp;
-    }
-    else {
-        if (!interp_is_primitive(pyret)) {
-            pytmp = PyObject_CallFunction((PyObject *)InterpObjProxyTypePtr,
-                                          "OO", pyret, self->tscap);
-            Py_DECREF(pyret);
-            pyret = pytmp;
-        }
-    }
 
     return pyret;
 }
@@ -238,11 +218,318 @@ InterpCall_repr(InterpCallObj *self, PyObject *Py_UNUSED(args))
     return pyrepr;
 }
 
+/**
+ * Prepares an object of the current interp for use by another interp.
+ * Existing proxies are passed as they are. None, the primitives, and exact
+ * tuples, lists, dicts, and frozensets of them are passed by value - mutable
+ * containers are copied so the receiver can't change the sender's data
+ * without a proxy. Anything else is wrapped in a proxy that switches back to
+ * the current interp when it's used. Proxies are cached by marshal_proxy(),
+ * which keeps the last MARSHAL_CACHE_SIZE proxied objects alive after the
+ * caller drops them.
+ * @param obj       - The object to marshal.
+ * @param callables - Nonzero to wrap callables in an InterpCall rather than
+ *                    an InterpObjProxy.
+ * @returns - A new reference to the value to hand over, or NULL on failure
+ *            with error state set.
+ */
+PyObject *
+interp_marshal(PyObject *obj, int callables)
+{
+    if (Py_TYPE(obj) == InterpCallTypePtr ||
+        Py_TYPE(obj) == InterpObjProxyTypePtr) {
+        Py_INCREF(obj);
+        return obj;
+    }
+    if (marshal_is_value(obj, 0)) {
+        return marshal_copy(obj);
+    }
+    return marshal_proxy(obj, callables);
+}
+
+/**
+ * Marshals the positional and keyword arguments of a call into another
+ * interp. If none of the positional arguments need converting, the args tuple
+ * itself is reused.
+ * @param args      - The positional arguments tuple.
+ * @param kwargs    - The keyword arguments dict, or NULL.
+ * @param callables - As for interp_marshal().
+ * @param pytup     - Receives a new reference to the marshalled args.
+ * @param pydict    - Receives a new reference to the marshalled kwargs, or
+ *                    NULL if there are none.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+interp_marshal_args(PyObject *args, PyObject *kwargs, int callables,
+                    PyObject **pytup, PyObject **pydict)
+{
+    PyObject    *pynewtup = NULL;
+    PyObject    *pynewdict;
+    PyObject    *pyobj;
+    PyObject    *pyval;
+    PyObject    *pykey;
+    Py_ssize_t  i, j, len;
+
+    len = PyTuple_GET_SIZE(args);
+
+    for (i = 0; i < len; i++) {
+        pyobj = PyTuple_GET_ITEM(args, i);
+        pyval = interp_marshal(pyobj, callables);
+        if (!pyval) {
+            goto error;
+        }
+        if (!pynewtup && pyval == pyobj) {
+            // Nothing's been converted so far.
+            Py_DECREF(pyval);
+            continue;
+        }
+        if (!pynewtup) {
+            if (!(pynewtup = PyTuple_New(len))) {
+                Py_DECREF(pyval);
+                goto error;
+            }
+            for (j = 0; j < i; j++) {
+                pyobj = PyTuple_GET_ITEM(args, j);
+                Py_INCREF(pyobj);
+                PyTuple_SET_ITEM(pynewtup, j, pyobj);
+            }
+        }
+        PyTuple_SET_ITEM(pynewtup, i, pyval);
+    }
+    if (!pynewtup) {
+        Py_INCREF(args);
+        pynewtup = args;
+    }
+
+    pynewdict = NULL;
+
+    if (kwargs && PyDict_GET_SIZE(kwargs)) {
+        if (!(pynewdict = PyDict_New())) {
+            goto error;
+        }
+        i = 0;
+        while (PyDict_Next(kwargs, &i, &pykey, &pyobj)) {
+            pyval = interp_marshal(pyobj, callables);
+            if (!pyval || PyDict_SetItem(pynewdict, pykey, pyval)) {
+                Py_XDECREF(pyval);
+                Py_DECREF(pynewdict);
+                goto error;
+            }
+            Py_DECREF(pyval);
+        }
+    }
+    *pytup  = pynewtup;
+    *pydict = pynewdict;
 
+    return 0;
 
+error:
+    Py_XDECREF(pynewtup);
+    return -1;
+}
 
+/**
+ * Returns 1 if an object can be passed to another interp by value; see
+ * marshal_is_value(). Otherwise returns 0.
+ */
+int
+interp_is_value(PyObject *obj)
+{
+    return marshal_is_value(obj, 0);
+}
 
+/**
+ * Determines whether an object can go to another interp by value: it's None,
+ * a primitive, or an exact tuple, list, dict, or frozenset holding only such
+ * values. Subclasses, like namedtuples, don't qualify.
+ * @param obj   - The object to check.
+ * @param depth - The nesting depth of obj.
+ * @returns - 1 if obj can be passed by value, 0 if not.
+ */
+int
+marshal_is_value(PyObject *obj, int depth)
+{
+    PyObject    *pyiter;
+    PyObject    *pykey;
+    PyObject    *pyval;
+    Py_ssize_t  i, len;
+    int         ret = 1;
+
+    if (obj == Py_None || interp_is_primitive(obj)) {
+        return 1;
+    }
+    if (depth >= MARSHAL_MAX_DEPTH) {
+        return 0;
+    }
+    if (PyTuple_CheckExact(obj) || PyList_CheckExact(obj)) {
+        len = PySequence_Fast_GET_SIZE(obj);
+        for (i = 0; i < len; i++) {
+            if (!marshal_is_value(PySequence_Fast_GET_ITEM(obj, i),
+                                  depth + 1)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (PyDict_CheckExact(obj)) {
+        i = 0;
+        while (PyDict_Next(obj, &i, &pykey, &pyval)) {
+            if (!marshal_is_value(pykey, depth + 1) ||
+                !marshal_is_value(pyval, depth + 1)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (PyFrozenSet_CheckExact(obj)) {
+        if (!(pyiter = PyObject_GetIter(obj))) {
+            PyErr_Clear();
+            return 0;
+        }
+        while (ret && (pyval = PyIter_Next(pyiter))) {
+            ret = marshal_is_value(pyval, depth + 1);
+            Py_DECREF(pyval);
+        }
+        Py_DECREF(pyiter);
+        return ret;
+    }
+    return 0;
+}
 
+/**
+ * Copies a value that marshal_is_value() accepted. Lists and dicts are
+ * copied; tuples are only rebuilt if they hold a list or dict. Everything
+ * else is immutable and is shared.
+ * @returns - A new reference, or NULL on failure with error state set.
+ */
+PyObject *
+marshal_copy(PyObject *obj)
+{
+    PyObject    *pycopy;
+    PyObject    *pyitem;
+    PyObject    *pykey;
+    PyObject    *pyval;
+    Py_ssize_t  i, len;
+    int         same = 1;
+
+    if (PyList_CheckExact(obj)) {
+        len = PyList_GET_SIZE(obj);
+        if (!(pycopy = PyList_New(len))) {
+            return NULL;
+        }
+        for (i = 0; i < len; i++) {
+            if (!(pyitem = marshal_copy(PyList_GET_ITEM(obj, i)))) {
+                Py_DECREF(pycopy);
+                return NULL;
+            }
+            PyList_SET_ITEM(pycopy, i, pyitem);
+        }
+        return pycopy;
+    }
+    if (PyDict_CheckExact(obj)) {
+        if (!(pycopy = PyDict_New())) {
+            return NULL;
+        }
+        i = 0;
+        while (PyDict_Next(obj, &i, &pykey, &pyval)) {
+            // Keys are hashable, so they're immutable already.
+            if (!(pyitem = marshal_copy(pyval)) ||
+                PyDict_SetItem(pycopy, pykey, pyitem)) {
+                Py_XDECREF(pyitem);
+                Py_DECREF(pycopy);
+                return NULL;
+            }
+            Py_DECREF(pyitem);
+        }
+        return pycopy;
+    }
+    if (PyTuple_CheckExact(obj)) {
+        len = PyTuple_GET_SIZE(obj);
+        if (!(pycopy = PyTuple_New(len))) {
+            return NULL;
+        }
+        for (i = 0; i < len; i++) {
+            pyval = PyTuple_GET_ITEM(obj, i);
+            if (!(pyitem = marshal_copy(pyval))) {
+                Py_DECREF(pycopy);
+                return NULL;
+            }
+            same &= (pyitem == pyval);
+            PyTuple_SET_ITEM(pycopy, i, pyitem);
+        }
+        if (!same) {
+            return pycopy;
+        }
+        Py_DECREF(pycopy);
+    }
+    Py_INCREF(obj);
+    return obj;
+}
 
+/**
+ * Returns a proxy for an object of the current interp, to be used by another
+ * interp. A proxy only refers to the interp it was made in, so proxies are
+ * cached per object and shared by all receivers; passing the same object
+ * repeatedly doesn't create a new proxy each time. The cache keeps the last
+ * MARSHAL_CACHE_SIZE proxied objects alive, until they're pushed out or the
+ * interp is deleted.
+ * @returns - A new reference to the proxy, or NULL on failure with error
+ *            state set.
+ */
+PyObject *
+marshal_proxy(PyObject *obj, int callables)
+{
+    PyObject    *pycache = interp_get_proxy_cache(); // BR.
+    PyObject    *pytype;
+    PyObject    *pykey;
+    PyObject    *pyproxy;
+    PyObject    *pytscap;
+    PyObject    *pyoldest;
+    PyObject    *pyignored;
+    Py_ssize_t  pos = 0;
+
+    callables = callables && PyCallable_Check(obj);
+
+    // The cached proxy holds a reference to obj, so its address can't be
+    // reused while the entry exists.
+    pykey = Py_BuildValue("(Ni)", PyLong_FromVoidPtr(obj), callables);
+    if (!pykey) {
+        return NULL;
+    }
+    if (pycache && (pyproxy = PyDict_GetItemWithError(pycache, pykey))) {
+        // Move the entry to the end, keeping the dict in LRU order.
+        Py_INCREF(pyproxy);
+        if (PyDict_DelItem(pycache, pykey) ||
+            PyDict_SetItem(pycache, pykey, pyproxy)) {
+            PyErr_Clear();
+        }
+        Py_DECREF(pykey);
+        return pyproxy;
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(pykey);
+        return NULL;
+    }
 
+    pytype  = callables ? (PyObject *)InterpCallTypePtr
+                        : (PyObject *)InterpObjProxyTypePtr;
+    pytscap = PyCapsule_New(PyThreadState_Get(), "interp", NULL);
+    pyproxy = pytscap ? PyObject_CallFunction(pytype, "OO", obj, pytscap)
+                      : NULL;
+    Py_XDECREF(pytscap);
+
+    if (pyproxy && pycache) {
+        if (PyDict_GET_SIZE(pycache) >= MARSHAL_CACHE_SIZE &&
+                PyDict_Next(pycache, &pos, &pyoldest, &pyignored)) {
+            Py_INCREF(pyoldest);
+            PyDict_DelItem(pycache, pyoldest);
+            Py_DECREF(pyoldest);
+        }
+        if (PyDict_SetItem(pycache, pykey, pyproxy)) {
+            PyErr_Clear();
+        }
+    }
+    Py_DECREF(pykey);
 
+    return pyproxy;
+}
@@ -123,7 +123,7 @@ static PyTypeObject InterpObjProxyType = {
 /**
  * Convenience pointer to the type.
  */
-PyTypeObject *InterpObjProxyTypePtr = &InterpObjProxyType;
+PyTypeObject *InterpObjProxyTypeDef = &InterpObjProxyType;
 
 /**
  * Constructor.
@@ -178,7 +178,7 @@ InterpObjProxy_dealloc(InterpObjProxyObj *self)
     Py_XDECREF(self->cache);
     Py_XDECREF(self->obj);
     Py_XDECREF(self->tscap);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 /**
@@ -221,6 +221,10 @@ InterpObjProxy_getattro(InterpObjProxyObj *self, PyObject *pyname)
     }
     PyErr_Clear();
 
+    if (interp_check_shared_gil(self->threadstate)) {
+        return NULL;
+    }
+
     tsinfo = switch_threadstate(self->threadstate);
 
     // Get the attribute from the wrapped object.
@@ -303,6 +307,10 @@ InterpObjProxy_setattro(InterpObjProxyObj *self, PyObject *name,
 
         // TODO - Wrap nonprimitives in proxy.
 
+        if (interp_check_shared_gil(self->threadstate)) {
+            return -1;
+        }
+
         tsinfo = switch_threadstate(self->threadstate);
 
         ret = PyObject_SetAttr(self->obj, name, value);
@@ -415,52 +423,23 @@ InterpObjProxy_hash(InterpObjProxyObj *self)
 PyObject *
 InterpObjProxy_call(InterpObjProxyObj *self, PyObject *args, PyObject *kwargs)
 {
-    PyObject     *pyret;
-    PyObject     *pytmp;
-    PyObject     *pyexc_type    = NULL;
-    PyObject     *pyexc         = NULL;
-    PyObject     *pytraceback   = NULL;
-    PyObject     *pytup;
-    PyObject     *pydict        = NULL;
-    PyObject     *pykey;
-    PyObject     *pyobj;
-    Py_ssize_t   i, j, len;
-    SwitchTSInfo tsinfo;
-
-    // Wrap callables and non basic types in a proxy that executes in the
-    // caller's context.
-    len    = PyObject_Length(args);
-    pytup  = PyTuple_New(len);
-
-    for (i = 0; i < len; i++) {
-        pyobj = PyTuple_GetItem(args, i); // BR.
-        if (PyObject_IsInstance(pyobj, (PyObject *)InterpObjProxyTypePtr) ||
-            interp_is_primitive(pyobj)) {
-            Py_INCREF(pyobj);
-        }
-        else {
-            pyobj = PyObject_CallFunction((PyObject *)InterpObjProxyTypePtr,
-                                          "O", pyobj);
-        }
-        PyTuple_SetItem(pytup, i, pyobj);
+    PyObject      *pyret;
+    PyObject      *pytmp;
+    PyObject      *pyexc_type    = NULL;
+    PyObject      *pyexc         = NULL;
+    PyObject      *pytraceback   = NULL;
+    PyObject      *pytup;
+    PyObject      *pydict;
+    SwitchTSInfo  tsinfo;
+
+    if (interp_check_shared_gil(self->threadstate)) {
+        return NULL;
     }
-    if (kwargs) {
-        len    = PyDict_Size(kwargs);
-        pydict = PyDict_New();
-        for (i = 0; i < len; i++) {
-            PyDict_Next(kwargs, &j, &pykey, &pyobj);
-
-            if (PyObject_IsInstance(pyobj, (PyObject *)InterpObjProxyTypePtr) ||
-                interp_is_primitive(pyobj)) {
-                Py_INCREF(pyobj);
-            }
-            else {
-                pyobj = PyObject_CallFunction((PyObject *)InterpObjProxyTypePtr,
-                                              "O", pyobj);
-            }
-            PyDict_SetItem(pydict, pykey, pyobj);
-            Py_DECREF(pyobj);
-        }
+
+    // Pass the arguments by value where possible, otherwise as proxies that
+    // execute in the caller's context.
+    if (interp_marshal_args(args, kwargs, 0, &pytup, &pydict)) {
+        return NULL;
     }
 
     // Switch to target interpreter.
@@ -469,6 +448,11 @@ InterpObjProxy_call(InterpObjProxyObj *self, PyObject *args, PyObject *kwargs)
     // Invoke call.
     pyret = PyObject_Call(self->obj, pytup, pydict);
 
+    if (pyret) {
+        pytmp = interp_marshal(pyret, 0);
+        Py_DECREF(pyret);
+        pyret = pytmp;
+    }
     if (!pyret) {
         // If error, capture exception data, clearing it in the target interp.
         PyErr_Fetch(&pyexc_type, &pyexc, &pytraceback);
@@ -486,25 +470,6 @@ InterpObjProxy_call(InterpObjProxyObj *self, PyObject *args, PyObject *kwargs)
         // If error, restore the exception in the calling interp.
         PyErr_Restore(pyexc_type, pyexc, pytraceback);
     }
-    else if (pyret == Py_None) {
-        // Do Nothing.
-    }
-    /*
-    else if (PyCallable_Check(pyret)) {
-        pytmp = PyObject_CallFunction((PyObject *)InterpCallTypePtr,
-                                      "OO", pyret, self->tscap);
-        Py_DECREF(pyret);
-        pyret = pytmp;
-    }
-    */
-    else {
-        if (!interp_is_primitive(pyret)) {
-            pytmp = PyObject_CallFunction((PyObject *)InterpObjProxyTypePtr,
-                                          "OO", pyret, self->tscap);
-            Py_DECREF(pyret);
-            pyret = pytmp;
-        }
-    }
 
     return pyret;
 }
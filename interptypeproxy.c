@@ -107,7 +107,7 @@ InterpTypeProxy_init(InterpTypeProxyObj *self, PyObject *args, PyObject *kwargs)
 void
 InterpTypeProxy_dealloc(InterpTypeProxyObj *self)
 {
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 PyObject *
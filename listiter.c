@@ -38,11 +38,13 @@
  */
 typedef struct {
     PyObject_HEAD
-    PyObject        *xlist_name;
-    PyObject        *field_names;
-    PyObject        *type_dict;
-    hexchat_list    *xlist_ptr;
-    int             nitem;
+    PyObject            *xlist_name;
+    PyObject            *field_names;
+    PyObject            *index_dict;    // Field name -> index in 'fields'.
+    const char          *list_name;
+    const char *const   *fields;        // From hexchat_list_fields().
+    hexchat_list        *xlist_ptr;
+    int                 nitem;
 } ListIterObj;
 
 static int      ListIter_init           (ListIterObj *, PyObject *, PyObject *);
@@ -51,6 +53,8 @@ static PyObject *ListIter_next          (ListIterObj *);
 static PyObject *ListIter_iter          (ListIterObj *);
 static PyObject *ListIter_getattro      (ListIterObj *, PyObject *);
 static PyObject *ListIter_dir           (ListIterObj *);
+static PyObject *ListIter_fetch         (ListIterObj *, PyObject *);
+static PyObject *ListIter_field         (ListIterObj *, PyObject *);
 
 static PyObject *ListIter_get_list_name     (ListIterObj *, void *);
 static PyObject *ListIter_get_field_names   (ListIterObj *, void *);
@@ -58,6 +62,17 @@ static PyObject *ListIter_get_field_names   (ListIterObj *, void *);
 static PyObject *get_lists_info             (ListIterObj *);
 static void     listiter_create_lists_info_dict(void);
 
+       PyObject *listiter_snapshot          (const char *, int);
+static PyObject *listiter_row_type          (const char *, const char *const *,
+                                             int);
+static PyObject *listiter_field_value       (hexchat_list *, const char *,
+                                             const char *, char);
+
+/**
+ * The most fields any HexChat list has is well under this.
+ */
+#define LISTITER_MAX_FIELDS 64
+
 /**
  * ListIter methods.
  */
@@ -66,6 +81,10 @@ static PyMethodDef ListIter_methods[] = {
      "Returns attributes of ListIter, which include the field names of the "
      "list."},
 
+    {"fetch",     (PyCFunction)ListIter_fetch,    METH_VARARGS,
+     "Returns a tuple of the given fields of the current item, or of all its "
+     "fields if none are given."},
+
     {NULL}
 };
 
@@ -106,7 +125,7 @@ static PyTypeObject ListIterType = {
 /**
  * ListIter convenience ptr.
  */
-PyTypeObject *ListIterTypePtr = &ListIterType;
+PyTypeObject *ListIterTypeDef = &ListIterType;
 
 /**
  * Constructor.
@@ -124,7 +143,8 @@ ListIter_init(ListIterObj *self, PyObject *args, PyObject *Py_UNUSED(kwargs))
     PyObject        *pyfield_info;
 
     self->xlist_ptr  = NULL;
-    self->xlist_name = self->field_names, self->type_dict = NULL;
+    self->xlist_name = self->field_names = self->index_dict = NULL;
+    self->nitem      = 0;
 
     if (!PyArg_ParseTuple(args, "U:init", &pyname)) {
         self->xlist_ptr = NULL;
@@ -156,11 +176,13 @@ ListIter_init(ListIterObj *self, PyObject *args, PyObject *Py_UNUSED(kwargs))
     
     self->xlist_name  = pyname;
     self->field_names = PyTuple_GetItem(pyfield_info, 0);
-    self->type_dict   = PyTuple_GetItem(pyfield_info, 1);
+    self->index_dict  = PyTuple_GetItem(pyfield_info, 1);
+    self->list_name   = name;
+    self->fields      = hexchat_list_fields(ph, name);
     
     Py_INCREF(self->xlist_name);
     Py_INCREF(self->field_names);
-    Py_INCREF(self->type_dict);
+    Py_INCREF(self->index_dict);
 
     Py_DECREF(pylists_info);
 
@@ -178,8 +200,8 @@ ListIter_dealloc(ListIterObj *self)
     }
     Py_XDECREF(self->xlist_name);
     Py_XDECREF(self->field_names);
-    Py_XDECREF(self->type_dict);
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    Py_XDECREF(self->index_dict);
+    interp_free_object((PyObject *)self);
 }
 
 /**
@@ -209,124 +231,86 @@ ListIter_iter(ListIterObj *self)
 
 /** 
  * Looks up attributes of ListIter objects and returns them. This is similar 
- * to the __getattr__() method of Python classes.
+ * to the __getattr__() method of Python classes. List fields are looked up
+ * first - none of them share a name with the type's own attributes - so
+ * reading a field doesn't raise and clear an AttributeError.
  * @param pyname - The name of the attribute to look up.
  * @returns The attribute requested.
  */
 PyObject *
 ListIter_getattro(ListIterObj *self, PyObject *pyname)
 {
-    PyObject        *pyattr_type;
-    char            attr_type;
-    PyObject        *pyretval;
-    int             ival;
-    const char      *sval;
-    PyObject        *pybytes;
-    time_t          tval;
-    void            *pval;
-    hexchat_list    *xlist;
-    const char      *attr_name;
-    const char      *list_name;
-    PyObject        *pycap;
-    
-    // See if the requested attribute is defined elsewhere first.
-    if ((pyretval = PyObject_GenericGetAttr((PyObject *)self, pyname))) {
-        return pyretval;
+    if (self->index_dict && PyDict_GetItem(self->index_dict, pyname)) {
+        return ListIter_field(self, pyname);
     }
-    // An AttributeError is expected if the attribute isn't one of the generics.
+    return PyObject_GenericGetAttr((PyObject *)self, pyname);
+}
+
+/**
+ * Implements ListIter.fetch(*fields).
+ * @param args  - Names of fields. If empty, all fields are returned.
+ * @returns - A tuple of the field values of the current item, or NULL with
+ *            error state set.
+ */
+PyObject *
+ListIter_fetch(ListIterObj *self, PyObject *args)
+{
+    PyObject    *pynames;
+    PyObject    *pyret;
+    PyObject    *pyvalue;
+    Py_ssize_t  size;
+    Py_ssize_t  i;
+
+    pynames = (PyTuple_GET_SIZE(args) > 0) ? args : self->field_names;
+    size    = PyTuple_GET_SIZE(pynames);
+    pyret   = PyTuple_New(size);
 
-    // If the error is an AttributeError, dismiss it; otherwise, return NULL to 
-    // propagate the error.
-    if (!PyErr_ExceptionMatches(PyExc_AttributeError)) {
+    if (!pyret) {
         return NULL;
     }
-    PyErr_Clear();
+    for (i = 0; i < size; i++) {
+        pyvalue = ListIter_field(self, PyTuple_GET_ITEM(pynames, i));
+        if (!pyvalue) {
+            Py_DECREF(pyret);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pyret, i, pyvalue); // Steals ref.
+    }
+    return pyret;
+}
 
-    // Get the list name and the attribute name and its type. Use these to 
-    // retrieve the value.
-    
-    attr_name   = PyUnicode_AsUTF8(pyname);
-    list_name   = PyUnicode_AsUTF8(self->xlist_name);
-    pyattr_type = PyDict_GetItem(self->type_dict, pyname); // Borrowed ref.
+/**
+ * Reads a field of the item the iterator is positioned on.
+ * @param pyname    - The field name.
+ * @returns - The field's value, or NULL with error state set.
+ */
+PyObject *
+ListIter_field(ListIterObj *self, PyObject *pyname)
+{
+    PyObject    *pyindex;
+    const char  *field;
+    Py_ssize_t  index;
 
-    if (!pyattr_type) {
+    pyindex = self->index_dict ? PyDict_GetItem(self->index_dict, pyname)
+                               : NULL; // BR.
+    if (!pyindex) {
         PyErr_Format(PyExc_AttributeError, 
-                     "Unknown field (<%s-list-item>.%s).", 
-                     list_name, attr_name);
+                     "Unknown field (<%s-list-item>.%S).", 
+                     self->list_name, pyname);
         return NULL;
     }
-
     if (self->nitem == 0) {
         PyErr_SetString(PyExc_RuntimeError,
             "next(<list-iterator>) must be invoked before accessing item "
             "attributes.");
         return NULL;
     }
+    index = PyLong_AsSsize_t(pyindex);
+    field = self->fields[index];
 
-    attr_type   = (char)PyLong_AsLong(pyattr_type);
-    xlist       = self->xlist_ptr;
-    
-    switch (attr_type)
-    {
-        case 's' : // string. 
-            sval = hexchat_list_str(ph, xlist, attr_name);
-            if (sval) {
-                // Occasionally, I've seen UTF-8 data come through this route
-                // with unknown characters. This is why the native string is 
-                // put in a bytes object first, then decoded with "replace". 
-                // Otherwise, an exception could be thrown which wouldn't be
-                // the fault of the plugins. Undecodable data will be replaced 
-                // with '\U0000fffd' (a badge with a question mark in it).
-                pybytes  = PyBytes_FromString(sval);
-                pyretval = PyUnicode_FromEncodedObject(pybytes, "utf-8", 
-                                                                "replace");
-                Py_DECREF(pybytes);
-            }
-            else {
-                pyretval = PyUnicode_FromString("");
-            }
-            break;
-        case 'i' : // int. 
-            ival     = hexchat_list_int(ph, xlist, attr_name);
-            pyretval = PyLong_FromLong(ival);
-            break;
-        case 'p' : // pointer.
-            if (!strcmp("channels", list_name) && 
-                !strcmp("context", attr_name)) {
-                // Currently channels.context is the only list field that 
-                // is a void pointer type.
-                pval = (void *)hexchat_list_str(ph, xlist, attr_name);
-                if (pval) {
-                    pycap = PyCapsule_New(pval, "context", NULL);
-                    pyretval = PyObject_CallFunction(
-                                    (PyObject *)ContextTypePtr,
-                                    "OOO", Py_None, Py_None, pycap);
-                    Py_DECREF(pycap);
-                }
-                else {
-                    pyretval = Py_None;
-                    Py_INCREF(pyretval);
-                }
-            }
-            else {
-                PyErr_Format(PyExc_RuntimeError, 
-                             "Pointer type requested for <%s-list-item>.%s "
-                             "unsupported.",
-                             list_name, attr_name);
-                return NULL;
-            }
-            break;
-        case 't' : // time.
-            tval     = hexchat_list_time(ph, xlist, attr_name);
-            pyretval = PyLong_FromLongLong((long long)tval);
-            break;
-        default : // unknown.
-            PyErr_Format(PyExc_RuntimeError, 
-                         "Unsupported field type(%c) for <%s-list-item>.%s", 
-                         attr_type, list_name, attr_name);
-            return NULL;
-    }
-    return pyretval;
+    // The first character of the field name indicates the data type.
+    return listiter_field_value(self->xlist_ptr, self->list_name, &field[1],
+                                field[0]);
 }
 
 /**
@@ -379,7 +363,10 @@ PyObject *ListIter_dir(ListIterObj *self)
 * The dictionary is of the form:
 *
 *     { "<list-name>" : (  (<field-name>, ... ),
-*                          { "<field-name>" : <type>, ... }  ), ... }
+*                          { "<field-name>" : <index>, ... }  ), ... }
+*
+* where <index> is the field's position in the array returned by
+* hexchat_list_fields(), whose entries also give the field types.
 */
 void
 listiter_create_lists_info_dict()
@@ -391,7 +378,7 @@ listiter_create_lists_info_dict()
     int                 llen;
     int                 i, j;
     PyObject            *pyfname;
-    PyObject            *pyftype;
+    PyObject            *pyfindex;
     const char *const   *list_fields;
     const char          *list_types[] = { "channels", "dcc", "ignore", "notify",
                                           "users", NULL };
@@ -405,20 +392,18 @@ listiter_create_lists_info_dict()
         list_fields = hexchat_list_fields(ph, list_types[i]);
         pyfield_dict = PyDict_New();
 
-        // Populate the field-type-dict - keyed on field name with data type 
-        // values.
+        // Populate the field-index-dict - keyed on field name with the
+        // field's index.
         llen = 0;
         for (j = 0; list_fields[j] != NULL; j++, llen++) {
 
             // The field name starts after the first character.
             pyfname = PyUnicode_FromString(&list_fields[j][1]);
+            pyfindex = PyLong_FromLong(j);
 
-            // The first character of the field name indicates the data type.
-            pyftype = PyLong_FromUnsignedLong((unsigned long)
-                                              list_fields[j][0]);
-            PyDict_SetItem(pyfield_dict, pyfname, pyftype);
+            PyDict_SetItem(pyfield_dict, pyfname, pyfindex);
             Py_DECREF(pyfname);
-            Py_DECREF(pyftype);
+            Py_DECREF(pyfindex);
         }
 
         // Construct the list of field names.
@@ -433,7 +418,7 @@ listiter_create_lists_info_dict()
         PyTuple_SetItem(pylist_info, 1, pyfield_dict);
 
         // Build the type dictionary. Format of the structure:
-        //    <list-name> : (<field-names>, <field-type-dict>)
+        //    <list-name> : (<field-names>, <field-index-dict>)
         PyDict_SetItemString(pytype_dict,
                              list_types[i],
                              pylist_info);
@@ -473,3 +458,209 @@ get_lists_info(ListIterObj *self)
 
 
 
+
+/**
+ * Takes a snapshot of a HexChat list for hexchat.get_list(). Fields are read
+ * directly with hexchat_list_str/int/time() using the types given by
+ * hexchat_list_fields(), and rows are built as instances of a namedtuple type
+ * that's created once per list name per interpreter.
+ * @param name      - The name of the list.
+ * @param columns   - If non-zero, a dict of lists keyed on field name is
+ *                    returned instead of a list of rows.
+ * @returns - A new list or dict, or NULL with error state set.
+ */
+PyObject *
+listiter_snapshot(const char *name, int columns)
+{
+    hexchat_list        *xlist;
+    const char *const   *fields;
+    PyObject            *pyrow_type;
+    PyObject            *pyresult;
+    PyObject            *pycols[LISTITER_MAX_FIELDS];
+    PyObject            *pyrow;
+    PyObject            *pyvalue;
+    int                 nfields;
+    int                 i;
+    int                 ok      = 1;
+
+    fields = hexchat_list_fields(ph, name);
+    xlist  = fields ? hexchat_list_get(ph, name) : NULL;
+
+    if (!xlist) {
+        PyErr_Format(PyExc_RuntimeError, "Bad list type requested (%s).", 
+                     name);
+        return NULL;
+    }
+    for (nfields = 0; fields[nfields]; nfields++);
+
+    if (nfields > LISTITER_MAX_FIELDS) {
+        // Can't happen with any current version of HexChat.
+        nfields = LISTITER_MAX_FIELDS;
+    }
+    if (columns) {
+        pyresult   = PyDict_New();
+        pyrow_type = NULL;
+
+        for (i = 0; i < nfields && pyresult; i++) {
+            // The first character of the field name indicates the data type.
+            pycols[i] = PyList_New(0);
+            if (!pycols[i] || 
+                PyDict_SetItemString(pyresult, &fields[i][1], pycols[i])) {
+                Py_XDECREF(pycols[i]);
+                Py_CLEAR(pyresult);
+                break;
+            }
+            Py_DECREF(pycols[i]); // The dict holds the ref.
+        }
+    }
+    else {
+        pyresult   = PyList_New(0);
+        pyrow_type = listiter_row_type(name, fields, nfields); // BR.
+    }
+    if (!pyresult || (!columns && !pyrow_type)) {
+        Py_XDECREF(pyresult);
+        hexchat_list_free(ph, xlist);
+        return NULL;
+    }
+    while (ok && hexchat_list_next(ph, xlist)) {
+        if (columns) {
+            for (i = 0; i < nfields && ok; i++) {
+                pyvalue = listiter_field_value(xlist, name, &fields[i][1],
+                                               fields[i][0]);
+                ok = pyvalue && !PyList_Append(pycols[i], pyvalue);
+                Py_XDECREF(pyvalue);
+            }
+            continue;
+        }
+        // namedtuple types are tuple subclasses without extra storage, so
+        // the row can be filled in directly, as tuple.__new__() does.
+        pyrow = ((PyTypeObject *)pyrow_type)->tp_alloc(
+                                        (PyTypeObject *)pyrow_type, nfields);
+        if (!pyrow) {
+            ok = 0;
+            break;
+        }
+        for (i = 0; i < nfields && ok; i++) {
+            pyvalue = listiter_field_value(xlist, name, &fields[i][1],
+                                           fields[i][0]);
+            if (pyvalue) {
+                PyTuple_SET_ITEM(pyrow, i, pyvalue); // Steals ref.
+            }
+            else {
+                ok = 0;
+            }
+        }
+        ok = ok && !PyList_Append(pyresult, pyrow);
+        Py_DECREF(pyrow);
+    }
+    hexchat_list_free(ph, xlist);
+
+    if (!ok) {
+        Py_DECREF(pyresult);
+        return NULL;
+    }
+    return pyresult;
+}
+
+/**
+ * Returns the namedtuple type for the items of a list, creating it the first
+ * time it's requested in the current interpreter.
+ * @returns - A borrowed reference to the type, or NULL with error state set.
+ */
+PyObject *
+listiter_row_type(const char *name, const char *const *fields, int nfields)
+{
+    PyObject    *pytypes;
+    PyObject    *pytype;
+    PyObject    *pyconstr;
+    PyObject    *pynames;
+    PyObject    *pytype_name;
+    int         i;
+
+    pytypes = interp_get_list_row_types(); // BR.
+    if (!pytypes) {
+        PyErr_SetString(PyExc_RuntimeError, 
+                        "get_list() isn't available in this interpreter.");
+        return NULL;
+    }
+    pytype = PyDict_GetItemString(pytypes, name); // BR.
+    if (pytype) {
+        return pytype;
+    }
+    pynames = PyTuple_New(nfields);
+    if (!pynames) {
+        return NULL;
+    }
+    for (i = 0; i < nfields; i++) {
+        PyTuple_SET_ITEM(pynames, i, PyUnicode_FromString(&fields[i][1]));
+    }
+    pyconstr    = interp_get_namedtuple_constr(); // BR.
+    pytype_name = PyUnicode_FromFormat("%s_item", name);
+    pytype      = PyObject_CallFunction(pyconstr, "OO", pytype_name, pynames);
+
+    Py_DECREF(pytype_name);
+    Py_DECREF(pynames);
+
+    if (!pytype) {
+        return NULL;
+    }
+    if (!PyType_Check(pytype) || 
+        !PyType_IsSubtype((PyTypeObject *)pytype, &PyTuple_Type)) {
+        PyErr_SetString(PyExc_TypeError, 
+                        "namedtuple() didn't return a tuple type.");
+        Py_DECREF(pytype);
+        return NULL;
+    }
+    if (PyDict_SetItemString(pytypes, name, pytype)) {
+        Py_DECREF(pytype);
+        return NULL;
+    }
+    Py_DECREF(pytype); // The cache holds the ref.
+    return pytype;
+}
+
+/**
+ * Reads one field of the list's current item.
+ * @param xlist - The list, positioned on an item.
+ * @param name  - The list name.
+ * @param field - The field name.
+ * @param type  - The field type ('s', 'i', 't', or 'p').
+ * @returns - A new reference to the value, or NULL with error state set.
+ */
+PyObject *
+listiter_field_value(hexchat_list *xlist, const char *name, const char *field,
+                     char type)
+{
+    const char  *sval;
+    void        *pval;
+
+    switch (type) {
+    case 's':
+        sval = hexchat_list_str(ph, xlist, field);
+        // Occasionally UTF-8 data with unknown characters comes through
+        // this route. It's decoded with "replace" so undecodable bytes
+        // become '\U0000fffd' instead of raising an exception that
+        // wouldn't be the fault of the plugins.
+        return sval ? PyUnicode_DecodeUTF8(sval, strlen(sval), "replace")
+                    : PyUnicode_FromString("");
+    case 'i':
+        return PyLong_FromLong(hexchat_list_int(ph, xlist, field));
+    case 't':
+        return PyLong_FromLongLong((long long)hexchat_list_time(ph, xlist,
+                                                                field));
+    case 'p':
+        // Currently channels.context is the only list field that is a void
+        // pointer type.
+        pval = (!strcmp("channels", name) && !strcmp("context", field))
+             ? (void *)hexchat_list_str(ph, xlist, field) : NULL;
+        if (!pval) {
+            Py_RETURN_NONE;
+        }
+        return context_intern((hexchat_context *)pval);
+    default:
+        PyErr_Format(PyExc_RuntimeError, 
+                     "Unsupported field type(%c) for <%s-list-item>.%s", 
+                     type, name, field);
+        return NULL;
+    }
+}
@@ -91,7 +91,7 @@ static PyTypeObject MainInterpType = {
 /**
  * Convenient type pointer.
  */
-PyTypeObject *MainInterpTypePtr = &MainInterpType;
+PyTypeObject *MainInterpTypeDef = &MainInterpType;
 
 /**
  * Always returns the singleton instance of the main interp object.
@@ -99,6 +99,9 @@ PyTypeObject *MainInterpTypePtr = &MainInterpType;
 PyObject *
 MainInterp_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
+    if (interp_check_shared_gil(NULL)) {
+        return NULL;
+    }
     if (!main_interp) {
         // tp_alloc() sets refcount to 1.
         main_interp = (MainInterpObj *)type->tp_alloc(type, 0);
@@ -138,7 +141,7 @@ MainInterp_init(MainInterpObj *self, PyObject *args, PyObject *kwargs)
 void
 MainInterp_dealloc(MainInterpObj *self)
 {
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    interp_free_object((PyObject *)self);
 }
 
 PyObject *
@@ -38,33 +38,17 @@
 hexchat_plugin  *ph;
 
 
-/** 
- * CallbackData - Used as userdata for commands/events hooked on behalf of 
- * Python callbacks.
- */
-typedef struct {
-    PyObject      *callback;
-    PyObject      *userdata;
-    PyThreadState *threadstate;
-    hexchat_hook  *hook;
-} CallbackData;
-
-/**
- * Types of hooks/callbacks - used by code that processes events and registers
- * callbacks.
- */
-typedef enum {
-    CBV_PRNT      = (1 << 0), CBV_SRV      = (1 << 1), 
-    CBV_PRNT_ATTR = (1 << 2), CBV_SRV_ATTR = (1 << 3), 
-    CBV_CMD       = (1 << 4), CBV_TIMER    = (1 << 5)
-} CB_VER;
-
 /** @defgroup forwarddecls
  *  @{
  */
 // Python hexchat module commands.
 static PyObject *py_command                (PyObject *, PyObject *);
 static PyObject *py_prnt                   (PyObject *, PyObject *);
+static PyObject *py_command_many           (PyObject *, PyObject *);
+static PyObject *py_prnt_many              (PyObject *, PyObject *);
+static PyObject *run_many                  (PyObject *, const char *,
+                                            void (*)(hexchat_plugin *,
+                                                     const char *));
        PyObject *py_emit_print             (PyObject *, PyObject *, PyObject *);
 static PyObject *py_emit_print_attrs       (PyObject *, PyObject *, PyObject *);
 static PyObject *py_send_modes             (PyObject *, PyObject *, PyObject *);
@@ -74,7 +58,8 @@ static PyObject *py_event_attrs_create     (PyObject *, PyObject *);
        PyObject *py_get_info               (PyObject *, PyObject *);
 static PyObject *py_get_prefs              (PyObject *, PyObject *, PyObject *);
        PyObject *py_get_listiter           (PyObject *, PyObject *);
-       PyObject *py_get_list               (PyObject *, PyObject *);
+       PyObject *py_get_list               (PyObject *, PyObject *,
+                                            PyObject *);
 static PyObject *py_list_fields            (PyObject *, PyObject *);
 
 static PyObject *py_hook_command           (PyObject *, PyObject *, PyObject *);
@@ -94,8 +79,14 @@ static PyObject *py_set_context            (PyObject *, PyObject *);
 static PyObject *py_set_pluginpref         (PyObject *, PyObject *);
 static PyObject *py_get_pluginpref         (PyObject *, PyObject *);
 static PyObject *py_del_pluginpref         (PyObject *, PyObject *);
+static PyObject *py_set_pluginprefs        (PyObject *, PyObject *);
+static PyObject *pluginpref_key            (PyObject *);
+static PyObject *py_get_pluginprefs        (PyObject *, PyObject *);
 static PyObject *py_list_pluginpref        (PyObject *, PyObject *);
 
+static PyObject *py_set_delegate_budget    (PyObject *, PyObject *);
+       PyObject *py_get_event_loop         (PyObject *, PyObject *, PyObject *);
+
 // Capsule pointer freeing functions.
        void     py_attrs_free_fn           (PyObject *);
 //static void     py_list_free_fn            (PyObject *);
@@ -107,15 +98,20 @@ static int      mpy_callback               (char *[], char *[], void *);
 
 // HexChat callbacks that wrap Python callbacks...
 static int      hc_command_callback        (char *[], char *[], void *);
-static int      hc_print_callback          (char *[], void *);
-static int      hc_print_attrs_callback    (char *[], 
-                                            hexchat_event_attrs *, void *);
-static int      hc_server_callback         (char *[], char *[], void *);
-static int      hc_server_attrs_callback   (char *[], char *[], 
-                                            hexchat_event_attrs *, void *);
 static int      hc_timer_callback          (void *);
 static int      hc_all_callback_inner      (CB_VER, char *[], char *[], 
                                             hexchat_event_attrs *, void *);
+static void     hc_unhook                  (CallbackData *);
+void            hc_unhook_all              (void);
+static HookStats *hc_hook_stats            (CB_VER, const char *, PyObject *);
+
+// Shared with dispatch.c.
+       int      hc_build_words             (CB_VER, char *[], char *[],
+                                            PyObject **, PyObject **);
+       PyObject *hc_eol_arg                (CallbackData *, PyObject *,
+                                            PyObject **);
+       void     hc_release_words           (PyObject *, PyObject *);
+       int      hc_callback_retval         (CB_VER, PyObject *);
 
 /** @} */ /* end forwarddecls */
 
@@ -129,6 +125,18 @@ static PyMethodDef hexchat_methods[] = {
     {"prnt",         (PyCFunction)py_prnt,         METH_VARARGS,
      "Prints message to the active HexChat window."},
 
+    {"command_many", (PyCFunction)py_command_many, METH_VARARGS,
+     "Executes each command in an iterable of (context, command) pairs. The "
+     "context can be a Context, a channel name on the current server, or "
+     "None for the current context. Returns a list with False for each "
+     "command whose context wasn't found. From other threads, use "
+     "hexchat.asynchronous.command_many() to send the whole batch to the "
+     "main thread at once."},
+
+    {"prnt_many",    (PyCFunction)py_prnt_many,    METH_VARARGS,
+     "Prints each message in an iterable of (context, message) pairs. "
+     "Contexts are as for command_many()."},
+
     {"emit_print",   (PyCFunction)py_emit_print,   METH_VARARGS | METH_KEYWORDS,
      "Generates a print event with the given arguments."},
      
@@ -158,6 +166,11 @@ static PyMethodDef hexchat_methods[] = {
     {"get_info",     (PyCFunction)py_get_info,     METH_VARARGS,
      "Returns information based on your current context."},
 
+    {"get_stats",    (PyCFunction)py_get_stats,    METH_NOARGS,
+     "Returns the hook statistics gathered while /MPY STATS is on: a dict "
+     "with 'enabled', 'plugins' (the totals of each plugin), and 'hooks' (a "
+     "list of dicts for each hooked name, the most time consuming first)."},
+
     {"get_prefs",    (PyCFunction)py_get_prefs,    METH_VARARGS | METH_KEYWORDS,
      "Provides HexChat’s setting information (that which is available through "
      "the /SET command)."},
@@ -167,9 +180,10 @@ static PyMethodDef hexchat_methods[] = {
      "access to list data since it doesn't internally construct a list before "
      "returning, as does get_list()."},
      
-    {"get_list",     (PyCFunction)py_get_list,     METH_VARARGS,
+    {"get_list",     (PyCFunction)py_get_list,     METH_VARARGS | METH_KEYWORDS,
      "Constructs and returns lists of information. List items are "
-     "namedtuple's."},
+     "namedtuple's. With `columns=True`, returns a dict of lists keyed on "
+     "field name instead."},
      
     {"list_fields",  (PyCFunction)py_list_fields,  METH_VARARGS,
      "Lists fields in a given list."},
@@ -178,23 +192,33 @@ static PyMethodDef hexchat_methods[] = {
      "Adds a new /command."},
      
     {"hook_print",   (PyCFunction)py_hook_print,   METH_VARARGS | METH_KEYWORDS,
-     "Registers a function to trap any print events."},
+     "Registers a function to trap any print events. The `eol` parameter "
+     "selects how word_eol is passed: 'lazy' (default) builds elements on "
+     "access, True passes a list, and False passes None. `filter` is a dict "
+     "such as {'word[2]': {'#a', '#b'}, 'prefix': 'nick!'} whose items are "
+     "all checked in C before the callback is called."},
 
     {"hook_print_attrs", 
                      (PyCFunction)py_hook_print_attrs,
                                                    METH_VARARGS | METH_KEYWORDS,
-     "Registers a function to trap any print events."},
+     "Registers a function to trap any print events. Takes the same `eol` "
+     "and `filter` parameters as hook_print()."},
 
     {"hook_server",  (PyCFunction)py_hook_server,  METH_VARARGS | METH_KEYWORDS,
-     "Registers a function to be called when a certain server event occurs."},
+     "Registers a function to be called when a certain server event occurs. "
+     "Takes the same `eol` and `filter` parameters as hook_print(); `filter` "
+     "can also be a compiled regex searched for in the raw line."},
      
     {"hook_server_attrs",
                      (PyCFunction)py_hook_server_attrs,
                                                    METH_VARARGS | METH_KEYWORDS,
-    "Registers a function to be called when a certain server event occurs."},
+    "Registers a function to be called when a certain server event occurs. "
+    "Takes the same parameters as hook_server()."},
     
     {"hook_timer",   (PyCFunction)py_hook_timer,   METH_VARARGS | METH_KEYWORDS,
-     "Registers a function to be called every “timeout” milliseconds."},    
+     "Registers a function to be called every “timeout” milliseconds. With "
+     "coalesce_ms > 0, the timer may run up to that many ms late so it can "
+     "run with other timers, all on one HexChat timer."},    
 
     {"unhook",       (PyCFunction)py_unhook,       METH_VARARGS,
      "Unhooks any hook registered with hexchat_hook_print/server/timer/command." 
@@ -216,13 +240,25 @@ static PyMethodDef hexchat_methods[] = {
     {"set_pluginpref", 
                      (PyCFunction)py_set_pluginpref, 
                                                    METH_VARARGS,
-     "Saves a plugin-specific setting with string value to a plugin-specific "
-     "config file."},
+     "Saves a plugin-specific setting to a plugin-specific config file. The "
+     "value can be a str, int, float, bool, bytes, or a JSON serializable "
+     "list or dict. None deletes the setting. Changes are written shortly "
+     "after, and when the plugin is unloaded."},
     {"get_pluginpref",
                      (PyCFunction)py_get_pluginpref,
                                                    METH_VARARGS,
-     "Loads a plugin-specific setting with string value from a plugin-specific "
-     "config file."},
+     "Loads a plugin-specific setting from a plugin-specific config file. "
+     "Returns None if it isn't set."},
+    {"set_pluginprefs", 
+                     (PyCFunction)py_set_pluginprefs, 
+                                                   METH_VARARGS,
+     "Saves several plugin-specific settings given as a mapping of names to "
+     "values. A value of None deletes the setting."},
+    {"get_pluginprefs",
+                     (PyCFunction)py_get_pluginprefs,
+                                                   METH_VARARGS,
+     "Loads several plugin-specific settings. Returns a dict of the names "
+     "given and their values, None for those that aren't set."},
     {"del_pluginpref", 
                      (PyCFunction)py_del_pluginpref,
                                                    METH_VARARGS,
@@ -232,10 +268,37 @@ static PyMethodDef hexchat_methods[] = {
                                                    METH_NOARGS,
      "Builds a comma-separated list of the currently saved settings from a "
      "plugin-specific config file."},
+    {"set_delegate_budget",
+                     (PyCFunction)py_set_delegate_budget,
+                                                   METH_VARARGS,
+     "Sets the maximum number of Delegate calls from other threads that are "
+     "executed for this plugin each time the main thread services them. "
+     "Returns the previous value."},
+    {"get_event_loop",
+                     (PyCFunction)py_get_event_loop,
+                                                   METH_VARARGS | METH_KEYWORDS,
+     "Returns the plugin's asyncio event loop, which runs on the HexChat main "
+     "thread. It's created on the first call. The optional `interval` sets "
+     "the milliseconds between loop iterations (10 by default)."},
 
     {NULL, NULL, 0, NULL}
 };
 
+static int hexchat_module_exec(PyObject *);
+
+/**
+ * Slots of the hexchat module. It uses multi-phase init so each interp runs
+ * hexchat_module_exec() and gets its own types (see interp_get_type()), and
+ * so it can be imported by interps with their own GIL.
+ */
+static PyModuleDef_Slot hexchat_module_slots[] = {
+    {Py_mod_exec, hexchat_module_exec},
+#ifdef MINPY_HAVE_OWN_GIL
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
 /**
  * hexchat_module - Python hexchat module defined in this struct.
  */
@@ -243,8 +306,9 @@ static struct PyModuleDef hexchat_module = {
     PyModuleDef_HEAD_INIT,
     "hexchat",
     NULL,         // module documentation, may be NULL
-    -1,           // size of per-interpreter state of the module.
-    hexchat_methods
+    0,            // size of per-interpreter state of the module.
+    hexchat_methods,
+    hexchat_module_slots
 };
 
 /**
@@ -254,7 +318,17 @@ static struct PyModuleDef hexchat_module = {
 PyMODINIT_FUNC
 PyInit_hexchat(void)
 {
-    PyObject    *pymodule;
+    return PyModuleDef_Init(&hexchat_module);
+}
+
+/**
+ * Populates the hexchat module of an interp.
+ * @param pymodule  - The new module.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+hexchat_module_exec(PyObject *pymodule)
+{
     PyObject    *pyvertuple;
     PyObject    *pyproxy;
     int         i;
@@ -268,6 +342,9 @@ PyInit_hexchat(void)
         "DelegateProxy",    DelegateProxyTypePtr,
         "EventAttrs",       EventAttrsTypePtr,
         "ListIter",         ListIterTypePtr,
+        "WordList",         WordListTypePtr,
+        "UserIndex",        UserIndexTypePtr,
+        "Channel",          ChannelTypePtr,
         "MainInterp",       MainInterpTypePtr,
         "OutStream",        OutStreamTypePtr,
         "MainInterp",       MainInterpTypePtr,
@@ -275,8 +352,7 @@ PyInit_hexchat(void)
         "InterpObjProxy",   InterpObjProxyTypePtr,
         NULL, NULL
     };
-    
-    pymodule = PyModule_Create(&hexchat_module);
+
 
     // Priorities for callback registration.
     PyModule_AddIntConstant(pymodule, "PRI_HIGHEST",     HEXCHAT_PRI_HIGHEST );
@@ -389,8 +465,10 @@ PyInit_hexchat(void)
             hexchat_printf(ph,
                            "\0034Error encountered registering hexchat.%s.",
                            (char *)types_to_register[i]);
-            return NULL;
+            return -1;
         }
+        // The reference is stolen, and this runs once per interp.
+        Py_INCREF((PyObject *)types_to_register[i + 1]);
         PyModule_AddObject(pymodule,
                            (char *)types_to_register[i],
                            (PyObject *)types_to_register[i + 1]);
@@ -405,7 +483,11 @@ PyInit_hexchat(void)
                                     "Oi", pymodule, true);
     PyModule_AddObject(pymodule, "asynchronous", pyproxy);
 
-    return pymodule;
+    // The users index; its data is shared by all interps.
+    PyModule_AddObject(pymodule, "users",
+                       PyObject_CallObject((PyObject *)UserIndexTypePtr, 
+                                           NULL));
+    return 0;
 }
 
 /**
@@ -453,12 +535,24 @@ int hexchat_plugin_init(hexchat_plugin *plugin_handle, char **plugin_name,
     // Store the main interpreter's thread state.
     py_g_main_threadstate = PyEval_SaveThread();
 
+    // Start printing output from threads.
+    outqueue_start();
+
     // Initialize the plugins module.
     init_plugins();
 
+    // Start the addons directory watcher if it's turned on.
+    watch_init();
+
+    // Remember find_context() results for channels, checked on each use.
+    context_cache_start();
+
     // Create the global console interpreter.
     create_console_interp();
 
+    // Prepare interps for plugins once HexChat is idle.
+    interp_pool_start();
+
     return 1;
 }
 
@@ -470,14 +564,28 @@ int
 hexchat_plugin_deinit(hexchat_plugin *plugin_handle)
 {
     int ret;
+    int console_left;
 
     close_console();
-    delete_console_interp();
+    console_left = delete_console_interp();
+    watch_stop();
     delete_plugins();
+    interp_pool_clear();
+    outqueue_stop();
+    userindex_disable();
+    pref_store_close();
+    context_cache_stop();
+    stats_clear();
+    quota_clear();
+    timerwheel_stop();
 
     switch_threadstate(py_g_main_threadstate);
 
-    ret = Py_FinalizeEx();
+    interp_clear_main_proxy_cache();
+
+    // Python can't be finalized while the Console interp is left for a stuck
+    // worker; it's left running instead.
+    ret = console_left ? -1 : Py_FinalizeEx();
 
     hexchat_printf(ph, "%s unloaded (%i).", MINPY_MODNAME, ret);
 
@@ -520,6 +628,144 @@ py_prnt(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+/**
+ * Implements the hexchat.command_many() function.
+ */
+PyObject *
+py_command_many(PyObject *self, PyObject *args)
+{
+    return run_many(args, "O:command_many", hexchat_command);
+}
+
+/**
+ * Implements the hexchat.prnt_many() function.
+ */
+PyObject *
+py_prnt_many(PyObject *self, PyObject *args)
+{
+    return run_many(args, "O:prnt_many", hexchat_print);
+}
+
+/**
+ * Runs command_many() and prnt_many(). The items are checked before any are
+ * run. HexChat only switches context between items with different contexts,
+ * and switches back once at the end.
+ * @param args      - The Python arguments, an iterable of (context, text)
+ *                    pairs. A context can be a Context (or a DelegateProxy of
+ *                    one), a channel name on the current server, or None for
+ *                    the current context.
+ * @param format    - The PyArg_ParseTuple() format.
+ * @param func      - hexchat_command() or hexchat_print().
+ * @returns - A list with True for each item that was run, and False for each
+ *            whose context couldn't be found or switched to. NULL on failure
+ *            with error state set.
+ */
+PyObject *
+run_many(PyObject *args, const char *format, 
+         void (*func)(hexchat_plugin *, const char *))
+{
+    PyObject        *pyitems;
+    PyObject        *pyseq;
+    PyObject        *pyitem;
+    PyObject        *pyctx;
+    PyObject        *pytext;
+    PyObject        *pyret;
+    hexchat_context **ctxs;
+    const char      **texts;
+    hexchat_context *prior_ctx;
+    hexchat_context *cur_ctx;
+    Py_ssize_t      size;
+    Py_ssize_t      i;
+    int             ok;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, format, &pyitems)) {
+        return NULL;
+    }
+    pyseq = PySequence_Fast(pyitems, "items must be an iterable of "
+                                     "(context, text) pairs.");
+    if (!pyseq) {
+        return NULL;
+    }
+    size  = PySequence_Fast_GET_SIZE(pyseq);
+    ctxs  = PyMem_Malloc(sizeof(hexchat_context *) * (size + 1));
+    texts = PyMem_Malloc(sizeof(const char *) * (size + 1));
+    pyret = NULL;
+
+    if (!ctxs || !texts) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    prior_ctx = hexchat_get_context(ph);
+
+    // Resolve the contexts and check the items first so none are run if one
+    // is bad.
+    for (i = 0; i < size; i++) {
+        pyitem = PySequence_Fast_GET_ITEM(pyseq, i); // BR.
+
+        if (!PyTuple_Check(pyitem) || PyTuple_GET_SIZE(pyitem) != 2 ||
+            !PyUnicode_Check(PyTuple_GET_ITEM(pyitem, 1))) {
+            PyErr_SetString(PyExc_TypeError, 
+                            "items must be (context, text) pairs with str "
+                            "text.");
+            goto done;
+        }
+        pyctx  = PyTuple_GET_ITEM(pyitem, 0); // BR.
+        pytext = PyTuple_GET_ITEM(pyitem, 1); // BR.
+
+        if (pyctx == Py_None) {
+            ctxs[i] = prior_ctx;
+        }
+        else if (PyUnicode_Check(pyctx)) {
+            ctxs[i] = context_find_ptr(NULL, PyUnicode_AsUTF8(pyctx));
+        }
+        else if (Py_TYPE(pyctx) == DelegateProxyTypePtr) {
+            // Contexts returned to threads by the proxies are wrapped.
+            pyctx   = PyObject_GetAttrString(pyctx, "obj");
+            ctxs[i] = pyctx ? context_get_ptr(pyctx) : NULL;
+            Py_XDECREF(pyctx);
+        }
+        else {
+            ctxs[i] = context_get_ptr(pyctx);
+        }
+        if (PyErr_Occurred()) {
+            goto done;
+        }
+        texts[i] = PyUnicode_AsUTF8(pytext);
+        if (!texts[i]) {
+            goto done;
+        }
+    }
+    pyret = PyList_New(size);
+    if (!pyret) {
+        goto done;
+    }
+    cur_ctx = prior_ctx;
+
+    for (i = 0; i < size; i++) {
+        ok = ctxs[i] && 
+             (ctxs[i] == cur_ctx || hexchat_set_context(ph, ctxs[i]));
+        if (ok) {
+            func(ph, texts[i]);
+
+            // A command can change the current context, or close it.
+            cur_ctx = hexchat_get_context(ph);
+        }
+        PyList_SET_ITEM(pyret, i, PyBool_FromLong(ok));
+    }
+    if (cur_ctx != prior_ctx) {
+        hexchat_set_context(ph, prior_ctx);
+    }
+
+done:
+    PyMem_Free(ctxs);
+    PyMem_Free(texts);
+    Py_DECREF(pyseq);
+    return pyret;
+}
+
 /**
  * Implements the hexchat.emit_print() function.
  */
@@ -821,81 +1067,25 @@ py_get_listiter(PyObject *self, PyObject *args)
 }
 
 /**
- * Implements the hexchat.get_list() function. Although this iterates over a
- * list and constructs a Python list for all data before returning, it's 
- * still very fast.
+ * Implements the hexchat.get_list() function. Takes a snapshot of the list and
+ * returns it as a list of namedtuple's, or with `columns=True`, as a dict of
+ * lists keyed on field name.
  */
 PyObject *
-py_get_list(PyObject *self, PyObject *args)
+py_get_list(PyObject *self, PyObject *args, PyObject *kwargs)
 {   
-    PyObject    *pyiter;
     PyObject    *pyname;
-    PyObject    *pyconstr;
-    PyObject    *pyname_tupl;
-    PyObject    *pyattr;
-    PyObject    *pyitem;
-    PyObject    *pyntup_type;
-    PyObject    *pyntup;
-    PyObject    *pyargs;
-    PyObject    *pylist;
-    Py_ssize_t  len;
-    Py_ssize_t  i;
+    int         columns     = 0;
+    static char *keywords[] = { "name", "columns", NULL };
     
     if (main_thread_check()) {
         return NULL;
     }
-    if (!PyArg_ParseTuple(args, "U:get_list", &pyname)) {
-        return NULL;
-    }
-    
-    // Get the iterator for the requested list.
-    pyiter = PyObject_CallFunction((PyObject *)ListIterTypePtr, "O", pyname);
-
-    if (!pyiter) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|p:get_list", keywords,
+                                     &pyname, &columns)) {
         return NULL;
     }
-    // Grab the namedtuple constructor.
-    pyconstr = interp_get_namedtuple_constr(); // BR.
-
-    // Get the list information. List name, field names, etc.
-    pyname       = PyUnicode_FromFormat("%U_item", pyname);
-    pyname_tupl  = PyObject_GetAttrString(pyiter, "field_names");
-    len          = PyObject_Length(pyname_tupl);
-
-    // Create a custom namedtuple type to use as list items.
-    pyntup_type  = PyObject_CallFunction(pyconstr, "OO", pyname, pyname_tupl);
-
-    Py_DECREF(pyname);
-
-    pylist = PyList_New(0);
-
-    // Iterate over the list.
-    while ((pyitem = PyIter_Next(pyiter))) {
-        
-        // Build arguments for the nametuple type constructor.
-        pyargs = PyTuple_New(len);
-
-        for (i = 0; i < len; i++) {
-            pyname = PyTuple_GetItem(pyname_tupl, i);   // BR.
-            pyattr = PyObject_GetAttr(pyitem, pyname);  // NR.
-            PyTuple_SetItem(pyargs, i, pyattr);         // Steals ref.
-        }
-        // Create the custom namedtuple.
-        pyntup = PyObject_CallObject(pyntup_type, pyargs);
-
-        // Append it to the list.
-        PyList_Append(pylist, pyntup);
-
-        Py_DECREF(pyitem);
-        Py_DECREF(pyargs);
-        Py_DECREF(pyntup);
-    }
-    
-    Py_DECREF(pyiter);
-    Py_DECREF(pyname_tupl);
-    Py_DECREF(pyntup_type);
-
-    return pylist;
+    return listiter_snapshot(PyUnicode_AsUTF8(pyname), columns);
 }
 
 /**
@@ -933,6 +1123,46 @@ py_list_fields(PyObject *self, PyObject *args)
     return pyretval;
 }
 
+/**
+ * Gets the statistics entry for a new hook. Timers are named after their
+ * callback, as they have no name of their own.
+ * @param ver           - The type of hook.
+ * @param name          - The command or event name.
+ * @param pycallback    - The callback.
+ * @returns - The entry shared by all the interp's hooks for the name.
+ */
+HookStats *
+hc_hook_stats(CB_VER ver, const char *name, PyObject *pycallback)
+{
+    PyObject    *pyqualname;
+    HookStats   *stats;
+    const char  *kind;
+
+    switch (ver) {
+    case CBV_CMD        : kind = "command"; break;
+    case CBV_PRNT       :
+    case CBV_PRNT_ATTR  : kind = "print";   break;
+    case CBV_SRV        :
+    case CBV_SRV_ATTR   : kind = "server";  break;
+    default             : kind = "timer";   break;
+    }
+    if (ver != CBV_TIMER) {
+        return stats_get(interp_get_main_threadstate(), kind, name);
+    }
+    pyqualname = PyObject_GetAttrString(pycallback, "__qualname__");
+
+    if (pyqualname && PyUnicode_Check(pyqualname)) {
+        name = PyUnicode_AsUTF8(pyqualname);
+    }
+    PyErr_Clear();
+
+    stats = stats_get(interp_get_main_threadstate(), kind,
+                      name ? name : "timer");
+    Py_XDECREF(pyqualname);
+
+    return stats;
+}
+
 /**
  * Registers the given callback for HexChat events. All hook_xxx functions
  * invoke this internally.
@@ -952,12 +1182,18 @@ py_all_hook_inner(CB_VER ver, PyObject *self, PyObject *args, PyObject *kwargs)
     CallbackData    *userdata;
     int             timeout;
     const char      *cmd_spec   = NULL;
+    PyObject        *pyeol      = NULL;
+    int             eol         = EOL_LAZY;
+    PyObject        *pyfilter   = Py_None;
+    HookFilter      *filter     = NULL;
+    double          coalesce    = 0;
 
     static char     *cmd_kwds[] = { "name", "callback", "userdata",
                                     "priority", "help", NULL };
     static char     *prt_kwds[] = { "name", "callback", "userdata",
-                                    "priority", NULL };
-    static char     *tmr_kwds[] = { "timeout", "callback", "userdata", NULL };
+                                    "priority", "eol", "filter", NULL };
+    static char     *tmr_kwds[] = { "timeout", "callback", "userdata",
+                                    "coalesce_ms", NULL };
 
     if (!(ver & CBV_TIMER) && main_thread_check()) {
         return NULL;
@@ -974,10 +1210,10 @@ py_all_hook_inner(CB_VER ver, PyObject *self, PyObject *args, PyObject *kwargs)
     }
     else if (ver & (CBV_PRNT | CBV_PRNT_ATTR | CBV_SRV | CBV_SRV_ATTR)) {
         switch (ver) {
-        case CBV_PRNT     : cmd_spec = "UO|Oi:hook_print";        break;
-        case CBV_PRNT_ATTR: cmd_spec = "UO|Oi:hook_print_attrs";  break;
-        case CBV_SRV      : cmd_spec = "UO|Oi:hook_server";       break;
-        case CBV_SRV_ATTR : cmd_spec = "UO|Oi:hook_server_attrs"; break;
+        case CBV_PRNT     : cmd_spec = "UO|OiOO:hook_print";        break;
+        case CBV_PRNT_ATTR: cmd_spec = "UO|OiOO:hook_print_attrs";  break;
+        case CBV_SRV      : cmd_spec = "UO|OiOO:hook_server";       break;
+        case CBV_SRV_ATTR : cmd_spec = "UO|OiOO:hook_server_attrs"; break;
         default:
             // Shouldn't ever get here.
             assert("Bad value for ver!" == 0); 
@@ -985,21 +1221,50 @@ py_all_hook_inner(CB_VER ver, PyObject *self, PyObject *args, PyObject *kwargs)
         }
         if (!PyArg_ParseTupleAndKeywords(args, kwargs, cmd_spec,
                                          prt_kwds, &pyname, &pycallback,
-                                         &pyuserdata, &priority)) {
+                                         &pyuserdata, &priority, &pyeol,
+                                         &pyfilter)) {
+            return NULL;
+        }
+        if (pyeol == NULL || (PyUnicode_Check(pyeol) && 
+                              !PyUnicode_CompareWithASCIIString(pyeol, 
+                                                                "lazy"))) {
+            eol = EOL_LAZY;
+        }
+        else if (PyBool_Check(pyeol)) {
+            eol = (pyeol == Py_True) ? EOL_LIST : EOL_NONE;
+        }
+        else {
+            PyErr_SetString(PyExc_ValueError, 
+                            "eol must be 'lazy', True, or False.");
             return NULL;
         }
+        if (pyfilter != Py_None) {
+            filter = hookfilter_new(ver, pyfilter);
+            if (!filter) {
+                return NULL;
+            }
+        }
     }
     else { // ver is CBV_TIMER.
-        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO|O:hook_timer",
+        if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO|Od:hook_timer",
                                          tmr_kwds, &timeout, &pycallback, 
-                                         &pyuserdata)) {
+                                         &pyuserdata, &coalesce)) {
             return NULL;
         } 
+        if (coalesce < 0) {
+            PyErr_SetString(PyExc_ValueError, "coalesce_ms can't be negative.");
+            return NULL;
+        }
+        // The timer wheel is only run on the main thread.
+        if (coalesce > 0 && main_thread_check()) {
+            return NULL;
+        }
     }
     name = (pyname) ? PyUnicode_AsUTF8(pyname) : "timer";
 
     if (!PyCallable_Check(pycallback)) {
         PyErr_SetString(PyExc_TypeError, "callback argument must be callable.");
+        hookfilter_free(filter);
         return NULL;
     }
     
@@ -1009,6 +1274,13 @@ py_all_hook_inner(CB_VER ver, PyObject *self, PyObject *args, PyObject *kwargs)
     userdata->callback    = pycallback;
     userdata->userdata    = pyuserdata;
     userdata->threadstate = interp_get_main_threadstate();
+    userdata->hook        = NULL;
+    userdata->dispatcher  = NULL;
+    userdata->filter      = filter;
+    userdata->stats       = hc_hook_stats(ver, name, pycallback);
+    userdata->quota       = quota_get(userdata->threadstate);
+    userdata->wheel       = NULL;
+    userdata->eol         = eol;
 
     Py_INCREF(pycallback);
     Py_INCREF(pyuserdata);
@@ -1021,25 +1293,21 @@ py_all_hook_inner(CB_VER ver, PyObject *self, PyObject *args, PyObject *kwargs)
                                     help, userdata);
         break;
     case CBV_PRNT:
-        hook = hexchat_hook_print(  ph, name, priority, hc_print_callback, 
-                                    userdata);
-        break;
     case CBV_PRNT_ATTR:
-        hook = hexchat_hook_print_attrs(
-                                    ph, name, priority, 
-                                    hc_print_attrs_callback, userdata);
-        break;
     case CBV_SRV:
-        hook = hexchat_hook_server( ph, name, priority, hc_server_callback, 
-                                    userdata);
-        break;
     case CBV_SRV_ATTR:
-        hook = hexchat_hook_server_attrs(
-                                    ph, name, priority, 
-                                    hc_server_attrs_callback, userdata);
+        // All callbacks for the same event and priority share one HexChat
+        // hook.
+        hook = dispatch_hook(ver, name, priority, userdata);
         break;
     case CBV_TIMER:
-        hook = hexchat_hook_timer(  ph, timeout, hc_timer_callback, userdata);
+        if (coalesce > 0) {
+            hook = timerwheel_hook(userdata, timeout, coalesce);
+        }
+        else {
+            hook = hexchat_hook_timer(ph, timeout, hc_timer_callback,
+                                      userdata);
+        }
         break;
     default: 
         // Can't get here.
@@ -1049,6 +1317,10 @@ py_all_hook_inner(CB_VER ver, PyObject *self, PyObject *args, PyObject *kwargs)
     if (!hook) {
         PyErr_Format(PyExc_RuntimeError, "Unable to set callback for %s.",
                      name);
+        Py_DECREF(pycallback);
+        Py_DECREF(pyuserdata);
+        hookfilter_free(filter);
+        PyMem_RawFree(userdata);
         return NULL;
     }
     // Get the hook, and create a capsule for it.
@@ -1127,8 +1399,6 @@ py_unhook(PyObject *self, PyObject *args)
     PyObject        *pyhook;
     //PyObject        *pyuserdata = Py_None;
     CallbackData    *data;
-    PyObject        *pyhook_list;
-    PyObject        *pyret;
     const char      *hook_type;
     
     if (main_thread_check()) {
@@ -1156,17 +1426,9 @@ py_unhook(PyObject *self, PyObject *args)
     data  = (CallbackData *)PyCapsule_GetContext(pyhook);
 
     if (data->hook) {
-        hexchat_unhook(ph, hook);
-        data->hook  = NULL;
-        
-        pyhook_list = interp_get_hooks();
-        
-        pyret = PyObject_CallMethod(pyhook_list, "remove", "O", pyhook);
-        
-        if (pyret) {
-            Py_DECREF(pyret);
-        }
-        else {
+        hc_unhook(data);
+
+        if (PySet_Discard(interp_get_hooks(), pyhook) < 0) {
             PyErr_Clear();
         }
     }
@@ -1214,9 +1476,8 @@ py_find_context(PyObject *self, PyObject *args, PyObject *kwargs)
         return NULL;
     }
 
-    pyret = PyObject_CallFunction((PyObject *)
-                                  ContextTypePtr, "OOO", 
-                                  pyserver, pychannel, Py_None);
+    pyret = context_find(pyserver, pychannel);
+
     if (!pyret) {
         PyErr_Clear();
         pyret = Py_None;
@@ -1239,7 +1500,7 @@ py_get_context(PyObject *self, PyObject *Py_UNUSED(args))
     if (main_thread_check()) {
         return NULL;
     }
-    pyret = PyObject_CallFunction((PyObject *)ContextTypePtr, NULL);
+    pyret = context_intern(hexchat_get_context(ph));
 
     return pyret;
 }
@@ -1265,17 +1526,30 @@ py_set_context(PyObject *self, PyObject *args)
     return pyret;
 }
 
+/**
+ * Builds the key a plugin's pref is stored under, "<plugin name> <name>".
+ * @param pyname    - The name of the pref. Must be a str.
+ * @returns - A new reference to the key.
+ */
+static PyObject *
+pluginpref_key(PyObject *pyname)
+{
+    PyObject *pyplugin;
+    PyObject *pykey;
+
+    pyplugin = interp_get_plugin_name(); // NR.
+    pykey    = PyUnicode_FromFormat("%U %U", pyplugin, pyname);
+
+    Py_DECREF(pyplugin);
+    return pykey;
+}
+
 PyObject *
 py_set_pluginpref(PyObject *self, PyObject *args)
 {
-    #define     MAX_STR 2048
     PyObject    *pyname;
     PyObject    *pykey;
-    PyObject    *pyplugin;
     PyObject    *pyvalue;
-    PyObject    *pyret;
-    const char  *val;
-    Py_ssize_t  size;
     int         ret;
     
     if (main_thread_check()) {
@@ -1285,51 +1559,23 @@ py_set_pluginpref(PyObject *self, PyObject *args)
         return NULL;
     }
     // Prepend the plugin name to the key used to store the value.
-    pyplugin = interp_get_plugin_name(); // NR.
-    pykey    = PyUnicode_FromFormat("%U %U", pyplugin, pyname);
+    pykey = pluginpref_key(pyname);
+    ret   = pref_store_set(PyUnicode_AsUTF8(pykey), pyvalue);
 
-    Py_DECREF(pyplugin);
+    Py_DECREF(pykey);
 
-    if (PyLong_Check(pyvalue)) {
-        ret = hexchat_pluginpref_set_int(ph,
-                                         PyUnicode_AsUTF8(pykey), 
-                                         (int)PyLong_AsLong(pyvalue));
-    }
-    else if (PyUnicode_Check(pyvalue)) {
-        val = PyUnicode_AsUTF8AndSize(pyvalue, &size);
-        if (size >= MAX_STR - 1) {
-            PyErr_Format(PyExc_RuntimeError,
-                         "String passed to set_pluginpref() exceeds "
-                         "maximum encoded bytes length (%i).", MAX_STR);
-            Py_DECREF(pykey);
-            return NULL;
-        }
-        ret = hexchat_pluginpref_set_str(ph,
-                                         PyUnicode_AsUTF8(pykey),
-                                         val);
-    }
-    else {
-        PyErr_SetString(PyExc_TypeError,
-                        "pluginpref value must be a string or integer value.");
-        Py_DECREF(pykey);
+    if (ret) {
         return NULL;
     }
-    Py_DECREF(pykey);
-    pyret = (ret) ? Py_True : Py_False;
-    Py_INCREF(pyret);
-    return pyret;
+    Py_RETURN_TRUE;
 }
 
 PyObject *
 py_get_pluginpref(PyObject *self, PyObject *args)
 {
-    #define     MAX_STR 2048
     PyObject    *pyname;
-    PyObject    *pyplugin;
     PyObject    *pykey;
     PyObject    *pyret;
-    char        val[MAX_STR];
-    int         ret;
     
     if (main_thread_check()) {
         return NULL;
@@ -1338,28 +1584,111 @@ py_get_pluginpref(PyObject *self, PyObject *args)
         return NULL;
     }
     // Prepend the plugin name to the key used to retrieve the value.
-    pyplugin = interp_get_plugin_name(); // NR.
-    pykey    = PyUnicode_FromFormat("%U %U", pyplugin, pyname);
+    pykey = pluginpref_key(pyname);
+    pyret = pref_store_get(PyUnicode_AsUTF8(pykey));
 
-    Py_DECREF(pyplugin);
+    Py_DECREF(pykey);
+    return pyret;
+}
 
-    ret = hexchat_pluginpref_get_int(ph, PyUnicode_AsUTF8(pykey));
-    
-    if (ret == -1) {
-        ret = hexchat_pluginpref_get_str(ph, PyUnicode_AsUTF8(pykey), val);
-        
-        if (ret) {
-            pyret = PyUnicode_FromString(val);
+/**
+ * Implements hexchat.set_pluginprefs(). Sets each pref in a mapping of names
+ * to values. They're written together by the next flush.
+ */
+PyObject *
+py_set_pluginprefs(PyObject *self, PyObject *args)
+{
+    PyObject    *pymapping;
+    PyObject    *pyitems;
+    PyObject    *pyitem;
+    PyObject    *pyname;
+    PyObject    *pykey;
+    Py_ssize_t  size;
+    Py_ssize_t  i;
+    int         ret = 0;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "O:set_pluginprefs", &pymapping)) {
+        return NULL;
+    }
+    pyitems = PyMapping_Items(pymapping);
+    if (!pyitems) {
+        return NULL;
+    }
+    size = PyList_GET_SIZE(pyitems);
+
+    for (i = 0; i < size && !ret; i++) {
+        pyitem = PyList_GET_ITEM(pyitems, i); // BR.
+        pyname = PyTuple_GET_ITEM(pyitem, 0); // BR.
+
+        if (!PyUnicode_Check(pyname)) {
+            PyErr_SetString(PyExc_TypeError, "pluginpref names must be str.");
+            ret = -1;
+            break;
+        }
+        pykey = pluginpref_key(pyname);
+        ret   = pref_store_set(PyUnicode_AsUTF8(pykey), 
+                               PyTuple_GET_ITEM(pyitem, 1));
+        Py_DECREF(pykey);
+    }
+    Py_DECREF(pyitems);
+
+    if (ret) {
+        return NULL;
+    }
+    Py_RETURN_TRUE;
+}
+
+/**
+ * Implements hexchat.get_pluginprefs(). Returns a dict of the values of the
+ * given pref names, with None for those that aren't set.
+ */
+PyObject *
+py_get_pluginprefs(PyObject *self, PyObject *args)
+{
+    PyObject    *pynames;
+    PyObject    *pyiter;
+    PyObject    *pyname;
+    PyObject    *pykey;
+    PyObject    *pyvalue;
+    PyObject    *pyret;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "O:get_pluginprefs", &pynames)) {
+        return NULL;
+    }
+    pyiter = PyObject_GetIter(pynames);
+    if (!pyiter) {
+        return NULL;
+    }
+    pyret = PyDict_New();
+
+    while (pyret && (pyname = PyIter_Next(pyiter))) {
+        if (!PyUnicode_Check(pyname)) {
+            PyErr_SetString(PyExc_TypeError, "pluginpref names must be str.");
+            Py_CLEAR(pyret);
         }
         else {
-            pyret = Py_None;
-            Py_INCREF(pyret);
+            pykey   = pluginpref_key(pyname);
+            pyvalue = pref_store_get(PyUnicode_AsUTF8(pykey));
+
+            if (!pyvalue || PyDict_SetItem(pyret, pyname, pyvalue)) {
+                Py_CLEAR(pyret);
+            }
+            Py_XDECREF(pyvalue);
+            Py_DECREF(pykey);
         }
+        Py_DECREF(pyname);
     }
-    else {
-        pyret = PyLong_FromLong(ret);
+    Py_DECREF(pyiter);
+
+    if (PyErr_Occurred()) {
+        Py_CLEAR(pyret);
     }
-    Py_DECREF(pykey);
     return pyret;
 }
 
@@ -1367,7 +1696,6 @@ PyObject *
 py_del_pluginpref(PyObject *self, PyObject *args)
 {
     PyObject *pyname;
-    PyObject *pyplugin;
     PyObject *pykey;
     PyObject *pyret;
     int      ret;
@@ -1379,13 +1707,10 @@ py_del_pluginpref(PyObject *self, PyObject *args)
         return NULL;
     }
     // Prepend plugin name to key.
-    pyplugin = interp_get_plugin_name(); // NR.
-    pykey    = PyUnicode_FromFormat("%U %U", pyplugin, pyname);
-
-    ret   = hexchat_pluginpref_delete(ph, PyUnicode_AsUTF8(pykey));
+    pykey = pluginpref_key(pyname);
+    ret   = pref_store_delete(PyUnicode_AsUTF8(pykey));
     pyret = (ret) ? Py_True : Py_False;
 
-    Py_DECREF(pyplugin);
     Py_DECREF(pykey);
     Py_INCREF(pyret);
 
@@ -1410,6 +1735,9 @@ py_list_pluginpref(PyObject *self, PyObject *Py_UNUSED(args))
 
     Py_ssize_t  size;
 
+    // The file has to be current to list it.
+    pref_store_flush();
+
     ret = hexchat_pluginpref_list(ph, dest);
 
     if (ret) {
@@ -1438,8 +1766,11 @@ py_list_pluginpref(PyObject *self, PyObject *Py_UNUSED(args))
             pystr  = PyList_GetItem(pylst, i); // BR.
             pybool = PyObject_CallMethod(pystr, "startswith", "O", pykey);
 
-            if (pybool == Py_True) {
+            if (pybool == Py_True && 
+                PyUnicode_FindChar(pystr, '\001', 0, 
+                                   PyUnicode_GET_LENGTH(pystr), 1) < 0) {
                 // Strip off the plugin name from list item and add to list.
+                // Keys holding parts of long values are skipped.
                 pystr = PyUnicode_Replace(pystr, pykey, pyemp, 1); // NR.
                 PyList_Append(pyret, pystr);
                 Py_DECREF(pystr);
@@ -1458,6 +1789,31 @@ py_list_pluginpref(PyObject *self, PyObject *Py_UNUSED(args))
     return pyret;
 }
 
+/**
+ * Sets how many queued Delegate calls made from other threads get executed
+ * for the current interp per tick of the main thread's delegate pump. Can be
+ * called from any thread.
+ */
+PyObject *
+py_set_delegate_budget(PyObject *self, PyObject *args)
+{
+    int           budget;
+    DelegateQueue *dqueue;
+
+    if (!PyArg_ParseTuple(args, "i:set_delegate_budget", &budget)) {
+        return NULL;
+    }
+    if (budget < 1) {
+        PyErr_SetString(PyExc_ValueError, "budget must be 1 or greater.");
+        return NULL;
+    }
+    dqueue = interp_get_delegate_queue();
+    if (!dqueue) {
+        return NULL;
+    }
+    return PyLong_FromLong(delegate_queue_set_budget(dqueue, budget));
+}
+
 /**
  * Capsule destructor for attrs pointers allocated with 
  * hexchat_event_attrs_create().
@@ -1495,115 +1851,109 @@ void py_hook_free_fn(PyObject *pyhook) {
     }
     data = (CallbackData *)PyCapsule_GetContext(pyhook);
 
-    // If hook == NULL, the hook has already been unhooked.
+    // If hook == NULL, the hook has already been unhooked. The callback and
+    // userdata are held until now either way, as unhook() returns userdata.
     if (data->hook) {
-        hexchat_unhook(ph, hook);
-        data->hook = NULL;
-
-        Py_DECREF(data->callback);
-        Py_DECREF(data->userdata);
+        hc_unhook(data);
     }
+    Py_DECREF(data->callback);
+    Py_DECREF(data->userdata);
+    hookfilter_free(data->filter);
     PyMem_RawFree(data);
 }
 
 
 /**
- * The handler for all various types of callback. When a HexChat event
- * occurs, a callback is invoked, which invokes this function that converts
- * the arguments to Python data, then invokes the Python callback registered 
- * for the event.
+ * Creates the word and word_eol WordLists for an event. Print events have no
+ * word_eol[] array; theirs is built from the word WordList on access.
+ * @param ver           - The type of event.
+ * @param word          - HexChat's word[] array.
+ * @param word_eol      - HexChat's word_eol[] array, or NULL.
+ * @param pyword        - Receives the word WordList.
+ * @param pyword_eol    - Receives the word_eol WordList.
+ * @returns - 0 on success, -1 with error state set on failure.
  */
 int
-hc_all_callback_inner(CB_VER ver, char *word[], char *word_eol[], 
-                      hexchat_event_attrs *attrs, void *userdata)
+hc_build_words(CB_VER ver, char *word[], char *word_eol[],
+               PyObject **pyword, PyObject **pyword_eol)
 {
-    PyObject        *pyword     = NULL;
-    PyObject        *pyword_eol = NULL;
-    PyObject        *pyattrs;
-    PyObject        *pystr;
-    PyObject        *pybytes;
-    PyObject        *pysep;
-    PyObject        *pyslice;
-    Py_ssize_t      py_len;
-    PyObject        *pyret;
-    int             retval      = 0;
-    int             i;
-    CallbackData    *data;
-    SwitchTSInfo    tsinfo;
+    int nword;
+    int i;
 
-    data = (CallbackData *)userdata;
-    
-    if (!data->hook) {
-        // If the hook is NULL, then it's already been unhooked and this 
-        // callback invokation should be ignored.
-        return HEXCHAT_EAT_NONE;
-    }
+    // Wrap the word[] array in a WordList; elements are decoded on access.
+    for (nword = 1; word[nword] && strcmp("", word[nword]); nword++);
 
-    // Switch to the callback owner's sub-interpreter threadstate.
-    tsinfo = switch_threadstate(data->threadstate);
-    
-    // Convert the word[] array to a Python list.
-    if (ver & (CBV_PRNT | CBV_PRNT_ATTR | CBV_CMD | CBV_SRV | CBV_SRV_ATTR)) {
-        pyword = PyList_New(0);
-        for (i = 1; word[i] && strcmp("", word[i]); i++) {
-            // Need to grab text as a bytes object first so it can be decoded
-            // replacing bad values with '\U0000fffd'.
-            pybytes = PyBytes_FromString(word[i]);
-            pystr   = PyUnicode_FromEncodedObject(pybytes, "utf-8", "replace");
-            PyList_Append(pyword, pystr);
-            Py_DECREF(pystr);
-            Py_DECREF(pybytes);
-        }
+    *pyword     = wordlist_new(&word[1], nword - 1);
+    *pyword_eol = NULL;
+
+    if (!*pyword) {
+        return -1;
     }
-    // Convert the word_eol[] array (if it exists) to a Python list.
+    // Wrap the word_eol[] array (if it exists).
     if (ver & (CBV_CMD | CBV_SRV | CBV_SRV_ATTR)) {
-        pyword_eol = PyList_New(0);
-        for (i = 1; word_eol[i] && strcmp("", word_eol[i]); i++) {
-            pybytes = PyBytes_FromString(word_eol[i]);
-            pystr   = PyUnicode_FromEncodedObject(pybytes, "utf-8", "replace");
-            PyList_Append(pyword_eol, pystr);
-            Py_DECREF(pystr);
-            Py_DECREF(pybytes);
-        }
+        for (i = 1; word_eol[i] && strcmp("", word_eol[i]); i++);
+        *pyword_eol = wordlist_new(&word_eol[1], i - 1);
     }
-    // Construct a word_eol Python list from the word[] array if necessary.
-    else if (ver & (CBV_PRNT | CBV_PRNT_ATTR)) {
-        py_len      = PyList_Size(pyword);
-        pyword_eol  = PyList_New(py_len);
-        pysep       = PyUnicode_FromString(" ");
-
-        for (i = 0; i < py_len; i++) {
-            pyslice = PyList_GetSlice(pyword, i, py_len);
-            pystr   = PyUnicode_Join(pysep, pyslice);
-            
-            PyList_SetItem(pyword_eol, i, pystr);
-            Py_DECREF(pyslice);
-        }
-        Py_DECREF(pysep);
+    // Print events have no word_eol[]; its elements are substrings of the
+    // joined words.
+    else {
+        *pyword_eol = wordlist_new_eol(*pyword);
     }
-    
-    // Invoke the callback.
-    if (ver & (CBV_PRNT | CBV_CMD | CBV_SRV)) {
-        pyret = PyObject_CallFunction(data->callback, "OOO", pyword, 
-                                      pyword_eol, data->userdata);
-        Py_DECREF(pyword);
-        Py_DECREF(pyword_eol);
-    }
-    else if (ver & (CBV_PRNT_ATTR | CBV_SRV_ATTR)) {
-        // Create an EventAttrs object for the Python callback.
-        pyattrs = PyObject_CallFunction((PyObject *)EventAttrsTypePtr, "L",
-                                        (long long)attrs->server_time_utc);
-
-        pyret = PyObject_CallFunction(data->callback, "OOOO", pyword, 
-                                      pyword_eol, pyattrs, data->userdata);
-        Py_DECREF(pyattrs);
-        Py_DECREF(pyword);
-        Py_DECREF(pyword_eol);
+    if (!*pyword_eol) {
+        Py_CLEAR(*pyword);
+        return -1;
     }
-    else { // CBV_TIMER
-        pyret = PyObject_CallFunction(data->callback, "O", data->userdata);
+    return 0;
+}
+
+/**
+ * Returns the word_eol argument for a callback according to its `eol` mode.
+ * @param data          - The callback's data.
+ * @param pyword_eol    - The WordList built by hc_build_words().
+ * @param pyeol_list    - Holds the materialized list for EOL_LIST callbacks
+ *                        so it's built once per event. Released by the caller.
+ * @returns - A borrowed reference, or NULL with error state set.
+ */
+PyObject *
+hc_eol_arg(CallbackData *data, PyObject *pyword_eol, PyObject **pyeol_list)
+{
+    switch (data->eol) {
+    case EOL_NONE:
+        return Py_None;
+    case EOL_LIST:
+        if (!*pyeol_list) {
+            *pyeol_list = PyObject_CallMethod(pyword_eol, "materialize", NULL);
+        }
+        return *pyeol_list;
+    default:
+        return pyword_eol;
     }
-    
+}
+
+/**
+ * Releases the word and word_eol objects after a callback. A print event's
+ * lazy word_eol holds its word list, so it's released first.
+ */
+void
+hc_release_words(PyObject *pyword, PyObject *pyword_eol)
+{
+    wordlist_release(pyword_eol);
+    wordlist_release(pyword);
+}
+
+/**
+ * Converts the value returned by a Python callback to the value returned to
+ * HexChat, and reports any errors.
+ * @param ver   - The type of callback.
+ * @param pyret - The callback's return value, or NULL if it raised. The 
+ *                reference is released.
+ * @returns - The HexChat return value.
+ */
+int
+hc_callback_retval(CB_VER ver, PyObject *pyret)
+{
+    int retval;
+
     if (pyret) {
         // Convert return value; and check for, and report, any errors.
         retval = (int)PyLong_AsLong(pyret);
@@ -1633,24 +1983,91 @@ hc_all_callback_inner(CB_VER ver, char *word[], char *word_eol[],
         PyErr_Print();
         retval = (ver & CBV_TIMER) ? 0 : HEXCHAT_EAT_NONE;
     }
-
-    // Switch back to the previous threadstate.
-    switch_threadstate_back(tsinfo);
-
     return retval;
 }
 
+/**
+ * The handler for command and timer callbacks. When a HexChat event
+ * occurs, a callback is invoked, which invokes this function that converts
+ * the arguments to Python data, then invokes the Python callback registered 
+ * for the event. Print and server events are delivered by the dispatchers in
+ * dispatch.c instead.
+ */
 int
-hc_print_callback(char *word[], void *userdata) 
+hc_all_callback_inner(CB_VER ver, char *word[], char *word_eol[], 
+                      hexchat_event_attrs *attrs, void *userdata)
 {
-    return hc_all_callback_inner(CBV_PRNT, word, NULL, NULL, userdata);
-}
+    PyObject        *pyword     = NULL;
+    PyObject        *pyword_eol = NULL;
+    PyObject        *pycallback;
+    PyObject        *pyuserdata;
+    PyObject        *pyret;
+    int             retval;
+    CallbackData    *data;
+    HookStats       *stats;
+    PluginQuota     *quota;
+    SwitchTSInfo    tsinfo;
+    long long       t0, t1, t2, t3;
 
-int
-hc_print_attrs_callback(char *word[], hexchat_event_attrs *attrs, 
-                        void *userdata)
-{
-    return hc_all_callback_inner(CBV_PRNT_ATTR, word, NULL, attrs, userdata);
+    data = (CallbackData *)userdata;
+    
+    if (!data->hook) {
+        // If the hook is NULL, then it's already been unhooked and this 
+        // callback invokation should be ignored.
+        return HEXCHAT_EAT_NONE;
+    }
+    // The plugin is over its quota; keep timers alive, but don't run them.
+    if (quota_blocked(data->quota, ver & CBV_TIMER)) {
+        return (ver & CBV_TIMER) ? 1 : HEXCHAT_EAT_NONE;
+    }
+    // The callback may unhook itself, which frees its data.
+    stats      = stats_enabled ? data->stats : NULL;
+    quota      = data->quota;
+    pycallback = data->callback;
+    pyuserdata = data->userdata;
+    t0         = stats ? stats_now() : 0;
+
+    // Switch to the callback owner's sub-interpreter threadstate.
+    tsinfo = switch_threadstate(data->threadstate);
+    t1     = stats_now();
+    t2     = t1;
+    
+    // Invoke the callback. Its refs are held in case it unhooks itself.
+    Py_INCREF(pycallback);
+    Py_INCREF(pyuserdata);
+
+    if (ver & CBV_CMD) {
+        if (hc_build_words(ver, word, word_eol, &pyword, &pyword_eol)) {
+            PyErr_Print();
+            Py_DECREF(pycallback);
+            Py_DECREF(pyuserdata);
+            switch_threadstate_back(tsinfo);
+            return HEXCHAT_EAT_NONE;
+        }
+        t2    = stats ? stats_now() : 0;
+        pyret = PyObject_CallFunctionObjArgs(pycallback, pyword, pyword_eol,
+                                             pyuserdata, NULL);
+    }
+    else { // CBV_TIMER
+        pyret = PyObject_CallFunctionObjArgs(pycallback, pyuserdata, NULL);
+    }
+    t3 = stats ? stats_now() : 0;
+
+    Py_DECREF(pycallback);
+    Py_DECREF(pyuserdata);
+
+    hc_release_words(pyword, pyword_eol);
+    retval = hc_callback_retval(ver, pyret);
+
+    if (stats) {
+        stats_record(stats, t1 - t0, (t2 - t1) + (stats_now() - t3), t3 - t2);
+    }
+    // Switch back to the previous threadstate.
+    switch_threadstate_back(tsinfo);
+
+    quota_charge(quota, stats_now() - t1);
+
+    return retval;
 }
 
 int
@@ -1665,17 +2082,56 @@ hc_timer_callback(void *userdata)
     return hc_all_callback_inner(CBV_TIMER, NULL, NULL, NULL, userdata);
 }
 
-int
-hc_server_callback(char *word[], char *word_eol[], void *userdata)
+/**
+ * Unhooks all the callbacks the current interp has registered, and empties
+ * its set of hooks. Hook objects the plugin still holds become inert, as if
+ * passed to unhook().
+ */
+void
+hc_unhook_all()
 {
-    return hc_all_callback_inner(CBV_SRV, word, word_eol, NULL, userdata);
+    PyObject        *pyhook_set;
+    PyObject        *pyiter;
+    PyObject        *pyhook;
+    CallbackData    *data;
+
+    pyhook_set = interp_get_hooks();
+    if (!pyhook_set || !(pyiter = PyObject_GetIter(pyhook_set))) {
+        return;
+    }
+    // Unhooking doesn't touch the set, so it can be iterated in place.
+    while ((pyhook = PyIter_Next(pyiter))) {
+        data = (CallbackData *)PyCapsule_GetContext(pyhook);
+
+        if (data && data->hook) {
+            hc_unhook(data);
+        }
+        Py_DECREF(pyhook);
+    }
+    Py_DECREF(pyiter);
+
+    if (PyErr_Occurred() || PySet_Clear(pyhook_set)) {
+        PyErr_Print();
+    }
 }
 
-int
-hc_server_attrs_callback(char *word[], char *word_eol[], 
-                         hexchat_event_attrs *attrs, void *userdata)
+/**
+ * Unhooks a callback from HexChat, from its dispatcher for print and server
+ * events, or from the timer wheel for coalesced timers.
+ */
+void
+hc_unhook(CallbackData *data)
 {
-    return hc_all_callback_inner(CBV_SRV_ATTR, word, word_eol, attrs, userdata);
+    if (data->dispatcher) {
+        dispatch_unhook(data);
+    }
+    else if (data->wheel) {
+        timerwheel_unhook(data);
+    }
+    else {
+        hexchat_unhook(ph, data->hook);
+    }
+    data->hook = NULL;
 }
 
 static inline int
@@ -1706,12 +2162,21 @@ mpy_callback(char *word[], char *word_eol[], void *userdata)
     //int          len_word_eol;
 
     static const char *help =
-        "\00311Usage: /MPY LOAD     <filename>\n"
-        "\00311            UNLOAD   <filename | name>\n"
-        "\00311            RELOAD   <filename | name>\n"
-        "\00311            LIST\n"
-        "\00311            EXEC     <command>\n"
-        "\00311            CONSOLE\n"
+        "\00311Usage: /MPY LOAD     <filename>\n"
+        "\00311            UNLOAD   <filename | name>\n"
+        "\00311            RELOAD   <filename | name>\n"
+        "\00311            HOTRELOAD <filename | name>\n"
+        "\00311            LIST\n"
+        "\00311            WATCH    [ON | OFF]\n"
+        "\00311            AUTOLOAD [ON | OFF]\n"
+        "\00311            OUTRATE  [<lines/sec> [<max queued>]]\n"
+        "\00311            EXEC     [--bg] <command>\n"
+        "\00311            CONSOLE  [--bg | --fg]\n"
+        "\00311            STATS    [ON | OFF | RESET]\n"
+        "\00311            QUOTA    [LIMIT <ms> [WARN | THROTTLE | SUSPEND]"
+                                   " [<plugin>]]\n"
+        "\00311            QUOTA    [CLEAR | RESUME] <plugin>\n"
+        "\00311            QUOTA    MEMORY [ON | OFF]\n"
         "\00311            ABOUT";
 
     tsinfo = switch_threadstate(py_g_main_threadstate);
@@ -1739,20 +2204,57 @@ mpy_callback(char *word[], char *word_eol[], void *userdata)
             retval = HEXCHAT_EAT_NONE;
         }
     }
+    else if (len_word >= 3 && pystrmatch(pycmd, "HOTRELOAD")) {
+
+        retval = hot_reload_plugin(word_eol[3]);
+    }
     else if (len_word == 2 && pystrmatch(pycmd, "LIST")) {
 
-        hexchat_printf(ph, "Not implemented yet: %s.", word[2]);
+        retval = list_plugins();
+    }
+    else if (len_word >= 2 && len_word <= 3 && pystrmatch(pycmd, "WATCH")) {
+
+        retval = watch_command(word[3]);
+    }
+    else if (len_word >= 2 && len_word <= 3 && 
+             pystrmatch(pycmd, "AUTOLOAD")) {
+
+        retval = autoload_command(word[3]);
+    }
+    else if (len_word >= 2 && len_word <= 4 && pystrmatch(pycmd, "OUTRATE")) {
+
+        retval = outqueue_command(word[3], word[4]);
+    }
+    else if (len_word >= 4 && pystrmatch(pycmd, "EXEC") &&
+             !strcmp(word[3], "--bg")) {
+
+        exec_console_command(word_eol[4], 1);
         retval = HEXCHAT_EAT_ALL;
     }
     else if (len_word >= 3 && pystrmatch(pycmd, "EXEC")) {
 
-        exec_console_command(word_eol[3]);
+        exec_console_command(word_eol[3], 0);
         retval = HEXCHAT_EAT_ALL;
     }
     else if (len_word == 2 && pystrmatch(pycmd, "CONSOLE")) {
 
         retval = create_console();
     }
+    else if (len_word == 3 && pystrmatch(pycmd, "CONSOLE") &&
+             (!strcmp(word[3], "--bg") ||
+              !strcmp(word[3], "--fg"))) {
+
+        console_set_background(!strcmp(word[3], "--bg"));
+        retval = create_console();
+    }
+    else if (len_word >= 2 && len_word <= 3 && pystrmatch(pycmd, "STATS")) {
+
+        retval = stats_command(word[3]);
+    }
+    else if (len_word >= 2 && pystrmatch(pycmd, "QUOTA")) {
+
+        retval = quota_command(word, word_eol);
+    }
     else if (len_word == 2 && pystrmatch(pycmd, "ABOUT")) {
 
         hexchat_printf(ph, "Not implemented yet: %s.", word[2]);
@@ -31,10 +31,15 @@
  *                  When the asynchronous interface is used, each function
  *                  returns immediately with an AsyncResult object that can be
  *                  either ignored, or used to block for the result of the call.
+ * channel.c     -  Declares the Channel type, a named message buffer shared
+ *                  by all the plugins that open it. Messages are copied, so
+ *                  no proxies are involved.
  * colorizelexer.yy.c
  *               -  This is an autogenerated file from Flex run on the 
  *                  colorizelexer.flex input file. It provides a function to
  *                  colorize Python source code used mainly by the console.
+ * codecache.c   -  Caches the compiled code of plugin scripts under the
+ *                  config dir so loads and reloads skip compiling them.
  * colorizelexer.flex
  *               -  Defines a simple token grammar used to add color codes to
  *                  Python text. This is the input file to Flex to produce the
@@ -60,8 +65,17 @@
  *                  The asynchronous proxy provides asynchronous delegates for
  *                  the hexchat API that return immediately with an 
  *                  AsyncResult object.
+ * dispatch.c    -  Registers one HexChat hook per print/server event and
+ *                  priority, and fans each event out to all the Python
+ *                  callbacks subscribed to it, grouped by interpreter.
  * eventattrs.c  -  Declares a simple structure for hexchat attrs. This just has 
  *                  a field with a time_t value. Some API calls use this.
+ * eventloop.c   -  Provides each plugin an asyncio event loop that's run on
+ *                  the HexChat main thread by a recurring timer. Coroutines
+ *                  can await AsyncResult objects.
+ * hookfilter.c  -  Converts the `filter` argument of hook_print() and
+ *                  hook_server() to C predicates that the dispatcher checks
+ *                  before entering the callback's interpreter.
  * listiter.c    -  Declares a list iterator type for lists requested via
  *                  hexchat.get_listiter(). This provides fast access to lists.
  *                  In contrast, get_list() constructs all the list data before
@@ -77,13 +91,35 @@
  * outstream.c   -  Declares the OutStream type wich is assigned to stdout and
  *                  stderr for each subinterpreter. The Python print() function
  *                  writes to these objects. Error output from scripts is
- *                  colorized in red by stderr.
+ *                  colorized in red by stderr. Output from threads other
+ *                  than the main thread goes to a queue that a timer prints
+ *                  at a limited rate.
  * plugin.c      -  Declares functions specific to plugins for loading and
  *                  unloading. It maintains a linked list of the currently
- *                  loaded plugins.
+ *                  loaded plugins, indexed by name, path and threadstate.
+ * prefstore.c   -  Caches pluginprefs in memory and writes changes behind on a
+ *                  timer. Stores typed and long values in HexChat's
+ *                  pluginpref file.
+ * quota.c       -  Charges the main thread time of callbacks to each plugin
+ *                  over a sliding window, and warns, throttles, or suspends
+ *                  plugins over their limit. Implements /MPY QUOTA.
+ * stats.c       -  Times hook callbacks, delegate calls, and output per
+ *                  plugin when turned on with /MPY STATS ON. Shown by
+ *                  /MPY STATS and hexchat.get_stats().
  * subinterp.c   -  Provides functions related to subinterpeters, such as 
- *                  switching between them, accessing per-interpreter data,
+ *                  switching between them, accessing per-interpreter data
+ *                  (kept in a native struct for each interp),
  *                  managing hexchat callback hooks for each interp, etc.
+ * timerwheel.c  -  Runs timers hooked with a coalesce time on one hierarchical
+ *                  timer wheel driven by a single HexChat timer, grouping
+ *                  their expirations by interp.
+ * userindex.c   -  Keeps an index of the users of joined channels, updated from
+ *                  server events, which plugins query via hexchat.users.
+ * watcher.c     -  Watches the addons directory and hot reloads plugins whose
+ *                  files change, when turned on with /MPY WATCH ON.
+ * wordlist.c    -  Declares the WordList type passed as `word` and `word_eol`
+ *                  to hook callbacks. It wraps HexChat's word arrays and only
+ *                  decodes the elements that are accessed.
  */
  
 #ifndef __MINPYTHON_H__
@@ -102,63 +138,373 @@ extern hexchat_plugin *ph;
 extern PyThreadState  *py_g_main_threadstate;
 
 /**
- * Pointers to the types declared in this library. Declaration for each is in
- * the similarly named C file.
+ * Pointers to the static definitions of the types declared in this library.
+ * Declaration for each is in the similarly named C file. Code should use the
+ * XxxTypePtr macros below rather than these.
  */ 
-extern PyTypeObject *OutStreamTypePtr;
-extern PyTypeObject *EventAttrsTypePtr;
-extern PyTypeObject *ContextTypePtr;
-extern PyTypeObject *ListIterTypePtr;
-extern PyTypeObject *DelegateTypePtr;
-extern PyTypeObject *DelegateProxyTypePtr;
-extern PyTypeObject *AsyncResultTypePtr;
-extern PyTypeObject *MainInterpTypePtr;
-extern PyTypeObject *InterpCallTypePtr;
-extern PyTypeObject *InterpObjProxyTypePtr;
+extern PyTypeObject *OutStreamTypeDef;
+extern PyTypeObject *EventAttrsTypeDef;
+extern PyTypeObject *ContextTypeDef;
+extern PyTypeObject *ListIterTypeDef;
+extern PyTypeObject *DelegateTypeDef;
+extern PyTypeObject *DelegateProxyTypeDef;
+extern PyTypeObject *AsyncResultTypeDef;
+extern PyTypeObject *MainInterpTypeDef;
+extern PyTypeObject *InterpCallTypeDef;
+extern PyTypeObject *InterpObjProxyTypeDef;
+extern PyTypeObject *WordListTypeDef;
+extern PyTypeObject *UserIndexTypeDef;
+extern PyTypeObject *ChannelTypeDef;
+
+/**
+ * Indices of the types for interp_get_type(). Keep in the same order as
+ * interp_type_defs[] in subinterp.c.
+ */
+typedef enum {
+    MPY_OUTSTREAM_TYPE,
+    MPY_EVENTATTRS_TYPE,
+    MPY_CONTEXT_TYPE,
+    MPY_LISTITER_TYPE,
+    MPY_DELEGATE_TYPE,
+    MPY_DELEGATEPROXY_TYPE,
+    MPY_ASYNCRESULT_TYPE,
+    MPY_MAININTERP_TYPE,
+    MPY_INTERPCALL_TYPE,
+    MPY_INTERPOBJPROXY_TYPE,
+    MPY_WORDLIST_TYPE,
+    MPY_USERINDEX_TYPE,
+    MPY_CHANNEL_TYPE,
+    MPY_NUM_TYPES
+} MpyTypeId;
+
+/**
+ * The types as seen by the current interp. Interps with their own GIL get
+ * their own heap type copies of the static types; every other interp uses the
+ * static types directly.
+ */
+#define OutStreamTypePtr        interp_get_type(MPY_OUTSTREAM_TYPE)
+#define EventAttrsTypePtr       interp_get_type(MPY_EVENTATTRS_TYPE)
+#define ContextTypePtr          interp_get_type(MPY_CONTEXT_TYPE)
+#define ListIterTypePtr         interp_get_type(MPY_LISTITER_TYPE)
+#define DelegateTypePtr         interp_get_type(MPY_DELEGATE_TYPE)
+#define DelegateProxyTypePtr    interp_get_type(MPY_DELEGATEPROXY_TYPE)
+#define AsyncResultTypePtr      interp_get_type(MPY_ASYNCRESULT_TYPE)
+#define MainInterpTypePtr       interp_get_type(MPY_MAININTERP_TYPE)
+#define InterpCallTypePtr       interp_get_type(MPY_INTERPCALL_TYPE)
+#define InterpObjProxyTypePtr   interp_get_type(MPY_INTERPOBJPROXY_TYPE)
+#define WordListTypePtr         interp_get_type(MPY_WORDLIST_TYPE)
+#define UserIndexTypePtr        interp_get_type(MPY_USERINDEX_TYPE)
+#define ChannelTypePtr          interp_get_type(MPY_CHANNEL_TYPE)
+
+/**
+ * Per-interpreter GILs are available from Python 3.12.
+ */
+#if PY_VERSION_HEX >= 0x030C0000
+#define MINPY_HAVE_OWN_GIL 1
+#endif
 
 /**
  * Python functions declared in minpython.c needed by context.c
  */
 extern PyObject     *py_emit_print         (PyObject *, PyObject *, PyObject *);
 extern PyObject     *py_get_info           (PyObject *, PyObject *);
-extern PyObject     *py_get_list           (PyObject *, PyObject *);
+extern PyObject     *py_get_list           (PyObject *, PyObject *, 
+                                            PyObject *);
 extern PyObject     *py_get_listiter       (PyObject *, PyObject *);
 
+/**
+ * Types of hooks/callbacks - used by code that processes events and registers
+ * callbacks.
+ */
+typedef enum {
+    CBV_PRNT      = (1 << 0), CBV_SRV      = (1 << 1), 
+    CBV_PRNT_ATTR = (1 << 2), CBV_SRV_ATTR = (1 << 3), 
+    CBV_CMD       = (1 << 4), CBV_TIMER    = (1 << 5)
+} CB_VER;
+
+/**
+ * How word_eol is passed to print and server callbacks - set by the `eol` parameter of
+ * the print and server hook functions.
+ */
+typedef enum {
+    EOL_LAZY    = 0,    // A WordList over the word WordList - 'lazy'.
+    EOL_LIST    = 1,    // A fully built list - True.
+    EOL_NONE    = 2     // None - False.
+} EOL_MODE;
+
+typedef struct _Dispatcher Dispatcher;
+typedef struct _HookFilter HookFilter;
+typedef struct _HookStats  HookStats;
+typedef struct _PluginQuota PluginQuota;
+typedef struct _WheelTimer  WheelTimer;
+
+/** 
+ * CallbackData - Used as userdata for commands/events hooked on behalf of 
+ * Python callbacks. Print and server event callbacks are subscribers of a
+ * Dispatcher (see dispatch.c), and `hook` is the dispatcher's shared hook.
+ */
+typedef struct {
+    PyObject      *callback;
+    PyObject      *userdata;
+    PyThreadState *threadstate;
+    hexchat_hook  *hook;
+    Dispatcher    *dispatcher;
+    HookFilter    *filter;
+    HookStats     *stats;
+    PluginQuota   *quota;
+    WheelTimer    *wheel;
+    int           eol;
+} CallbackData;
+
+/**
+ * Callback helpers declared in minpython.c, shared with dispatch.c.
+ */
+extern int          hc_build_words         (CB_VER, char *[], char *[],
+                                            PyObject **, PyObject **);
+extern int          interp_is_value       (PyObject *);
+extern PyObject     *hc_eol_arg            (CallbackData *, PyObject *,
+                                            PyObject **);
+extern void         hc_release_words       (PyObject *, PyObject *);
+extern int          hc_callback_retval     (CB_VER, PyObject *);
+extern void         hc_unhook_all          (void);
+
+/**
+ * Functions declared in context.c.
+ */
+extern hexchat_context *context_get_ptr    (PyObject *);
+extern PyObject        *context_intern     (hexchat_context *);
+extern PyObject        *context_find       (PyObject *, PyObject *);
+extern hexchat_context *context_find_ptr   (const char *, const char *);
+extern void            context_cache_start (void);
+extern void            context_cache_stop  (void);
+
+/**
+ * Functions declared in userindex.c.
+ */
+extern int          userindex_enable       (void);
+extern void         userindex_disable      (void);
+
+/**
+ * Functions declared in listiter.c.
+ */
+extern PyObject     *listiter_snapshot     (const char *, int);
+
+/**
+ * Functions declared in interpcall.c.
+ */
+extern PyObject     *interp_marshal        (PyObject *, int);
+extern int          interp_marshal_args   (PyObject *, PyObject *, int,
+                                            PyObject **, PyObject **);
+
+/**
+ * Functions declared in dispatch.c.
+ */
+extern hexchat_hook *dispatch_hook         (CB_VER, const char *, int,
+                                            CallbackData *);
+extern void         dispatch_unhook        (CallbackData *);
+
+/**
+ * Functions declared in codecache.c.
+ */
+extern PyObject     *codecache_get_code    (FILE *, const char *);
+
+/**
+ * Functions declared in outstream.c.
+ */
+extern void         outqueue_start         (void);
+extern void         outqueue_stop          (void);
+extern int          outqueue_command       (char *, char *);
+
+/**
+ * Functions declared in watcher.c.
+ */
+extern int          watch_init             (void);
+extern int          watch_start            (void);
+extern void         watch_stop             (void);
+extern int          watch_command          (char *);
+
+/**
+ * Functions declared in prefstore.c.
+ */
+extern const char   *pref_store_get_raw    (const char *);
+extern int          pref_store_get_int     (const char *, int);
+extern void         pref_store_set_raw     (const char *, const char *);
+extern void         pref_store_set_int     (const char *, int);
+extern int          pref_store_delete      (const char *);
+extern PyObject     *pref_store_get        (const char *);
+extern int          pref_store_set         (const char *, PyObject *);
+extern void         pref_store_flush       (void);
+extern void         pref_store_close       (void);
+
+/**
+ * Functions declared in stats.c. Times are in ns from stats_now(), and are
+ * only recorded while stats_enabled is set.
+ */
+extern int          stats_enabled;
+
+extern long long    stats_now              (void);
+extern HookStats    *stats_get             (PyThreadState *, const char *,
+                                            const char *);
+extern void         stats_record           (HookStats *, long long,
+                                            long long, long long);
+extern void         stats_forget           (PyThreadState *);
+extern void         stats_clear            (void);
+extern int          stats_command          (const char *);
+extern PyObject     *py_get_stats          (PyObject *, PyObject *);
+
+/**
+ * Functions declared in quota.c. quota_get() can be called from any thread,
+ * the rest only from the main thread.
+ */
+extern PluginQuota  *quota_get             (PyThreadState *);
+extern int          quota_blocked          (PluginQuota *, int);
+extern void         quota_charge           (PluginQuota *, long long);
+extern void         quota_forget           (PyThreadState *);
+extern void         quota_clear            (void);
+extern int          quota_command          (char *[], char *[]);
+
+/**
+ * Functions declared in timerwheel.c. Main thread only.
+ */
+extern hexchat_hook *timerwheel_hook       (CallbackData *, int, double);
+extern void         timerwheel_unhook      (CallbackData *);
+extern void         timerwheel_stop        (void);
+
+/**
+ * Functions declared in hookfilter.c.
+ */
+extern HookFilter   *hookfilter_new        (CB_VER, PyObject *);
+extern void         hookfilter_free        (HookFilter *);
+extern int          hookfilter_match       (HookFilter *, char *[], char *[]);
+
 /**
  * Enforces the policy that hexchat API calls need to occur on the main thread.
  */
 extern int          main_thread_check      (void);
 
+/**
+ * Minimal atomic operations for the lock-free structures shared between
+ * worker threads and the HexChat main thread. 'long' is used for integer
+ * values so the MSVC Interlocked functions can be used directly.
+ */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define atom_xchg_ptr(p, v)     _InterlockedExchangePointer( \
+                                    (void * volatile *)(p), (void *)(v))
+#define atom_load_ptr(p)        _InterlockedCompareExchangePointer( \
+                                    (void * volatile *)(p), NULL, NULL)
+#define atom_store_ptr(p, v)    (void)_InterlockedExchangePointer( \
+                                    (void * volatile *)(p), (void *)(v))
+#define atom_cas_long(p, o, n)  (_InterlockedCompareExchange( \
+                                    (long volatile *)(p), (n), (o)) == (o))
+#define atom_load_long(p)       _InterlockedCompareExchange( \
+                                    (long volatile *)(p), 0, 0)
+#define atom_store_long(p, v)   (void)_InterlockedExchange( \
+                                    (long volatile *)(p), (v))
+#else
+#define atom_xchg_ptr(p, v)     __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+#define atom_load_ptr(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atom_store_ptr(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atom_cas_long(p, o, n)  __extension__ ({                              \
+                                    long _o = (o);                            \
+                                    __atomic_compare_exchange_n(              \
+                                        (p), &_o, (n), 0,                     \
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);  \
+                                })
+#define atom_load_long(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atom_store_long(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/**
+ * Thread-local storage class.
+ */
+#if defined(_MSC_VER)
+#define MPY_THREAD_LOCAL        __declspec(thread)
+#else
+#define MPY_THREAD_LOCAL        __thread
+#endif
+
+/**
+ * Per-interpreter queue of Delegate calls made from other threads. See
+ * delegate.c.
+ */
+typedef struct _DelegateQueue DelegateQueue;
+
+extern DelegateQueue *delegate_queue_create     (PyThreadState *);
+extern void          delegate_queue_destroy     (DelegateQueue *);
+extern int           delegate_queue_set_budget  (DelegateQueue *, int);
+extern void          delegate_run_pending       (void);
+
+/**
+ * Per-interpreter asyncio event loop run by a HexChat timer. See eventloop.c.
+ */
+typedef struct _EventLoop EventLoop;
+
+extern EventLoop     *eventloop_create          (PyThreadState *);
+extern void          eventloop_destroy          (EventLoop *);
+extern PyObject      *py_get_event_loop         (PyObject *, PyObject *, 
+                                                             PyObject *);
+
+/**
+ * WordList functions for hook callback arguments. See wordlist.c.
+ */
+extern PyObject     *wordlist_new          (char *[], Py_ssize_t);
+extern PyObject     *wordlist_new_eol      (PyObject *);
+extern void         wordlist_release       (PyObject *);
+
 /**
  * Capsule free function used when a capsule is created for an attrs pointer.
  */
 extern void         py_attrs_free_fn       (PyObject *);
 
 /**
- * AsyncResult utility functions for setting result or error info.
+ * AsyncResult utility functions for creating, completing and waiting on
+ * AsyncResults.
  */
+extern PyObject     *asyncresult_new       (void);
+extern void         asyncresult_complete   (PyObject *, PyObject *, PyObject *);
+extern int          asyncresult_wait       (PyObject *, double);
+extern PyObject     *asyncresult_unwrap    (PyObject *);
 extern void         asyncresult_set_error  (PyObject *, PyObject *);
 extern void         asyncresult_set_result (PyObject *, PyObject *);
 
 /**
  * Struct used to assign color codes to syntax items for the colorizer.
- * Syntax highlighting is a outstream.c/colorizelexer.c feature.
+ * Syntax highlighting is a outstream.c/colorizelexer.c feature. Besides the
+ * colors, it holds the colorizer's reusable scanner, output buffer, and cache
+ * of colorized lines.
  */
+#define COLORIZER_COLOR_SIZE 16
+
 typedef struct {
-    PyObject *builtins_list;
-    PyObject *string_color;
-    PyObject *number_color;
-    PyObject *keyword_color;
-    PyObject *operator_color;
-    PyObject *origattr_color;
-    PyObject *comment_color;
-    PyObject *builtins_color;
+    char                    string_color   [COLORIZER_COLOR_SIZE];
+    char                    number_color   [COLORIZER_COLOR_SIZE];
+    char                    keyword_color  [COLORIZER_COLOR_SIZE];
+    char                    operator_color [COLORIZER_COLOR_SIZE];
+    char                    origattr_color [COLORIZER_COLOR_SIZE];
+    char                    comment_color  [COLORIZER_COLOR_SIZE];
+    char                    builtins_color [COLORIZER_COLOR_SIZE];
+    struct _GHashTable      *builtins;      // Set of builtin names.
+
+    void                    *scanner;       // yyscan_t.
+    int                     state;          // Start condition for streaming.
+    char                    *out;
+    Py_ssize_t              out_len;
+    Py_ssize_t              out_size;
+    int                     out_error;
+
+    struct _GHashTable      *cache;         // Line -> ColorCacheEntry.
+    struct _ColorCacheEntry *lru_head;
+    struct _ColorCacheEntry *lru_tail;
 } ColorizerParams;
 
 /**
- * Colorizes Python code text for outstream. Defined in colorizelexer.flex.
+ * Colorizer functions for outstream. Defined in colorizelexer.flex.
  */
-extern PyObject  *flex_colorize             (PyObject *, ColorizerParams *);
+extern int           flex_colorizer_init   (ColorizerParams *);
+extern void          flex_colorizer_free   (ColorizerParams *);
+extern const char    *flex_colorize        (ColorizerParams *, const char *,
+                                            Py_ssize_t, int, Py_ssize_t *);
 
 /**
  * Struct and functions for switching to subinterpreters and back to the prior
@@ -168,6 +514,8 @@ typedef struct {
     int           do_swap;
     int           do_release;
     PyThreadState *prior;
+    int           own_gil;      // Switched by releasing and taking GILs.
+    int           main_had_gil;
 } SwitchTSInfo;
 
 extern SwitchTSInfo switch_threadstate      (PyThreadState *);
@@ -178,9 +526,10 @@ extern void         switch_threadstate_back (SwitchTSInfo);
  */
 extern int  create_console_interp   (void);
 extern int  delete_console_interp   (void);
-extern int  exec_console_command    (const char *);
+extern int  exec_console_command    (const char *, int);
 extern int  create_console          (void);
 extern int  close_console           (void);
+extern int  console_set_background  (int);
 
 /**
  * Functions declared in plugins.c
@@ -189,6 +538,16 @@ extern int  init_plugins            (void);
 extern int  delete_plugins          (void);
 extern int  load_plugin             (char *);
 extern int  unload_plugin           (char *);
+extern int  list_plugins            (void);
+extern int  hot_reload_plugin       (char *);
+extern int  autoload_command        (char *);
+extern const char *plugin_get_name  (PyThreadState *);
+extern PyThreadState *plugin_get_threadstate(const char *);
+
+typedef void (*plugin_foreach_func)(const char *, const char *,
+                                    PyThreadState *, void *);
+
+extern void plugin_list_foreach     (plugin_foreach_func, void *);
 
 
 /**
@@ -196,7 +555,8 @@ extern int  unload_plugin           (char *);
  */
 typedef int (*interp_config_func)(PyThreadState *, void *);
 
-extern PyThreadState   *create_interp              (interp_config_func, void *);
+extern PyThreadState   *create_interp              (interp_config_func, void *,
+                                                    int);
 extern int             delete_interp               (PyThreadState *, 
                                                     interp_config_func,
                                                     void *);
@@ -208,10 +568,25 @@ extern PyObject        *interp_hook_unload          (PyObject *, PyObject *);
 extern PyObject        *interp_unhook_unload        (PyObject *);
 extern PyObject        *interp_get_hooks            (void); // BR.
 extern PyObject        *interp_get_unload_hooks     (void); // BR.
+extern void            interp_run_unload_hooks      (void);
 extern PyObject        *interp_get_queue_constr     (void); // BR.
 extern PyObject        *interp_get_namedtuple_constr(void); // BR.
 extern PyObject        *interp_get_lists_info       (void); // BR.
+extern PyObject        *interp_get_list_row_types   (void); // BR.
+extern PyObject        *interp_get_proxy_cache      (void); // BR.
+extern PyObject        *interp_get_context_cache    (void); // BR.
+extern void            interp_clear_main_proxy_cache(void);
 extern PyObject        *interp_get_plugin_name      (void); // NR.
+extern void            interp_set_plugin_name       (PyObject *);
+extern DelegateQueue   *interp_get_delegate_queue   (void);
+extern EventLoop       *interp_get_event_loop       (void);
 extern int             interp_is_primitive          (PyObject *);
+extern PyTypeObject    *interp_get_type             (MpyTypeId);
+extern void            interp_free_object           (PyObject *);
+extern Py_ssize_t      interp_count_hooks           (PyThreadState *);
+extern int             interp_has_own_gil           (PyThreadState *);
+extern int             interp_check_shared_gil      (PyThreadState *);
+extern void            interp_pool_start            (void);
+extern void            interp_pool_clear            (void);
 
 #endif // __MINPYTHON_H__ 
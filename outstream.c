@@ -38,35 +38,75 @@
  * e.g. hexchat.set_pluginpref('string_color', hexchat.IRC_RED). The settings
  * will become effective after restarting HexChat, or you can do this:
  * sys.stdout = hexchat.OutStream(); sys.stdout.colorize_on = True.
+ *
+ * With sys.stdout.colorize_stream = True, the colorizer carries its state from
+ * one write to the next, so the lines of a triple-quoted string printed one at
+ * a time are all colored as a string. The console turns this on.
+ *
+ * Output printed from threads other than the main thread is queued and printed
+ * by one timer on the main thread, at most 'rate' lines per second. If more
+ * than 'max' lines are waiting, further output is dropped and a notice of how
+ * many lines were lost is printed. Both are set with /MPY OUTRATE.
  */
 
+#include <glib.h>
 #include "minpython.h"
 
+#define OUTSTREAM_KEEP_SIZE     0x10000 // Larger buffers are freed on flush.
+
+#define OUTQUEUE_INTERVAL       50      // ms between drains of the queue.
+#define OUTQUEUE_RATE           500     // Default lines printed per second.
+#define OUTQUEUE_MAX            5000    // Default max lines waiting to print.
+#define OUTQUEUE_RATE_PREF      "mpy_out_rate"
+#define OUTQUEUE_MAX_PREF       "mpy_out_max"
+
 /**
  * OutStream object data. 
  */
 typedef struct {
     PyObject_HEAD
-    PyObject *orig_stream;
-    PyObject *str_list;
-    PyObject *emptystr;
-    PyObject *newline;
-    int      color;
+    PyObject    *orig_stream;
+    PyObject    *emptystr;
+    int         color;
+
+    // Output buffered until a newline or flush(). UTF-8 and NUL terminated.
+    char        *buf;
+    Py_ssize_t  buf_len;
+    Py_ssize_t  buf_size;
 
     // For Python script colorization in console.
     int colorize_on;
+    char colorize_stream;
     ColorizerParams colorizer_params;
+
+    // Timing of output printed on the main thread, see stats.c.
+    HookStats   *stats;
     
 } OutStreamObj;
 
-/** 
- * Data used by timer_write() to print to the active context.
+/**
+ * Output from threads other than the main thread can't be printed directly.
+ * It's added to this queue, which a single timer drains on the main thread a
+ * batch of lines at a time. The timer is hooked when output is queued and
+ * ends once the queue is empty; outqueue_hook is guarded by the lock, so it's
+ * only hooked once. When the queue is full, new output is dropped and the
+ * number of lines lost is reported when the queue catches up.
  */
 typedef struct {
-    char       *text;
-    int        color;
-    Py_ssize_t size;
-} OutStreamData;
+    GMutex      lock;
+    char        *buf;       // Queued text is buf[start] to buf[start + len].
+    Py_ssize_t  start;
+    Py_ssize_t  len;
+    Py_ssize_t  size;
+    int         lines;
+    gint64      dropped;
+    int         rate;       // Lines per second.
+    int         max;        // Max lines queued.
+    int         running;
+} OutQueue;
+
+static OutQueue     outqueue = { .rate = OUTQUEUE_RATE, .max = OUTQUEUE_MAX };
+static hexchat_hook *outqueue_hook = NULL;
 
 /**
  * Forward declarations. See actual declarations below for info on functions.
@@ -82,11 +122,20 @@ static PyObject *OutStream_get_colorize_on
 static int      OutStream_set_colorize_on
                                       (OutStreamObj *, PyObject *, void *);
 
+static int      outstream_reserve     (OutStreamObj *, Py_ssize_t);
 static int      colorize_init         (OutStreamObj *);
+static void     colorize_get_color    (char *, const char *, const char *,
+                                       const char *);
 static PyObject *add_mono_color       (OutStreamObj *, PyObject *);
-static int      timer_write           (void *);
 inline void     print_string          (const char *, Py_ssize_t);
 
+void            outqueue_start        (void);
+void            outqueue_stop         (void);
+int             outqueue_command      (char *, char *);
+static void     outqueue_push         (const char *, Py_ssize_t);
+static int      outqueue_drain        (int);
+static int      outqueue_timer        (void *);
+
 /**
  * OutStream member data.
  */
@@ -99,6 +148,11 @@ static PyMemberDef OutStream_members[] = {
      "The IRC color code as an integer to use in printing the output. "
      "E.g. IRC_RED = 4. If -1, output is not colorized."},
 
+    {"colorize_stream",   T_BOOL,      offsetof(OutStreamObj, colorize_stream),
+     0,
+     "If True, the colorizer's state, such as being in a triple-quoted "
+     "string, carries over from one write to the next."},
+
     {NULL}
 };
 
@@ -153,7 +207,7 @@ static PyTypeObject OutStreamType = {
 /**
  * Global type pointer for OutStream.
  */
-PyTypeObject *OutStreamTypePtr = &OutStreamType;
+PyTypeObject *OutStreamTypeDef = &OutStreamType;
 
 /**
  * Constructor - initializes the OutStream object.
@@ -171,13 +225,11 @@ OutStream_init(OutStreamObj *self, PyObject *args, PyObject *kwargs)
     }
     
     self->emptystr    = PyUnicode_FromString("");
-    self->newline     = PyUnicode_FromString("\n");
     self->color       = color;
     self->orig_stream = pyorig_stream;
     
     Py_INCREF(pyorig_stream);
     
-    self->str_list = PyList_New(0);
     return 0;
 }
 
@@ -188,24 +240,17 @@ static void
 OutStream_dealloc(OutStreamObj *self)
 {
     Py_XDECREF(self->orig_stream);
-    Py_XDECREF(self->str_list);
     Py_XDECREF(self->emptystr);
-    Py_XDECREF(self->newline);
+
+    PyMem_RawFree(self->buf);
     
-    Py_XDECREF(self->colorizer_params.builtins_list);
-    Py_XDECREF(self->colorizer_params.string_color);
-    Py_XDECREF(self->colorizer_params.number_color);
-    Py_XDECREF(self->colorizer_params.keyword_color);
-    Py_XDECREF(self->colorizer_params.operator_color);
-    Py_XDECREF(self->colorizer_params.origattr_color);
-    Py_XDECREF(self->colorizer_params.comment_color);
-    Py_XDECREF(self->colorizer_params.builtins_color);
+    flex_colorizer_free(&self->colorizer_params);
     
-    Py_TYPE(self)->tp_free((PyObject *)self);
+    interp_free_object((PyObject *)self);
 }
 
 /**
- * "Buffers" the provided text for printing. If it's terminated with a newline, 
+ * Buffers the provided text for printing. If it's terminated with a newline, 
  * the buffer is flushed immediately and all pending text is written to the 
  * active context window.
  * @param self      - instance.
@@ -215,98 +260,135 @@ OutStream_dealloc(OutStreamObj *self)
 PyObject *
 OutStream_write(OutStreamObj *self, PyObject *args)
 {
-    PyObject    *pycmp;
     PyObject    *pytext;
+    const char  *text;
+    Py_ssize_t  size;
 
     if (!PyArg_ParseTuple(args, "U:write", &pytext)) {
         return NULL;
     }
-    // Append the text string to the list used to "buffer" output.
-    PyList_Append(self->str_list, pytext);
+    // The UTF-8 form is cached in the str object, so usually this is free.
+    text = PyUnicode_AsUTF8AndSize(pytext, &size);
 
-    // Check for '\n' at the end.
-    pycmp = PyObject_CallMethod(pytext, "endswith", "s", "\n");
-    
-    if (pycmp == Py_True) {
-        // If the last character of the output string was '\n', call flush().
-        OutStream_flush(self, NULL);
+    if (!text) {
+        return NULL;
+    }
+    if (outstream_reserve(self, size)) {
+        return PyErr_NoMemory();
+    }
+    memcpy(self->buf + self->buf_len, text, size);
+    self->buf_len += size;
+    self->buf[self->buf_len] = '\0';
+
+    if (size > 0 && text[size - 1] == '\n') {
+        // If the last character of the output string was '\n', flush.
+        return OutStream_flush(self, NULL);
     }
-    Py_DECREF(pycmp);
-    
     Py_RETURN_NONE;
 }
 
 /**
- * "Flushes" the internal "buffer" and writes out the text to the active 
- * context.
+ * Flushes the internal buffer and writes out the text to the active context.
  */
 PyObject *
 OutStream_flush(OutStreamObj *self, PyObject *Py_UNUSED(args))
 {
-    PyObject        *pystr;
+    PyObject        *pystr  = NULL;
     PyObject        *pycolstr;
-    PyObject        *pylist;
+    char            *buf;
     const char      *text;
+    const char      *colored;
     Py_ssize_t      size;
-    OutStreamData   *data;
-    PyThreadState   *pythreadstate;
+    Py_ssize_t      colored_size;
+    Py_ssize_t      buf_size;
+    long long       t0;
+    long long       t1;
+    int             profile = stats_enabled;
     
-    // Create a new "buffer" for the OutStream.
-    pylist         = self->str_list;
-    self->str_list = PyList_New(0);
-    
-    // Join the old "buffer" list into one string.
-    pystr = PyUnicode_Join(self->emptystr, pylist);
+    if (self->buf_len == 0) {
+        Py_RETURN_NONE;
+    }
+    t0 = profile ? stats_now() : 0;
 
-    Py_DECREF(pylist);
+    // Take the buffer so output written while printing starts a new one.
+    buf            = self->buf;
+    size           = self->buf_len;
+    buf_size       = self->buf_size;
+    self->buf      = NULL;
+    self->buf_len  = 0;
+    self->buf_size = 0;
+    text           = buf;
 
     if (self->colorize_on) {
-        // Colorize the string if Python code colorization is enabled.
-        pycolstr = PyObject_CallMethod((PyObject *)
-                                       self, "colorize", "O", pystr);
-        Py_DECREF(pystr);
-        pystr = pycolstr;
+        // Colorize the text if Python code colorization is enabled. If it
+        // fails, the text is printed as is.
+        if (self->colorizer_params.scanner || !colorize_init(self)) {
+            colored = flex_colorize(&self->colorizer_params, buf, size,
+                                    self->colorize_stream, &colored_size);
+            if (colored) {
+                text = colored;
+                size = colored_size;
+            }
+        }
+        else {
+            PyErr_Clear();
+        }
     }
     else if (self->color != -1) {
         // Mono color enabled. This is used for stderr output in red.
+        pystr = PyUnicode_DecodeUTF8(buf, size, "replace");
+
+        if (!pystr) {
+            PyMem_RawFree(buf);
+            return NULL;
+        }
         pycolstr = add_mono_color(self, pystr);
-        Py_DECREF(pystr);
-        pystr = pycolstr;
+
+        if (pycolstr) {
+            Py_DECREF(pystr);
+            pystr = pycolstr;
+        }
+        else {
+            PyErr_Clear();
+        }
+        text = PyUnicode_AsUTF8AndSize(pystr, &size);
     }
     
-    // Get the current threadstate.
-    pythreadstate = PyThreadState_Get(); // PyGILState_GetThisThreadState();
-    
-    // Get the text to be printed.
-    text  = PyUnicode_AsUTF8AndSize(pystr, &size);
-    
-    if (pythreadstate->thread_id == py_g_main_threadstate->thread_id) {
+    if (PyThreadState_Get()->thread_id == py_g_main_threadstate->thread_id) {
         // This is the main thread. Just print the text.
+        t1 = profile ? stats_now() : 0;
         print_string(text, size);
+
+        if (profile) {
+            if (!self->stats) {
+                self->stats = stats_get(interp_get_main_threadstate(),
+                                        "output", (self->color != -1) ?
+                                                  "stderr" : "stdout");
+            }
+            stats_record(self->stats, 0, t1 - t0, stats_now() - t1);
+        }
     }
     else {
-        // This isn't the main thread. Use the timer queue to print the 
-        // text.
-        size++;
-        
-        data = (OutStreamData *)PyMem_RawMalloc(sizeof(OutStreamData));
-        data->color = self->color;
-        data->text  = (char *)PyMem_RawMalloc(size);
-        data->size = size;
-
-        memcpy(data->text, text, size);
+        // This isn't the main thread. The queue's timer prints the text.
+        outqueue_push(text, size);
+    }
+    Py_XDECREF(pystr);
 
-        hexchat_hook_timer(ph, 0, timer_write, data);
+    if (!self->buf && buf_size <= OUTSTREAM_KEEP_SIZE) {
+        // Nothing was written while printing; reuse the buffer.
+        self->buf      = buf;
+        self->buf_size = buf_size;
+    }
+    else {
+        PyMem_RawFree(buf);
     }
-    Py_DECREF(pystr);
-    
     Py_RETURN_NONE;
 }
 
 
 /**
  * Colorizes the Python code string passed to it. This method is available
- * via OutStream objects.
+ * via OutStream objects. The stream's streaming state isn't used or changed.
  * @param self      - instance.
  * @param args      - 'str' from Python. The string of Python code to colorize.
  * @returns - Either the colorized string object, or NULL with error state set.
@@ -314,34 +396,28 @@ OutStream_flush(OutStreamObj *self, PyObject *Py_UNUSED(args))
 PyObject *
 OutStream_colorize(OutStreamObj *self, PyObject *args)
 {
-    PyObject *pystr;
-    PyObject *pycolstr;
+    PyObject    *pystr;
+    const char  *text;
+    const char  *colored;
+    Py_ssize_t  size;
 
     if (!PyArg_ParseTuple(args, "U:colorize", &pystr)) {
         return NULL;
     }
-    if (self->colorizer_params.builtins_color == NULL) {
-        colorize_init(self);
+    if (!self->colorizer_params.scanner && colorize_init(self)) {
+        return NULL;
     }
-    Py_INCREF(pystr);
-
-    pycolstr = flex_colorize(pystr, &self->colorizer_params);
+    text = PyUnicode_AsUTF8AndSize(pystr, &size);
 
-    if (!pycolstr) {
-        // If there's an error, just clear it and use the original string.
-        PyErr_Clear();
+    if (!text) {
+        return NULL;
     }
-    else {
-        if (PyUnicode_GetLength(pycolstr) >= PyUnicode_GetLength(pystr)) {
-            // All OK - use the colorized string.
-            Py_DECREF(pystr);
-            pystr = pycolstr;
-        }
-        else {
-            Py_XDECREF(pycolstr);
-        }
+    colored = flex_colorize(&self->colorizer_params, text, size, 0, &size);
+
+    if (!colored) {
+        return PyErr_NoMemory();
     }
-    return pystr;
+    return PyUnicode_DecodeUTF8(colored, size, "replace");
 }
 
 /**
@@ -381,7 +457,7 @@ OutStream_set_colorize_on(OutStreamObj *self, PyObject *value, void *closure)
             "colorize_on requres boolean type.");
         return -1;
     }
-    if (value == Py_True && !self->colorizer_params.builtins_list) {
+    if (value == Py_True && !self->colorizer_params.scanner) {
         if (colorize_init(self)) {
             self->colorize_on = 0;
             return -1;
@@ -391,17 +467,33 @@ OutStream_set_colorize_on(OutStreamObj *self, PyObject *value, void *closure)
 }
 
 /**
- * Timer callback that writes text to the current context.
+ * Makes room in the OutStream's buffer for more text and its NUL terminator.
+ * @param self  - instance.
+ * @param size  - The number of bytes to be appended.
+ * @returns - 0 on success, -1 if out of memory.
  */
 int
-timer_write(void *userdata)
+outstream_reserve(OutStreamObj *self, Py_ssize_t size)
 {
-    OutStreamData *data = (OutStreamData *)userdata;
+    Py_ssize_t  need = self->buf_len + size + 1;
+    Py_ssize_t  new_size;
+    char        *buf;
 
-    print_string(data->text, data->size);
-    
-    PyMem_RawFree(data->text);
-    PyMem_RawFree(data);
+    if (need <= self->buf_size) {
+        return 0;
+    }
+    new_size = self->buf_size ? self->buf_size : 256;
+
+    while (new_size < need) {
+        new_size *= 2;
+    }
+    buf = PyMem_RawRealloc(self->buf, new_size);
+
+    if (!buf) {
+        return -1;
+    }
+    self->buf      = buf;
+    self->buf_size = new_size;
     return 0;
 }
 
@@ -435,61 +527,108 @@ add_mono_color(OutStreamObj *self, PyObject *pystr)
 
 /**
  * Used internally by colorize_init() to set the color for syntax items using
- * either pluginprefs, or the default colors.
- * @param pymodule      - The hexchat module.
+ * either pluginprefs, or the default colors. A pluginpref can hold a color 
+ * string such as hexchat.IRC_RED, or a color number.
+ * @param color         - Receives the color string.
+ * @param plugin        - The name of the plugin the stream belongs to.
  * @param syntax_item   - The name of the syntax item: 'string_color',
  *                        'number_color', 'keyword_color', 'operator_color',
  *                        'comment_color', 'builtins_color'.
- * @param default_color - The name of the default color to use: one of the
- *                        hexchat module attributes that begin with 'IRC_'.
- * @returns - The color code from either pluginprefs or the default.
+ * @param default_color - The color to use if the pluginpref isn't set.
  */
-inline PyObject *
-get_color(PyObject *pymodule, char *syntax_item, char *default_color)
+void
+colorize_get_color(char *color, const char *plugin, const char *syntax_item,
+                   const char *default_color)
 {
-    PyObject *pypref;
+    char        key[256];
+    const char  *val;
+    char        *end;
+    long        num;
 
-    pypref = PyObject_CallMethod(pymodule, "get_pluginpref", "s", syntax_item);
+    // Same key as hexchat.get_pluginpref() uses for the plugin.
+    g_snprintf(key, sizeof(key), "%s %s", plugin, syntax_item);
 
-    if (pypref == Py_None) {
-        Py_DECREF(pypref);
-        pypref = PyObject_GetAttrString(pymodule, default_color);
+    val = pref_store_get_raw(key);
+
+    if (!val || *val == '\001') {
+        // Not set, or set to something that isn't a str or int.
+        g_strlcpy(color, default_color, COLORIZER_COLOR_SIZE);
+        return;
     }
+    num = strtol(val, &end, 10);
 
-    return pypref;
+    if (*val && !*end) {
+        g_snprintf(color, COLORIZER_COLOR_SIZE, "\003%02ld", num);
+    }
+    else {
+        g_strlcpy(color, val, COLORIZER_COLOR_SIZE);
+    }
 }
 
 /**
- * Initializes the colorization parameters - assigns colors to syntax items.
- * @returns - 0.
+ * Initializes the colorization parameters - assigns colors to syntax items,
+ * builds the set of builtin names, and creates the scanner.
+ * @returns - 0 on success, -1 on fail with error state set.
  */
 int
 colorize_init(OutStreamObj *self)
 {
-    PyObject *pybuiltins_module;
-    PyObject *pyhcmodule;
+    ColorizerParams *cp = &self->colorizer_params;
+    PyObject        *pybuiltins_module;
+    PyObject        *pynames;
+    PyObject        *pyplugin;
+    const char      *plugin;
+    const char      *name;
+    Py_ssize_t      i;
 
-    pyhcmodule        = PyImport_ImportModule("hexchat");
     pybuiltins_module = PyImport_ImportModule("builtins");
 
-    ColorizerParams cp = {
-        .builtins_list  = PyObject_Dir(pybuiltins_module),
-        .origattr_color = PyObject_GetAttrString(pyhcmodule,
-                                                 "IRC_ORIG_ATTRIBS"),
+    if (!pybuiltins_module) {
+        return -1;
+    }
+    pynames = PyObject_Dir(pybuiltins_module);
 
-        .string_color   = get_color(pyhcmodule, "string_color",  "IRC_MAGENTA"),
-        .number_color   = get_color(pyhcmodule, "number_color",  "IRC_CYAN"),
-        .keyword_color  = get_color(pyhcmodule, "keyword_color", "IRC_NAVY"),
-        .operator_color = get_color(pyhcmodule, "operator_color", "IRC_OLIVE"),
-        .comment_color  = get_color(pyhcmodule, "comment_color",  "IRC_GREEN"),
-        .builtins_color = get_color(pyhcmodule, "builtins_color", "IRC_TEAL"),
-    };
+    Py_DECREF(pybuiltins_module);
 
-    self->colorizer_params = cp;
+    if (!pynames) {
+        return -1;
+    }
+    pyplugin = interp_get_plugin_name(); // NR.
+    plugin   = PyUnicode_AsUTF8(pyplugin);
 
-    Py_DECREF(pybuiltins_module);
-    Py_DECREF(pyhcmodule);
-    
+    if (!plugin) {
+        PyErr_Clear();
+        plugin = "";
+    }
+    colorize_get_color(cp->string_color,   plugin, "string_color",   "\00313");
+    colorize_get_color(cp->number_color,   plugin, "number_color",   "\00311");
+    colorize_get_color(cp->keyword_color,  plugin, "keyword_color",  "\00302");
+    colorize_get_color(cp->operator_color, plugin, "operator_color", "\00307");
+    colorize_get_color(cp->comment_color,  plugin, "comment_color",  "\00303");
+    colorize_get_color(cp->builtins_color, plugin, "builtins_color", "\00310");
+    g_strlcpy(cp->origattr_color, "\017", COLORIZER_COLOR_SIZE);
+
+    Py_DECREF(pyplugin);
+
+    // A set is much faster to check identifiers against than the list.
+    cp->builtins = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, 
+                                         NULL);
+
+    for (i = 0; i < PyList_GET_SIZE(pynames); i++) {
+        name = PyUnicode_AsUTF8(PyList_GET_ITEM(pynames, i));
+
+        if (name) {
+            g_hash_table_add(cp->builtins, g_strdup(name));
+        }
+    }
+    Py_DECREF(pynames);
+    PyErr_Clear();
+
+    if (flex_colorizer_init(cp)) {
+        flex_colorizer_free(cp);
+        PyErr_NoMemory();
+        return -1;
+    }
     return 0;
 }
 
@@ -574,3 +713,251 @@ print_string(const char *str, Py_ssize_t size)
         PyMem_RawFree(buf);
     }
 }
+
+/**
+ * Starts queueing output from threads. The rate and queue limit come from
+ * pluginprefs set by /MPY OUTRATE.
+ */
+void
+outqueue_start()
+{
+    int rate = pref_store_get_int(OUTQUEUE_RATE_PREF, -1);
+    int max  = pref_store_get_int(OUTQUEUE_MAX_PREF, -1);
+
+    g_mutex_lock(&outqueue.lock);
+    outqueue.rate    = rate > 0 ? rate : OUTQUEUE_RATE;
+    outqueue.max     = max  > 0 ? max  : OUTQUEUE_MAX;
+    outqueue.running = 1;
+    g_mutex_unlock(&outqueue.lock);
+}
+
+/**
+ * Stops the timer and prints whatever is left in the queue. Output from 
+ * threads after this is dropped.
+ */
+void
+outqueue_stop()
+{
+    hexchat_hook *hook;
+
+    g_mutex_lock(&outqueue.lock);
+    hook             = outqueue_hook;
+    outqueue_hook    = NULL;
+    outqueue.running = 0;
+    g_mutex_unlock(&outqueue.lock);
+
+    if (hook) {
+        hexchat_unhook(ph, hook);
+    }
+
+    outqueue_drain(-1);
+
+    g_mutex_lock(&outqueue.lock);
+    PyMem_RawFree(outqueue.buf);
+    outqueue.buf   = NULL;
+    outqueue.size  = 0;
+    outqueue.start = 0;
+    outqueue.len   = 0;
+    g_mutex_unlock(&outqueue.lock);
+}
+
+/**
+ * Implements /MPY OUTRATE [<lines/sec> [<max queued lines>]]. Sets how fast
+ * output from threads is printed and how much can wait before it's dropped.
+ * Without arguments the current settings are printed.
+ * @param rate  - Lines per second as a string, or "".
+ * @param max   - Max lines queued as a string, or "".
+ * @returns - HEXCHAT_EAT_ALL.
+ */
+int
+outqueue_command(char *rate, char *max)
+{
+    int value;
+
+    if (*rate) {
+        value = atoi(rate);
+
+        if (value > 0) {
+            g_mutex_lock(&outqueue.lock);
+            outqueue.rate = value;
+            g_mutex_unlock(&outqueue.lock);
+            pref_store_set_int(OUTQUEUE_RATE_PREF, value);
+        }
+    }
+    if (*max) {
+        value = atoi(max);
+
+        if (value > 0) {
+            g_mutex_lock(&outqueue.lock);
+            outqueue.max = value;
+            g_mutex_unlock(&outqueue.lock);
+            pref_store_set_int(OUTQUEUE_MAX_PREF, value);
+        }
+    }
+    hexchat_printf(ph, "Thread output is printed at up to %i lines/sec with "
+                       "up to %i lines queued.", outqueue.rate, outqueue.max);
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Adds output from a thread other than the main thread to the queue, and
+ * hooks the timer that prints it if it isn't already. A newline is added if
+ * the text doesn't end with one, so each flush() prints on its own line as it
+ * would from the main thread.
+ * @param text  - UTF-8 text to print.
+ * @param size  - The length of the text in bytes.
+ */
+void
+outqueue_push(const char *text, Py_ssize_t size)
+{
+    Py_ssize_t  need;
+    Py_ssize_t  new_size;
+    char        *buf;
+    Py_ssize_t  i;
+    int         add_nl;
+    int         lines   = 0;
+
+    for (i = 0; i < size; i++) {
+        lines += text[i] == '\n';
+    }
+    add_nl  = size == 0 || text[size - 1] != '\n';
+    lines  += add_nl;
+
+    g_mutex_lock(&outqueue.lock);
+
+    if (!outqueue.running || outqueue.lines + lines > outqueue.max) {
+        // Full; GUI responsiveness wins over completeness.
+        outqueue.dropped += outqueue.running ? lines : 0;
+        g_mutex_unlock(&outqueue.lock);
+        return;
+    }
+    need = outqueue.len + size + add_nl + 1;
+
+    if (outqueue.start + need > outqueue.size) {
+        if (outqueue.start > 0) {
+            // Move pending text to the front to reuse the printed space.
+            memmove(outqueue.buf, outqueue.buf + outqueue.start, 
+                    outqueue.len);
+            outqueue.start = 0;
+        }
+        if (need > outqueue.size) {
+            new_size = outqueue.size ? outqueue.size : 4096;
+
+            while (new_size < need) {
+                new_size *= 2;
+            }
+            buf = PyMem_RawRealloc(outqueue.buf, new_size);
+
+            if (!buf) {
+                outqueue.dropped += lines;
+                g_mutex_unlock(&outqueue.lock);
+                return;
+            }
+            outqueue.buf  = buf;
+            outqueue.size = new_size;
+        }
+    }
+    buf = outqueue.buf + outqueue.start + outqueue.len;
+
+    memcpy(buf, text, size);
+
+    if (add_nl) {
+        buf[size] = '\n';
+    }
+    outqueue.len   += size + add_nl;
+    outqueue.lines += lines;
+
+    // Hooked under the lock, so the timer can't see the queue empty and end
+    // before outqueue_hook is set.
+    if (!outqueue_hook) {
+        outqueue_hook = hexchat_hook_timer(ph, OUTQUEUE_INTERVAL, 
+                                           outqueue_timer, NULL);
+    }
+    g_mutex_unlock(&outqueue.lock);
+}
+
+/**
+ * Prints up to 'budget' lines from the queue as one block, followed by a
+ * notice if any output was dropped.
+ * @param budget    - The max lines to print, or -1 for all.
+ * @returns - The number of lines still queued.
+ */
+int
+outqueue_drain(int budget)
+{
+    char        *text;
+    Py_ssize_t  size;
+    gint64      dropped;
+    int         lines   = 0;
+    int         left;
+
+    g_mutex_lock(&outqueue.lock);
+
+    if (outqueue.lines == 0 && outqueue.dropped == 0) {
+        g_mutex_unlock(&outqueue.lock);
+        return 0;
+    }
+    text = outqueue.buf + outqueue.start;
+
+    for (size = 0; size < outqueue.len && lines != budget; size++) {
+        lines += text[size] == '\n';
+    }
+    text = NULL;
+
+    if (size > 0) {
+        // Copy out so the lock isn't held while HexChat prints.
+        text = PyMem_RawMalloc(size + 1);
+
+        if (text) {
+            memcpy(text, outqueue.buf + outqueue.start, size);
+            text[size - 1] = '\0'; // Replaces the final newline.
+        }
+        outqueue.start += size;
+        outqueue.len   -= size;
+        outqueue.lines -= lines;
+
+        if (outqueue.len == 0) {
+            outqueue.start = 0;
+        }
+    }
+    dropped          = outqueue.dropped;
+    outqueue.dropped = 0;
+    left             = outqueue.lines;
+
+    g_mutex_unlock(&outqueue.lock);
+
+    if (text) {
+        print_string(text, size);
+        PyMem_RawFree(text);
+    }
+    if (dropped) {
+        hexchat_printf(ph, "\00314[%" G_GINT64_FORMAT " lines of thread "
+                           "output dropped]", dropped);
+    }
+    return left;
+}
+
+/**
+ * Timer callback that prints the next batch of queued output. The batch size 
+ * is set from the rate so output is printed at no more than that many lines 
+ * per second.
+ * @returns - 1 to keep the timer going, or 0 once the queue is empty.
+ */
+int
+outqueue_timer(void *userdata)
+{
+    int budget = outqueue.rate * OUTQUEUE_INTERVAL / 1000;
+    int done;
+
+    outqueue_drain(budget > 0 ? budget : 1);
+
+    // Output queued since the drain keeps the timer going.
+    g_mutex_lock(&outqueue.lock);
+    done = outqueue.lines == 0 && outqueue.dropped == 0;
+    if (done) {
+        outqueue_hook = NULL;
+    }
+    g_mutex_unlock(&outqueue.lock);
+
+    return !done;
+}
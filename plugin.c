@@ -27,41 +27,104 @@
  * mangement of plugins written in Python.
  */
 
+#include <glib.h>
+#include <glib/gstdio.h>
 #include "minpython.h"
 
 #define MAX_IDCHR    512 
+#define AUTOLOAD_PREF "mpy_autoload" // No space, so no plugin's key.
 
 /**
- * Plugin info. Linked list item.
+ * The keys plugins are indexed by, besides their threadstate.
+ */
+enum {
+    PLUGIN_BY_NAME,
+    PLUGIN_BY_PATH,
+    PLUGIN_NUM_KEYS
+};
+
+/**
+ * Plugin info. Linked list item. Plugins loaded with the same name or path as
+ * an earlier one are chained from it by 'same', in load order.
  */
 typedef struct _PluginData {
     struct
     _PluginData     *next;
+    struct
+    _PluginData     *prev;
+    struct
+    _PluginData     *same[PLUGIN_NUM_KEYS];
     PyThreadState   *threadstate;
     void            *plugin_handle;
-    PyObject        *name;
-    PyObject        *path;
+    char            *name;      // UTF-8, so no interp owns them.
+    char            *path;
+    gint64          load_time;  // Microseconds taken to load.
+    gint64          exec_time;  // Wall clock time the script was last run.
 } PluginData;
 
 /**
- * Linked list root for plugin info.
+ * Linked list root for plugin info, and its last item.
  */
 static PluginData plugin_data = { .next = NULL };
+static PluginData *plugin_last = &plugin_data;
+
+/**
+ * The first plugin loaded with each name and path, and the plugin of each
+ * threadstate. Keys are owned by the PluginData. Created by the first
+ * plugin_list_add().
+ */
+static GHashTable *plugin_index[PLUGIN_NUM_KEYS] = { NULL };
+static GHashTable *plugin_index_ts               = NULL;
+
+/**
+ * A plugin found in the addons directory at startup. The header fields are
+ * read by autoload_scan() on a worker thread.
+ */
+typedef struct {
+    char    *path;
+    char    *name;          // __module_name__, or NULL if not declared.
+    char    **requires;     // __module_requires__, NULL terminated.
+    int     state;          // For ordering: 0 new, 1 visiting, 2 done.
+} AutoloadItem;
 
 int                 init_plugins            (void);
 int                 delete_plugins          (void);
 int                 load_plugin             (char *);
 int                 unload_plugin           (char *);
+int                 list_plugins            (void);
+int                 hot_reload_plugin       (char *);
+int                 autoload_command        (char *);
+const char          *plugin_get_name        (PyThreadState *);
+PyThreadState       *plugin_get_threadstate (const char *);
+void                plugin_list_foreach     (plugin_foreach_func, void *);
 
 static int          load_plugin_callback    (char *[], char *[], void *);
 static int          unload_plugin_callback  (char *[], char *[], void *);
 static int          reload_plugin_callback  (char *[], char *[], void *);
 
-static void         plugin_list_add         (PyObject *, PyObject *, 
-                                             PyThreadState *, void *);
-//static PluginData   *plugin_list_find_ts    (PyThreadState *);
-static PluginData   *plugin_list_remove     (PyObject *);
+static void         plugin_list_add         (const char *, const char *,
+                                             PyThreadState *, void *, gint64);
+static PluginData   *plugin_list_find_ts    (PyThreadState *);
+static PluginData   *plugin_list_find       (const char *);
+static PluginData   *plugin_list_remove     (const char *);
+static char         *plugin_resolve_path    (const char *);
 static void         plugin_list_clear       (void);
+static const char   *plugin_key             (PluginData *, int);
+static void         plugin_index_add        (PluginData *, int);
+static void         plugin_index_remove     (PluginData *, int);
+
+static int          plugin_run_file         (FILE *, const char *);
+static void         plugin_reset_main       (void);
+static void         plugin_drop_modules     (const char *, gint64);
+static int          plugin_wants_own_gil    (FILE *);
+static const char   *plugin_header_value    (const char *, const char *);
+
+static int          autoload_callback       (void *);
+static void         autoload_scan           (gpointer, gpointer);
+static char         **autoload_parse_names  (const char *, int);
+static void         autoload_order          (AutoloadItem *, AutoloadItem *,
+                                             int, AutoloadItem **, int *);
+static int          autoload_cmp            (const void *, const void *);
 
 
 /**
@@ -83,6 +146,12 @@ init_plugins()
     hexchat_hook_command(ph, "RELOAD",  HEXCHAT_PRI_NORM, 
                          reload_plugin_callback,
                          "Handles reload events for MinPython plugins.", NULL);    
+
+    // Load the addons once HexChat is running, if that's turned on. It's off
+    // by default since HexChat's own Python plugin loads the same directory.
+    if (pref_store_get_int(AUTOLOAD_PREF, 0) == 1) {
+        hexchat_hook_timer(ph, 0, autoload_callback, NULL);
+    }
     return 0;
 }
 
@@ -110,7 +179,7 @@ create_interp_callback(PyThreadState *ts, void *userdata)
     PyObject   *pymain_module;
     PyObject   *pymain_dict;
     PyObject   *pystr;
-    PyObject   *pymodname, *pypath;
+    PyObject   *pymodname;
     const char *modname;
     const char *version;
     const char *desc;
@@ -118,12 +187,13 @@ create_interp_callback(PyThreadState *ts, void *userdata)
     void       *plugin_handle;
     FILE       *fp;
     int        script_ret;
+    gint64     load_time;
     
     fp   = (FILE *)((void **)userdata)[0];
     path = (char *)((void **)userdata)[1];
     
     // Run the Python script.
-    script_ret = PyRun_SimpleFile(fp, path);
+    script_ret = plugin_run_file(fp, path);
     
     fclose(fp);    
     
@@ -158,14 +228,17 @@ create_interp_callback(PyThreadState *ts, void *userdata)
                 plugin_handle = hexchat_plugingui_add(ph, path, modname,
                     desc, version, NULL);
 
-                pypath = PyUnicode_FromString(path);
+                load_time = g_get_monotonic_time() - 
+                            *(gint64 *)((void **)userdata)[2];
 
                 // Add local list item for it.
-                plugin_list_add(pymodname, pypath, ts, plugin_handle);
+                plugin_list_add(modname, path, ts, plugin_handle, load_time);
 
-                Py_DECREF(pypath);
+                // Cache the name for pluginpref calls.
+                interp_set_plugin_name(pymodname);
 
-                hexchat_printf(ph, "%s loaded.", modname);
+                hexchat_printf(ph, "%s loaded (%.1f ms).", modname,
+                               load_time / 1000.0);
             }
         }
     }
@@ -182,82 +255,68 @@ create_interp_callback(PyThreadState *ts, void *userdata)
 int 
 load_plugin(char *name_or_path)
 {   
-    PyObject   *pyos_module;
-    PyObject   *pypath_obj;
-    PyObject   *pylibdir;
-    PyObject   *pyplugin_path;
-    PyObject   *pyenc_path;
-    const char *libdir;
-    const char *modname;
     FILE       *fp;
-    void       *userdata[2]; // fp, path
+    char       *path;
+    void       *userdata[3]; // fp, path, start time
+    int        own_gil;
+    gint64     start_time;
 
-    // This function will be executing within the main Python interpreter when
-    // called.
-    
-    // This should succeed if path is absolute. However it could just be the
-    // name of the file.
-    fp = fopen(name_or_path, "r");
+    start_time = g_get_monotonic_time();
+
+    // The plugin is known by its full path from here on, so reloading it and
+    // caching its code don't depend on HexChat's working directory.
+    path = plugin_resolve_path(name_or_path);
+    fp   = path ? fopen(path, "r") : NULL;
 
     if (!fp) {
-        // If fopen() failed, prepend the addons directory to the path
-        // and try again.
+        hexchat_printf(ph, "Couldn't load %s.", name_or_path);
+        g_free(path);
+        return HEXCHAT_EAT_ALL;
+    }
+    userdata[0] = fp;
+    userdata[1] = path;
+    userdata[2] = &start_time;
+
+    own_gil = plugin_wants_own_gil(fp);
     
-        modname = name_or_path;
+    create_interp(create_interp_callback, &userdata, own_gil);
+    g_free(path);
     
-        // Retrieve the os.path object.
-        pyos_module = PyImport_AddModule("os"); // BR
-        if (!pyos_module) { 
-            PyErr_Print(); 
-            return HEXCHAT_EAT_ALL;
-        }
-        pypath_obj = PyObject_GetAttrString(pyos_module, "path"); // NR
-        
-        // Get the addons dir path.
-        libdir   = hexchat_get_info(ph, "xchatdir");
-        pylibdir = PyUnicode_DecodeFSDefault(libdir);
-        
-        if (!pylibdir) {
-            Py_DECREF(pypath_obj);
-            PyErr_Print();
-            return HEXCHAT_EAT_ALL;
-        }
-        
-        // Join the addons path with the file name.
-        pyplugin_path = PyObject_CallMethod(pypath_obj, "join", "Oss", 
-                                            pylibdir,"addons", modname);
-        Py_DECREF(pypath_obj);
-        Py_DECREF(pylibdir);
+    return HEXCHAT_EAT_ALL;
+}
 
-        if (!pyplugin_path) {
-            PyErr_Print();
-            return HEXCHAT_EAT_ALL;
-        }
-        pyenc_path = PyUnicode_EncodeFSDefault(pyplugin_path);
+/**
+ * Resolves the path of a plugin file given to /LOAD. A path that names an
+ * existing file is made absolute; otherwise it's taken as relative to the
+ * addons directory.
+ * @param name_or_path  - The file name or path, UTF-8 encoded.
+ * @returns - The full path, which the caller frees, or NULL if there's no
+ *            such file.
+ */
+char *
+plugin_resolve_path(const char *name_or_path)
+{
+    char *cwd;
+    char *path;
 
-        Py_DECREF(pyplugin_path);
-        
-        if (!pyenc_path) {
-            PyErr_Print();
-            return HEXCHAT_EAT_ALL;
-        }
-        
-        // Try opening the file again with the full path.
-        fp = fopen(PyBytes_AsString(pyenc_path), "r");
-        
-        Py_DECREF(pyenc_path);
-        
-        if (!fp) {
-            hexchat_printf(ph, "Couldn't load %s.", name_or_path);
-            return HEXCHAT_EAT_ALL;
+    if (g_file_test(name_or_path, G_FILE_TEST_IS_REGULAR)) {
+        if (g_path_is_absolute(name_or_path)) {
+            return g_strdup(name_or_path);
         }
-    }    
-    userdata[0] = fp;
-    userdata[1] = name_or_path;
-    
-    create_interp(create_interp_callback, &userdata);
-    
-    return HEXCHAT_EAT_ALL;
+        cwd  = g_get_current_dir();
+        path = g_build_filename(cwd, name_or_path, NULL);
+        g_free(cwd);
+
+        return path;
+    }
+    path = g_build_filename(hexchat_get_info(ph, "xchatdir"), "addons",
+                            name_or_path, NULL);
+
+    if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+        g_free(path);
+        return NULL;
+    }
+    return path;
 }
 
 /**
@@ -272,22 +331,17 @@ int
 unload_plugin(char *name_or_path)
 {
     PluginData  *pd;
-    PyObject    *pyname;
 
-    pyname = PyUnicode_FromString(name_or_path);
-    
-    pd = plugin_list_remove(pyname);
-    
-    Py_DECREF(pyname);
+    pd = plugin_list_remove(name_or_path);
     
     if (pd) { 
         delete_interp(pd->threadstate, NULL, NULL);
         
         hexchat_plugingui_remove(ph, pd->plugin_handle);
-        hexchat_printf(ph, "%s unloaded.", PyUnicode_AsUTF8(pd->name));
+        hexchat_printf(ph, "%s unloaded.", pd->name);
 
-        Py_DECREF(pd->name);
-        Py_DECREF(pd->path);
+        g_free(pd->name);
+        g_free(pd->path);
         
         PyMem_RawFree(pd);
 
@@ -296,6 +350,233 @@ unload_plugin(char *name_or_path)
     return HEXCHAT_EAT_NONE;
 }
 
+/**
+ * Reloads a plugin without replacing its interpreter, so the modules it has
+ * imported stay loaded. Its unload hooks are called and its hooks removed,
+ * then its script is run again in the same __main__. Globals the script names
+ * in `__module_persistent__` keep their values; the others are cleared first.
+ * Modules imported from the plugin's directory that changed since the last
+ * run are removed from sys.modules so the script imports them afresh.
+ * Implements /MPY HOTRELOAD.
+ *
+ * @param name_or_path - the name or path of the plugin to reload.
+ * @returns - HEXCHAT_EAT_ALL if found, HEXCHAT_EAT_NONE if not.
+ */
+int
+hot_reload_plugin(char *name_or_path)
+{
+    PluginData      *pd;
+    SwitchTSInfo    tsinfo;
+    FILE            *fp;
+    char            *dir;
+    gint64          start_time;
+    gint64          exec_time;
+    int             ret;
+
+    if (!(pd = plugin_list_find(name_or_path))) {
+        return HEXCHAT_EAT_NONE;
+    }
+    if (!(fp = fopen(pd->path, "r"))) {
+        hexchat_printf(ph, "Couldn't read %s.", pd->path);
+        return HEXCHAT_EAT_ALL;
+    }
+    start_time = g_get_monotonic_time();
+    exec_time  = g_get_real_time();
+
+    tsinfo = switch_threadstate(pd->threadstate);
+
+    interp_run_unload_hooks();
+    hc_unhook_all();
+    plugin_reset_main();
+
+    dir = g_path_get_dirname(pd->path);
+    plugin_drop_modules(dir, pd->exec_time);
+    g_free(dir);
+
+    ret = plugin_run_file(fp, pd->path);
+    fclose(fp);
+
+    switch_threadstate_back(tsinfo);
+
+    pd->exec_time = exec_time;
+    pd->load_time = g_get_monotonic_time() - start_time;
+
+    if (ret) {
+        hexchat_printf(ph, "\00304%s failed to reload; it has no hooks until "
+                       "it's reloaded again.", pd->name);
+    }
+    else {
+        hexchat_printf(ph, "%s reloaded (%.1f ms).", pd->name,
+                       pd->load_time / 1000.0);
+    }
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Clears the current interp's __main__ for a hot reload, except for dunder
+ * names and those listed in `__module_persistent__`.
+ */
+void
+plugin_reset_main()
+{
+    PyObject    *pymain_dict;
+    PyObject    *pykeep;
+    PyObject    *pykeys;
+    PyObject    *pykey;
+    Py_ssize_t  len;
+    Py_ssize_t  i;
+    int         keep;
+
+    pymain_dict = PyModule_GetDict(PyImport_AddModule("__main__")); // BR
+    pykeep      = PyDict_GetItemString(pymain_dict, 
+                                       "__module_persistent__"); // BR
+    pykeys      = PyDict_Keys(pymain_dict);
+    if (!pykeys) {
+        PyErr_Print();
+        return;
+    }
+    for (i = 0; i < PyList_GET_SIZE(pykeys); i++) {
+        pykey = PyList_GET_ITEM(pykeys, i); // BR
+        if (!PyUnicode_Check(pykey)) {
+            continue;
+        }
+        len  = PyUnicode_GET_LENGTH(pykey);
+        keep = len > 4 && 
+               PyUnicode_READ_CHAR(pykey, 0) == '_' &&
+               PyUnicode_READ_CHAR(pykey, 1) == '_' &&
+               PyUnicode_READ_CHAR(pykey, len - 1) == '_' &&
+               PyUnicode_READ_CHAR(pykey, len - 2) == '_';
+
+        if (!keep && pykeep) {
+            if ((keep = PySequence_Contains(pykeep, pykey)) < 0) {
+                PyErr_Clear();
+                keep = 0;
+            }
+        }
+        if (!keep && PyDict_DelItem(pymain_dict, pykey)) {
+            PyErr_Clear();
+        }
+    }
+    Py_DECREF(pykeys);
+}
+
+/**
+ * Removes modules loaded from a directory, or one below it, from sys.modules
+ * if their files were modified after a given time. File times are compared
+ * in whole seconds, so a file saved in the same second as 'since' is taken
+ * as modified; reloading an unchanged module is harmless, running a stale
+ * one isn't.
+ * @param dir   - The directory.
+ * @param since - The time, in microseconds since the epoch (as with
+ *                g_get_real_time()).
+ */
+void
+plugin_drop_modules(const char *dir, gint64 since)
+{
+    PyObject    *pymodules;
+    PyObject    *pyitems;
+    PyObject    *pyitem;
+    PyObject    *pyfile;
+    PyObject    *pyenc;
+    const char  *file;
+    size_t      dirlen = strlen(dir);
+    GStatBuf    st;
+    Py_ssize_t  i;
+
+    pymodules = PySys_GetObject("modules"); // BR
+    if (!pymodules || !(pyitems = PyDict_Items(pymodules))) {
+        PyErr_Clear();
+        return;
+    }
+    for (i = 0; i < PyList_GET_SIZE(pyitems); i++) {
+        pyitem = PyList_GET_ITEM(pyitems, i); // BR
+        pyfile = PyObject_GetAttrString(PyTuple_GET_ITEM(pyitem, 1),
+                                        "__file__");
+        if (!pyfile || !PyUnicode_Check(pyfile) || 
+            !(pyenc = PyUnicode_EncodeFSDefault(pyfile))) {
+            Py_XDECREF(pyfile);
+            PyErr_Clear();
+            continue;
+        }
+        file = PyBytes_AS_STRING(pyenc);
+
+        if (!strncmp(file, dir, dirlen) && 
+            (file[dirlen] == '/' || file[dirlen] == '\\') &&
+            !g_stat(file, &st) && 
+            (gint64)st.st_mtime >= since / G_USEC_PER_SEC) {
+
+            if (PyDict_DelItem(pymodules, PyTuple_GET_ITEM(pyitem, 0))) {
+                PyErr_Clear();
+            }
+        }
+        Py_DECREF(pyenc);
+        Py_DECREF(pyfile);
+    }
+    Py_DECREF(pyitems);
+}
+
+/**
+ * Prints the loaded plugins with the time each took to load. Implements
+ * /MPY LIST.
+ * @returns - HEXCHAT_EAT_ALL.
+ */
+int
+list_plugins()
+{
+    PluginData  *pd;
+    gint64      total = 0;
+
+    hexchat_print(ph, "\00311Plugin               Load (ms)  Path");
+
+    for (pd = plugin_data.next; pd; pd = pd->next) {
+        hexchat_printf(ph, "%-20s %10.1f  %s", pd->name, 
+                       pd->load_time / 1000.0, pd->path);
+        total += pd->load_time;
+    }
+    hexchat_printf(ph, "\00311Total                %10.1f", total / 1000.0);
+
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Returns the name of the loaded plugin that owns the interp of the given
+ * threadstate, or NULL if it isn't a plugin's. Used to total statistics per
+ * plugin.
+ */
+const char *
+plugin_get_name(PyThreadState *ts)
+{
+    PluginData *pd = plugin_list_find_ts(ts);
+
+    return pd ? pd->name : NULL;
+}
+
+/**
+ * Returns the threadstate of the loaded plugin with the given name or path, or
+ * NULL if it isn't loaded.
+ */
+PyThreadState *
+plugin_get_threadstate(const char *name_or_path)
+{
+    PluginData *pd = plugin_list_find(name_or_path);
+
+    return pd ? pd->threadstate : NULL;
+}
+
+/**
+ * Calls a function for each loaded plugin, in the order they were loaded.
+ * The function mustn't load or unload plugins.
+ */
+void
+plugin_list_foreach(plugin_foreach_func func, void *userdata)
+{
+    PluginData *pd;
+
+    for (pd = plugin_data.next; pd; pd = pd->next) {
+        func(pd->name, pd->path, pd->threadstate, userdata);
+    }
+}
+
 /**
  * /LOAD command callback for Python plugins.
  */
@@ -362,40 +643,72 @@ reload_plugin_callback(char *word[], char *word_eol[], void *userdata)
  *                        it was registered with hexchat.
  */
 void 
-plugin_list_add(PyObject *name, PyObject *path, 
-                PyThreadState *ts, void *plugin_handle)
+plugin_list_add(const char *name, const char *path, 
+                PyThreadState *ts, void *plugin_handle, gint64 load_time)
 {
-    PluginData *pd = &plugin_data;
-
-    for (; pd->next; pd = pd->next);
+    PluginData  *pd;
+    int         i;
 
-    pd->next            = PyMem_RawMalloc(sizeof(PluginData));
-    pd                  = pd->next;
+    if (!plugin_index_ts) {
+        for (i = 0; i < PLUGIN_NUM_KEYS; i++) {
+            plugin_index[i] = g_hash_table_new(g_str_hash, g_str_equal);
+        }
+        plugin_index_ts = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    pd                  = PyMem_RawMalloc(sizeof(PluginData));
     pd->threadstate     = ts;
     pd->plugin_handle   = plugin_handle;
     pd->next            = NULL;
+    pd->prev            = plugin_last;
+    plugin_last->next   = pd;
+    plugin_last         = pd;
 
-    pd->name            = name;
-    pd->path            = path;
-    
-    Py_INCREF(name);
-    Py_INCREF(path);
+    pd->name            = g_strdup(name);
+    pd->path            = g_strdup(path);
+    pd->load_time       = load_time;
+    pd->exec_time       = g_get_real_time() - load_time;
+
+    for (i = 0; i < PLUGIN_NUM_KEYS; i++) {
+        plugin_index_add(pd, i);
+    }
+    g_hash_table_insert(plugin_index_ts, ts, pd);
 }
 
 /**
  * Finds the plugin data with the given threadstate. Returns its pointer value
  * if found, or NULL if not found.
  */
- /*
 PluginData *
 plugin_list_find_ts(PyThreadState *ts)
 {
-    PluginData    *pd;
+    return plugin_index_ts ? g_hash_table_lookup(plugin_index_ts, ts) : NULL;
+}
 
-    for (pd = plugin_data.next; pd && pd->threadstate != ts; pd = pd->next);
+/**
+ * Finds the plugin with the given name or path. If more than one matches, the
+ * one loaded first is found, and names are matched before paths. Paths that
+ * aren't the full path are resolved as load_plugin() does.
+ * @param name_or_path - the name or path of the plugin.
+ * @returns - the PluginData for the plugin, or NULL if not found.
+ */
+PluginData *
+plugin_list_find(const char *name_or_path)
+{
+    PluginData  *pd = NULL;
+    char        *path;
+    int         i;
+
+    for (i = 0; i < PLUGIN_NUM_KEYS && !pd && plugin_index[i]; i++) {
+        pd = g_hash_table_lookup(plugin_index[i], name_or_path);
+    }
+    if (!pd && plugin_index[PLUGIN_BY_PATH] &&
+        (path = plugin_resolve_path(name_or_path))) {
+        // A file name or relative path, as given to /LOAD.
+        pd = g_hash_table_lookup(plugin_index[PLUGIN_BY_PATH], path);
+        g_free(path);
+    }
     return pd;
 }
-*/
 
 /**
  * Removes the named item from the list and returns it, or NULL if not found.
@@ -405,24 +718,86 @@ plugin_list_find_ts(PyThreadState *ts)
  *            object needs to be freed by the caller.
  */
 PluginData *
-plugin_list_remove(PyObject *name_or_path)
+plugin_list_remove(const char *name_or_path)
 {
-    PluginData    *pd      = &plugin_data;
-    PluginData    *found   = NULL;
+    PluginData  *pd = plugin_list_find(name_or_path);
+    int         i;
 
-    for (; pd->next; pd = pd->next) {
-        
-        if (!PyUnicode_Compare(pd->next->name, name_or_path) ||
-            !PyUnicode_Compare(pd->next->path, name_or_path)) {
+    if (!pd) {
+        return NULL;
+    }
+    pd->prev->next = pd->next;
 
-            found = pd->next;
-            break;
+    if (pd->next) {
+        pd->next->prev = pd->prev;
+    }
+    else {
+        plugin_last = pd->prev;
+    }
+    for (i = 0; i < PLUGIN_NUM_KEYS; i++) {
+        plugin_index_remove(pd, i);
+    }
+    g_hash_table_remove(plugin_index_ts, pd->threadstate);
+
+    return pd;
+}
+
+/**
+ * Returns a plugin's name or path.
+ */
+const char *
+plugin_key(PluginData *pd, int key)
+{
+    return (key == PLUGIN_BY_NAME) ? pd->name : pd->path;
+}
+
+/**
+ * Indexes a plugin by its name or path, or chains it after the plugins
+ * already loaded with the same one.
+ */
+void
+plugin_index_add(PluginData *pd, int key)
+{
+    PluginData *first = g_hash_table_lookup(plugin_index[key],
+                                            plugin_key(pd, key));
+    pd->same[key] = NULL;
+
+    if (!first) {
+        g_hash_table_insert(plugin_index[key], (char *)plugin_key(pd, key),
+                            pd);
+        return;
+    }
+    for (; first->same[key]; first = first->same[key]);
+
+    first->same[key] = pd;
+}
+
+/**
+ * Removes a plugin from the index of its name or path. The next plugin loaded
+ * with the same one takes its place.
+ */
+void
+plugin_index_remove(PluginData *pd, int key)
+{
+    PluginData *first = g_hash_table_lookup(plugin_index[key],
+                                            plugin_key(pd, key));
+    if (first == pd) {
+        if (pd->same[key]) {
+            // Replaced, not inserted, so the key is the next plugin's too.
+            g_hash_table_replace(plugin_index[key],
+                                (char *)plugin_key(pd->same[key], key),
+                                pd->same[key]);
         }
+        else {
+            g_hash_table_remove(plugin_index[key], plugin_key(pd, key));
+        }
+        return;
     }
-    if (found) {
-        pd->next = pd->next->next;
+    for (; first && first->same[key] != pd; first = first->same[key]);
+
+    if (first) {
+        first->same[key] = pd->same[key];
     }
-    return found;
 }
 
 /**
@@ -431,11 +806,341 @@ plugin_list_remove(PyObject *name_or_path)
 void
 plugin_list_clear()
 {
-    PluginData *pd = plugin_data.next;
-    
+    PluginData  *pd = plugin_data.next;
+    int         i;
+    
     while (pd) {
-        unload_plugin(PyUnicode_AsUTF8(pd->path));
+        unload_plugin(pd->path);
         pd = plugin_data.next;
     }
+    for (i = 0; i < PLUGIN_NUM_KEYS && plugin_index[i]; i++) {
+        g_hash_table_destroy(plugin_index[i]);
+        plugin_index[i] = NULL;
+    }
+    if (plugin_index_ts) {
+        g_hash_table_destroy(plugin_index_ts);
+        plugin_index_ts = NULL;
+    }
+}
+
+/**
+ * Runs a plugin's script in __main__ using codecache_get_code(). As with
+ * PyRun_SimpleFile(), errors are printed and __file__ is set while the script
+ * runs.
+ * @param fp    - The open script file.
+ * @param path  - The script's full path.
+ * @returns - 0 on success, -1 if the script failed.
+ */
+int
+plugin_run_file(FILE *fp, const char *path)
+{
+    PyObject    *pymain_dict;
+    PyObject    *pycode;
+    PyObject    *pyfile;
+    PyObject    *pyret = NULL;
+    int         set_file = 0;
+
+    pymain_dict = PyModule_GetDict(PyImport_AddModule("__main__")); // BR
+
+    if (!PyDict_GetItemString(pymain_dict, "__file__")) {
+        pyfile = PyUnicode_DecodeFSDefault(path);
+        if (!pyfile || PyDict_SetItemString(pymain_dict, "__file__", pyfile)) {
+            Py_XDECREF(pyfile);
+            PyErr_Print();
+            return -1;
+        }
+        Py_DECREF(pyfile);
+        set_file = 1;
+    }
+    if ((pycode = codecache_get_code(fp, path))) {
+        pyret = PyEval_EvalCode(pycode, pymain_dict, pymain_dict);
+        Py_DECREF(pycode);
+    }
+    if (!pyret) {
+        PyErr_Print();
+    }
+    if (set_file && PyDict_DelItemString(pymain_dict, "__file__")) {
+        PyErr_Clear();
+    }
+    if (!pyret) {
+        return -1;
+    }
+    Py_DECREF(pyret);
+    return 0;
+}
+
+/**
+ * Looks for a line starting with `__module_own_gil__ = True` in a plugin
+ * file, which asks for the plugin to get its own GIL. The file is rewound.
+ * @param fp    - The open plugin file.
+ * @returns - 1 if the plugin asks for its own GIL, 0 if not.
+ */
+int
+plugin_wants_own_gil(FILE *fp)
+{
+    char    line[MAX_IDCHR];
+    char    *p;
+    int     retval = 0;
+
+    while (!retval && fgets(line, sizeof(line), fp)) {
+        p = (char *)plugin_header_value(line, "__module_own_gil__");
+
+        retval = p && !strncmp(p, "True", 4);
+    }
+    rewind(fp);
+    return retval;
+}
+
+/**
+ * Gets the value assigned to a variable on a line of plugin source, if the
+ * line starts with an assignment to it.
+ * @param line  - The start of the line.
+ * @param var   - The variable name.
+ * @returns - A pointer to the start of the value, or NULL.
+ */
+const char *
+plugin_header_value(const char *line, const char *var)
+{
+    size_t      len = strlen(var);
+    const char  *p;
+
+    if (strncmp(line, var, len)) {
+        return NULL;
+    }
+    for (p = line + len; *p == ' ' || *p == '\t'; p++);
+    if (*p++ != '=' || *p == '=') {
+        return NULL;
+    }
+    for (; *p == ' ' || *p == '\t'; p++);
+    return p;
+}
+
+/**
+ * Turns loading the addons directory at startup on or off for later sessions
+ * (/MPY AUTOLOAD ON | OFF), and prints the setting.
+ * @param arg   - "ON", "OFF", or an empty string to just print the setting.
+ * @returns - HEXCHAT_EAT_ALL.
+ */
+int
+autoload_command(char *arg)
+{
+    if (!g_ascii_strcasecmp(arg, "ON")) {
+        pref_store_set_int(AUTOLOAD_PREF, 1);
+    }
+    else if (!g_ascii_strcasecmp(arg, "OFF")) {
+        pref_store_set_int(AUTOLOAD_PREF, 0);
+    }
+    hexchat_printf(ph, "Loading the addons directory at startup is %s.",
+                   pref_store_get_int(AUTOLOAD_PREF, 0) == 1 ? "on" : "off");
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Loads the plugins in the addons directory in dependency order: by file
+ * name, except that a plugin comes after the ones named in its
+ * __module_requires__. Only reading the files and their headers is done on
+ * worker threads. Each plugin is then compiled and run by load_plugin() on the
+ * main thread, one at a time.
+ * @returns - 0, so the timer that calls this only runs once.
+ */
+int
+autoload_callback(void *userdata)
+{
+    SwitchTSInfo    tsinfo;
+    GThreadPool     *pool;
+    GDir            *dir;
+    const char      *fname;
+    char            *dirpath;
+    AutoloadItem    *items = NULL;
+    AutoloadItem    **order;
+    int             count  = 0;
+    int             norder = 0;
+    int             i;
+
+    dirpath = g_build_filename(hexchat_get_info(ph, "xchatdir"), "addons",
+                               NULL);
+    dir     = g_dir_open(dirpath, 0, NULL);
+
+    if (!dir) {
+        g_free(dirpath);
+        return 0;
+    }
+    while ((fname = g_dir_read_name(dir))) {
+        if (strlen(fname) < 3 || 
+            g_ascii_strcasecmp(fname + strlen(fname) - 3, ".py")) {
+            continue;
+        }
+        items = g_renew(AutoloadItem, items, count + 1);
+        memset(&items[count], 0, sizeof(AutoloadItem));
+        items[count++].path = g_build_filename(dirpath, fname, NULL);
+    }
+    g_dir_close(dir);
+    g_free(dirpath);
+
+    if (count == 0) {
+        return 0;
+    }
+    qsort(items, count, sizeof(AutoloadItem), autoload_cmp);
+
+    // Read the files and their headers in parallel. No Python is involved.
+    pool = g_thread_pool_new(autoload_scan, NULL, 
+                             (gint)g_get_num_processors(), FALSE, NULL);
+    for (i = 0; i < count; i++) {
+        g_thread_pool_push(pool, &items[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    order = g_new(AutoloadItem *, count);
+
+    for (i = 0; i < count; i++) {
+        autoload_order(&items[i], items, count, order, &norder);
+    }
+
+    // load_plugin() expects the main interp to be current.
+    tsinfo = switch_threadstate(py_g_main_threadstate);
+
+    for (i = 0; i < norder; i++) {
+        load_plugin(order[i]->path);
+    }
+    switch_threadstate_back(tsinfo);
+
+    for (i = 0; i < count; i++) {
+        g_free(items[i].path);
+        g_free(items[i].name);
+        g_strfreev(items[i].requires);
+    }
+    g_free(order);
+    g_free(items);
+
+    return 0;
 }
 
+/**
+ * Thread pool function that reads the header fields of a plugin file.
+ * @param data      - The AutoloadItem of the plugin.
+ * @param userdata  - Unused.
+ */
+void
+autoload_scan(gpointer data, gpointer userdata)
+{
+    AutoloadItem    *item = data;
+    char            *text;
+    const char      *line;
+    const char      *p;
+    char            **names;
+
+    if (!g_file_get_contents(item->path, &text, NULL, NULL)) {
+        return;
+    }
+    for (line = text; line; line = (p = strchr(line, '\n')) ? p + 1 : NULL) {
+        if (!item->name && 
+                (p = plugin_header_value(line, "__module_name__"))) {
+            names = autoload_parse_names(p, 1);
+            if (names && names[0]) {
+                item->name = g_strdup(names[0]);
+            }
+            g_strfreev(names);
+        }
+        else if (!item->requires && 
+                (p = plugin_header_value(line, "__module_requires__"))) {
+            item->requires = autoload_parse_names(p, 0);
+        }
+    }
+    g_free(text);
+}
+
+/**
+ * Collects the string literals of a value in plugin source, such as 
+ * `"a"`, `("a", "b")` or `["a", "b"]`. A bracketed value can span lines.
+ * @param p     - The start of the value.
+ * @param max   - The most strings to collect, or 0 for no limit.
+ * @returns - A NULL terminated array of the strings, free with g_strfreev().
+ */
+char **
+autoload_parse_names(const char *p, int max)
+{
+    char        **names = g_new0(char *, 1);
+    int         count   = 0;
+    int         depth   = 0;
+    const char  *end;
+    char        quote;
+
+    for (; *p && (max == 0 || count < max); p++) {
+        if (*p == '(' || *p == '[') {
+            depth++;
+        }
+        else if (*p == ')' || *p == ']' || *p == '#') {
+            if (*p == '#' || --depth <= 0) {
+                break;
+            }
+        }
+        else if (*p == '\n' && depth == 0) {
+            break;
+        }
+        else if (*p == '"' || *p == '\'') {
+            quote = *p;
+            if (!(end = strchr(p + 1, quote))) {
+                break;
+            }
+            names = g_renew(char *, names, count + 2);
+            names[count++] = g_strndup(p + 1, end - p - 1);
+            names[count]   = NULL;
+            p = end;
+        }
+    }
+    return names;
+}
+
+/**
+ * Appends a plugin to the load order after the plugins it requires. A
+ * missing or circular requirement is reported, and the plugin is loaded
+ * without waiting on it.
+ * @param item      - The plugin to place.
+ * @param items     - All the plugins found.
+ * @param count     - The number of items.
+ * @param order     - The load order being built.
+ * @param norder    - The number of plugins in order so far.
+ */
+void
+autoload_order(AutoloadItem *item, AutoloadItem *items, int count,
+               AutoloadItem **order, int *norder)
+{
+    char    **req;
+    int     i;
+
+    if (item->state) {
+        return;
+    }
+    item->state = 1;
+
+    for (req = item->requires; req && *req; req++) {
+        for (i = 0; i < count; i++) {
+            if (items[i].name && !strcmp(items[i].name, *req)) {
+                break;
+            }
+        }
+        if (i == count) {
+            hexchat_printf(ph, "\00304%s requires %s, which isn't in the "
+                           "addons directory.", item->path, *req);
+        }
+        else if (items[i].state == 1) {
+            hexchat_printf(ph, "\00304%s and %s require each other.",
+                           item->path, items[i].path);
+        }
+        else {
+            autoload_order(&items[i], items, count, order, norder);
+        }
+    }
+    item->state = 2;
+    order[(*norder)++] = item;
+}
+
+/**
+ * Compares AutoloadItems by path for qsort().
+ */
+int
+autoload_cmp(const void *a, const void *b)
+{
+    return strcmp(((const AutoloadItem *)a)->path, 
+                  ((const AutoloadItem *)b)->path);
+}
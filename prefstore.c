@@ -0,0 +1,542 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+
+/**
+ * An in-memory cache in front of HexChat's pluginpref file. Every
+ * hexchat_pluginpref_* call reads or rewrites the whole file, so values are
+ * read from the file once and kept here, and changes are written behind on a
+ * timer that runs PREF_FLUSH_DELAY ms after the first unsaved change, when a
+ * plugin is unloaded, and when MagPy is unloaded.
+ *
+ * All plugins share the one file, so the cache is keyed by the full key,
+ * "<plugin name> <pref name>", and is only used on the main thread.
+ *
+ * Values are kept as the strings written to the file. Integers and plain
+ * strings are written as before, so older settings still read the same.
+ * Other values start with PREF_MARK and a type letter:
+ *
+ *      \001j<json>     - bool, float, list, dict, and strings that wouldn't
+ *                        survive as plain text (e.g. ones with newlines, or
+ *                        that look like integers).
+ *      \001y<base64>   - bytes.
+ *      \001c<count>    - A value too long for HexChat's 512 byte buffer. It's
+ *                        base64 encoded and split over <count> keys named
+ *                        "<key>\001<i>".
+ */
+
+#include <glib.h>
+#include "minpython.h"
+
+#define PREF_FLUSH_DELAY    2000    // ms from the first change to the write.
+#define PREF_CHUNK_SIZE     500     // Max bytes of a value HexChat can read.
+#define PREF_MARK           '\001'
+
+/**
+ * A cached pref. `raw` is the value as it's written to the file, or NULL if
+ * the pref doesn't exist.
+ */
+typedef struct {
+    char    *raw;
+    int     dirty;
+    int     disk_chunks;    // Number of chunk keys in the file.
+} PrefEntry;
+
+static GHashTable   *pref_table         = NULL; // key -> PrefEntry.
+static hexchat_hook *pref_flush_hook    = NULL;
+
+const char  *pref_store_get_raw     (const char *);
+int         pref_store_get_int      (const char *, int);
+void        pref_store_set_raw      (const char *, const char *);
+void        pref_store_set_int      (const char *, int);
+int         pref_store_delete       (const char *);
+PyObject    *pref_store_get         (const char *);
+int         pref_store_set          (const char *, PyObject *);
+void        pref_store_flush        (void);
+void        pref_store_close        (void);
+
+static PrefEntry    *pref_store_entry       (const char *);
+static char         *pref_store_load        (const char *, int *);
+static void         pref_store_write        (const char *, PrefEntry *);
+static void         pref_store_drop_chunks  (const char *, int, int);
+static int          pref_store_timer        (void *);
+static void         pref_entry_free         (gpointer);
+static int          pref_is_int             (const char *);
+static int          pref_str_is_plain       (const char *, Py_ssize_t);
+
+/**
+ * Gets the cache entry for a key, reading it from the file the first time.
+ * Keys that aren't in the file get an entry too so misses are cached.
+ * @param key   - The full key.
+ * @returns - The entry, owned by the cache.
+ */
+PrefEntry *
+pref_store_entry(const char *key)
+{
+    PrefEntry *entry;
+
+    if (!pref_table) {
+        pref_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, pref_entry_free);
+    }
+    entry = g_hash_table_lookup(pref_table, key);
+
+    if (!entry) {
+        entry      = g_new0(PrefEntry, 1);
+        entry->raw = pref_store_load(key, &entry->disk_chunks);
+
+        g_hash_table_insert(pref_table, g_strdup(key), entry);
+    }
+    return entry;
+}
+
+/**
+ * Reads a value from the file, joining it back together if it was split.
+ * @param key       - The full key.
+ * @param chunks    - Receives the number of chunk keys the value uses.
+ * @returns - The value (free with g_free()), or NULL if there isn't one.
+ */
+char *
+pref_store_load(const char *key, int *chunks)
+{
+    char        buf[512];
+    char        *chunkkey;
+    GString     *encoded;
+    guchar      *decoded;
+    gsize       size;
+    int         count;
+    int         i;
+
+    *chunks = 0;
+
+    if (!hexchat_pluginpref_get_str(ph, key, buf)) {
+        return NULL;
+    }
+    if (buf[0] != PREF_MARK || buf[1] != 'c') {
+        return g_strdup(buf);
+    }
+    count   = atoi(buf + 2);
+    encoded = g_string_new(NULL);
+
+    for (i = 0; i < count; i++) {
+        chunkkey = g_strdup_printf("%s%c%i", key, PREF_MARK, i);
+
+        if (!hexchat_pluginpref_get_str(ph, chunkkey, buf)) {
+            g_free(chunkkey);
+            break;
+        }
+        g_string_append(encoded, buf);
+        g_free(chunkkey);
+    }
+    *chunks = count;
+
+    if (i < count) {
+        // Part of the value is missing.
+        g_string_free(encoded, TRUE);
+        return NULL;
+    }
+    decoded = g_base64_decode(encoded->str, &size);
+    g_string_free(encoded, TRUE);
+
+    decoded       = g_realloc(decoded, size + 1);
+    decoded[size] = '\0';
+
+    return (char *)decoded;
+}
+
+/**
+ * Gets the value of a pref as it's stored. Used by native code that reads
+ * MagPy's own settings.
+ * @param key   - The full key.
+ * @returns - The value, owned by the cache, or NULL if the pref isn't set.
+ */
+const char *
+pref_store_get_raw(const char *key)
+{
+    return pref_store_entry(key)->raw;
+}
+
+/**
+ * Gets an integer pref.
+ * @param key           - The full key.
+ * @param default_value - Returned if the pref isn't set or isn't an integer.
+ * @returns - The value.
+ */
+int
+pref_store_get_int(const char *key, int default_value)
+{
+    const char *raw = pref_store_get_raw(key);
+
+    if (!raw || !pref_is_int(raw)) {
+        return default_value;
+    }
+    return atoi(raw);
+}
+
+/**
+ * Sets the stored value of a pref and schedules the write.
+ * @param key   - The full key.
+ * @param raw   - The value as it's written to the file, or NULL to delete the
+ *                pref.
+ */
+void
+pref_store_set_raw(const char *key, const char *raw)
+{
+    PrefEntry *entry = pref_store_entry(key);
+
+    if (entry->raw == raw || (entry->raw && raw && !strcmp(entry->raw, raw))) {
+        return;
+    }
+    g_free(entry->raw);
+    entry->raw   = g_strdup(raw);
+    entry->dirty = 1;
+
+    if (!pref_flush_hook) {
+        pref_flush_hook = hexchat_hook_timer(ph, PREF_FLUSH_DELAY,
+                                             pref_store_timer, NULL);
+    }
+}
+
+/**
+ * Sets an integer pref.
+ * @param key   - The full key.
+ * @param value - The value.
+ */
+void
+pref_store_set_int(const char *key, int value)
+{
+    char buf[16];
+
+    g_snprintf(buf, sizeof(buf), "%i", value);
+    pref_store_set_raw(key, buf);
+}
+
+/**
+ * Deletes a pref.
+ * @param key   - The full key.
+ * @returns - 1 if the pref existed, 0 if not.
+ */
+int
+pref_store_delete(const char *key)
+{
+    int existed = pref_store_get_raw(key) != NULL;
+
+    pref_store_set_raw(key, NULL);
+    return existed;
+}
+
+/**
+ * Gets the value of a pref as a Python object. Must be called holding the
+ * GIL.
+ * @param key   - The full key.
+ * @returns - A new reference to the value, None if the pref isn't set, or
+ *            NULL with an exception set if the value can't be decoded.
+ */
+PyObject *
+pref_store_get(const char *key)
+{
+    const char  *raw = pref_store_get_raw(key);
+    PyObject    *pyjson;
+    PyObject    *pyret;
+    guchar      *data;
+    gsize       size;
+
+    if (!raw) {
+        Py_RETURN_NONE;
+    }
+    if (raw[0] == PREF_MARK && raw[1] == 'j') {
+        pyjson = PyImport_ImportModule("json");
+        if (!pyjson) {
+            return NULL;
+        }
+        pyret = PyObject_CallMethod(pyjson, "loads", "s", raw + 2);
+        Py_DECREF(pyjson);
+        return pyret;
+    }
+    if (raw[0] == PREF_MARK && raw[1] == 'y') {
+        data  = g_base64_decode(raw + 2, &size);
+        pyret = PyBytes_FromStringAndSize((char *)data, size);
+        g_free(data);
+        return pyret;
+    }
+    if (pref_is_int(raw)) {
+        return PyLong_FromString(raw, NULL, 10);
+    }
+    return PyUnicode_FromString(raw);
+}
+
+/**
+ * Sets a pref from a Python object. Must be called holding the GIL.
+ * @param key       - The full key.
+ * @param pyvalue   - The value. None deletes the pref.
+ * @returns - 0 on success, -1 with an exception set if the value can't be
+ *            stored.
+ */
+int
+pref_store_set(const char *key, PyObject *pyvalue)
+{
+    PyObject    *pyjson;
+    PyObject    *pystr;
+    const char  *str;
+    char        *raw;
+    char        *data;
+    Py_ssize_t  size;
+
+    if (pyvalue == Py_None) {
+        pref_store_set_raw(key, NULL);
+        return 0;
+    }
+    if (PyLong_CheckExact(pyvalue)) {
+        pystr = PyObject_Str(pyvalue);
+        if (!pystr) {
+            return -1;
+        }
+        pref_store_set_raw(key, PyUnicode_AsUTF8(pystr));
+        Py_DECREF(pystr);
+        return 0;
+    }
+    if (PyUnicode_Check(pyvalue)) {
+        str = PyUnicode_AsUTF8AndSize(pyvalue, &size);
+        if (!str) {
+            return -1;
+        }
+        if (pref_str_is_plain(str, size)) {
+            pref_store_set_raw(key, str);
+            return 0;
+        }
+    }
+    else if (PyBytes_Check(pyvalue) || PyByteArray_Check(pyvalue)) {
+        if (PyBytes_Check(pyvalue)) {
+            PyBytes_AsStringAndSize(pyvalue, &data, &size);
+        }
+        else {
+            data = PyByteArray_AS_STRING(pyvalue);
+            size = PyByteArray_GET_SIZE(pyvalue);
+        }
+        str = g_base64_encode((guchar *)data, size);
+        raw = g_strdup_printf("%cy%s", PREF_MARK, str);
+
+        pref_store_set_raw(key, raw);
+
+        g_free((char *)str);
+        g_free(raw);
+        return 0;
+    }
+    // Everything else, including strs that need escaping, is stored as JSON.
+    pyjson = PyImport_ImportModule("json");
+    if (!pyjson) {
+        return -1;
+    }
+    pystr = PyObject_CallMethod(pyjson, "dumps", "O", pyvalue);
+    Py_DECREF(pyjson);
+
+    if (!pystr) {
+        return -1;
+    }
+    raw = g_strdup_printf("%cj%s", PREF_MARK, PyUnicode_AsUTF8(pystr));
+    pref_store_set_raw(key, raw);
+
+    g_free(raw);
+    Py_DECREF(pystr);
+    return 0;
+}
+
+/**
+ * Writes all unsaved changes to the file.
+ */
+void
+pref_store_flush()
+{
+    GHashTableIter  iter;
+    gpointer        key;
+    gpointer        value;
+
+    if (pref_flush_hook) {
+        hexchat_unhook(ph, pref_flush_hook);
+        pref_flush_hook = NULL;
+    }
+    if (!pref_table) {
+        return;
+    }
+    g_hash_table_iter_init(&iter, pref_table);
+
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (((PrefEntry *)value)->dirty) {
+            pref_store_write((const char *)key, (PrefEntry *)value);
+        }
+    }
+}
+
+/**
+ * Writes unsaved changes and frees the cache. Called when MagPy is unloaded.
+ */
+void
+pref_store_close()
+{
+    pref_store_flush();
+
+    if (pref_table) {
+        g_hash_table_destroy(pref_table);
+        pref_table = NULL;
+    }
+}
+
+/**
+ * Writes one entry to the file, splitting long values over several keys.
+ * @param key   - The full key.
+ * @param entry - The entry.
+ */
+void
+pref_store_write(const char *key, PrefEntry *entry)
+{
+    char    *encoded;
+    char    *chunkkey;
+    char    head[16];
+    char    save;
+    size_t  len;
+    int     count;
+    int     i;
+
+    entry->dirty = 0;
+
+    if (!entry->raw) {
+        hexchat_pluginpref_delete(ph, key);
+        pref_store_drop_chunks(key, 0, entry->disk_chunks);
+        entry->disk_chunks = 0;
+        return;
+    }
+    if (strlen(entry->raw) <= PREF_CHUNK_SIZE) {
+        hexchat_pluginpref_set_str(ph, key, entry->raw);
+        pref_store_drop_chunks(key, 0, entry->disk_chunks);
+        entry->disk_chunks = 0;
+        return;
+    }
+    encoded = g_base64_encode((guchar *)entry->raw, strlen(entry->raw));
+    len     = strlen(encoded);
+    count   = (int)((len + PREF_CHUNK_SIZE - 1) / PREF_CHUNK_SIZE);
+
+    // Write the chunks before the head that says how many there are.
+    for (i = 0; i < count; i++) {
+        chunkkey = g_strdup_printf("%s%c%i", key, PREF_MARK, i);
+
+        if ((size_t)(i + 1) * PREF_CHUNK_SIZE < len) {
+            save = encoded[(i + 1) * PREF_CHUNK_SIZE];
+            encoded[(i + 1) * PREF_CHUNK_SIZE] = '\0';
+            hexchat_pluginpref_set_str(ph, chunkkey,
+                                       encoded + i * PREF_CHUNK_SIZE);
+            encoded[(i + 1) * PREF_CHUNK_SIZE] = save;
+        }
+        else {
+            hexchat_pluginpref_set_str(ph, chunkkey,
+                                       encoded + i * PREF_CHUNK_SIZE);
+        }
+        g_free(chunkkey);
+    }
+    g_snprintf(head, sizeof(head), "%cc%i", PREF_MARK, count);
+    hexchat_pluginpref_set_str(ph, key, head);
+
+    pref_store_drop_chunks(key, count, entry->disk_chunks);
+    entry->disk_chunks = count;
+
+    g_free(encoded);
+}
+
+/**
+ * Deletes the chunk keys of a value from the file.
+ * @param key   - The full key of the value.
+ * @param from  - The first chunk to delete.
+ * @param to    - One past the last chunk to delete.
+ */
+void
+pref_store_drop_chunks(const char *key, int from, int to)
+{
+    char    *chunkkey;
+    int     i;
+
+    for (i = from; i < to; i++) {
+        chunkkey = g_strdup_printf("%s%c%i", key, PREF_MARK, i);
+        hexchat_pluginpref_delete(ph, chunkkey);
+        g_free(chunkkey);
+    }
+}
+
+/**
+ * The one-shot timer that writes changes behind.
+ * @param userdata  - Not used.
+ * @returns - 0, the timer is set again by the next change.
+ */
+int
+pref_store_timer(void *userdata)
+{
+    // The hook is removed by HexChat when this returns 0.
+    pref_flush_hook = NULL;
+    pref_store_flush();
+    return 0;
+}
+
+/**
+ * Frees a cache entry. Passed to the hash table.
+ */
+void
+pref_entry_free(gpointer data)
+{
+    PrefEntry *entry = (PrefEntry *)data;
+
+    g_free(entry->raw);
+    g_free(entry);
+}
+
+/**
+ * Says whether a stored string is an integer, which is how integer prefs are
+ * stored.
+ */
+int
+pref_is_int(const char *s)
+{
+    if (*s == '-') {
+        s++;
+    }
+    if (!*s) {
+        return 0;
+    }
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Says whether a str can be stored as is and read back as the same str.
+ */
+int
+pref_str_is_plain(const char *s, Py_ssize_t size)
+{
+    if (size == 0 || s[0] == PREF_MARK ||
+        strchr(" \t", s[0]) || strchr(" \t", s[size - 1]) || pref_is_int(s)) {
+        return 0;
+    }
+    return strlen(s) == (size_t)size && !strpbrk(s, "\r\n");
+}
@@ -0,0 +1,680 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+
+/**
+ * Accounts for the time each plugin's callbacks take on HexChat's main thread,
+ * and enforces soft limits on it so one plugin can't starve the others.
+ *
+ * The time of commands, print and server events, timers, asyncio loop ticks,
+ * and Delegate calls made for a plugin's threads is charged to the plugin in a
+ * sliding window of QUOTA_SLOTS one second slots. A plugin can have a limit
+ * of ms per window. Going over it does one of:
+ *
+ *      WARN     - Prints a warning once each time it goes over.
+ *      THROTTLE - Skips the plugin's timers and loop ticks until it's back
+ *                 under the limit.
+ *      SUSPEND  - Skips all its callbacks until /MPY QUOTA RESUME <plugin>.
+ *                 Delegate calls still run, so its threads aren't left
+ *                 blocked.
+ *
+ * Limits are set with /MPY QUOTA LIMIT and kept in the pref store, either as
+ * the default for all plugins or for one plugin. The console has no limit.
+ * /MPY QUOTA MEMORY ON starts tracemalloc so /MPY QUOTA can also show the
+ * memory allocated by each plugin's script. tracemalloc traces all interps,
+ * so memory is attributed by the file that made the allocation.
+ *
+ * Entries are created for an interp by quota_get(), which can be called from
+ * any thread. Everything else is main thread only. Like those of stats.c,
+ * entries of deleted interps are set aside until MagPy is unloaded.
+ */
+
+#include <glib.h>
+#include "minpython.h"
+
+#define QUOTA_SLOTS         10                  // One second each.
+#define QUOTA_PREF          "mpy_quota"         // Default "<ms> <action>".
+#define QUOTA_PLUGIN_PREF   "mpy_quota:%s"      // A plugin's "<ms> <action>".
+#define QUOTA_NS_PER_SEC    1000000000LL
+
+typedef enum {
+    QUOTA_WARN,
+    QUOTA_THROTTLE,
+    QUOTA_SUSPEND
+} QuotaAction;
+
+typedef enum {
+    QUOTA_OK,
+    QUOTA_WARNED,
+    QUOTA_THROTTLED,
+    QUOTA_SUSPENDED
+} QuotaState;
+
+struct _PluginQuota {
+    PyThreadState   *threadstate;
+    gint64          calls;
+    gint64          total_ns;
+    gint64          slots[QUOTA_SLOTS];     // ns charged in each second.
+    gint64          slot_sec;               // The second of slots[slot].
+    int             slot;
+    gint64          limit_ns;               // Per window, 0 for no limit.
+    QuotaAction     action;
+    int             gen;                    // quota_gen the limit is for.
+    QuotaState      state;
+};
+
+static GHashTable   *quota_table    = NULL; // threadstate -> entry.
+static GPtrArray    *quota_retired  = NULL;
+static GMutex       quota_lock;
+static int          quota_gen       = 1;    // Bumped when limits change.
+
+static const char   *quota_actions[] = { "WARN", "THROTTLE", "SUSPEND" };
+static const char   *quota_states[]  = { "ok", "over", "throttled",
+                                         "suspended" };
+
+PluginQuota *quota_get          (PyThreadState *);
+int         quota_blocked       (PluginQuota *, int);
+void        quota_charge        (PluginQuota *, long long);
+void        quota_forget        (PyThreadState *);
+void        quota_clear         (void);
+int         quota_command       (char *[], char *[]);
+
+static PluginQuota  *quota_find         (PyThreadState *);
+static gint64       quota_used          (PluginQuota *, gint64);
+static void         quota_resolve       (PluginQuota *);
+static int          quota_parse         (const char *, gint64 *,
+                                         QuotaAction *);
+static void         quota_exceeded      (PluginQuota *, gint64);
+static int          quota_set_limit     (const char *, const char *,
+                                         const char *);
+static int          quota_resume        (const char *);
+static int          quota_memory        (const char *);
+static PyObject     *quota_memory_map   (void);
+static void         quota_print_row     (const char *, const char *,
+                                         PyThreadState *, void *);
+static void         quota_print         (void);
+
+
+/**
+ * Gets the entry of an interp, creating it if needed.
+ * @param ts    - The interp's main threadstate.
+ * @returns - The entry, which lasts until MagPy is unloaded.
+ */
+PluginQuota *
+quota_get(PyThreadState *ts)
+{
+    PluginQuota *quota;
+
+    g_mutex_lock(&quota_lock);
+
+    if (!quota_table) {
+        quota_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    }
+    quota = g_hash_table_lookup(quota_table, ts);
+
+    if (!quota) {
+        quota              = g_new0(PluginQuota, 1);
+        quota->threadstate = ts;
+
+        g_hash_table_insert(quota_table, ts, quota);
+    }
+    g_mutex_unlock(&quota_lock);
+
+    return quota;
+}
+
+/**
+ * Returns the entry of an interp, or NULL if it has none.
+ */
+PluginQuota *
+quota_find(PyThreadState *ts)
+{
+    PluginQuota *quota;
+
+    g_mutex_lock(&quota_lock);
+    quota = quota_table ? g_hash_table_lookup(quota_table, ts) : NULL;
+    g_mutex_unlock(&quota_lock);
+
+    return quota;
+}
+
+/**
+ * Tells whether a plugin's callback should be skipped.
+ * @param quota     - The plugin's entry. NULL is never blocked.
+ * @param is_timer  - Nonzero for timers and loop ticks, which are skipped
+ *                    while the plugin is throttled.
+ * @returns - Nonzero to skip the callback.
+ */
+int
+quota_blocked(PluginQuota *quota, int is_timer)
+{
+    if (!quota || quota->state < QUOTA_THROTTLED) {
+        return 0;
+    }
+    if (quota->gen != quota_gen) {
+        quota_resolve(quota);
+    }
+    if (quota->state == QUOTA_SUSPENDED) {
+        return 1;
+    }
+    if (quota->state != QUOTA_THROTTLED || !is_timer) {
+        return 0;
+    }
+    // Throttled. Let it go once enough time has slid out of the window.
+    if (quota_used(quota, stats_now()) <= quota->limit_ns) {
+        quota->state = QUOTA_OK;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Charges time to a plugin and applies its limit.
+ * @param quota - The plugin's entry. NULL is ignored.
+ * @param ns    - The time its callback took.
+ */
+void
+quota_charge(PluginQuota *quota, long long ns)
+{
+    gint64 used;
+
+    if (!quota) {
+        return;
+    }
+    used = quota_used(quota, stats_now());
+
+    quota->slots[quota->slot] += ns;
+    quota->total_ns           += ns;
+    quota->calls++;
+    used                      += ns;
+
+    if (quota->gen != quota_gen) {
+        quota_resolve(quota);
+    }
+    if (quota->limit_ns && used > quota->limit_ns) {
+        quota_exceeded(quota, used);
+    }
+    else if (quota->state == QUOTA_WARNED ||
+             quota->state == QUOTA_THROTTLED) {
+        quota->state = QUOTA_OK;
+    }
+}
+
+/**
+ * Slides the window up to the given time.
+ * @returns - The time charged in the window.
+ */
+gint64
+quota_used(PluginQuota *quota, gint64 now)
+{
+    gint64  sec  = now / QUOTA_NS_PER_SEC;
+    gint64  used = 0;
+    gint64  n;
+    int     i;
+
+    if (sec != quota->slot_sec) {
+        n = MIN(sec - quota->slot_sec, QUOTA_SLOTS);
+
+        for (i = 0; i < n; i++) {
+            quota->slot = (quota->slot + 1) % QUOTA_SLOTS;
+            quota->slots[quota->slot] = 0;
+        }
+        quota->slot_sec = sec;
+    }
+    for (i = 0; i < QUOTA_SLOTS; i++) {
+        used += quota->slots[i];
+    }
+    return used;
+}
+
+/**
+ * Looks up the limit of an entry's plugin: its own, or else the default.
+ * Interps that aren't (yet) a loaded plugin's have no limit, and are looked
+ * up again on their next charge. A warned or throttled plugin is let go, to
+ * be checked against the new limit on its next charge; a suspended one stays
+ * suspended until resumed.
+ */
+void
+quota_resolve(PluginQuota *quota)
+{
+    const char  *name = plugin_get_name(quota->threadstate);
+    const char  *raw  = NULL;
+    char        *key;
+
+    quota->limit_ns = 0;
+    quota->action   = QUOTA_WARN;
+
+    if (quota->state != QUOTA_SUSPENDED) {
+        quota->state = QUOTA_OK;
+    }
+
+    if (!name) {
+        return;
+    }
+    key = g_strdup_printf(QUOTA_PLUGIN_PREF, name);
+    raw = pref_store_get_raw(key);
+    g_free(key);
+
+    if (!raw) {
+        raw = pref_store_get_raw(QUOTA_PREF);
+    }
+    if (raw) {
+        quota_parse(raw, &quota->limit_ns, &quota->action);
+    }
+    quota->gen = quota_gen;
+}
+
+/**
+ * Parses "<ms> [<action>]".
+ * @returns - 0 on success, -1 if it isn't valid.
+ */
+int
+quota_parse(const char *text, gint64 *limit_ns, QuotaAction *action)
+{
+    char    *end;
+    long    ms;
+    int     i;
+
+    ms = strtol(text, &end, 10);
+
+    if (end == text || ms < 0) {
+        return -1;
+    }
+    while (*end == ' ') {
+        end++;
+    }
+    *limit_ns = ms * 1000000LL;
+    *action   = QUOTA_WARN;
+
+    if (!*end) {
+        return 0;
+    }
+    for (i = 0; i <= QUOTA_SUSPEND; i++) {
+        if (!g_ascii_strcasecmp(end, quota_actions[i])) {
+            *action = (QuotaAction)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Applies a plugin's action when it's over its limit.
+ */
+void
+quota_exceeded(PluginQuota *quota, gint64 used)
+{
+    const char  *name   = plugin_get_name(quota->threadstate);
+    double      used_ms = used / 1e6;
+    double      lim_ms  = quota->limit_ns / 1e6;
+
+    switch (quota->action) {
+    case QUOTA_WARN:
+        if (quota->state == QUOTA_OK) {
+            quota->state = QUOTA_WARNED;
+            hexchat_printf(ph, "\00304%s used %.0f ms of its %.0f ms in the "
+                               "last %i seconds.", name, used_ms, lim_ms,
+                               QUOTA_SLOTS);
+        }
+        break;
+    case QUOTA_THROTTLE:
+        if (quota->state != QUOTA_THROTTLED) {
+            quota->state = QUOTA_THROTTLED;
+            hexchat_printf(ph, "\00304%s used %.0f ms of its %.0f ms in the "
+                               "last %i seconds. Its timers are paused until "
+                               "it's under.", name, used_ms, lim_ms,
+                               QUOTA_SLOTS);
+        }
+        break;
+    case QUOTA_SUSPEND:
+        if (quota->state != QUOTA_SUSPENDED) {
+            quota->state = QUOTA_SUSPENDED;
+            hexchat_printf(ph, "\00304%s used %.0f ms of its %.0f ms in the "
+                               "last %i seconds and was suspended. Resume it "
+                               "with /MPY QUOTA RESUME %s.", name, used_ms,
+                               lim_ms, QUOTA_SLOTS, name);
+        }
+        break;
+    }
+}
+
+/**
+ * Retires the entry of an interp. Called when it's deleted.
+ */
+void
+quota_forget(PyThreadState *ts)
+{
+    PluginQuota *quota;
+
+    g_mutex_lock(&quota_lock);
+
+    if (quota_table && (quota = g_hash_table_lookup(quota_table, ts))) {
+        if (!quota_retired) {
+            quota_retired = g_ptr_array_new_with_free_func(g_free);
+        }
+        g_ptr_array_add(quota_retired, quota);
+        g_hash_table_steal(quota_table, ts);
+    }
+    g_mutex_unlock(&quota_lock);
+}
+
+/**
+ * Frees all the entries. Called when MagPy is unloaded.
+ */
+void
+quota_clear()
+{
+    g_mutex_lock(&quota_lock);
+
+    if (quota_table) {
+        g_hash_table_destroy(quota_table);
+        quota_table = NULL;
+    }
+    if (quota_retired) {
+        g_ptr_array_free(quota_retired, TRUE);
+        quota_retired = NULL;
+    }
+    g_mutex_unlock(&quota_lock);
+}
+
+/**
+ * Implements:
+ *
+ *      /MPY QUOTA
+ *      /MPY QUOTA LIMIT <ms> [WARN | THROTTLE | SUSPEND] [<plugin>]
+ *      /MPY QUOTA CLEAR <plugin>
+ *      /MPY QUOTA RESUME <plugin>
+ *      /MPY QUOTA MEMORY [ON | OFF]
+ *
+ * Called with the main interp current.
+ * @returns - HEXCHAT_EAT_ALL.
+ */
+int
+quota_command(char *word[], char *word_eol[])
+{
+    const char *sub = word[3];
+
+    if (!*sub) {
+        quota_print();
+    }
+    else if (!g_ascii_strcasecmp(sub, "LIMIT") && *word[4]) {
+        if (quota_set_limit(word[4], word[5], word_eol[6])) {
+            hexchat_print(ph, "Usage: /MPY QUOTA LIMIT <ms> "
+                              "[WARN | THROTTLE | SUSPEND] [<plugin>]");
+        }
+    }
+    else if (!g_ascii_strcasecmp(sub, "CLEAR") && *word[4]) {
+        quota_set_limit(NULL, NULL, word_eol[4]);
+    }
+    else if (!g_ascii_strcasecmp(sub, "RESUME") && *word[4]) {
+        quota_resume(word_eol[4]);
+    }
+    else if (!g_ascii_strcasecmp(sub, "MEMORY")) {
+        if (quota_memory(word[4])) {
+            PyErr_Print();
+        }
+    }
+    else {
+        hexchat_print(ph, "Usage: /MPY QUOTA [LIMIT <ms> [<action>] [<plugin>]"
+                          " | CLEAR <plugin> | RESUME <plugin> | "
+                          "MEMORY [ON | OFF]]");
+    }
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Sets or clears a limit.
+ * @param ms        - The limit per window, or NULL to clear the plugin's.
+ * @param action    - The action, or "" for WARN.
+ * @param plugin    - The plugin, or "" to set the default.
+ * @returns - 0 on success, -1 if the arguments aren't valid.
+ */
+int
+quota_set_limit(const char *ms, const char *action, const char *plugin)
+{
+    QuotaAction act;
+    gint64      limit_ns;
+    char        *value;
+    char        *key;
+
+    key = *plugin ? g_strdup_printf(QUOTA_PLUGIN_PREF, plugin)
+                  : g_strdup(QUOTA_PREF);
+    if (!ms) {
+        pref_store_delete(key);
+        hexchat_printf(ph, "%s uses the default limit.", plugin);
+    }
+    else {
+        value = g_strdup_printf("%s %s", ms, action);
+
+        if (quota_parse(value, &limit_ns, &act)) {
+            g_free(value);
+            g_free(key);
+            return -1;
+        }
+        g_free(value);
+        value = g_strdup_printf("%" G_GINT64_FORMAT " %s",
+                                limit_ns / 1000000, quota_actions[act]);
+        pref_store_set_raw(key, value);
+        g_free(value);
+
+        if (!limit_ns) {
+            hexchat_printf(ph, "%s%s no limit.", *plugin ? plugin : "Plugins",
+                           *plugin ? " has" : " have");
+        }
+        else {
+            hexchat_printf(ph, "%s%s limited to %" G_GINT64_FORMAT " ms in "
+                               "%i seconds (%s).",
+                           *plugin ? plugin : "Plugins",
+                           *plugin ? " is" : " are", limit_ns / 1000000,
+                           QUOTA_SLOTS, quota_actions[act]);
+        }
+    }
+    g_free(key);
+    quota_gen++;
+
+    return 0;
+}
+
+/**
+ * Resumes a suspended plugin, and empties its window.
+ */
+int
+quota_resume(const char *plugin)
+{
+    PyThreadState   *ts = plugin_get_threadstate(plugin);
+    PluginQuota     *quota;
+
+    quota = ts ? quota_find(ts) : NULL;
+
+    if (!quota) {
+        hexchat_printf(ph, "%s isn't loaded.", plugin);
+        return -1;
+    }
+    memset(quota->slots, 0, sizeof(quota->slots));
+    quota->state = QUOTA_OK;
+
+    hexchat_printf(ph, "%s was resumed.", plugin);
+    return 0;
+}
+
+/**
+ * Starts or stops tracemalloc, or shows whether it's on.
+ * @returns - 0 on success, -1 on error with the error set.
+ */
+int
+quota_memory(const char *arg)
+{
+    PyObject    *pytracemalloc;
+    PyObject    *pyret          = NULL;
+    const char  *method         = "is_tracing";
+
+    if (!g_ascii_strcasecmp(arg, "ON")) {
+        method = "start";
+    }
+    else if (!g_ascii_strcasecmp(arg, "OFF")) {
+        method = "stop";
+    }
+    pytracemalloc = PyImport_ImportModule("tracemalloc");
+
+    if (pytracemalloc) {
+        pyret = PyObject_CallMethod(pytracemalloc, method, NULL);
+        Py_DECREF(pytracemalloc);
+    }
+    if (!pyret) {
+        return -1;
+    }
+    if (!strcmp(method, "is_tracing")) {
+        hexchat_printf(ph, "Memory tracing is %s.",
+                       (pyret == Py_True) ? "on" : "off");
+    }
+    else {
+        hexchat_printf(ph, "Memory tracing is %s.",
+                       !strcmp(method, "start") ? "on" : "off");
+    }
+    Py_DECREF(pyret);
+
+    return 0;
+}
+
+/**
+ * Sums the memory traced by tracemalloc per file.
+ * @returns - A dict of file name to bytes, or NULL if tracemalloc isn't on.
+ */
+PyObject *
+quota_memory_map()
+{
+    PyObject    *pytracemalloc;
+    PyObject    *pysnapshot     = NULL;
+    PyObject    *pystats        = NULL;
+    PyObject    *pymap          = NULL;
+    PyObject    *pyret;
+    PyObject    *pyframe;
+    PyObject    *pyfile;
+    PyObject    *pysize;
+    Py_ssize_t  i;
+
+    pytracemalloc = PyImport_ImportModule("tracemalloc");
+    if (!pytracemalloc) {
+        goto error;
+    }
+    pyret = PyObject_CallMethod(pytracemalloc, "is_tracing", NULL);
+    if (pyret != Py_True) {
+        Py_XDECREF(pyret);
+        goto error;
+    }
+    Py_DECREF(pyret);
+
+    pysnapshot = PyObject_CallMethod(pytracemalloc, "take_snapshot", NULL);
+    if (pysnapshot) {
+        pystats = PyObject_CallMethod(pysnapshot, "statistics", "s",
+                                      "filename");
+    }
+    if (!pystats || !PyList_Check(pystats) || !(pymap = PyDict_New())) {
+        goto error;
+    }
+    for (i = 0; i < PyList_GET_SIZE(pystats); i++) {
+        // Each Statistic is for the file of the allocating frame.
+        pyframe = PyObject_GetAttrString(PyList_GET_ITEM(pystats, i),
+                                         "traceback");
+        pysize  = PyObject_GetAttrString(PyList_GET_ITEM(pystats, i),
+                                         "size");
+        pyfile  = NULL;
+
+        if (pyframe) {
+            pyret = PySequence_GetItem(pyframe, 0);
+            Py_DECREF(pyframe);
+            pyfile = pyret ? PyObject_GetAttrString(pyret, "filename")
+                           : NULL;
+            Py_XDECREF(pyret);
+        }
+        if (pyfile && pysize) {
+            PyDict_SetItem(pymap, pyfile, pysize);
+        }
+        Py_XDECREF(pyfile);
+        Py_XDECREF(pysize);
+    }
+error:
+    PyErr_Clear();
+    Py_XDECREF(pytracemalloc);
+    Py_XDECREF(pysnapshot);
+    Py_XDECREF(pystats);
+
+    return pymap;
+}
+
+/**
+ * Prints a plugin's row of /MPY QUOTA. Passed to plugin_list_foreach().
+ * @param userdata  - The dict from quota_memory_map(), or NULL.
+ */
+void
+quota_print_row(const char *name, const char *path, PyThreadState *ts,
+                void *userdata)
+{
+    PyObject    *pymap  = (PyObject *)userdata;
+    PyObject    *pysize;
+    PluginQuota *quota  = quota_get(ts);
+    char        limit[32];
+    char        memory[32];
+
+    if (quota->gen != quota_gen) {
+        quota_resolve(quota);
+    }
+    if (quota->limit_ns) {
+        g_snprintf(limit, sizeof(limit), "%" G_GINT64_FORMAT " %s",
+                   quota->limit_ns / 1000000, quota_actions[quota->action]);
+    }
+    else {
+        g_strlcpy(limit, "-", sizeof(limit));
+    }
+    g_strlcpy(memory, "-", sizeof(memory));
+
+    if (pymap) {
+        pysize = PyDict_GetItemString(pymap, path); // BR.
+        g_snprintf(memory, sizeof(memory), "%.1f",
+                   pysize ? PyLong_AsLongLong(pysize) / 1024.0 : 0.0);
+    }
+    hexchat_printf(ph, "%-18s %5zd %10.1f %11.1f  %-14s %-9s %9s", name,
+                   interp_count_hooks(ts),
+                   quota_used(quota, stats_now()) / 1e6,
+                   quota->total_ns / 1e6, limit, quota_states[quota->state],
+                   memory);
+}
+
+/**
+ * Prints the usage and limits of the loaded plugins.
+ */
+void
+quota_print()
+{
+    PyObject *pymap = quota_memory_map();
+
+    hexchat_printf(ph, "\00311Plugin             Hooks  Last %2is ms    "
+                       "Total ms  Limit ms       State     Memory KB",
+                   QUOTA_SLOTS);
+
+    plugin_list_foreach(quota_print_row, pymap);
+
+    Py_XDECREF(pymap);
+}
@@ -0,0 +1,573 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+
+/**
+ * Timing statistics for hook callbacks, delegate calls, and output, turned on
+ * with /MPY STATS ON and read with /MPY STATS or hexchat.get_stats().
+ *
+ * Each entry is kept per interp and per hooked name, e.g. "print" and
+ * "Channel Message", so several hooks of a plugin on the same event share one
+ * entry, and the entry outlives the hooks until the interp is deleted. The
+ * time of a call is split into the wait to switch to the interp (mostly
+ * waiting for the GIL), converting the arguments and return value, and the
+ * call itself. Call times are also counted in a histogram of buckets a
+ * quarter octave wide, from which p50 and p99 are estimated.
+ *
+ * stats_get() can be called from any thread, as timers can be hooked from
+ * threads. Times are only recorded on the main thread.
+ *
+ * A plugin can be unloaded from within one of its own callbacks, which then
+ * records its time after the interp is gone, so the entries of deleted
+ * interps are set aside rather than freed until MagPy is unloaded.
+ */
+
+#include <glib.h>
+#include "minpython.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define STATS_BUCKETS   100     // Quarter octaves from 1 us up to ~16 s.
+#define STATS_TOP       15      // Hooks listed by /MPY STATS.
+
+struct _HookStats {
+    PyThreadState   *threadstate;
+    char            *kind;
+    char            *name;
+    gint64          calls;
+    gint64          total_ns;
+    gint64          max_ns;
+    gint64          gil_ns;
+    gint64          convert_ns;
+    guint32         buckets[STATS_BUCKETS];
+};
+
+/**
+ * Totals of a plugin's entries.
+ */
+typedef struct {
+    const char  *plugin;
+    gint64      calls;
+    gint64      total_ns;
+    gint64      gil_ns;
+    gint64      convert_ns;
+} PluginStats;
+
+int                 stats_enabled   = 0;
+
+static GHashTable   *stats_table    = NULL; // "<ts> <kind> <name>" -> entry.
+static GPtrArray    *stats_retired  = NULL; // Entries of deleted interps.
+static GMutex       stats_lock;
+
+long long   stats_now           (void);
+HookStats   *stats_get          (PyThreadState *, const char *, const char *);
+void        stats_record        (HookStats *, long long, long long, long long);
+void        stats_forget        (PyThreadState *);
+void        stats_clear         (void);
+int         stats_command       (const char *);
+PyObject    *py_get_stats       (PyObject *, PyObject *);
+
+static int          stats_bucket        (gint64);
+static double       stats_percentile    (HookStats *, double);
+static const char   *stats_plugin_name  (PyThreadState *);
+static HookStats    **stats_snapshot    (guint *);
+static PluginStats  *stats_by_plugin    (HookStats **, guint, guint *);
+static int          stats_cmp_total     (const void *, const void *);
+static void         stats_print         (void);
+static void         stats_free_entry    (gpointer);
+
+
+/**
+ * Returns a monotonic time in nanoseconds for measuring intervals.
+ */
+long long
+stats_now()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER    freq;
+    LARGE_INTEGER           count;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&count);
+
+    return (long long)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Gets the entry for something an interp hooked, creating it if needed.
+ * @param ts    - The interp's main threadstate.
+ * @param kind  - "command", "print", "server", "timer", "delegate", or
+ *                "output".
+ * @param name  - The command or event name, or a description.
+ * @returns - The entry, which lasts until MagPy is unloaded.
+ */
+HookStats *
+stats_get(PyThreadState *ts, const char *kind, const char *name)
+{
+    HookStats   *stats;
+    char        *key;
+
+    key = g_strdup_printf("%p %s %s", (void *)ts, kind, name);
+
+    g_mutex_lock(&stats_lock);
+
+    if (!stats_table) {
+        stats_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, stats_free_entry);
+    }
+    stats = g_hash_table_lookup(stats_table, key);
+
+    if (!stats) {
+        stats               = g_new0(HookStats, 1);
+        stats->threadstate  = ts;
+        stats->kind         = g_strdup(kind);
+        stats->name         = g_strdup(name);
+
+        g_hash_table_insert(stats_table, key, stats);
+        key = NULL;
+    }
+    g_mutex_unlock(&stats_lock);
+    g_free(key);
+
+    return stats;
+}
+
+/**
+ * Records a call. Main thread only.
+ * @param stats     - The entry, NULL is ignored.
+ * @param gil_ns    - Time spent switching to the interp.
+ * @param conv_ns   - Time spent converting arguments and return values.
+ * @param call_ns   - Time spent in the call.
+ */
+void
+stats_record(HookStats *stats, long long gil_ns, long long conv_ns,
+             long long call_ns)
+{
+    gint64 total = gil_ns + conv_ns + call_ns;
+
+    if (!stats) {
+        return;
+    }
+    stats->calls++;
+    stats->total_ns   += total;
+    stats->gil_ns     += gil_ns;
+    stats->convert_ns += conv_ns;
+
+    if (total > stats->max_ns) {
+        stats->max_ns = total;
+    }
+    stats->buckets[stats_bucket(total)]++;
+}
+
+/**
+ * Retires the entries of an interp. Called when it's deleted.
+ */
+void
+stats_forget(PyThreadState *ts)
+{
+    GHashTableIter  iter;
+    HookStats       *stats;
+    gpointer        key;
+
+    g_mutex_lock(&stats_lock);
+
+    if (stats_table) {
+        if (!stats_retired) {
+            stats_retired = g_ptr_array_new_with_free_func(stats_free_entry);
+        }
+        g_hash_table_iter_init(&iter, stats_table);
+
+        while (g_hash_table_iter_next(&iter, &key, (gpointer *)&stats)) {
+            if (stats->threadstate == ts) {
+                g_ptr_array_add(stats_retired, stats);
+                g_hash_table_iter_steal(&iter);
+                g_free(key);
+            }
+        }
+    }
+    g_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Frees all the entries. Called when MagPy is unloaded.
+ */
+void
+stats_clear()
+{
+    g_mutex_lock(&stats_lock);
+
+    if (stats_table) {
+        g_hash_table_destroy(stats_table);
+        stats_table = NULL;
+    }
+    if (stats_retired) {
+        g_ptr_array_free(stats_retired, TRUE);
+        stats_retired = NULL;
+    }
+    stats_enabled = 0;
+
+    g_mutex_unlock(&stats_lock);
+}
+
+/**
+ * Implements /MPY STATS [ON | OFF | RESET].
+ * @param arg   - The subcommand, or "" to print the statistics.
+ * @returns - HEXCHAT_EAT_ALL.
+ */
+int
+stats_command(const char *arg)
+{
+    GHashTableIter  iter;
+    HookStats       *stats;
+
+    if (!g_ascii_strcasecmp(arg, "ON")) {
+        stats_enabled = 1;
+        hexchat_print(ph, "Hook statistics are on.");
+    }
+    else if (!g_ascii_strcasecmp(arg, "OFF")) {
+        stats_enabled = 0;
+        hexchat_print(ph, "Hook statistics are off.");
+    }
+    else if (!g_ascii_strcasecmp(arg, "RESET")) {
+        g_mutex_lock(&stats_lock);
+
+        if (stats_table) {
+            g_hash_table_iter_init(&iter, stats_table);
+
+            while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+                stats->calls = stats->total_ns = stats->max_ns = 0;
+                stats->gil_ns = stats->convert_ns = 0;
+                memset(stats->buckets, 0, sizeof(stats->buckets));
+            }
+        }
+        g_mutex_unlock(&stats_lock);
+        hexchat_print(ph, "Hook statistics were reset.");
+    }
+    else if (!*arg) {
+        stats_print();
+    }
+    else {
+        hexchat_print(ph, "Usage: /MPY STATS [ON | OFF | RESET]");
+    }
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * Prints the totals of each plugin and the hooks that took the most time.
+ */
+void
+stats_print()
+{
+    HookStats   **entries;
+    HookStats   *stats;
+    PluginStats *plugins;
+    guint       n;
+    guint       nplugins;
+    guint       i;
+
+    if (!stats_enabled) {
+        hexchat_print(ph, "Hook statistics are off. "
+                          "Turn them on with /MPY STATS ON.");
+    }
+    entries = stats_snapshot(&n);
+
+    if (!n) {
+        hexchat_print(ph, "No calls have been timed.");
+        g_free(entries);
+        return;
+    }
+    plugins = stats_by_plugin(entries, n, &nplugins);
+
+    hexchat_print(ph, "\00311Plugin                  Calls    Total ms      "
+                      "GIL ms     Conv ms");
+
+    for (i = 0; i < nplugins; i++) {
+        hexchat_printf(ph, "%-18s %10" G_GINT64_FORMAT " %11.2f %11.2f %11.2f",
+                       plugins[i].plugin, plugins[i].calls,
+                       plugins[i].total_ns / 1e6, plugins[i].gil_ns / 1e6,
+                       plugins[i].convert_ns / 1e6);
+    }
+    hexchat_print(ph, "\00311Plugin             Hook                      "
+                      "Calls    Total ms  p50 us  p99 us  max us");
+
+    for (i = 0; i < n && i < STATS_TOP; i++) {
+        stats = entries[i];
+        hexchat_printf(ph, "%-18s %-20.20s %10" G_GINT64_FORMAT
+                       " %11.2f %7.0f %7.0f %7.0f",
+                       stats_plugin_name(stats->threadstate), stats->name,
+                       stats->calls, stats->total_ns / 1e6,
+                       stats_percentile(stats, 0.50),
+                       stats_percentile(stats, 0.99), stats->max_ns / 1e3);
+    }
+    g_free(plugins);
+    g_free(entries);
+}
+
+/**
+ * Python facing get_stats(). Returns a dict with the 'enabled' flag, a
+ * 'plugins' dict of each plugin's totals, and a 'hooks' list of dicts for
+ * every entry, the most time consuming first.
+ */
+PyObject *
+py_get_stats(PyObject *self, PyObject *args)
+{
+    HookStats   **entries;
+    HookStats   *stats;
+    PluginStats *plugins;
+    PyObject    *pyplugins;
+    PyObject    *pyhooks;
+    PyObject    *pyitem;
+    PyObject    *pyret      = NULL;
+    guint       n;
+    guint       nplugins;
+    guint       i;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    entries   = stats_snapshot(&n);
+    plugins   = stats_by_plugin(entries, n, &nplugins);
+    pyplugins = PyDict_New();
+    pyhooks   = PyList_New(0);
+
+    if (!pyplugins || !pyhooks) {
+        goto error;
+    }
+    for (i = 0; i < nplugins; i++) {
+        pyitem = Py_BuildValue("{sLsdsdsd}",
+                               "calls",      (long long)plugins[i].calls,
+                               "total_ms",   plugins[i].total_ns / 1e6,
+                               "gil_ms",     plugins[i].gil_ns / 1e6,
+                               "convert_ms", plugins[i].convert_ns / 1e6);
+        if (!pyitem ||
+            PyDict_SetItemString(pyplugins, plugins[i].plugin, pyitem)) {
+            Py_XDECREF(pyitem);
+            goto error;
+        }
+        Py_DECREF(pyitem);
+    }
+    for (i = 0; i < n; i++) {
+        stats  = entries[i];
+        pyitem = Py_BuildValue("{sssssssLsdsdsdsdsdsd}",
+                               "plugin",
+                               stats_plugin_name(stats->threadstate),
+                               "kind",       stats->kind,
+                               "name",       stats->name,
+                               "calls",      (long long)stats->calls,
+                               "total_ms",   stats->total_ns / 1e6,
+                               "gil_ms",     stats->gil_ns / 1e6,
+                               "convert_ms", stats->convert_ns / 1e6,
+                               "p50_us",     stats_percentile(stats, 0.50),
+                               "p99_us",     stats_percentile(stats, 0.99),
+                               "max_us",     stats->max_ns / 1e3);
+        if (!pyitem || PyList_Append(pyhooks, pyitem)) {
+            Py_XDECREF(pyitem);
+            goto error;
+        }
+        Py_DECREF(pyitem);
+    }
+    pyret = Py_BuildValue("{sOsOsO}", "enabled",
+                          stats_enabled ? Py_True : Py_False,
+                          "plugins", pyplugins, "hooks", pyhooks);
+error:
+    Py_XDECREF(pyplugins);
+    Py_XDECREF(pyhooks);
+    g_free(plugins);
+    g_free(entries);
+
+    return pyret;
+}
+
+/**
+ * Returns the histogram bucket of a time. Bucket 0 is under 1 us, and the
+ * others are quarter octaves: bucket 1 + 4 * e + s starts at
+ * (4 + s) * 2^e / 4 us.
+ */
+int
+stats_bucket(gint64 ns)
+{
+    gint64  us = ns / 1000;
+    int     e  = 0;
+    int     sub;
+    int     i;
+
+    if (us < 1) {
+        return 0;
+    }
+    while ((us >> e) > 1) {
+        e++;
+    }
+    sub = (e >= 2) ? (int)((us >> (e - 2)) & 3) : (int)((us << (2 - e)) & 3);
+    i   = 1 + 4 * e + sub;
+
+    return (i < STATS_BUCKETS) ? i : STATS_BUCKETS - 1;
+}
+
+/**
+ * Estimates a percentile of an entry's call times from its histogram.
+ * @param p - The percentile, from 0 to 1.
+ * @returns - The midpoint of the bucket the percentile falls in, in us.
+ */
+double
+stats_percentile(HookStats *stats, double p)
+{
+    gint64  target;
+    gint64  count = 0;
+    double  lo;
+    double  hi;
+    int     i;
+
+    if (!stats->calls) {
+        return 0.0;
+    }
+    target = (gint64)(stats->calls * p + 0.999999);
+
+    for (i = 0; i < STATS_BUCKETS - 1; i++) {
+        count += stats->buckets[i];
+        if (count >= target) {
+            break;
+        }
+    }
+    if (i == 0) {
+        return 0.5;
+    }
+    lo = (4 + (i - 1) % 4) * (double)(1LL << ((i - 1) / 4)) / 4;
+    hi = (4 + i % 4)       * (double)(1LL << (i / 4)) / 4;
+
+    return MIN((lo + hi) / 2, stats->max_ns / 1e3);
+}
+
+/**
+ * Returns the name of the plugin that owns an interp.
+ */
+const char *
+stats_plugin_name(PyThreadState *ts)
+{
+    const char *name = plugin_get_name(ts);
+
+    if (name) {
+        return name;
+    }
+    return (ts == py_g_main_threadstate) ? "(main)" : "(console)";
+}
+
+/**
+ * Gets the entries that have calls, sorted by total time, most first.
+ * @param n - Receives the number of entries.
+ * @returns - The array, free with g_free().
+ */
+HookStats **
+stats_snapshot(guint *n)
+{
+    GHashTableIter  iter;
+    HookStats       **entries;
+    HookStats       *stats;
+
+    g_mutex_lock(&stats_lock);
+
+    *n      = 0;
+    entries = g_new(HookStats *, stats_table ?
+                                 g_hash_table_size(stats_table) + 1 : 1);
+    if (stats_table) {
+        g_hash_table_iter_init(&iter, stats_table);
+
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&stats)) {
+            if (stats->calls) {
+                entries[(*n)++] = stats;
+            }
+        }
+    }
+    g_mutex_unlock(&stats_lock);
+
+    qsort(entries, *n, sizeof(HookStats *), stats_cmp_total);
+
+    return entries;
+}
+
+/**
+ * Sums the entries of each plugin, in the order of the plugins' first
+ * entries.
+ * @param entries   - The entries from stats_snapshot().
+ * @param n         - Their number.
+ * @param nplugins  - Receives the number of plugins.
+ * @returns - An array of totals, free with g_free().
+ */
+PluginStats *
+stats_by_plugin(HookStats **entries, guint n, guint *nplugins)
+{
+    PluginStats *plugins = g_new0(PluginStats, n + 1);
+    const char  *name;
+    guint       i;
+    guint       j;
+
+    *nplugins = 0;
+
+    for (i = 0; i < n; i++) {
+        name = stats_plugin_name(entries[i]->threadstate);
+
+        for (j = 0; j < *nplugins && strcmp(plugins[j].plugin, name); j++);
+
+        if (j == *nplugins) {
+            plugins[j].plugin = name;
+            (*nplugins)++;
+        }
+        plugins[j].calls      += entries[i]->calls;
+        plugins[j].total_ns   += entries[i]->total_ns;
+        plugins[j].gil_ns     += entries[i]->gil_ns;
+        plugins[j].convert_ns += entries[i]->convert_ns;
+    }
+    return plugins;
+}
+
+int
+stats_cmp_total(const void *a, const void *b)
+{
+    gint64 ta = (*(HookStats **)a)->total_ns;
+    gint64 tb = (*(HookStats **)b)->total_ns;
+
+    return (ta < tb) - (ta > tb);
+}
+
+void
+stats_free_entry(gpointer p)
+{
+    HookStats *stats = (HookStats *)p;
+
+    g_free(stats->kind);
+    g_free(stats->name);
+    g_free(stats);
+}
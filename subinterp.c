@@ -24,24 +24,117 @@
 
 
 /**
- * This module provides access to per subinterpreter data stored within each 
- * subinterp's environment. It also has functions that execute within a
+ * This module provides access to per subinterpreter data, which is kept in a
+ * native InterpData struct for each subinterp. It also has functions that execute within a
  * subinterp to configure it (setting up stdout/stderr, etc.). It also has
  * functions to switch threads.
+ *
+ * On Python 3.12 and later a plugin can be given its own GIL, so its threads
+ * run in parallel with the rest. Such an interp gets heap type copies of the
+ * hexchat types instead of sharing the static ones, and can't use the proxies
+ * that reach into other interps (MainInterp, InterpCall, InterpObjProxy);
+ * hexchat.Channel is the way to talk to other plugins. Switching to or from
+ * it releases one GIL and takes the other rather than swapping threadstates
+ * under the one GIL.
  */
 
+#include <glib.h>
 #include "minpython.h"
 
-// Consts for quick access to per-interp data.
-#define HC_DATA_KEY             "__hexchat_private__"
-#define HC_HOOKS_KEY            0   
-#define HC_UNLOAD_KEY           1   
-#define HC_MAIN_THREADSTATE_KEY 2   
-#define HC_QUEUE_MODULE         3
-#define HC_THREADING_MODULE     4
-#define HC_COLLECTIONS_MODULE   5
-#define HC_LISTS_INFO           6
-#define HC_NUM_KEYS             7 
+/**
+ * The private data of a subinterpreter. Kept out of the interp's environment
+ * so scripts can't disturb it, and so getting at it is a pointer comparison
+ * rather than several dict lookups. A capsule of it is also kept in the
+ * interp's state dict, which scripts can't reach, so the interp can find its
+ * own data without taking interp_data_lock.
+ */
+typedef struct _InterpData InterpData;
+
+#define INTERP_DATA_KEY     "minpython.interp_data"
+
+struct _InterpData {
+    PyInterpreterState  *interp;
+    PyThreadState       *threadstate;       // The interp's main threadstate.
+    PyObject            *hooks;             // A set of hook capsules.
+    PyObject            *unload_hooks;
+    PyObject            *queue_module;
+    PyObject            *threading_module;
+    PyObject            *collections_module;
+    PyObject            *lists_info;
+    PyObject            *list_row_types;    // Cached get_list() item types.
+    PyObject            *plugin_name;       // Set once the plugin is loaded.
+    PyObject            *proxy_cache;       // Proxies handed to other interps.
+    PyObject            *context_cache;     // Interned Context objects.
+    DelegateQueue       *delegate_queue;
+    EventLoop           *event_loop;
+    int                 own_gil;
+    PyTypeObject        *types[MPY_NUM_TYPES]; // Only if own_gil is set.
+};
+
+/**
+ * The data of all subinterps keyed by PyInterpreterState, guarded by
+ * interp_data_lock since interps with their own GIL look entries up
+ * concurrently. interp_data_gen is bumped when an entry is released.
+ * interp_own_gil_count is the number of interps with their own GIL; while
+ * it's 0 none of the extra work for them is done.
+ */
+static GHashTable   *interp_data_table      = NULL;
+static GMutex       interp_data_lock;
+static long         interp_data_gen         = 0;
+static long         interp_own_gil_count    = 0;
+
+/**
+ * Each thread's most recently looked up entry, valid while interp_data_gen
+ * hasn't changed. The interp is kept too, so misses for the main interp,
+ * which has no entry, are also cached.
+ */
+static MPY_THREAD_LOCAL PyInterpreterState  *interp_data_last_interp = NULL;
+static MPY_THREAD_LOCAL InterpData          *interp_data_last        = NULL;
+static MPY_THREAD_LOCAL long                interp_data_last_gen     = -1;
+
+/**
+ * The static definitions of the types, indexed by MpyTypeId.
+ */
+static PyTypeObject **interp_type_defs[MPY_NUM_TYPES] = {
+    &OutStreamTypeDef,
+    &EventAttrsTypeDef,
+    &ContextTypeDef,
+    &ListIterTypeDef,
+    &DelegateTypeDef,
+    &DelegateProxyTypeDef,
+    &AsyncResultTypeDef,
+    &MainInterpTypeDef,
+    &InterpCallTypeDef,
+    &InterpObjProxyTypeDef,
+    &WordListTypeDef,
+    &UserIndexTypeDef,
+    &ChannelTypeDef,
+};
+
+#ifdef MINPY_HAVE_OWN_GIL
+#if PY_VERSION_HEX >= 0x030D0000
+#define interp_current_ts()     PyThreadState_GetUnchecked()
+#else
+#define interp_current_ts()     _PyThreadState_UncheckedGet()
+#endif
+#endif
+
+/**
+ * Interps created ahead of time, one per timer tick while HexChat is idle, so
+ * loading a plugin only has to run its script. Only for interps sharing the
+ * main GIL.
+ */
+#define INTERP_POOL_SIZE        4
+#define INTERP_POOL_INTERVAL    50  // ms between pooled interp creations.
+
+static PyThreadState    *interp_pool[INTERP_POOL_SIZE];
+static int              interp_pool_len     = 0;
+static hexchat_hook     *interp_pool_hook   = NULL;
+
+/**
+ * The main interp has no InterpData; its proxy cache is kept here.
+ */
+static PyObject *main_proxy_cache = NULL;
 
 /**
  * Callback information used for the custom unload event hook.
@@ -62,7 +155,8 @@ static int              py_main_has_gil = 0;
  */
 PyThreadState   *py_g_main_threadstate = NULL;
 
-PyThreadState   *create_interp                  (interp_config_func, void *);
+PyThreadState   *create_interp                  (interp_config_func, void *,
+                                                 int);
 int             delete_interp                   (PyThreadState *, 
                                                  interp_config_func,
                                                  void *);
@@ -72,18 +166,41 @@ PyObject        *interp_hook_unload             (PyObject *, PyObject *);
 PyObject        *interp_unhook_unload           (PyObject *);
 PyObject        *interp_get_hooks               (void);
 PyObject        *interp_get_unload_hooks        (void);
+void            interp_run_unload_hooks         (void);
 PyObject        *interp_get_queue_constr        (void);
 PyObject        *interp_get_namedtuple_constr   (void);
 PyObject        *interp_get_lists_info          (void);
+PyObject        *interp_get_list_row_types      (void);
+PyObject        *interp_get_proxy_cache         (void);
+PyObject        *interp_get_context_cache       (void);
+void            interp_clear_main_proxy_cache   (void);
 PyObject        *interp_get_plugin_name         (void);
+void            interp_set_plugin_name          (PyObject *);
+DelegateQueue   *interp_get_delegate_queue      (void);
+EventLoop       *interp_get_event_loop          (void);
 int             interp_set_up_stdout_stderr     (void);
 int             interp_is_primitive             (PyObject *);
-
-static void     interp_init_data                (PyThreadState *);
+PyTypeObject    *interp_get_type                (MpyTypeId);
+void            interp_free_object              (PyObject *);
+Py_ssize_t      interp_count_hooks              (PyThreadState *);
+int             interp_has_own_gil              (PyThreadState *);
+int             interp_check_shared_gil         (PyThreadState *);
+void            interp_pool_start               (void);
+void            interp_pool_clear               (void);
+
+static int      interp_init_data                (PyThreadState *, int);
 static void     interp_destroy_data             (void);
+static InterpData *interp_find_data             (PyInterpreterState *);
+static PyThreadState *interp_create_new         (interp_config_func, void *,
+                                                 int);
+static PyThreadState *interp_pool_take          (void);
+static int      interp_pool_callback            (void *);
+#ifdef MINPY_HAVE_OWN_GIL
+static PyTypeObject *interp_copy_type           (PyTypeObject *);
+#endif
 
 static 
-inline PyObject *interp_get_data                (Py_ssize_t );
+inline InterpData *interp_get_data              (void);
 
 static void     py_hook_free_fn                 (PyObject *);
 
@@ -93,7 +210,8 @@ void            switch_threadstate_back         (SwitchTSInfo);
 int             main_thread_check               (void);
 
 /**
- * Creates a subinterpreter and sets up it's environment. 
+ * Creates a subinterpreter and sets up it's environment. A prepared interp is
+ * taken from the pool if one is ready (see interp_pool_start()).
  * @param configfunc - a callback to invoke after the subinterp has been 
  *                     configured. This can provide additional configuration.
  *                     It must return 0 on success, or non-zero on failure. If
@@ -102,14 +220,42 @@ int             main_thread_check               (void);
  * @param data       - Like 'userdata' for other calls. The caller can provide
  *                     data it wants passed back to itself when invoking
  *                     configfunc().
+ * @param own_gil    - Nonzero to give the interp its own GIL. Needs Python
+ *                     3.12 or later; ignored with a warning otherwise.
  * @returns - pointer to new threadstate, or NULL ond failure.
  */
 PyThreadState *
-create_interp(interp_config_func configfunc, void *data)
+create_interp(interp_config_func configfunc, void *data, int own_gil)
 {
-    PyThreadState   *pynew_interp_threadstate;
     SwitchTSInfo    tsinfo;
     PyThreadState   *retval;
+
+    if (own_gil || !(retval = interp_pool_take())) {
+        return interp_create_new(configfunc, data, own_gil);
+    }
+    // A prepared interp is ready; only the callback needs to run.
+    tsinfo = switch_threadstate(retval);
+
+    if (configfunc && configfunc(retval, data)) {
+        delete_interp(retval, NULL, NULL);
+        retval = NULL;
+    }
+    switch_threadstate_back(tsinfo);
+
+    return retval;
+}
+
+/**
+ * Does the work of create_interp() for a new interp rather than a pooled
+ * one. The parameters and return value are the same.
+ */
+PyThreadState *
+interp_create_new(interp_config_func configfunc, void *data, int own_gil)
+{
+    PyThreadState   *pynew_interp_threadstate = NULL;
+    SwitchTSInfo    tsinfo;
+    PyThreadState   *retval;
+    int             alive;
     
     retval = NULL;
 
@@ -117,36 +263,87 @@ create_interp(interp_config_func configfunc, void *data)
     tsinfo = switch_threadstate(py_g_main_threadstate);
 
     // Create a new sub-interp.
-    pynew_interp_threadstate = Py_NewInterpreter();
+#ifdef MINPY_HAVE_OWN_GIL
+    if (own_gil) {
+        PyInterpreterConfig config = {
+            .use_main_obmalloc              = 0,
+            .allow_fork                     = 0,
+            .allow_exec                     = 0,
+            .allow_threads                  = 1,
+            .allow_daemon_threads           = 0,
+            .check_multi_interp_extensions  = 1,
+            .gil                            = PyInterpreterConfig_OWN_GIL,
+        };
+        PyStatus status;
+
+        // On success the new interp's GIL is held and the main GIL released.
+        status = Py_NewInterpreterFromConfig(&pynew_interp_threadstate,
+                                             &config);
+        if (PyStatus_Exception(status)) {
+            pynew_interp_threadstate = NULL;
+            if (status.err_msg) {
+                hexchat_printf(ph, "\00304%s", status.err_msg);
+            }
+        }
+    }
+    else
+#else
+    if (own_gil) {
+        hexchat_print(ph, "\00304A plugin can only have its own GIL with "
+                          "Python 3.12 or later; it will share the GIL.");
+        own_gil = 0;
+    }
+#endif
+    {
+        pynew_interp_threadstate = Py_NewInterpreter();
+    }
 
     if (!pynew_interp_threadstate) {
         // There was a problem creating the interp.
         hexchat_print(ph,
             "\00304Unable to create new sub-interpreter.");
+        switch_threadstate_back(tsinfo);
+        return NULL;
     }
-    else {
-        // Switch to the new interpreter.
-        PyThreadState_Swap(pynew_interp_threadstate);
 
-        // Initialize internal data.
-        interp_init_data(pynew_interp_threadstate);
+    // Switch to the new interpreter.
+    PyThreadState_Swap(pynew_interp_threadstate);
 
+    alive = 1;
+
+    // Initialize internal data.
+    if (interp_init_data(pynew_interp_threadstate, own_gil)) {
+        hexchat_print(ph,
+            "\00304Unable to set up the new sub-interpreter.");
+        PyErr_Clear();
+        Py_EndInterpreter(pynew_interp_threadstate);
+        alive = 0;
+    }
+    else {
         // Set up the new sub-interp's standard output.
         interp_set_up_stdout_stderr();
-        
-        if (configfunc) {
+
+        if (configfunc &&
+                configfunc(pynew_interp_threadstate, data)) {
             // Call customization callback.
-            if (configfunc(pynew_interp_threadstate, data)) {
-                delete_interp(pynew_interp_threadstate, NULL, NULL);
-                retval = NULL;
-            }
+            delete_interp(pynew_interp_threadstate, NULL, NULL);
+            alive = 0;
         }
         else {
             retval = pynew_interp_threadstate;
         }
     }
+
     // Switch back to the main interp threadstate.
-    PyThreadState_Swap(py_g_main_threadstate);
+    if (own_gil) {
+        if (alive) {
+            PyEval_SaveThread();
+        }
+        PyEval_RestoreThread(py_g_main_threadstate);
+    }
+    else {
+        PyThreadState_Swap(py_g_main_threadstate);
+    }
 
     // Restore the initial threadstate.
     switch_threadstate_back(tsinfo);
@@ -154,6 +351,79 @@ create_interp(interp_config_func configfunc, void *data)
     return retval;
 }
 
+/**
+ * Starts filling the pool of prepared interps. Each timer tick while HexChat
+ * is idle creates one, so the work doesn't hold up the caller.
+ */
+void
+interp_pool_start()
+{
+    if (!interp_pool_hook && interp_pool_len < INTERP_POOL_SIZE) {
+        interp_pool_hook = hexchat_hook_timer(ph, INTERP_POOL_INTERVAL,
+                                              interp_pool_callback, NULL);
+    }
+}
+
+/**
+ * Deletes the interps left in the pool and stops refilling it.
+ */
+void
+interp_pool_clear()
+{
+    if (interp_pool_hook) {
+        hexchat_unhook(ph, interp_pool_hook);
+        interp_pool_hook = NULL;
+    }
+    while (interp_pool_len > 0) {
+        delete_interp(interp_pool[--interp_pool_len], NULL, NULL);
+    }
+}
+
+/**
+ * Removes a prepared interp from the pool and schedules its replacement.
+ * @returns - The interp's threadstate, or NULL if none are ready.
+ */
+PyThreadState *
+interp_pool_take()
+{
+    PyThreadState *ts;
+
+    if (interp_pool_len == 0) {
+        return NULL;
+    }
+    // Taken in the order created.
+    ts = interp_pool[0];
+    memmove(interp_pool, interp_pool + 1, 
+            --interp_pool_len * sizeof(PyThreadState *));
+
+    interp_pool_start();
+    return ts;
+}
+
+/**
+ * The timer callback that adds an interp to the pool.
+ * @returns - 1 to keep the timer going, 0 once the pool is full.
+ */
+int
+interp_pool_callback(void *userdata)
+{
+    PyThreadState *ts;
+
+    if (interp_pool_len < INTERP_POOL_SIZE) {
+        if (!(ts = interp_create_new(NULL, NULL, 0))) {
+            // Don't keep trying if interps can't be created.
+            interp_pool_hook = NULL;
+            return 0;
+        }
+        interp_pool[interp_pool_len++] = ts;
+    }
+    if (interp_pool_len < INTERP_POOL_SIZE) {
+        return 1;
+    }
+    interp_pool_hook = NULL;
+    return 0;
+}
+
 /**
  * Deletes the interpreter.
  * @param ts         - The threadsate for the interpreter to delete.
@@ -167,14 +437,6 @@ int
 delete_interp(PyThreadState *ts, interp_config_func configfunc, void *data)
 {
     SwitchTSInfo tsinfo;
-    PyObject    *pyunload_hooks;
-    PyObject    *pycap;
-    PyObject    *pycallable;
-    PyObject    *pyuserdata;
-    PyObject    *pyret;
-    Py_ssize_t  size;
-    int         i;
-    UnhookEventData *evt_data;
     
     tsinfo = switch_threadstate(ts);
 
@@ -186,96 +448,172 @@ delete_interp(PyThreadState *ts, interp_config_func configfunc, void *data)
             configfunc(ts, data);
         }
         
-        pyunload_hooks = interp_get_unload_hooks();
-        
-        size = PyObject_Length(pyunload_hooks);
-        
         // Invoke callbacks for the unload event.
-        for (i = 0; i < size; i++) {
-            pycap      = PyList_GetItem(pyunload_hooks, i); // BR
-            
-            evt_data   = PyCapsule_GetPointer(pycap, "unload_hook");
-            pycallable = evt_data->callable;
-            pyuserdata = evt_data->userdata;
-            
-            pyret = PyObject_CallFunction(pycallable, "O", pyuserdata);
-            if (!pyret) {
-                PyErr_Print();
-            }
-            else {
-                Py_DECREF(pyret);
-            }
-        }
+        interp_run_unload_hooks();
+
+        // Hooks the plugin still holds would outlive the interp otherwise.
+        hc_unhook_all();
         
         // Delete the interp's private data.
         interp_destroy_data();
-        
-        // Kill the interp.
-        Py_EndInterpreter(ts);
 
         if (PyErr_Occurred()) {
             PyErr_Print();
         }
+        
+        // Kill the interp. No threadstate is current afterward.
+        Py_EndInterpreter(ts);
     }
     switch_threadstate_back(tsinfo);
+
+    stats_forget(ts);
+    quota_forget(ts);
+
+    // Save what the plugin and its unload hooks changed.
+    pref_store_flush();
     return 0;
 }
 
 /**
- * Sets up data objects for storing specific data for each subinterpreter.
- * @param ts    - The threadstate of the interpreter.
+ * Invokes the current interp's unload hooks, then removes them. Errors raised
+ * by the callbacks are printed.
  */
 void
-interp_init_data(PyThreadState *ts)
-{
-    PyObject *pymain;
-    PyObject *pydict;
-    PyObject *pytup;
-    PyObject *pyhooks;
-    PyObject *pyunload;
-    PyObject *pytscap;
-    PyObject *pymodule;
-    PyObject *pystr;
-
-    pymain = PyImport_AddModule("__main__");    // BR
-    pydict = PyModule_GetDict(pymain);          // BR
-    pytup  = PyTuple_New(HC_NUM_KEYS);
-
-    // Add __hexchat_private__ to the main environment for the subinterp.
-    PyDict_SetItemString(pydict, HC_DATA_KEY, pytup);
+interp_run_unload_hooks()
+{
+    PyObject        *pyunload_hooks;
+    PyObject        *pycap;
+    PyObject        *pyret;
+    Py_ssize_t      size;
+    Py_ssize_t      i;
+    UnhookEventData *evt_data;
 
-    Py_DECREF(pytup);
+    pyunload_hooks = interp_get_unload_hooks();
+    if (!pyunload_hooks) {
+        return;
+    }
+    size = PyList_GET_SIZE(pyunload_hooks);
 
-    pyhooks  = PyList_New(0);
-    pyunload = PyList_New(0);
+    for (i = 0; i < size && i < PyList_GET_SIZE(pyunload_hooks); i++) {
+        pycap    = PyList_GET_ITEM(pyunload_hooks, i); // BR
+        evt_data = PyCapsule_GetPointer(pycap, "unload_hook");
 
-    PyTuple_SetItem(pytup, HC_HOOKS_KEY, pyhooks);  // Steals ref
-    PyTuple_SetItem(pytup, HC_UNLOAD_KEY, pyunload);
+        pyret = PyObject_CallFunction(evt_data->callable, "O", 
+                                      evt_data->userdata);
+        if (!pyret) {
+            PyErr_Print();
+        }
+        else {
+            Py_DECREF(pyret);
+        }
+    }
+    if (PyList_SetSlice(pyunload_hooks, 0, PY_SSIZE_T_MAX, NULL)) {
+        PyErr_Print();
+    }
+}
 
-    pytscap = PyCapsule_New(ts, "threadstate", NULL);
+/**
+ * Sets up data objects for storing specific data for each subinterpreter.
+ * @param ts      - The threadstate of the interpreter.
+ * @param own_gil - Nonzero if the interp was created with its own GIL.
+ * @returns - 0 on success, -1 on failure with error state set.
+ */
+int
+interp_init_data(PyThreadState *ts, int own_gil)
+{
+    InterpData  *data;
+    PyObject    *pystr;
+    PyObject    *pycap;
+    int         i;
 
-    PyTuple_SetItem(pytup, HC_MAIN_THREADSTATE_KEY, pytscap);
+    data = PyMem_RawCalloc(1, sizeof(InterpData));
+    if (!data) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    data->interp        = ts->interp;
+    data->threadstate   = ts;
+
+    pycap = PyCapsule_New(data, INTERP_DATA_KEY, NULL);
+    if (!pycap || PyDict_SetItemString(PyInterpreterState_GetDict(ts->interp),
+                                       INTERP_DATA_KEY, pycap)) {
+        Py_XDECREF(pycap);
+        PyMem_RawFree(data);
+        return -1;
+    }
+    Py_DECREF(pycap);
+
+#ifndef MINPY_HAVE_OWN_GIL
+    own_gil = 0;
+#endif
+    g_mutex_lock(&interp_data_lock);
+    if (!interp_data_table) {
+        interp_data_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    g_hash_table_insert(interp_data_table, data->interp, data);
+    if (own_gil) {
+        data->own_gil   = 1;
+        atom_store_long(&interp_own_gil_count,
+                        atom_load_long(&interp_own_gil_count) + 1);
+    }
+    g_mutex_unlock(&interp_data_lock);
+
+#ifdef MINPY_HAVE_OWN_GIL
+    if (own_gil) {
+        // The types have to exist before anything in the interp can use them.
+        for (i = 0; i < MPY_NUM_TYPES; i++) {
+            data->types[i] = interp_copy_type(*interp_type_defs[i]);
+            if (!data->types[i]) {
+                interp_destroy_data();
+                return -1;
+            }
+        }
+    }
+#else
+    (void)i;
+#endif
+    data->hooks         = PySet_New(NULL);
+    data->unload_hooks  = PyList_New(0);
+    data->lists_info    = PyDict_New();
+    data->list_row_types = PyDict_New();
+    data->proxy_cache   = PyDict_New();
+    data->context_cache = PyDict_New();
 
     // Need to use PyImport_Import() to make sure the queue package is loaded
     // correctly. Using other functions worked, but there were missing 
     // dependencies for some reason. It would get weird after a plugin was
     // unloaded then loaded again.
-    pystr         = PyUnicode_FromString("queue");
-    pymodule      = PyImport_Import(pystr); // NR.
-    PyTuple_SetItem(pytup, HC_QUEUE_MODULE, pymodule);
+    pystr                    = PyUnicode_FromString("queue");
+    data->queue_module       = PyImport_Import(pystr); // NR.
     Py_DECREF(pystr);
     
-    pystr         = PyUnicode_FromString("threading");
-    pymodule      = PyImport_Import(pystr);
-    PyTuple_SetItem(pytup, HC_THREADING_MODULE, pymodule);
+    pystr                    = PyUnicode_FromString("threading");
+    data->threading_module   = PyImport_Import(pystr);
     Py_DECREF(pystr);
 
-    pystr         = PyUnicode_FromString("collections");
-    pymodule      = PyImport_Import(pystr);
-    PyTuple_SetItem(pytup, HC_COLLECTIONS_MODULE, pymodule);
+    pystr                    = PyUnicode_FromString("collections");
+    data->collections_module = PyImport_Import(pystr);
     Py_DECREF(pystr);
-    
-    PyTuple_SetItem(pytup, HC_LISTS_INFO, PyDict_New());
+
+    // The queue other threads use to submit Delegate calls to the main thread.
+    data->delegate_queue = delegate_queue_create(ts);
+
+    // The asyncio loop data; the loop itself is created on demand.
+    data->event_loop     = eventloop_create(ts);
+
+    if (!data->hooks || !data->unload_hooks || !data->lists_info ||
+        !data->list_row_types || !data->proxy_cache || !data->context_cache ||
+        !data->queue_module || !data->threading_module ||
+        !data->collections_module || !data->delegate_queue ||
+        !data->event_loop) {
+
+        interp_destroy_data();
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        return -1;
+    }
+    return 0;
 }
 
 /**
@@ -284,15 +622,11 @@ interp_init_data(PyThreadState *ts)
 PyObject *
 interp_get_queue_constr()
 {
-    PyObject *pymod;
-    PyObject *pydict;
-    PyObject *pyconstr;
-
-    pymod    = interp_get_data(HC_QUEUE_MODULE);
-    pydict   = PyModule_GetDict(pymod);
-    pyconstr = PyDict_GetItemString(pydict, "Queue");
+    InterpData *data = interp_get_data();
 
-    return pyconstr; // BR.
+    return data ? PyDict_GetItemString(PyModule_GetDict(data->queue_module),
+                                       "Queue") 
+                : NULL; // BR.
 }
 
 /**
@@ -302,74 +636,367 @@ interp_get_queue_constr()
 PyObject *
 interp_get_namedtuple_constr()
 {
-    PyObject *pymod;
-    PyObject *pydict;
-    PyObject *pyconstr;
+    InterpData *data = interp_get_data();
 
-    pymod    = interp_get_data(HC_COLLECTIONS_MODULE);
-    pydict   = PyModule_GetDict(pymod);
-    pyconstr = PyDict_GetItemString(pydict, "namedtuple");
+    return data ? PyDict_GetItemString(
+                              PyModule_GetDict(data->collections_module),
+                              "namedtuple")
+                : NULL; // BR.
+}
 
-    return pyconstr; // BR.
+/**
+ * Returns the dict that caches the types of the interp's hexchat lists.
+ */
+PyObject *
+interp_get_lists_info(void)
+{
+    InterpData *data = interp_get_data();
 
+    return data ? data->lists_info : NULL;
 }
 
 /**
- * Returns the tuple object that holds an interpreter's private data.
+ * Returns the dict of namedtuple types used for get_list() items, keyed on
+ * list name.
  */
 PyObject *
-interp_get_lists_info(void)
+interp_get_list_row_types(void)
+{
+    InterpData *data = interp_get_data();
+
+    return data ? data->list_row_types : NULL;
+}
+
+/**
+ * Returns the dict of Context objects the current interp has handed out,
+ * keyed by their context pointer. See context_intern().
+ * @returns - The dict, or NULL for the main interp, which doesn't intern.
+ */
+PyObject *
+interp_get_context_cache(void)
+{
+    InterpData *data = interp_get_data();
+
+    return data ? data->context_cache : NULL;
+}
+
+/**
+ * Returns the dict of proxies the current interp has made of its objects for
+ * use by other interps. See interp_marshal(). The main interp's cache is
+ * created on first use.
+ */
+PyObject *
+interp_get_proxy_cache(void)
 {
-    return interp_get_data(HC_LISTS_INFO);
+    InterpData *data = interp_get_data();
+
+    if (data) {
+        return data->proxy_cache;
+    }
+    if (!main_proxy_cache) {
+        main_proxy_cache = PyDict_New();
+    }
+    return main_proxy_cache;
 }
 
 /**
- * Ensures that the destructors are called on data objects. The hooks depend
- * on this when a plugin is being unloaded. The hook capsule free functions
- * need to get invoked to call hexchat_unhook().
+ * Releases the main interp's proxy cache. Called with the main interp current
+ * before it's finalized.
+ */
+void
+interp_clear_main_proxy_cache(void)
+{
+    Py_CLEAR(main_proxy_cache);
+}
+
+/**
+ * Releases an interpreter's private data. The hooks depend on this when a
+ * plugin is being unloaded. The hook capsule free functions need to get
+ * invoked to call hexchat_unhook(). Must be called with the interp current.
  */
 void
 interp_destroy_data()
 {
-    PyObject *pymain;
-    PyObject *pydict;
-    
-    pymain = PyImport_AddModule("__main__");    // BR
-    pydict = PyModule_GetDict(pymain);          // BR
-    
-    // This forces the destructors for the capsules to get called.
-    PyDict_DelItemString(pydict, HC_DATA_KEY);
+    InterpData  *data = interp_get_data();
+    int         i;
+
+    if (!data) {
+        return;
+    }
+    if (PyDict_DelItemString(PyInterpreterState_GetDict(data->interp),
+                             INTERP_DATA_KEY)) {
+        PyErr_Clear();
+    }
+    g_mutex_lock(&interp_data_lock);
+    g_hash_table_remove(interp_data_table, data->interp);
+
+    if (data->own_gil) {
+        atom_store_long(&interp_own_gil_count,
+                        atom_load_long(&interp_own_gil_count) - 1);
+    }
+    // Other threads drop their cached entries when they see the new gen.
+    atom_store_long(&interp_data_gen, atom_load_long(&interp_data_gen) + 1);
+    g_mutex_unlock(&interp_data_lock);
+
+    interp_data_last_interp = NULL;
+    interp_data_last        = NULL;
+
+    // Released in the reverse order of creation.
+    eventloop_destroy(data->event_loop);
+    delegate_queue_destroy(data->delegate_queue);
+
+    Py_XDECREF(data->plugin_name);
+    Py_XDECREF(data->context_cache);
+    Py_XDECREF(data->proxy_cache);
+    Py_XDECREF(data->list_row_types);
+    Py_XDECREF(data->lists_info);
+    Py_XDECREF(data->collections_module);
+    Py_XDECREF(data->threading_module);
+    Py_XDECREF(data->queue_module);
+    Py_XDECREF(data->unload_hooks);
+    Py_XDECREF(data->hooks);
+
+    for (i = 0; i < MPY_NUM_TYPES; i++) {
+        Py_XDECREF(data->types[i]);
+    }
+    PyMem_RawFree(data);
 }
 
 /**
- * Returns a borrowed reference to the requested data object.
- * @param key   - One of the key's #define'd above.
- * @returns - The requested object.
+ * Returns the private data of the current interpreter. A miss on the thread's
+ * cached entry reads the capsule in the interp's state dict, which the GIL
+ * held for the interp already guards.
+ * @returns - The interp's data, or NULL if it has none (the main interp).
  */
-PyObject *
-interp_get_data(Py_ssize_t key)
+InterpData *
+interp_get_data()
 {
-    PyObject *pymain;
-    PyObject *pydict;
-    PyObject *pytup;
+    PyInterpreterState  *interp = PyThreadState_Get()->interp;
+    long                gen     = atom_load_long(&interp_data_gen);
+    InterpData          *data   = NULL;
+    PyObject            *pydict;
+    PyObject            *pycap  = NULL;
+
+    if (interp == interp_data_last_interp && gen == interp_data_last_gen) {
+        return interp_data_last;
+    }
+    pydict = PyInterpreterState_GetDict(interp); // BR.
+    if (pydict) {
+        pycap = PyDict_GetItemString(pydict, INTERP_DATA_KEY); // BR.
+    }
+    if (pycap) {
+        data = PyCapsule_GetPointer(pycap, INTERP_DATA_KEY);
+    }
 
-    pymain = PyImport_AddModule("__main__");
-    pydict = PyModule_GetDict(pymain);
-    pytup  = PyDict_GetItemString(pydict, HC_DATA_KEY); // BR
+    interp_data_last_interp = interp;
+    interp_data_last        = data;
+    interp_data_last_gen    = gen;
+
+    return data;
+}
+
+/**
+ * Finds the data of any interp, for callers that don't hold its GIL. Must be
+ * called with interp_data_lock held.
+ */
+InterpData *
+interp_find_data(PyInterpreterState *interp)
+{
+    return interp_data_table ? g_hash_table_lookup(interp_data_table, interp)
+                             : NULL;
+}
+
+/**
+ * Returns the type object the current interp uses for one of the hexchat
+ * types. That's the static definition unless the interp has its own GIL.
+ * @param id    - The type's MpyTypeId.
+ * @returns - A borrowed reference to the type.
+ */
+PyTypeObject *
+interp_get_type(MpyTypeId id)
+{
+    InterpData *data;
+
+    if (atom_load_long(&interp_own_gil_count)) {
+        data = interp_get_data();
+        if (data && data->own_gil) {
+            return data->types[id];
+        }
+    }
+    return *interp_type_defs[id];
+}
+
+/**
+ * The common tail of the hexchat types' dealloc functions. Objects of the
+ * heap type copies hold a reference to their type which is released here.
+ */
+void
+interp_free_object(PyObject *self)
+{
+    PyTypeObject *tp = Py_TYPE(self);
+
+    tp->tp_free(self);
+
+    if (tp->tp_flags & Py_TPFLAGS_HEAPTYPE) {
+        Py_DECREF(tp);
+    }
+}
+
+/**
+ * Returns the number of live hooks of the interp of a threadstate. Reading
+ * the size of its list doesn't need a switch into the interp.
+ * @param ts    - The threadstate.
+ * @returns - The number of hooks, or 0 if the interp has no data.
+ */
+Py_ssize_t
+interp_count_hooks(PyThreadState *ts)
+{
+    InterpData  *data;
+    Py_ssize_t  count = 0;
+
+    g_mutex_lock(&interp_data_lock);
+    data = interp_find_data(ts->interp);
 
-    return PyTuple_GetItem(pytup, key); // BR
+    if (data && data->hooks) {
+        count = PySet_GET_SIZE(data->hooks);
+    }
+    g_mutex_unlock(&interp_data_lock);
+
+    return count;
+}
+
+/**
+ * Indicates whether the interp of a threadstate has its own GIL. Doesn't need
+ * the GIL to be held.
+ * @param ts    - The threadstate, which can be NULL.
+ * @returns - 1 if the interp has its own GIL, 0 if not.
+ */
+int
+interp_has_own_gil(PyThreadState *ts)
+{
+    InterpData  *data;
+    int         retval;
+
+    if (!ts || !atom_load_long(&interp_own_gil_count)) {
+        return 0;
+    }
+    g_mutex_lock(&interp_data_lock);
+    data   = interp_find_data(ts->interp);
+    retval = data && data->own_gil;
+    g_mutex_unlock(&interp_data_lock);
+
+    return retval;
+}
+
+/**
+ * Checks that both the current interp and the target interp share the main
+ * GIL. Objects can only be proxied between interps that do.
+ * @param target    - The threadstate of the other interp, or NULL if it's
+ *                    the main interp.
+ * @returns - 0 if they do, -1 with error state set if not.
+ */
+int
+interp_check_shared_gil(PyThreadState *target)
+{
+    if (interp_has_own_gil(PyThreadState_Get()) ||
+        interp_has_own_gil(target)) {
+
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cross-interpreter proxies aren't available to "
+                        "plugins with their own GIL. Use hexchat.Channel.");
+        return -1;
+    }
+    return 0;
 }
 
+#ifdef MINPY_HAVE_OWN_GIL
+/**
+ * Creates a heap type copy of one of the static hexchat types for an interp
+ * with its own GIL. Must be called with that interp current.
+ * @param def   - The static type definition.
+ * @returns - A new reference to the type, or NULL with error state set.
+ */
+PyTypeObject *
+interp_copy_type(PyTypeObject *def)
+{
+    PyType_Slot slots[40];
+    PyType_Spec spec;
+    int         n = 0;
+
+#define COPY_SLOT(id, field) \
+    if (field) { slots[n].slot = id; slots[n++].pfunc = (void *)field; }
+
+    COPY_SLOT(Py_tp_doc,            def->tp_doc);
+    COPY_SLOT(Py_tp_init,           def->tp_init);
+    COPY_SLOT(Py_tp_new,            def->tp_new);
+    COPY_SLOT(Py_tp_dealloc,        def->tp_dealloc);
+    COPY_SLOT(Py_tp_repr,           def->tp_repr);
+    COPY_SLOT(Py_tp_str,            def->tp_str);
+    COPY_SLOT(Py_tp_hash,           def->tp_hash);
+    COPY_SLOT(Py_tp_call,           def->tp_call);
+    COPY_SLOT(Py_tp_getattro,       def->tp_getattro);
+    COPY_SLOT(Py_tp_setattro,       def->tp_setattro);
+    COPY_SLOT(Py_tp_richcompare,    def->tp_richcompare);
+    COPY_SLOT(Py_tp_iter,           def->tp_iter);
+    COPY_SLOT(Py_tp_iternext,       def->tp_iternext);
+    COPY_SLOT(Py_tp_methods,        def->tp_methods);
+    COPY_SLOT(Py_tp_members,        def->tp_members);
+    COPY_SLOT(Py_tp_getset,         def->tp_getset);
+
+    if (def->tp_as_async) {
+        COPY_SLOT(Py_am_await,      def->tp_as_async->am_await);
+        COPY_SLOT(Py_am_aiter,      def->tp_as_async->am_aiter);
+        COPY_SLOT(Py_am_anext,      def->tp_as_async->am_anext);
+    }
+    if (def->tp_as_sequence) {
+        COPY_SLOT(Py_sq_length,     def->tp_as_sequence->sq_length);
+        COPY_SLOT(Py_sq_concat,     def->tp_as_sequence->sq_concat);
+        COPY_SLOT(Py_sq_repeat,     def->tp_as_sequence->sq_repeat);
+        COPY_SLOT(Py_sq_item,       def->tp_as_sequence->sq_item);
+        COPY_SLOT(Py_sq_ass_item,   def->tp_as_sequence->sq_ass_item);
+        COPY_SLOT(Py_sq_contains,   def->tp_as_sequence->sq_contains);
+    }
+    if (def->tp_as_mapping) {
+        COPY_SLOT(Py_mp_length,     def->tp_as_mapping->mp_length);
+        COPY_SLOT(Py_mp_subscript,  def->tp_as_mapping->mp_subscript);
+        COPY_SLOT(Py_mp_ass_subscript, 
+                                    def->tp_as_mapping->mp_ass_subscript);
+    }
+#undef COPY_SLOT
+
+    slots[n].slot  = 0;
+    slots[n].pfunc = NULL;
+
+    spec.name       = def->tp_name;
+    spec.basicsize  = (int)def->tp_basicsize;
+    spec.itemsize   = (int)def->tp_itemsize;
+    spec.flags      = Py_TPFLAGS_DEFAULT | 
+                      (unsigned int)(def->tp_flags & Py_TPFLAGS_BASETYPE);
+    spec.slots      = slots;
+
+    if (!def->tp_new) {
+        spec.flags |= Py_TPFLAGS_DISALLOW_INSTANTIATION;
+    }
+    return (PyTypeObject *)PyType_FromSpec(&spec);
+}
+#endif
+
 /**
  * Returns a string object for the name of the plugin (__module_name__).
  */
 PyObject *
 interp_get_plugin_name()
 {
-    PyObject *pymain;
-    PyObject *pydict;
-    PyObject *pyret;
+    InterpData  *data = interp_get_data();
+    PyObject    *pymain;
+    PyObject    *pydict;
+    PyObject    *pyret;
 
+    if (data && data->plugin_name) {
+        Py_INCREF(data->plugin_name);
+        return data->plugin_name;
+    }
+    // The plugin is still loading; __module_name__ may not be set yet.
     pymain = PyImport_AddModule("__main__");
     pydict = PyModule_GetDict(pymain);
     pyret  = PyDict_GetItemString(pydict, "__module_name__"); // BR.
@@ -383,6 +1010,22 @@ interp_get_plugin_name()
     return pyret;
 }
 
+/**
+ * Records the name of the current interp's plugin, which is then returned by
+ * interp_get_plugin_name() without consulting __main__.
+ * @param pyname    - The plugin's __module_name__.
+ */
+void
+interp_set_plugin_name(PyObject *pyname)
+{
+    InterpData *data = interp_get_data();
+
+    if (data) {
+        Py_INCREF(pyname);
+        Py_XSETREF(data->plugin_name, pyname);
+    }
+}
+
 /**
  * Returns the *main* threadstate for the current subinterpreter. The 
  * subinterpreter may have multiple threadstates, but each may need access to 
@@ -391,24 +1034,52 @@ interp_get_plugin_name()
 PyThreadState *
 interp_get_main_threadstate()
 {
-    PyObject *pymtcap;
-    
-    pymtcap = interp_get_data(HC_MAIN_THREADSTATE_KEY);
-    
-    return (PyThreadState *)PyCapsule_GetPointer(pymtcap, "threadstate");
+    InterpData *data = interp_get_data();
+
+    return data ? data->threadstate : NULL;
 }
 
 /**
- * Adds a hook capsule to the list of hooks for the current subinterpreter.
+ * Returns the current interpreter's queue for Delegate calls made from other
+ * threads.
+ */
+DelegateQueue *
+interp_get_delegate_queue()
+{
+    InterpData *data = interp_get_data();
+
+    return data ? data->delegate_queue : NULL;
+}
+
+/**
+ * Returns the current interpreter's asyncio event loop data.
+ */
+EventLoop *
+interp_get_event_loop()
+{
+    InterpData *data = interp_get_data();
+
+    if (!data) {
+        PyErr_SetString(PyExc_RuntimeError, 
+                        "The interpreter has no event loop.");
+        return NULL;
+    }
+    return data->event_loop;
+}
+
+/**
+ * Adds a hook capsule to the set of hooks for the current subinterpreter.
+ * Capsules hash by identity, so adding and removing them is O(1).
  * @param hook - the hook to add.
  */
 void
 interp_add_hook(PyObject *hook)
 {
-    PyObject *pyhooks;
+    InterpData *data = interp_get_data();
 
-    pyhooks = interp_get_data(HC_HOOKS_KEY);
-    PyList_Append(pyhooks, hook);
+    if (PySet_Add(data->hooks, hook)) {
+        PyErr_Print();
+    }
 }
 
 /**
@@ -426,7 +1097,7 @@ interp_hook_unload(PyObject *callback, PyObject *userdata)
     PyObject        *pycap;
     UnhookEventData *evt_data;
     
-    pyhooks = interp_get_data(HC_UNLOAD_KEY);
+    pyhooks = interp_get_unload_hooks();
     
     evt_data = (UnhookEventData *)PyMem_RawMalloc(sizeof(UnhookEventData));
     evt_data->callable = callback;
@@ -471,12 +1142,14 @@ interp_unhook_unload(PyObject *hook) {
 }
 
 /**
- * Returns a mutable list of hooks. 
+ * Returns the mutable set of hooks.
  */
 PyObject *
 interp_get_hooks()
 {
-    return interp_get_data(HC_HOOKS_KEY);
+    InterpData *data = interp_get_data();
+
+    return data ? data->hooks : NULL;
 }
 
 /**
@@ -485,7 +1158,9 @@ interp_get_hooks()
 PyObject *
 interp_get_unload_hooks()
 {
-    return interp_get_data(HC_UNLOAD_KEY);
+    InterpData *data = interp_get_data();
+
+    return data ? data->unload_hooks : NULL;
 }
 
 
@@ -553,8 +1228,32 @@ SwitchTSInfo
 switch_threadstate(PyThreadState *ts)
 {
     PyThreadState *pycur_ts;
-    SwitchTSInfo  tsinfo = { 0, 0, NULL };
+    SwitchTSInfo  tsinfo = { 0, 0, NULL, 0, 0 };
 
+#ifdef MINPY_HAVE_OWN_GIL
+    if (atom_load_long(&interp_own_gil_count)) {
+        pycur_ts = interp_current_ts();
+
+        if (ts == pycur_ts) {
+            return tsinfo;
+        }
+        if (interp_has_own_gil(ts) || interp_has_own_gil(pycur_ts)) {
+            // The interps have different GILs. Let go of the current one
+            // and take the one of the requested threadstate.
+            tsinfo.own_gil      = 1;
+            tsinfo.prior        = pycur_ts;
+            tsinfo.main_had_gil = py_main_has_gil;
+
+            if (pycur_ts) {
+                PyEval_SaveThread();
+            }
+            PyEval_RestoreThread(ts);
+            py_main_has_gil = !interp_has_own_gil(ts);
+
+            return tsinfo;
+        }
+    }
+#endif
     if (!py_main_has_gil) {
         // Main thread grabs the GIL.
         py_gilstate = PyGILState_Ensure();
@@ -589,6 +1288,19 @@ switch_threadstate(PyThreadState *ts)
 void
 switch_threadstate_back(SwitchTSInfo tsinfo)
 {
+#ifdef MINPY_HAVE_OWN_GIL
+    if (tsinfo.own_gil) {
+        // The switched to interp may have been ended in the meantime.
+        if (interp_current_ts()) {
+            PyEval_SaveThread();
+        }
+        if (tsinfo.prior) {
+            PyEval_RestoreThread(tsinfo.prior);
+        }
+        py_main_has_gil = tsinfo.main_had_gil;
+        return;
+    }
+#endif
     if (tsinfo.do_swap) {
         // Swapping back to previous threadstate.
         PyThreadState_Swap(tsinfo.prior);
@@ -0,0 +1,493 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * Timers hooked with hook_timer(..., coalesce_ms=N) don't get a HexChat timer
+ * each. They're kept on one hierarchical timer wheel driven by a single
+ * HexChat timer, which is re-armed for the next expiration whenever it fires.
+ *
+ * The wheel ticks once per millisecond, HexChat's timer resolution. It has
+ * TW_LEVELS levels of TW_SLOTS slots; each level's slots span TW_SLOTS of the
+ * level below, so the wheel covers about 4.6 hours and later expirations wait
+ * in its last slot. When a level wraps, the next level's slot is cascaded
+ * down. Adding and removing a timer is O(1).
+ *
+ * A timer's expirations are rounded up to a multiple of its coalesce time on
+ * the monotonic clock, so timers with the same tolerance expire together.
+ * The coalesce time can be under a millisecond, in which case the timer only
+ * shares the tick it falls in. Everything that expires when the wheel's timer
+ * fires is run grouped by interp, with one threadstate switch per group.
+ *
+ * Main thread only.
+ */
+
+#include <glib.h>
+#include "minpython.h"
+
+#define TW_TICK_US      1000
+#define TW_BITS         6
+#define TW_SLOTS        (1 << TW_BITS)
+#define TW_MASK         (TW_SLOTS - 1)
+#define TW_LEVELS       4
+#define TW_SPAN         ((gint64)1 << (TW_BITS * TW_LEVELS))
+
+typedef enum {
+    TW_IDLE,        // Not on the wheel; a one-shot timer that has finished.
+    TW_QUEUED,      // In a slot.
+    TW_DUE          // In the batch being run.
+} WheelState;
+
+/**
+ * A timer on the wheel. Lives until its hook is unhooked. If that happens
+ * while it's in the running batch, 'data' is cleared and the batch frees it.
+ */
+struct _WheelTimer {
+    WheelTimer      *next;
+    WheelTimer      *prev;
+    CallbackData    *data;
+    gint64          due_us;         // Next expiration, before rounding.
+    gint64          interval_us;
+    gint64          coalesce_us;
+    gint64          expires;        // The tick it runs at.
+    guint64         seq;            // Run order within an interp.
+    WheelState      state;
+    int             level;
+    int             slot;
+};
+
+static WheelTimer   *tw_slots[TW_LEVELS][TW_SLOTS];
+static gint64       tw_tick     = 0;        // The last tick processed.
+static long         tw_queued   = 0;
+static guint64      tw_seq      = 0;
+static GPtrArray    *tw_batch   = NULL;
+static int          tw_running  = 0;
+static hexchat_hook *tw_hook    = NULL;
+static gint64       tw_wake     = 0;        // The tick tw_hook is set for.
+static int          tw_stopped  = 0;
+
+hexchat_hook        *timerwheel_hook        (CallbackData *, int, double);
+void                timerwheel_unhook       (CallbackData *);
+void                timerwheel_stop         (void);
+
+static void         tw_schedule             (WheelTimer *, gint64);
+static void         tw_place                (WheelTimer *);
+static void         tw_unlink               (WheelTimer *);
+static void         tw_advance              (gint64);
+static void         tw_cascade              (int, int);
+static gint64       tw_next_expiry          (void);
+static void         tw_arm                  (void);
+static int          tw_callback             (void *);
+static void         tw_run_batch            (gint64);
+static gint         tw_batch_cmp            (gconstpointer, gconstpointer);
+
+
+/**
+ * Puts a timer on the wheel.
+ * @param data          - The timer's callback data.
+ * @param timeout       - Its interval in ms.
+ * @param coalesce_ms   - How late, in ms, it may run so it can run with other
+ *                        timers. Must be > 0.
+ * @returns - A token that stands in for the timer's HexChat hook, as the wheel
+ *            timers have none of their own.
+ */
+hexchat_hook *
+timerwheel_hook(CallbackData *data, int timeout, double coalesce_ms)
+{
+    WheelTimer  *wt;
+    gint64      now = g_get_monotonic_time();
+
+    wt = PyMem_RawMalloc(sizeof(WheelTimer));
+    if (!wt) {
+        return NULL;
+    }
+    wt->data        = data;
+    wt->interval_us = (gint64)MAX(timeout, 0) * 1000;
+    wt->coalesce_us = MAX((gint64)(coalesce_ms * 1000), 1);
+    wt->seq         = tw_seq++;
+    wt->state       = TW_IDLE;
+    data->wheel     = wt;
+
+    if (!tw_queued && !tw_running) {
+        // Nothing's on the wheel, so it can skip ahead.
+        tw_tick = now / TW_TICK_US;
+    }
+    tw_schedule(wt, now + wt->interval_us);
+    tw_arm();
+
+    return (hexchat_hook *)wt;
+}
+
+/**
+ * Takes a timer off the wheel. Called by hc_unhook().
+ */
+void
+timerwheel_unhook(CallbackData *data)
+{
+    WheelTimer *wt = data->wheel;
+
+    data->wheel = NULL;
+
+    switch (wt->state) {
+    case TW_DUE:
+        wt->data = NULL;
+        break;
+    case TW_QUEUED:
+        tw_unlink(wt);
+        // Fall through.
+    case TW_IDLE:
+        PyMem_RawFree(wt);
+        break;
+    }
+    if (!tw_running) {
+        tw_arm();
+    }
+}
+
+/**
+ * Removes the wheel's HexChat timer for good. Called when MagPy is unloaded;
+ * timers still hooked are freed when they're unhooked.
+ */
+void
+timerwheel_stop()
+{
+    tw_stopped = 1;
+
+    if (tw_hook) {
+        hexchat_unhook(ph, tw_hook);
+        tw_hook = NULL;
+    }
+    if (tw_batch) {
+        g_ptr_array_free(tw_batch, TRUE);
+        tw_batch = NULL;
+    }
+}
+
+/**
+ * Sets a timer's next expiration and puts it in its slot.
+ * @param due_us    - When it's due, on the monotonic clock.
+ */
+void
+tw_schedule(WheelTimer *wt, gint64 due_us)
+{
+    gint64 rounded;
+
+    rounded     = (due_us + wt->coalesce_us - 1) / wt->coalesce_us *
+                  wt->coalesce_us;
+    wt->due_us  = due_us;
+    wt->expires = MAX((rounded + TW_TICK_US - 1) / TW_TICK_US, tw_tick + 1);
+
+    tw_place(wt);
+}
+
+/**
+ * Puts a timer in the slot for its expiration, or in the batch if it's due.
+ */
+void
+tw_place(WheelTimer *wt)
+{
+    gint64  expires = wt->expires;
+    gint64  delta   = expires - tw_tick;
+    int     level;
+
+    if (delta <= 0) {
+        wt->state = TW_DUE;
+        g_ptr_array_add(tw_batch, wt);
+        return;
+    }
+    if (delta >= TW_SPAN) {
+        // Too far out. It waits in the last slot, and is placed again when
+        // that's cascaded.
+        expires = tw_tick + TW_SPAN - 1;
+        delta   = TW_SPAN - 1;
+    }
+    for (level = 0; delta >= ((gint64)1 << (TW_BITS * (level + 1))); level++);
+
+    wt->level = level;
+    wt->slot  = (int)((expires >> (TW_BITS * level)) & TW_MASK);
+    wt->state = TW_QUEUED;
+    wt->prev  = NULL;
+    wt->next  = tw_slots[level][wt->slot];
+
+    if (wt->next) {
+        wt->next->prev = wt;
+    }
+    tw_slots[level][wt->slot] = wt;
+    tw_queued++;
+}
+
+/**
+ * Removes a timer from its slot.
+ */
+void
+tw_unlink(WheelTimer *wt)
+{
+    if (wt->prev) {
+        wt->prev->next = wt->next;
+    }
+    else {
+        tw_slots[wt->level][wt->slot] = wt->next;
+    }
+    if (wt->next) {
+        wt->next->prev = wt->prev;
+    }
+    wt->state = TW_IDLE;
+    tw_queued--;
+}
+
+/**
+ * Advances the wheel tick by tick up to the given one, moving what expires
+ * to the batch.
+ */
+void
+tw_advance(gint64 tick)
+{
+    WheelTimer  *wt;
+    int         index;
+    int         level;
+
+    while (tw_tick < tick) {
+        tw_tick++;
+        index = (int)(tw_tick & TW_MASK);
+
+        for (level = 1; !index && level < TW_LEVELS; level++) {
+            index = (int)((tw_tick >> (TW_BITS * level)) & TW_MASK);
+            tw_cascade(level, index);
+        }
+        index = (int)(tw_tick & TW_MASK);
+
+        while ((wt = tw_slots[0][index])) {
+            tw_unlink(wt);
+            wt->state = TW_DUE;
+            g_ptr_array_add(tw_batch, wt);
+        }
+        if (!tw_queued) {
+            tw_tick = tick;
+        }
+    }
+}
+
+/**
+ * Places the timers of a higher level's slot again, now that they're closer.
+ */
+void
+tw_cascade(int level, int index)
+{
+    WheelTimer *wt;
+
+    while ((wt = tw_slots[level][index])) {
+        tw_unlink(wt);
+        tw_place(wt);
+    }
+}
+
+/**
+ * Finds the first tick at which something could expire: the next occupied
+ * level 0 slot, or the next cascade of an occupied slot of a higher level.
+ * @returns - The tick, or 0 if the wheel is empty.
+ */
+gint64
+tw_next_expiry()
+{
+    gint64  best = 0;
+    gint64  base;
+    int     level;
+    int     j;
+
+    for (level = 0; level < TW_LEVELS; level++) {
+        base = tw_tick >> (TW_BITS * level);
+
+        for (j = 1; j <= TW_SLOTS; j++) {
+            if (tw_slots[level][(base + j) & TW_MASK]) {
+                base = (base + j) << (TW_BITS * level);
+                if (!best || base < best) {
+                    best = base;
+                }
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/**
+ * Sets the wheel's HexChat timer for the next expiration, or removes it if
+ * the wheel is empty.
+ */
+void
+tw_arm()
+{
+    gint64  wake = (tw_queued && !tw_stopped) ? tw_next_expiry() : 0;
+    gint64  now;
+    gint64  delay;
+
+    if (tw_hook && wake == tw_wake) {
+        return;
+    }
+    if (tw_hook) {
+        hexchat_unhook(ph, tw_hook);
+        tw_hook = NULL;
+    }
+    if (!wake) {
+        return;
+    }
+    now   = g_get_monotonic_time() / TW_TICK_US;
+    delay = MAX(wake - now, 1) * TW_TICK_US / 1000;
+
+    tw_wake = wake;
+    tw_hook = hexchat_hook_timer(ph, (int)MIN(delay, G_MAXINT), tw_callback,
+                                 NULL);
+}
+
+/**
+ * The wheel's HexChat timer callback. Runs what has expired, then sets a new
+ * timer for the next expiration.
+ * @returns - 0, as this timer is replaced each time.
+ */
+int
+tw_callback(void *userdata)
+{
+    gint64 now = g_get_monotonic_time();
+
+    tw_hook    = NULL;
+    tw_running = 1;
+
+    if (!tw_batch) {
+        tw_batch = g_ptr_array_new();
+    }
+    tw_advance(now / TW_TICK_US);
+    tw_run_batch(now);
+
+    tw_running = 0;
+    tw_arm();
+
+    return 0;
+}
+
+/**
+ * Runs the expired timers, grouped by interp in the order they were placed,
+ * and puts the recurring ones back on the wheel.
+ */
+void
+tw_run_batch(gint64 now)
+{
+    WheelTimer      *wt;
+    CallbackData    *data;
+    PyThreadState   *group_ts   = NULL;
+    PyObject        *pycallback;
+    PyObject        *pyuserdata;
+    PyObject        *pyret;
+    HookStats       *stats;
+    PluginQuota     *quota;
+    SwitchTSInfo    tsinfo;
+    long long       gil_ns      = 0;
+    long long       t0;
+    long long       t1;
+    guint           i;
+    int             retval;
+
+    g_ptr_array_sort(tw_batch, tw_batch_cmp);
+
+    for (i = 0; i < tw_batch->len; i++) {
+        wt   = g_ptr_array_index(tw_batch, i);
+        data = wt->data;
+
+        if (!data) {
+            // Unhooked by an earlier callback.
+            PyMem_RawFree(wt);
+            continue;
+        }
+        // Timers of a plugin that's over its quota wait for their next turn.
+        if (quota_blocked(data->quota, 1)) {
+            tw_schedule(wt, now + wt->interval_us);
+            continue;
+        }
+        if (data->threadstate != group_ts) {
+            if (group_ts) {
+                switch_threadstate_back(tsinfo);
+            }
+            t0       = stats_now();
+            group_ts = data->threadstate;
+            tsinfo   = switch_threadstate(group_ts);
+            gil_ns   = stats_now() - t0;
+        }
+        // The callback may unhook itself, which frees its data.
+        pycallback = data->callback;
+        pyuserdata = data->userdata;
+        stats      = stats_enabled ? data->stats : NULL;
+        quota      = data->quota;
+        Py_INCREF(pycallback);
+        Py_INCREF(pyuserdata);
+
+        t1     = stats_now();
+        pyret  = PyObject_CallFunctionObjArgs(pycallback, pyuserdata, NULL);
+        t0     = stats_now();
+        retval = hc_callback_retval(CBV_TIMER, pyret);
+
+        Py_DECREF(pycallback);
+        Py_DECREF(pyuserdata);
+
+        quota_charge(quota, t0 - t1);
+
+        if (stats) {
+            // The group's switch is counted against its first callback.
+            stats_record(stats, gil_ns, 0, t0 - t1);
+        }
+        gil_ns = 0;
+
+        if (!wt->data) {
+            PyMem_RawFree(wt);
+            continue;
+        }
+        if (retval) {
+            // Keep to the timer's schedule unless it's fallen behind.
+            tw_schedule(wt, (wt->due_us + wt->interval_us > now)
+                            ? wt->due_us + wt->interval_us
+                            : now + wt->interval_us);
+        }
+        else {
+            wt->state = TW_IDLE;
+        }
+    }
+    if (group_ts) {
+        switch_threadstate_back(tsinfo);
+    }
+    g_ptr_array_set_size(tw_batch, 0);
+}
+
+/**
+ * Orders the batch by interp, then by the order timers were placed.
+ */
+gint
+tw_batch_cmp(gconstpointer a, gconstpointer b)
+{
+    const WheelTimer *wa = *(WheelTimer * const *)a;
+    const WheelTimer *wb = *(WheelTimer * const *)b;
+    PyThreadState    *ta = wa->data ? wa->data->threadstate : NULL;
+    PyThreadState    *tb = wb->data ? wb->data->threadstate : NULL;
+
+    if (ta != tb) {
+        return (ta < tb) ? -1 : 1;
+    }
+    return (wa->seq < wb->seq) ? -1 : (wa->seq > wb->seq);
+}
@@ -0,0 +1,946 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * An index of the users in each channel, per server, that answers "who's in
+ * this channel" and "which channels is this nick in" without walking HexChat's
+ * lists. It's used through the `hexchat.users` object of every plugin.
+ *
+ * The index is off until it's first queried. It's then seeded from the
+ * 'channels' and 'users' lists, and kept up to date by native JOIN, PART,
+ * KICK, QUIT, NICK, and 353 (NAMES) server hooks. The data lives in C and is
+ * shared by all the plugin interpreters; the Python objects are read-only
+ * views of it. Everything is accessed only on the HexChat main thread.
+ *
+ * Nicks and channel names are keyed with RFC 1459 casemapping.
+ */
+
+#include <glib.h>
+#include "minpython.h"
+
+/**
+ * A user known to be in at least one channel of a server.
+ */
+typedef struct {
+    char        *nick;          // As last seen.
+    char        *host;
+    GHashTable  *channels;      // Folded channel name -> UIChannel *.
+} UIUser;
+
+/**
+ * A channel the user is in.
+ */
+typedef struct {
+    char        *name;
+    GHashTable  *users;         // Folded nick -> UIUser *.
+} UIChannel;
+
+/**
+ * The users and channels of one server connection. This owns the UIUser and
+ * UIChannel entries; the channel and user tables inside them only refer to
+ * each other.
+ */
+typedef struct {
+    GHashTable  *users;         // Folded nick -> UIUser *.
+    GHashTable  *channels;      // Folded channel name -> UIChannel *.
+} UIServer;
+
+/**
+ * userindex instance data. There's one per interp, exposed as hexchat.users.
+ */
+typedef struct {
+    PyObject_HEAD
+} UserIndexObj;
+
+/**
+ * The index. The servers are keyed on the 'id' field of the channels list.
+ * The ids of contexts are cached because HexChat has no direct way to get the
+ * id of the current context.
+ */
+static GHashTable   *ui_servers     = NULL;     // Server id -> UIServer *.
+static GHashTable   *ui_context_ids = NULL;     // hexchat_context * -> id.
+
+static const char   *ui_server_events[] = { "JOIN", "PART", "KICK", "QUIT",
+                                            "NICK", "353", NULL };
+static const char   *ui_print_events[]  = { "Disconnected", "Close Context",
+                                            NULL };
+
+#define UI_NUM_HOOKS    8
+
+static hexchat_hook *ui_hooks[UI_NUM_HOOKS];
+
+       int          userindex_enable        (void);
+       void         userindex_disable       (void);
+static int          ui_server_id            (hexchat_context *);
+static UIServer     *ui_get_server          (int, int);
+static char         *ui_fold                (const char *, size_t);
+static UIChannel    *ui_get_channel         (UIServer *, const char *, int);
+static void         ui_add_member           (UIServer *, const char *,
+                                             const char *, size_t,
+                                             const char *);
+static void         ui_remove_member        (UIServer *, const char *,
+                                             const char *);
+static void         ui_drop_channel         (UIServer *, const char *);
+static void         ui_quit                 (UIServer *, const char *);
+static void         ui_rename               (UIServer *, const char *,
+                                             const char *);
+static void         ui_seed                 (void);
+static int          ui_is_me                (const char *);
+static const char   *ui_prefix_nick         (const char *, char *, size_t);
+static const char   *ui_strip_colon         (const char *);
+
+static void         ui_user_free            (gpointer);
+static void         ui_channel_free         (gpointer);
+static void         ui_server_free          (gpointer);
+
+static int          ui_server_callback      (char *[], char *[], void *);
+static int          ui_print_callback       (char *[], void *);
+
+static PyObject     *UserIndex_lookup       (UserIndexObj *, PyObject *);
+static PyObject     *UserIndex_in_channel   (UserIndexObj *, PyObject *);
+static PyObject     *UserIndex_has          (UserIndexObj *, PyObject *);
+static PyObject     *UserIndex_host         (UserIndexObj *, PyObject *);
+static int          UserIndex_target        (PyObject *, UIServer **,
+                                             UIChannel **);
+static PyObject     *UserIndex_keys_tuple   (GHashTable *, int);
+
+/**
+ * UserIndex methods.
+ */
+static PyMethodDef UserIndex_methods[] = {
+    {"lookup",      (PyCFunction)UserIndex_lookup,      METH_VARARGS,
+     "Returns a tuple of the channels of the current server the given nick is "
+     "known to be in."},
+
+    {"in_channel",  (PyCFunction)UserIndex_in_channel,  METH_VARARGS,
+     "Returns a tuple of the nicks in a channel. Takes a Context, a channel "
+     "name on the current server, or nothing for the current channel."},
+
+    {"has",         (PyCFunction)UserIndex_has,         METH_VARARGS,
+     "has(nick, channel=None) - Returns True if the nick is in the channel "
+     "(a Context, a channel name, or the current channel)."},
+
+    {"host",        (PyCFunction)UserIndex_host,        METH_VARARGS,
+     "Returns the last known host of the nick on the current server, or "
+     "None."},
+
+    {NULL}
+};
+
+/**
+ * UserIndex type declaration/instance.
+ */
+static PyTypeObject UserIndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name        = "hexchat.UserIndex",
+    .tp_doc         = "Index of the users of joined channels. Use the "
+                      "hexchat.users instance.",
+    .tp_basicsize   = sizeof(UserIndexObj),
+    .tp_itemsize    = 0,
+    .tp_flags       = Py_TPFLAGS_DEFAULT,
+    .tp_new         = PyType_GenericNew,
+    .tp_methods     = UserIndex_methods,
+};
+
+/**
+ * UserIndex convenience ptr.
+ */
+PyTypeObject *UserIndexTypeDef = &UserIndexType;
+
+/**
+ * Seeds the index and installs its hooks, if that hasn't been done already.
+ * Must be called on the main thread.
+ * @returns - 0 on success, -1 if a hook couldn't be installed.
+ */
+int
+userindex_enable()
+{
+    int i;
+    int n = 0;
+
+    if (ui_servers) {
+        return 0;
+    }
+    ui_servers     = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, ui_server_free);
+    ui_context_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    // HIGHEST so the index is current when other callbacks see the event.
+    for (i = 0; ui_server_events[i]; i++) {
+        ui_hooks[n++] = hexchat_hook_server(ph, ui_server_events[i],
+                                            HEXCHAT_PRI_HIGHEST,
+                                            ui_server_callback, NULL);
+    }
+    for (i = 0; ui_print_events[i]; i++) {
+        ui_hooks[n++] = hexchat_hook_print(ph, ui_print_events[i],
+                                           HEXCHAT_PRI_HIGHEST,
+                                           ui_print_callback,
+                                           (void *)ui_print_events[i]);
+    }
+    for (i = 0; i < n; i++) {
+        if (!ui_hooks[i]) {
+            userindex_disable();
+            return -1;
+        }
+    }
+    ui_seed();
+    return 0;
+}
+
+/**
+ * Removes the index's hooks and frees it. Called when the plugin is unloaded.
+ */
+void
+userindex_disable()
+{
+    int i;
+
+    if (!ui_servers) {
+        return;
+    }
+    for (i = 0; i < UI_NUM_HOOKS; i++) {
+        if (ui_hooks[i]) {
+            hexchat_unhook(ph, ui_hooks[i]);
+            ui_hooks[i] = NULL;
+        }
+    }
+    g_hash_table_destroy(ui_servers);
+    g_hash_table_destroy(ui_context_ids);
+    ui_servers     = NULL;
+    ui_context_ids = NULL;
+}
+
+/**
+ * Returns the server id of a context. Unknown contexts are looked up in the
+ * channels list, and the ids of all the contexts seen are cached.
+ * @returns - The id, or -1 if the context isn't in the channels list.
+ */
+int
+ui_server_id(hexchat_context *ctx)
+{
+    hexchat_list    *xlist;
+    hexchat_context *lctx;
+    gpointer        value;
+    int             id;
+    int             retval = -1;
+
+    if (g_hash_table_contains(ui_context_ids, ctx)) {
+        value = g_hash_table_lookup(ui_context_ids, ctx);
+        return GPOINTER_TO_INT(value);
+    }
+    xlist = hexchat_list_get(ph, "channels");
+    if (!xlist) {
+        return -1;
+    }
+    while (hexchat_list_next(ph, xlist)) {
+        lctx = (hexchat_context *)hexchat_list_str(ph, xlist, "context");
+        id   = hexchat_list_int(ph, xlist, "id");
+
+        g_hash_table_insert(ui_context_ids, lctx, GINT_TO_POINTER(id));
+
+        if (lctx == ctx) {
+            retval = id;
+        }
+    }
+    hexchat_list_free(ph, xlist);
+    return retval;
+}
+
+/**
+ * Returns the index of a server, optionally creating it.
+ */
+UIServer *
+ui_get_server(int id, int create)
+{
+    UIServer *srv;
+
+    srv = g_hash_table_lookup(ui_servers, GINT_TO_POINTER(id));
+    if (!srv && create && id >= 0) {
+        srv           = g_new0(UIServer, 1);
+        srv->users    = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, ui_user_free);
+        srv->channels = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, ui_channel_free);
+        g_hash_table_insert(ui_servers, GINT_TO_POINTER(id), srv);
+    }
+    return srv;
+}
+
+/**
+ * Returns a copy of a nick or channel name lowercased per RFC 1459, where
+ * []\~ are the uppercase forms of {}|^.
+ * @param str   - The name.
+ * @param len   - The length of the name, or -1 if it's null terminated.
+ */
+char *
+ui_fold(const char *str, size_t len)
+{
+    char    *folded;
+    size_t  i;
+
+    folded = (len == (size_t)-1) ? g_strdup(str) : g_strndup(str, len);
+
+    for (i = 0; folded[i]; i++) {
+        switch (folded[i]) {
+        case '[':  folded[i] = '{'; break;
+        case ']':  folded[i] = '}'; break;
+        case '\\': folded[i] = '|'; break;
+        case '~':  folded[i] = '^'; break;
+        default:
+            if (folded[i] >= 'A' && folded[i] <= 'Z') {
+                folded[i] += 'a' - 'A';
+            }
+            break;
+        }
+    }
+    return folded;
+}
+
+/**
+ * Returns a channel of the server, optionally creating it.
+ */
+UIChannel *
+ui_get_channel(UIServer *srv, const char *name, int create)
+{
+    UIChannel   *chan;
+    char        *key;
+
+    key  = ui_fold(name, -1);
+    chan = g_hash_table_lookup(srv->channels, key);
+
+    if (!chan && create) {
+        chan        = g_new0(UIChannel, 1);
+        chan->name  = g_strdup(name);
+        chan->users = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                            g_free, NULL);
+        g_hash_table_insert(srv->channels, key, chan); // Takes key.
+        return chan;
+    }
+    g_free(key);
+    return chan;
+}
+
+/**
+ * Records that a nick is in a channel.
+ * @param srv       - The server.
+ * @param channel   - The channel name.
+ * @param nick      - The nick.
+ * @param nicklen   - The length of the nick, which needn't be terminated.
+ * @param host      - The user's host, or NULL if not known.
+ */
+void
+ui_add_member(UIServer *srv, const char *channel, const char *nick,
+              size_t nicklen, const char *host)
+{
+    UIChannel   *chan;
+    UIUser      *user;
+    char        *ukey;
+
+    if (nicklen == 0) {
+        return;
+    }
+    chan = ui_get_channel(srv, channel, 1);
+    ukey = ui_fold(nick, nicklen);
+    user = g_hash_table_lookup(srv->users, ukey);
+
+    if (!user) {
+        user           = g_new0(UIUser, 1);
+        user->nick     = g_strndup(nick, nicklen);
+        user->channels = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, NULL);
+        g_hash_table_insert(srv->users, g_strdup(ukey), user);
+    }
+    if (host && *host) {
+        g_free(user->host);
+        user->host = g_strdup(host);
+    }
+    g_hash_table_replace(chan->users, ukey, user); // Takes ukey.
+    g_hash_table_replace(user->channels, ui_fold(channel, -1), chan);
+}
+
+/**
+ * Removes a nick from a channel. The user is forgotten when it's no longer
+ * in any channel.
+ */
+void
+ui_remove_member(UIServer *srv, const char *channel, const char *nick)
+{
+    UIChannel   *chan;
+    UIUser      *user;
+    char        *ckey;
+    char        *ukey;
+
+    ckey = ui_fold(channel, -1);
+    ukey = ui_fold(nick, -1);
+    chan = g_hash_table_lookup(srv->channels, ckey);
+    user = g_hash_table_lookup(srv->users, ukey);
+
+    if (chan && user) {
+        g_hash_table_remove(chan->users, ukey);
+        g_hash_table_remove(user->channels, ckey);
+
+        if (g_hash_table_size(user->channels) == 0) {
+            g_hash_table_remove(srv->users, ukey);
+        }
+    }
+    g_free(ckey);
+    g_free(ukey);
+}
+
+/**
+ * Forgets a channel, when the user leaves it.
+ */
+void
+ui_drop_channel(UIServer *srv, const char *channel)
+{
+    GHashTableIter  iter;
+    UIChannel       *chan;
+    gpointer        key;
+    gpointer        value;
+    UIUser          *user;
+    char            *ckey;
+
+    ckey = ui_fold(channel, -1);
+    chan = g_hash_table_lookup(srv->channels, ckey);
+
+    if (chan) {
+        g_hash_table_iter_init(&iter, chan->users);
+
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            user = (UIUser *)value;
+            g_hash_table_remove(user->channels, ckey);
+
+            // The channel's table is discarded below, so its entries for
+            // freed users are never read.
+            if (g_hash_table_size(user->channels) == 0) {
+                g_hash_table_remove(srv->users, key);
+            }
+        }
+        g_hash_table_remove(srv->channels, ckey);
+    }
+    g_free(ckey);
+}
+
+/**
+ * Removes a nick from all channels of the server.
+ */
+void
+ui_quit(UIServer *srv, const char *nick)
+{
+    GHashTableIter  iter;
+    UIUser          *user;
+    gpointer        key;
+    gpointer        value;
+    char            *ukey;
+
+    ukey = ui_fold(nick, -1);
+    user = g_hash_table_lookup(srv->users, ukey);
+
+    if (user) {
+        g_hash_table_iter_init(&iter, user->channels);
+
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            g_hash_table_remove(((UIChannel *)value)->users, ukey);
+        }
+        g_hash_table_remove(srv->users, ukey);
+    }
+    g_free(ukey);
+}
+
+/**
+ * Follows a nick change.
+ */
+void
+ui_rename(UIServer *srv, const char *oldnick, const char *newnick)
+{
+    GHashTableIter  iter;
+    UIUser          *user;
+    gpointer        key;
+    gpointer        value;
+    gpointer        orig_key;
+    char            *okey;
+    char            *nkey;
+
+    okey = ui_fold(oldnick, -1);
+    nkey = ui_fold(newnick, -1);
+    user = g_hash_table_lookup(srv->users, okey);
+
+    if (user) {
+        g_free(user->nick);
+        user->nick = g_strdup(newnick);
+
+        if (strcmp(okey, nkey)) {
+            // A stale entry under the new nick would be replaced and freed
+            // below, so take it out of its channels first.
+            if (g_hash_table_contains(srv->users, nkey)) {
+                ui_quit(srv, newnick);
+            }
+            g_hash_table_iter_init(&iter, user->channels);
+
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                g_hash_table_remove(((UIChannel *)value)->users, okey);
+                g_hash_table_insert(((UIChannel *)value)->users,
+                                    g_strdup(nkey), user);
+            }
+            // Stealing doesn't free the entry's key.
+            g_hash_table_lookup_extended(srv->users, okey, &orig_key, NULL);
+            g_hash_table_steal(srv->users, okey);
+            g_free(orig_key);
+            g_hash_table_insert(srv->users, g_strdup(nkey), user);
+        }
+    }
+    g_free(okey);
+    g_free(nkey);
+}
+
+/**
+ * Fills the index from HexChat's lists.
+ */
+void
+ui_seed()
+{
+    hexchat_list    *xchannels;
+    hexchat_list    *xusers;
+    hexchat_context *prior_ctx;
+    hexchat_context *ctx;
+    UIServer        *srv;
+    const char      *channel;
+    const char      *nick;
+    int             id;
+
+    prior_ctx = hexchat_get_context(ph);
+    xchannels = hexchat_list_get(ph, "channels");
+
+    if (!xchannels) {
+        return;
+    }
+    while (hexchat_list_next(ph, xchannels)) {
+        ctx = (hexchat_context *)hexchat_list_str(ph, xchannels, "context");
+        id  = hexchat_list_int(ph, xchannels, "id");
+
+        g_hash_table_insert(ui_context_ids, ctx, GINT_TO_POINTER(id));
+
+        // Type 2 is a channel.
+        if (hexchat_list_int(ph, xchannels, "type") != 2 ||
+            !hexchat_set_context(ph, ctx)) {
+            continue;
+        }
+        channel = hexchat_list_str(ph, xchannels, "channel");
+        srv     = ui_get_server(id, 1);
+
+        ui_get_channel(srv, channel, 1);
+
+        xusers = hexchat_list_get(ph, "users");
+        while (xusers && hexchat_list_next(ph, xusers)) {
+            nick = hexchat_list_str(ph, xusers, "nick");
+            if (nick) {
+                ui_add_member(srv, channel, nick, strlen(nick),
+                              hexchat_list_str(ph, xusers, "host"));
+            }
+        }
+        if (xusers) {
+            hexchat_list_free(ph, xusers);
+        }
+    }
+    hexchat_list_free(ph, xchannels);
+    hexchat_set_context(ph, prior_ctx);
+}
+
+/**
+ * Returns 1 if the nick is the user's own on the current server.
+ */
+int
+ui_is_me(const char *nick)
+{
+    const char *me = hexchat_get_info(ph, "nick");
+
+    return me && !hexchat_nickcmp(ph, me, nick);
+}
+
+/**
+ * Extracts the nick from a message prefix (":nick!user@host").
+ * @param prefix    - The prefix.
+ * @param buf       - Receives the nick.
+ * @param size      - The size of buf.
+ * @returns - The host part of the prefix, or "" if there's none.
+ */
+const char *
+ui_prefix_nick(const char *prefix, char *buf, size_t size)
+{
+    const char  *bang;
+    size_t      len;
+
+    prefix = ui_strip_colon(prefix);
+    bang   = strchr(prefix, '!');
+    len    = bang ? (size_t)(bang - prefix) : strlen(prefix);
+
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(buf, prefix, len);
+    buf[len] = '\0';
+
+    return bang ? bang + 1 : "";
+}
+
+const char *
+ui_strip_colon(const char *str)
+{
+    return (*str == ':') ? str + 1 : str;
+}
+
+void
+ui_user_free(gpointer data)
+{
+    UIUser *user = (UIUser *)data;
+
+    g_hash_table_destroy(user->channels);
+    g_free(user->nick);
+    g_free(user->host);
+    g_free(user);
+}
+
+void
+ui_channel_free(gpointer data)
+{
+    UIChannel *chan = (UIChannel *)data;
+
+    g_hash_table_destroy(chan->users);
+    g_free(chan->name);
+    g_free(chan);
+}
+
+void
+ui_server_free(gpointer data)
+{
+    UIServer *srv = (UIServer *)data;
+
+    // Channels first; they only refer to the users.
+    g_hash_table_destroy(srv->channels);
+    g_hash_table_destroy(srv->users);
+    g_free(srv);
+}
+
+/**
+ * Server event hook that keeps the index current. Never eats the event.
+ */
+int
+ui_server_callback(char *word[], char *word_eol[], void *userdata)
+{
+    UIServer    *srv;
+    char        nick[128];
+    const char  *host;
+    const char  *cmd     = word[2];
+    const char  *channel = ui_strip_colon(word[3]);
+    const char  *names;
+    const char  *end;
+
+    srv = ui_get_server(ui_server_id(hexchat_get_context(ph)), 1);
+    if (!srv) {
+        return HEXCHAT_EAT_NONE;
+    }
+    host = ui_prefix_nick(word[1], nick, sizeof(nick));
+
+    if (!strcmp(cmd, "JOIN")) {
+        if (ui_is_me(nick)) {
+            // Start over; the NAMES reply fills the channel.
+            ui_drop_channel(srv, channel);
+        }
+        ui_add_member(srv, channel, nick, strlen(nick), host);
+    }
+    else if (!strcmp(cmd, "PART")) {
+        if (ui_is_me(nick)) {
+            ui_drop_channel(srv, channel);
+        }
+        else {
+            ui_remove_member(srv, channel, nick);
+        }
+    }
+    else if (!strcmp(cmd, "KICK")) {
+        if (ui_is_me(word[4])) {
+            ui_drop_channel(srv, channel);
+        }
+        else {
+            ui_remove_member(srv, channel, word[4]);
+        }
+    }
+    else if (!strcmp(cmd, "QUIT")) {
+        ui_quit(srv, nick);
+    }
+    else if (!strcmp(cmd, "NICK")) {
+        ui_rename(srv, nick, channel);
+    }
+    else if (!strcmp(cmd, "353")) {
+        // :server 353 me = #channel :@nick1 +nick2!user@host ...
+        channel = word[5];
+        names   = ui_strip_colon(word_eol[6]);
+
+        while (*names) {
+            // Skip membership prefixes such as @ and +.
+            while (*names && strchr("~&@%+ ", *names)) {
+                names++;
+            }
+            for (end = names; *end && *end != ' ' && *end != '!'; end++);
+
+            ui_add_member(srv, channel, names, end - names, NULL);
+
+            for (names = end; *names && *names != ' '; names++);
+        }
+    }
+    return HEXCHAT_EAT_NONE;
+}
+
+/**
+ * Print event hook that drops the data of a server when it disconnects, and
+ * forgets the ids of closed contexts.
+ * @param userdata  - The name of the event.
+ */
+int
+ui_print_callback(char *word[], void *userdata)
+{
+    hexchat_context *ctx = hexchat_get_context(ph);
+    int             id;
+
+    if (!strcmp((const char *)userdata, "Disconnected")) {
+        id = ui_server_id(ctx);
+        if (id >= 0) {
+            g_hash_table_remove(ui_servers, GINT_TO_POINTER(id));
+        }
+    }
+    else {
+        g_hash_table_remove(ui_context_ids, ctx);
+    }
+    return HEXCHAT_EAT_NONE;
+}
+
+/**
+ * Implements UserIndex.lookup(nick).
+ */
+PyObject *
+UserIndex_lookup(UserIndexObj *self, PyObject *args)
+{
+    const char  *nick;
+    UIServer    *srv;
+    UIUser      *user = NULL;
+    char        *ukey;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "s:lookup", &nick)) {
+        return NULL;
+    }
+    if (userindex_enable()) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to set up the index.");
+        return NULL;
+    }
+    srv = ui_get_server(ui_server_id(hexchat_get_context(ph)), 0);
+
+    if (srv) {
+        ukey = ui_fold(nick, -1);
+        user = g_hash_table_lookup(srv->users, ukey);
+        g_free(ukey);
+    }
+    if (!user) {
+        return PyTuple_New(0);
+    }
+    return UserIndex_keys_tuple(user->channels, 0);
+}
+
+/**
+ * Implements UserIndex.in_channel(channel=None).
+ */
+PyObject *
+UserIndex_in_channel(UserIndexObj *self, PyObject *args)
+{
+    PyObject    *pytarget = Py_None;
+    UIServer    *srv;
+    UIChannel   *chan;
+
+    if (!PyArg_ParseTuple(args, "|O:in_channel", &pytarget)) {
+        return NULL;
+    }
+    if (UserIndex_target(pytarget, &srv, &chan)) {
+        return NULL;
+    }
+    if (!chan) {
+        return PyTuple_New(0);
+    }
+    return UserIndex_keys_tuple(chan->users, 1);
+}
+
+/**
+ * Implements UserIndex.has(nick, channel=None).
+ */
+PyObject *
+UserIndex_has(UserIndexObj *self, PyObject *args)
+{
+    const char  *nick;
+    PyObject    *pytarget = Py_None;
+    UIServer    *srv;
+    UIChannel   *chan;
+    char        *ukey;
+    int         found = 0;
+
+    if (!PyArg_ParseTuple(args, "s|O:has", &nick, &pytarget)) {
+        return NULL;
+    }
+    if (UserIndex_target(pytarget, &srv, &chan)) {
+        return NULL;
+    }
+    if (chan) {
+        ukey  = ui_fold(nick, -1);
+        found = g_hash_table_contains(chan->users, ukey);
+        g_free(ukey);
+    }
+    return PyBool_FromLong(found);
+}
+
+/**
+ * Implements UserIndex.host(nick).
+ */
+PyObject *
+UserIndex_host(UserIndexObj *self, PyObject *args)
+{
+    const char  *nick;
+    UIServer    *srv;
+    UIUser      *user = NULL;
+    char        *ukey;
+
+    if (main_thread_check()) {
+        return NULL;
+    }
+    if (!PyArg_ParseTuple(args, "s:host", &nick)) {
+        return NULL;
+    }
+    if (userindex_enable()) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to set up the index.");
+        return NULL;
+    }
+    srv = ui_get_server(ui_server_id(hexchat_get_context(ph)), 0);
+
+    if (srv) {
+        ukey = ui_fold(nick, -1);
+        user = g_hash_table_lookup(srv->users, ukey);
+        g_free(ukey);
+    }
+    if (!user || !user->host) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_DecodeUTF8(user->host, strlen(user->host), "replace");
+}
+
+/**
+ * Resolves the channel argument of the query methods.
+ * @param pytarget  - A Context, a channel name on the current server, or None
+ *                    for the current context.
+ * @param srv       - Receives the server's index, or NULL.
+ * @param chan      - Receives the channel's index, or NULL.
+ * @returns - 0 on success, -1 with error state set on failure.
+ */
+int
+UserIndex_target(PyObject *pytarget, UIServer **srv, UIChannel **chan)
+{
+    hexchat_context *ctx;
+    hexchat_context *prior_ctx = NULL;
+    const char      *channel;
+
+    *srv  = NULL;
+    *chan = NULL;
+
+    if (main_thread_check()) {
+        return -1;
+    }
+    if (userindex_enable()) {
+        PyErr_SetString(PyExc_RuntimeError, "Unable to set up the index.");
+        return -1;
+    }
+    if (PyUnicode_Check(pytarget)) {
+        ctx     = hexchat_get_context(ph);
+        channel = PyUnicode_AsUTF8(pytarget);
+
+        if (!channel) {
+            return -1;
+        }
+    }
+    else if (pytarget == Py_None) {
+        ctx     = hexchat_get_context(ph);
+        channel = hexchat_get_info(ph, "channel");
+    }
+    else if ((ctx = context_get_ptr(pytarget)) != NULL) {
+        prior_ctx = hexchat_get_context(ph);
+
+        if (!hexchat_set_context(ph, ctx)) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "Failed to switch to context.");
+            return -1;
+        }
+        channel = hexchat_get_info(ph, "channel");
+    }
+    else {
+        return -1;
+    }
+    *srv = ui_get_server(ui_server_id(ctx), 0);
+
+    if (*srv && channel) {
+        *chan = ui_get_channel(*srv, channel, 0);
+    }
+    if (prior_ctx) {
+        hexchat_set_context(ph, prior_ctx);
+    }
+    return 0;
+}
+
+/**
+ * Builds a tuple of the names of the channels or users in a table.
+ * @param table - A channel or user table of a UIUser or UIChannel.
+ * @param users - 1 if the values are UIUser's, 0 if UIChannel's.
+ */
+PyObject *
+UserIndex_keys_tuple(GHashTable *table, int users)
+{
+    GHashTableIter  iter;
+    gpointer        value;
+    PyObject        *pytuple;
+    PyObject        *pystr;
+    const char      *name;
+    Py_ssize_t      i = 0;
+
+    pytuple = PyTuple_New(g_hash_table_size(table));
+    if (!pytuple) {
+        return NULL;
+    }
+    g_hash_table_iter_init(&iter, table);
+
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        name  = users ? ((UIUser *)value)->nick : ((UIChannel *)value)->name;
+        pystr = PyUnicode_DecodeUTF8(name, strlen(name), "replace");
+        if (!pystr) {
+            Py_DECREF(pytuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(pytuple, i++, pystr);
+    }
+    return pytuple;
+}
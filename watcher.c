@@ -0,0 +1,243 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+
+/**
+ * Watches the addons directory and hot reloads plugins whose files change
+ * (see hot_reload_plugin()). GIO's file monitor delivers the change events on
+ * the HexChat main loop, so nothing polls and no interp is entered until a
+ * plugin is actually reloaded. Editors often write a file in several steps,
+ * so a plugin is only reloaded once its file has been quiet for
+ * WATCH_DEBOUNCE ms.
+ *
+ * The watcher is turned on and off with /MPY WATCH ON | OFF, and the setting
+ * is kept across sessions.
+ */
+
+#include <gio/gio.h>
+#include "minpython.h"
+
+#define WATCH_DEBOUNCE      300     // ms a file must be quiet before reload.
+#define WATCH_INTERVAL      100     // ms between checks of pending files.
+#define WATCH_PREF          "mpy_watch" // No space, so no plugin's key.
+
+static GFileMonitor *watch_monitor  = NULL;
+static GHashTable   *watch_pending  = NULL; // path -> time of last event.
+static hexchat_hook *watch_hook     = NULL;
+
+int         watch_init          (void);
+int         watch_start         (void);
+void        watch_stop          (void);
+int         watch_command       (char *);
+
+static void watch_changed       (GFileMonitor *, GFile *, GFile *,
+                                 GFileMonitorEvent, gpointer);
+static int  watch_timer         (void *);
+static void watch_reload        (const char *);
+
+/**
+ * Starts the watcher if it was on in the last session.
+ * @returns - 0.
+ */
+int
+watch_init()
+{
+    if (pref_store_get_int(WATCH_PREF, 0) == 1) {
+        watch_start();
+    }
+    return 0;
+}
+
+/**
+ * Starts watching the addons directory.
+ * @returns - 0 on success, -1 if the directory can't be watched.
+ */
+int
+watch_start()
+{
+    GFile   *dir;
+    GError  *error = NULL;
+    char    *path;
+
+    if (watch_monitor) {
+        return 0;
+    }
+    path = g_build_filename(hexchat_get_info(ph, "xchatdir"), "addons", NULL);
+    dir  = g_file_new_for_path(path);
+
+    watch_monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_WATCH_MOVES,
+                                             NULL, &error);
+    g_object_unref(dir);
+
+    if (!watch_monitor) {
+        hexchat_printf(ph, "\00304Unable to watch %s: %s", path, 
+                       error ? error->message : "unknown error");
+        if (error) {
+            g_error_free(error);
+        }
+        g_free(path);
+        return -1;
+    }
+    g_free(path);
+
+    watch_pending = g_hash_table_new_full(g_str_hash, g_str_equal, 
+                                          g_free, g_free);
+
+    g_signal_connect(watch_monitor, "changed", G_CALLBACK(watch_changed), 
+                     NULL);
+    return 0;
+}
+
+/**
+ * Stops watching. Changes waiting on the debounce are dropped.
+ */
+void
+watch_stop()
+{
+    if (watch_hook) {
+        hexchat_unhook(ph, watch_hook);
+        watch_hook = NULL;
+    }
+    if (watch_monitor) {
+        g_file_monitor_cancel(watch_monitor);
+        g_object_unref(watch_monitor);
+        watch_monitor = NULL;
+    }
+    if (watch_pending) {
+        g_hash_table_destroy(watch_pending);
+        watch_pending = NULL;
+    }
+}
+
+/**
+ * Implements /MPY WATCH [ON | OFF]. Without an argument the current state is
+ * printed.
+ * @param arg   - "ON", "OFF", or "".
+ * @returns - HEXCHAT_EAT_ALL.
+ */
+int
+watch_command(char *arg)
+{
+    if (!g_ascii_strcasecmp(arg, "ON")) {
+        if (!watch_start()) {
+            pref_store_set_int(WATCH_PREF, 1);
+        }
+    }
+    else if (!g_ascii_strcasecmp(arg, "OFF")) {
+        watch_stop();
+        pref_store_set_int(WATCH_PREF, 0);
+    }
+    hexchat_printf(ph, "Plugin auto-reload is %s.", 
+                   watch_monitor ? "on" : "off");
+    return HEXCHAT_EAT_ALL;
+}
+
+/**
+ * The file monitor's "changed" signal handler. Notes the time of the change
+ * of a .py file and starts the timer that reloads it.
+ */
+void
+watch_changed(GFileMonitor *monitor, GFile *file, GFile *other_file,
+              GFileMonitorEvent event, gpointer userdata)
+{
+    gint64  *when;
+    char    *path;
+
+    switch (event) {
+    case G_FILE_MONITOR_EVENT_CHANGED:
+    case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+    case G_FILE_MONITOR_EVENT_CREATED:
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+        break;
+    case G_FILE_MONITOR_EVENT_RENAMED:
+        // Editors that save by renaming a temp file over the original.
+        file = other_file;
+        break;
+    default:
+        return;
+    }
+    if (!file || !(path = g_file_get_path(file))) {
+        return;
+    }
+    if (!g_str_has_suffix(path, ".py")) {
+        g_free(path);
+        return;
+    }
+    when  = g_new(gint64, 1);
+    *when = g_get_monotonic_time();
+
+    g_hash_table_replace(watch_pending, path, when);
+
+    if (!watch_hook) {
+        watch_hook = hexchat_hook_timer(ph, WATCH_INTERVAL, watch_timer, NULL);
+    }
+}
+
+/**
+ * Reloads the plugins whose files have been quiet for WATCH_DEBOUNCE ms.
+ * @returns - 1 while changes are pending, 0 to stop the timer.
+ */
+int
+watch_timer(void *userdata)
+{
+    GHashTableIter  iter;
+    gpointer        key;
+    gpointer        value;
+    GPtrArray       *ready;
+    gint64          now = g_get_monotonic_time();
+    guint           i;
+
+    ready = g_ptr_array_new_with_free_func(g_free);
+
+    g_hash_table_iter_init(&iter, watch_pending);
+
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (now - *(gint64 *)value >= WATCH_DEBOUNCE * G_TIME_SPAN_MILLISECOND) {
+            g_hash_table_iter_steal(&iter);
+            g_ptr_array_add(ready, key);
+            g_free(value);
+        }
+    }
+    for (i = 0; i < ready->len; i++) {
+        watch_reload(g_ptr_array_index(ready, i));
+    }
+    g_ptr_array_free(ready, TRUE);
+
+    if (g_hash_table_size(watch_pending) == 0) {
+        watch_hook = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Hot reloads the plugin loaded from a file, if there is one. Plugins are
+ * known by their full path, however they were loaded.
+ * @param path  - The full path of the changed file.
+ */
+void
+watch_reload(const char *path)
+{
+    hot_reload_plugin((char *)path);
+}
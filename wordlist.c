@@ -0,0 +1,436 @@
+/*******************************************************************************
+ * MIT License
+ *
+ * Copyright (c) 2018 tmtappr@gmail.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ ******************************************************************************/
+
+/**
+ * WordList objects are the `word` and `word_eol` parameters passed to hook
+ * callbacks. They wrap the char *word[] arrays HexChat passes to the C
+ * callbacks, and only decode an element into a str the first time it's
+ * indexed. For print events, which have no word_eol[] array, a word_eol
+ * WordList is created over the `word` WordList instead. It joins the words
+ * into one str the first time it's indexed, and its elements are substrings
+ * of that str taken at the cumulative word offsets; element 0 is the joined
+ * str itself.
+ *
+ * HexChat's arrays are only valid for the duration of the callback. When the
+ * callback returns, a WordList that's still referenced decodes its remaining
+ * elements and lets go of the arrays, so keeping word/word_eol around is still
+ * safe - it just costs what building a list used to. materialize() returns
+ * the elements as a plain list.
+ */
+
+#include "minpython.h"
+
+/**
+ * WordList instance data. The decoded elements are stored inline; ob_size is
+ * the number of elements.
+ */
+typedef struct {
+    PyObject_VAR_HEAD
+    char            **words;
+    PyObject        *source;    // For word_eol of print events, the word list.
+    PyObject        *joined;    // For word_eol of print events, word joined.
+    PyObject        *items[1];
+} WordListObj;
+
+static void         WordList_dealloc        (WordListObj *);
+static Py_ssize_t   WordList_length         (WordListObj *);
+static PyObject     *WordList_item          (WordListObj *, Py_ssize_t);
+static PyObject     *WordList_subscript     (WordListObj *, PyObject *);
+static PyObject     *WordList_richcompare   (WordListObj *, PyObject *, int);
+static PyObject     *WordList_repr          (WordListObj *);
+static PyObject     *WordList_materialize   (WordListObj *, PyObject *);
+
+       PyObject     *wordlist_new           (char *[], Py_ssize_t);
+       PyObject     *wordlist_new_eol       (PyObject *);
+       void         wordlist_release        (PyObject *);
+static PyObject     *wordlist_decode        (WordListObj *, Py_ssize_t);
+static PyObject     *wordlist_decode_eol    (WordListObj *, Py_ssize_t);
+
+/**
+ * WordList methods.
+ */
+static PyMethodDef WordList_methods[] = {
+    {"materialize", (PyCFunction)WordList_materialize,  METH_NOARGS,
+     "Returns the words as a list of str."},
+
+    {NULL}
+};
+
+/**
+ * Sequence and mapping protocols. The mapping protocol is there for slices.
+ */
+static PySequenceMethods WordList_as_sequence = {
+    .sq_length      = (lenfunc)WordList_length,
+    .sq_item        = (ssizeargfunc)WordList_item,
+};
+
+static PyMappingMethods WordList_as_mapping = {
+    .mp_length      = (lenfunc)WordList_length,
+    .mp_subscript   = (binaryfunc)WordList_subscript,
+};
+
+/**
+ * WordList type declaration/instance.
+ */
+static PyTypeObject WordListType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name        = "hexchat.WordList",
+    .tp_doc         = "Read-only sequence of the words passed to a hook "
+                      "callback. Elements are decoded on first access. "
+                      "Indexing with a slice, or materialize(), returns a "
+                      "list.",
+    .tp_basicsize   = offsetof(WordListObj, items),
+    .tp_itemsize    = sizeof(PyObject *),
+    .tp_flags       = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc     = (destructor)WordList_dealloc,
+    .tp_methods     = WordList_methods,
+    .tp_as_sequence = &WordList_as_sequence,
+    .tp_as_mapping  = &WordList_as_mapping,
+    .tp_richcompare = (richcmpfunc)WordList_richcompare,
+    .tp_repr        = (reprfunc)WordList_repr,
+};
+
+/**
+ * WordList convenience ptr.
+ */
+PyTypeObject *WordListTypeDef = &WordListType;
+
+/**
+ * Creates a WordList over a HexChat word array.
+ * @param words - The first element to expose (usually &word[1]).
+ * @param size  - The number of elements.
+ * @returns - A new reference, or NULL with error state set.
+ */
+PyObject *
+wordlist_new(char *words[], Py_ssize_t size)
+{
+    WordListObj *self;
+
+    self = PyObject_NewVar(WordListObj, WordListTypePtr, size);
+    if (!self) {
+        return NULL;
+    }
+    self->words  = words;
+    self->source = NULL;
+    self->joined = NULL;
+
+    memset(self->items, 0, size * sizeof(PyObject *));
+
+    return (PyObject *)self;
+}
+
+/**
+ * Creates a word_eol WordList for a print event, where element i is words
+ * i through the end of `pyword` joined by spaces. It must be released before
+ * `pyword` is.
+ * @param pyword    - The event's word WordList.
+ * @returns - A new reference, or NULL with error state set.
+ */
+PyObject *
+wordlist_new_eol(PyObject *pyword)
+{
+    WordListObj *self;
+    WordListObj *source = (WordListObj *)pyword;
+
+    self = (WordListObj *)wordlist_new(source->words, Py_SIZE(source));
+    if (!self) {
+        return NULL;
+    }
+    self->source = pyword;
+    Py_INCREF(pyword);
+
+    return (PyObject *)self;
+}
+
+/**
+ * Called after the callback has returned. If the callback kept a reference to
+ * the WordList, the remaining elements are decoded so it no longer depends on
+ * HexChat's array. The caller's reference is released.
+ * @param pywords   - The WordList, or NULL.
+ */
+void
+wordlist_release(PyObject *pywords)
+{
+    WordListObj *self = (WordListObj *)pywords;
+    Py_ssize_t  i;
+
+    if (!self) {
+        return;
+    }
+    if (Py_REFCNT(self) > 1 && self->words) {
+        for (i = 0; i < Py_SIZE(self); i++) {
+            if (!self->items[i] && !wordlist_decode(self, i)) {
+                PyErr_Print();
+                break;
+            }
+        }
+    }
+    self->words = NULL;
+
+    // A word_eol list no longer needs the word list once it's been released;
+    // dropping it here keeps the word list's ref count accurate for its own
+    // release.
+    Py_CLEAR(self->source);
+    Py_DECREF(self);
+}
+
+/**
+ * Decodes element i, caching the str.
+ * @returns - Borrowed reference, or NULL with error state set.
+ */
+PyObject *
+wordlist_decode(WordListObj *self, Py_ssize_t i)
+{
+    PyObject *pystr;
+
+    if (!self->words) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "WordList is no longer valid.");
+        return NULL;
+    }
+    if (self->source) {
+        pystr = wordlist_decode_eol(self, i);
+    }
+    else {
+        // Bad values are replaced with '\U0000fffd'.
+        pystr = PyUnicode_DecodeUTF8(self->words[i], strlen(self->words[i]),
+                                     "replace");
+    }
+    self->items[i] = pystr;
+    return pystr;
+}
+
+/**
+ * Produces word_eol element i for a print event. The source words are joined
+ * once; each element is then the substring starting at the sum of the lengths
+ * of the words before it, plus their separators.
+ * @returns - New reference, or NULL with error state set.
+ */
+PyObject *
+wordlist_decode_eol(WordListObj *self, Py_ssize_t i)
+{
+    PyObject    *pywords;
+    PyObject    *pysep;
+    PyObject    *pystr;
+    Py_ssize_t  offset  = 0;
+    Py_ssize_t  j;
+
+    if (!self->joined) {
+        pywords = WordList_materialize((WordListObj *)self->source, NULL);
+        if (!pywords) {
+            return NULL;
+        }
+        pysep = PyUnicode_FromString(" ");
+        if (!pysep) {
+            Py_DECREF(pywords);
+            return NULL;
+        }
+        self->joined = PyUnicode_Join(pysep, pywords);
+
+        Py_DECREF(pysep);
+        Py_DECREF(pywords);
+
+        if (!self->joined) {
+            return NULL;
+        }
+    }
+    if (i == 0) {
+        Py_INCREF(self->joined);
+        return self->joined;
+    }
+    // The words were all decoded for the join.
+    for (j = 0; j < i; j++) {
+        pystr   = ((WordListObj *)self->source)->items[j];
+        offset += PyUnicode_GET_LENGTH(pystr) + 1;
+    }
+    return PyUnicode_Substring(self->joined, offset, 
+                               PyUnicode_GET_LENGTH(self->joined));
+}
+
+/**
+ * Destructor.
+ */
+void
+WordList_dealloc(WordListObj *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < Py_SIZE(self); i++) {
+        Py_XDECREF(self->items[i]);
+    }
+    Py_XDECREF(self->source);
+    Py_XDECREF(self->joined);
+    interp_free_object((PyObject *)self);
+}
+
+Py_ssize_t
+WordList_length(WordListObj *self)
+{
+    return Py_SIZE(self);
+}
+
+/**
+ * Implements word[i]. Negative indices have already been adjusted.
+ */
+PyObject *
+WordList_item(WordListObj *self, Py_ssize_t i)
+{
+    PyObject *pystr;
+
+    if (i < 0 || i >= Py_SIZE(self)) {
+        PyErr_SetString(PyExc_IndexError, "WordList index out of range");
+        return NULL;
+    }
+    pystr = self->items[i];
+    if (!pystr) {
+        pystr = wordlist_decode(self, i);
+        if (!pystr) {
+            return NULL;
+        }
+    }
+    Py_INCREF(pystr);
+    return pystr;
+}
+
+/**
+ * Implements word[i] and word[i:j:k]. Slices return a list.
+ */
+PyObject *
+WordList_subscript(WordListObj *self, PyObject *pykey)
+{
+    Py_ssize_t  i;
+    Py_ssize_t  start, stop, step, slicelen;
+    Py_ssize_t  cur;
+    PyObject    *pylist;
+    PyObject    *pystr;
+
+    if (PyIndex_Check(pykey)) {
+        i = PyNumber_AsSsize_t(pykey, PyExc_IndexError);
+        if (i == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (i < 0) {
+            i += Py_SIZE(self);
+        }
+        return WordList_item(self, i);
+    }
+    if (!PySlice_Check(pykey)) {
+        PyErr_Format(PyExc_TypeError,
+                     "WordList indices must be integers or slices, not %.200s",
+                     Py_TYPE(pykey)->tp_name);
+        return NULL;
+    }
+    if (PySlice_GetIndicesEx(pykey, Py_SIZE(self),
+                             &start, &stop, &step, &slicelen)) {
+        return NULL;
+    }
+    pylist = PyList_New(slicelen);
+    if (!pylist) {
+        return NULL;
+    }
+    for (cur = start, i = 0; i < slicelen; cur += step, i++) {
+        pystr = WordList_item(self, cur);
+        if (!pystr) {
+            Py_DECREF(pylist);
+            return NULL;
+        }
+        PyList_SET_ITEM(pylist, i, pystr);
+    }
+    return pylist;
+}
+
+/**
+ * Implements WordList.materialize().
+ * @returns - A new list holding all the elements.
+ */
+PyObject *
+WordList_materialize(WordListObj *self, PyObject *Py_UNUSED(args))
+{
+    PyObject    *pylist;
+    PyObject    *pystr;
+    Py_ssize_t  i;
+
+    pylist = PyList_New(Py_SIZE(self));
+    if (!pylist) {
+        return NULL;
+    }
+    for (i = 0; i < Py_SIZE(self); i++) {
+        pystr = WordList_item(self, i);
+        if (!pystr) {
+            Py_DECREF(pylist);
+            return NULL;
+        }
+        PyList_SET_ITEM(pylist, i, pystr);
+    }
+    return pylist;
+}
+
+/**
+ * Compares like a list, so `word == ['a', 'b']` works as it did when the
+ * callbacks received lists.
+ */
+PyObject *
+WordList_richcompare(WordListObj *self, PyObject *pyother, int op)
+{
+    PyObject *pylist;
+    PyObject *pyolist   = NULL;
+    PyObject *pyret;
+
+    if (Py_TYPE(pyother) == WordListTypePtr) {
+        pyolist = WordList_materialize((WordListObj *)pyother, NULL);
+        if (!pyolist) {
+            return NULL;
+        }
+        pyother = pyolist;
+    }
+    else if (!PyList_Check(pyother)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    pylist = WordList_materialize(self, NULL);
+    if (!pylist) {
+        Py_XDECREF(pyolist);
+        return NULL;
+    }
+    pyret = PyObject_RichCompare(pylist, pyother, op);
+
+    Py_DECREF(pylist);
+    Py_XDECREF(pyolist);
+    return pyret;
+}
+
+PyObject *
+WordList_repr(WordListObj *self)
+{
+    PyObject *pylist;
+    PyObject *pyrepr;
+
+    pylist = WordList_materialize(self, NULL);
+    if (!pylist) {
+        return NULL;
+    }
+    pyrepr = PyUnicode_FromFormat("WordList(%R)", pylist);
+
+    Py_DECREF(pylist);
+    return pyrepr;
+}